@@ -0,0 +1,511 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include "archive.hpp"
+#include "text.hpp"
+
+// How much of the archive is collected in memory before it is written
+#define ARCHIVE_WRITE_BUFFER (1024 * 1024)
+
+static void put32(std::string &s, unsigned long long v) {
+	for (size_t i = 0; i < 4; i++) {
+		s.push_back((char) ((v >> (8 * i)) & 0xFF));
+	}
+}
+
+static void put64(std::string &s, unsigned long long v) {
+	for (size_t i = 0; i < 8; i++) {
+		s.push_back((char) ((v >> (8 * i)) & 0xFF));
+	}
+}
+
+static unsigned long long get32(const char *s) {
+	unsigned long long v = 0;
+	for (size_t i = 0; i < 4; i++) {
+		v |= ((unsigned long long) (unsigned char) s[i]) << (8 * i);
+	}
+	return v;
+}
+
+static unsigned long long get64(const char *s) {
+	unsigned long long v = 0;
+	for (size_t i = 0; i < 8; i++) {
+		v |= ((unsigned long long) (unsigned char) s[i]) << (8 * i);
+	}
+	return v;
+}
+
+// Rotate a quadrant of the Hilbert curve into place
+static void hilbert_rotate(unsigned long long n, unsigned long long *x, unsigned long long *y, unsigned long long rx, unsigned long long ry) {
+	if (ry == 0) {
+		if (rx == 1) {
+			*x = n - 1 - *x;
+			*y = n - 1 - *y;
+		}
+
+		unsigned long long t = *x;
+		*x = *y;
+		*y = t;
+	}
+}
+
+// The first tile id of zoom level z
+static unsigned long long zoom_base(int z) {
+	unsigned long long base = 0;
+	for (int i = 0; i < z; i++) {
+		base += 1ULL << (2 * i);
+	}
+	return base;
+}
+
+unsigned long long archive_tile_id(int z, unsigned x, unsigned y) {
+	unsigned long long n = 1ULL << z;
+	unsigned long long xx = x, yy = y;
+	unsigned long long d = 0;
+
+	for (unsigned long long s = n / 2; s > 0; s /= 2) {
+		unsigned long long rx = (xx & s) > 0;
+		unsigned long long ry = (yy & s) > 0;
+		d += s * s * ((3 * rx) ^ ry);
+		hilbert_rotate(n, &xx, &yy, rx, ry);
+	}
+
+	return zoom_base(z) + d;
+}
+
+void archive_tile_zxy(unsigned long long id, int *z, unsigned *x, unsigned *y) {
+	int zoom = 0;
+	while (zoom < 31 && id >= zoom_base(zoom + 1)) {
+		zoom++;
+	}
+
+	unsigned long long t = id - zoom_base(zoom);
+	unsigned long long n = 1ULL << zoom;
+	unsigned long long xx = 0, yy = 0;
+
+	for (unsigned long long s = 1; s < n; s *= 2) {
+		unsigned long long rx = 1 & (t / 2);
+		unsigned long long ry = 1 & (t ^ rx);
+		hilbert_rotate(s, &xx, &yy, rx, ry);
+		xx += s * rx;
+		yy += s * ry;
+		t /= 4;
+	}
+
+	*z = zoom;
+	*x = xx;
+	*y = yy;
+}
+
+static void write_all(int fd, const char *data, size_t len, std::string const &fname) {
+	while (len > 0) {
+		ssize_t written = write(fd, data, len);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror(fname.c_str());
+			exit(EXIT_FAILURE);
+		}
+
+		data += written;
+		len -= written;
+	}
+}
+
+/**
+ * Creates a new tile archive. Tiles are collected in a temporary
+ * file next to it, in the order they are written, and are put into
+ * Hilbert order by archive_close().
+ */
+archive_writer *archive_open(const char *fname) {
+	archive_writer *ar = new archive_writer;
+	ar->fname = fname;
+
+	ar->fd = open(fname, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+	if (ar->fd < 0) {
+		if (errno == EEXIST) {
+			fprintf(stderr, "%s: Tileset already exists\n", fname);
+		} else {
+			perror(fname);
+		}
+		exit(EXIT_FAILURE);
+	}
+
+	std::string tmp = ar->fname + ".tmp";
+	ar->tmpfd = open(tmp.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if (ar->tmpfd < 0) {
+		perror(tmp.c_str());
+		exit(EXIT_FAILURE);
+	}
+	unlink(tmp.c_str());
+
+	return ar;
+}
+
+/**
+ * Adds a tile to the archive. Not thread-safe: tiles must all be
+ * written from the same thread.
+ */
+void archive_write_tile(archive_writer *ar, int z, int tx, int ty, const char *data, size_t size) {
+	archive_pending p;
+	p.id = archive_tile_id(z, tx, ty);
+	p.offset = ar->tmp_len;
+	p.len = size;
+	p.hash1 = murmur64(data, size, 0x5bd1e995ULL);
+	p.hash2 = murmur64(data, size, 0x2545f4914f6cdd1dULL);
+	ar->pending.push_back(p);
+
+	write_all(ar->tmpfd, data, size, ar->fname + ".tmp");
+	ar->tmp_len += size;
+
+	if (z < ar->minzoom) {
+		ar->minzoom = z;
+	}
+	if (z > ar->maxzoom) {
+		ar->maxzoom = z;
+	}
+}
+
+void archive_write_metadata(archive_writer *ar, std::string const &json) {
+	ar->metadata = json;
+}
+
+static bool pending_less(archive_pending const &a, archive_pending const &b) {
+	return a.id < b.id;
+}
+
+// Identifies a tile's contents, the same way as deduplicated mbtiles:
+// two independently seeded hashes plus the length
+struct archive_content {
+	unsigned long long hash1;
+	unsigned long long hash2;
+	unsigned len;
+
+	archive_content(archive_pending const &p)
+	    : hash1(p.hash1), hash2(p.hash2), len(p.len) {
+	}
+
+	bool operator<(archive_content const &o) const {
+		if (hash1 < o.hash1) {
+			return true;
+		}
+		if (hash1 > o.hash1) {
+			return false;
+		}
+		if (hash2 < o.hash2) {
+			return true;
+		}
+		if (hash2 > o.hash2) {
+			return false;
+		}
+		return len < o.len;
+	}
+};
+
+/**
+ * Lays out the archive: the header, the metadata, the directory,
+ * and then each distinct tile, copied from the temporary file in
+ * tile id order.
+ */
+void archive_close(archive_writer *ar) {
+	std::stable_sort(ar->pending.begin(), ar->pending.end(), pending_less);
+
+	std::vector<archive_entry> directory;
+	std::vector<size_t> copy;  // pending tiles whose data goes into the archive
+	std::map<archive_content, unsigned long long> seen;
+	unsigned long long data_len = 0;
+
+	for (size_t i = 0; i < ar->pending.size(); i++) {
+		archive_pending const &p = ar->pending[i];
+
+		if (i > 0 && ar->pending[i - 1].id == p.id) {
+			int z;
+			unsigned x, y;
+			archive_tile_zxy(p.id, &z, &x, &y);
+			fprintf(stderr, "%s: Can't write tile %d/%u/%u to the archive more than once\n", ar->fname.c_str(), z, x, y);
+			exit(EXIT_FAILURE);
+		}
+
+		unsigned long long offset;
+		auto f = seen.find(archive_content(p));
+		if (f != seen.end()) {
+			offset = f->second;
+		} else {
+			offset = data_len;
+			data_len += p.len;
+			seen.insert(std::pair<archive_content, unsigned long long>(archive_content(p), offset));
+			copy.push_back(i);
+		}
+
+		if (directory.size() > 0) {
+			archive_entry &prev = directory.back();
+			if (prev.offset == offset && prev.len == p.len && prev.id + prev.run == p.id) {
+				prev.run++;
+				continue;
+			}
+		}
+
+		archive_entry e;
+		e.id = p.id;
+		e.offset = offset;
+		e.len = p.len;
+		e.run = 1;
+		directory.push_back(e);
+	}
+
+	unsigned long long metadata_offset = ARCHIVE_HEADER_BYTES;
+	unsigned long long directory_offset = metadata_offset + ar->metadata.size();
+	unsigned long long data_offset = directory_offset + directory.size() * ARCHIVE_ENTRY_BYTES;
+
+	std::string out = ARCHIVE_MAGIC;
+	out.push_back(ARCHIVE_VERSION);
+	put64(out, metadata_offset);
+	put64(out, ar->metadata.size());
+	put64(out, directory_offset);
+	put64(out, directory.size());
+	put64(out, data_offset);
+	put64(out, data_len);
+	put64(out, ar->pending.size());
+	put64(out, copy.size());
+	out.push_back(ar->maxzoom >= 0 ? ar->minzoom : 0);
+	out.push_back(ar->maxzoom >= 0 ? ar->maxzoom : 0);
+	out.resize(ARCHIVE_HEADER_BYTES, '\0');
+
+	out.append(ar->metadata);
+
+	for (size_t i = 0; i < directory.size(); i++) {
+		put64(out, directory[i].id);
+		put64(out, directory[i].offset);
+		put32(out, directory[i].len);
+		put32(out, directory[i].run);
+
+		if (out.size() >= ARCHIVE_WRITE_BUFFER) {
+			write_all(ar->fd, out.data(), out.size(), ar->fname);
+			out.clear();
+		}
+	}
+
+	std::string tile;
+	for (size_t i = 0; i < copy.size(); i++) {
+		archive_pending const &p = ar->pending[copy[i]];
+
+		tile.resize(p.len);
+		size_t off = 0;
+		while (off < p.len) {
+			ssize_t n = pread(ar->tmpfd, &tile[off], p.len - off, p.offset + off);
+			if (n <= 0) {
+				if (n < 0 && errno == EINTR) {
+					continue;
+				}
+				std::string tmp = ar->fname + ".tmp";
+				perror(tmp.c_str());
+				exit(EXIT_FAILURE);
+			}
+			off += n;
+		}
+		out.append(tile);
+
+		if (out.size() >= ARCHIVE_WRITE_BUFFER) {
+			write_all(ar->fd, out.data(), out.size(), ar->fname);
+			out.clear();
+		}
+	}
+
+	write_all(ar->fd, out.data(), out.size(), ar->fname);
+
+	if (close(ar->tmpfd) != 0) {
+		perror("close archive temporary file");
+		exit(EXIT_FAILURE);
+	}
+	if (close(ar->fd) != 0) {
+		perror(ar->fname.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	delete ar;
+}
+
+static void corrupt(archive_reader *ar, const char *what) {
+	fprintf(stderr, "%s: Corrupt tile archive: %s\n", ar->fname.c_str(), what);
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * Maps a tile archive into memory. Returns NULL if the file
+ * is not a tile archive, so it can be tried as something else.
+ */
+archive_reader *archive_open_read(const char *fname) {
+	int fd = open(fname, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	struct stat st;
+	char magic[ARCHIVE_HEADER_BYTES];
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < ARCHIVE_HEADER_BYTES ||
+	    pread(fd, magic, sizeof(magic), 0) != ARCHIVE_HEADER_BYTES || memcmp(magic, ARCHIVE_MAGIC, strlen(ARCHIVE_MAGIC)) != 0) {
+		if (close(fd) != 0) {
+			perror("close");
+			exit(EXIT_FAILURE);
+		}
+		return NULL;
+	}
+
+	archive_reader *ar = new archive_reader;
+	ar->fname = fname;
+	ar->fd = fd;
+	ar->map_len = st.st_size;
+
+	if (magic[strlen(ARCHIVE_MAGIC)] != ARCHIVE_VERSION) {
+		fprintf(stderr, "%s: Unsupported tile archive version %d\n", fname, magic[strlen(ARCHIVE_MAGIC)]);
+		exit(EXIT_FAILURE);
+	}
+
+	ar->map = (const char *) mmap(NULL, ar->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (ar->map == MAP_FAILED) {
+		perror(fname);
+		exit(EXIT_FAILURE);
+	}
+
+	const char *h = ar->map + 8;
+	unsigned long long metadata_offset = get64(h + 0);
+	unsigned long long metadata_len = get64(h + 8);
+	unsigned long long directory_offset = get64(h + 16);
+	unsigned long long entries = get64(h + 24);
+	unsigned long long data_offset = get64(h + 32);
+	unsigned long long data_len = get64(h + 40);
+	ar->tiles = get64(h + 48);
+	ar->contents = get64(h + 56);
+	ar->minzoom = (unsigned char) h[64];
+	ar->maxzoom = (unsigned char) h[65];
+
+	if (metadata_offset > ar->map_len || metadata_len > ar->map_len - metadata_offset) {
+		corrupt(ar, "metadata out of bounds");
+	}
+	if (directory_offset > ar->map_len || entries > (ar->map_len - directory_offset) / ARCHIVE_ENTRY_BYTES) {
+		corrupt(ar, "directory out of bounds");
+	}
+	if (data_offset > ar->map_len || data_len > ar->map_len - data_offset) {
+		corrupt(ar, "tile data out of bounds");
+	}
+
+	ar->metadata = ar->map + metadata_offset;
+	ar->metadata_len = metadata_len;
+	ar->directory = ar->map + directory_offset;
+	ar->entries = entries;
+	ar->data = ar->map + data_offset;
+	ar->data_len = data_len;
+
+	return ar;
+}
+
+archive_entry archive_get_entry(archive_reader *ar, size_t i) {
+	const char *p = ar->directory + i * ARCHIVE_ENTRY_BYTES;
+
+	archive_entry e;
+	e.id = get64(p);
+	e.offset = get64(p + 8);
+	e.len = get32(p + 16);
+	e.run = get32(p + 20);
+
+	if (e.offset > ar->data_len || e.len > ar->data_len - e.offset) {
+		corrupt(ar, "tile out of bounds");
+	}
+
+	return e;
+}
+
+/**
+ * Looks up a tile by binary search of the directory.
+ * Returns false if the archive does not contain it.
+ */
+bool archive_read_tile(archive_reader *ar, int z, unsigned x, unsigned y, std::string &out) {
+	if (z < 0 || z >= 32 || x >= (1ULL << z) || y >= (1ULL << z)) {
+		return false;
+	}
+
+	unsigned long long id = archive_tile_id(z, x, y);
+
+	// Find the last entry whose id is <= the tile's
+	size_t lo = 0, hi = ar->entries;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (get64(ar->directory + mid * ARCHIVE_ENTRY_BYTES) <= id) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	if (lo == 0) {
+		return false;
+	}
+
+	archive_entry e = archive_get_entry(ar, lo - 1);
+	if (id >= e.id + e.run) {
+		return false;
+	}
+
+	out = std::string(ar->data + e.offset, e.len);
+	return true;
+}
+
+static bool tile_less(archive_tile const &a, archive_tile const &b) {
+	if (a.z != b.z) {
+		return a.z < b.z;
+	}
+	if (a.x != b.x) {
+		return a.x < b.x;
+	}
+	return a.y > b.y;  // in order of TMS tile_row, like mbtiles
+}
+
+/**
+ * Lists every tile in the archive, in the same zoom, column,
+ * and TMS row order that tiles are read from mbtiles.
+ */
+std::vector<archive_tile> archive_tiles(archive_reader *ar) {
+	std::vector<archive_tile> out;
+
+	for (size_t i = 0; i < ar->entries; i++) {
+		archive_entry e = archive_get_entry(ar, i);
+
+		for (unsigned j = 0; j < e.run; j++) {
+			archive_tile t;
+			archive_tile_zxy(e.id + j, &t.z, &t.x, &t.y);
+			t.offset = e.offset;
+			t.len = e.len;
+			out.push_back(t);
+		}
+	}
+
+	std::sort(out.begin(), out.end(), tile_less);
+	return out;
+}
+
+std::string archive_read_metadata(archive_reader *ar) {
+	return std::string(ar->metadata, ar->metadata_len);
+}
+
+void archive_close_read(archive_reader *ar) {
+	if (munmap((void *) ar->map, ar->map_len) != 0) {
+		perror("munmap");
+		exit(EXIT_FAILURE);
+	}
+	if (close(ar->fd) != 0) {
+		perror("close");
+		exit(EXIT_FAILURE);
+	}
+
+	delete ar;
+}
@@ -0,0 +1,97 @@
+#ifndef ARCHIVE_HPP
+#define ARCHIVE_HPP
+
+#include <string>
+#include <vector>
+
+// A tile archive is a single file holding a whole tileset:
+//
+//	a fixed-size header, giving the location and size of each section,
+//	the metadata, as the same JSON object as a directory's metadata.json,
+//	a directory of fixed-size entries, sorted by tile id, each giving
+//	    the tile id, the offset and length of the tile's data, and how
+//	    many consecutive tile ids share that data,
+//	the tile data, in order of first use by the directory.
+//
+// Tile ids number the tiles of each zoom level along a Hilbert curve,
+// after all the tiles of the lower zoom levels, so tiles that are near
+// each other on the map are also near each other in the file. Identical
+// tiles are stored once, and runs of them share a directory entry.
+//
+// All numbers are little-endian. A tile can be found with a binary
+// search of the directory and read with one range request.
+
+#define ARCHIVE_MAGIC "TPARCHV"
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_HEADER_BYTES 128
+#define ARCHIVE_ENTRY_BYTES 24
+
+struct archive_pending {
+	unsigned long long id = 0;
+	unsigned long long offset = 0;  // in the temporary file
+	unsigned long long hash1 = 0;
+	unsigned long long hash2 = 0;
+	unsigned len = 0;
+};
+
+struct archive_writer {
+	std::string fname = "";
+	int fd = -1;
+	int tmpfd = -1;
+	unsigned long long tmp_len = 0;
+	std::vector<archive_pending> pending{};
+	std::string metadata = "";
+	int minzoom = 32;
+	int maxzoom = -1;
+};
+
+struct archive_entry {
+	unsigned long long id = 0;
+	unsigned long long offset = 0;  // in the data section
+	unsigned len = 0;
+	unsigned run = 0;
+};
+
+struct archive_tile {
+	int z = 0;
+	unsigned x = 0;
+	unsigned y = 0;
+	unsigned long long offset = 0;
+	unsigned len = 0;
+};
+
+struct archive_reader {
+	std::string fname = "";
+	int fd = -1;
+	const char *map = NULL;
+	size_t map_len = 0;
+
+	const char *metadata = NULL;
+	size_t metadata_len = 0;
+	const char *directory = NULL;
+	size_t entries = 0;
+	const char *data = NULL;
+	size_t data_len = 0;
+
+	unsigned long long tiles = 0;
+	unsigned long long contents = 0;
+	int minzoom = 0;
+	int maxzoom = 0;
+};
+
+unsigned long long archive_tile_id(int z, unsigned x, unsigned y);
+void archive_tile_zxy(unsigned long long id, int *z, unsigned *x, unsigned *y);
+
+archive_writer *archive_open(const char *fname);
+void archive_write_tile(archive_writer *ar, int z, int tx, int ty, const char *data, size_t size);
+void archive_write_metadata(archive_writer *ar, std::string const &json);
+void archive_close(archive_writer *ar);
+
+archive_reader *archive_open_read(const char *fname);
+archive_entry archive_get_entry(archive_reader *ar, size_t i);
+bool archive_read_tile(archive_reader *ar, int z, unsigned x, unsigned y, std::string &out);
+std::vector<archive_tile> archive_tiles(archive_reader *ar);
+std::string archive_read_metadata(archive_reader *ar);
+void archive_close_read(archive_reader *ar);
+
+#endif
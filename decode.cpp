@@ -8,50 +8,47 @@
 #include <vector>
 #include <map>
 #include <set>
+#include <deque>
 #include <zlib.h>
 #include <math.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <pthread.h>
 #include <protozero/pbf_reader.hpp>
 #include "mvt.hpp"
 #include "projection.hpp"
 #include "geometry.hpp"
 #include "write_json.hpp"
+#include "archive.hpp"
+#include "jsonpull/jsonpull.h"
+#include "timer.hpp"
 
 int minzoom = 0;
 int maxzoom = 32;
 bool force = false;
 
-void do_stats(mvt_tile &tile, size_t size, bool compressed, int z, unsigned x, unsigned y) {
-	printf("{ \"zoom\": %d, \"x\": %u, \"y\": %u, \"bytes\": %zu, \"compressed\": %s", z, x, y, size, compressed ? "true" : "false");
+void do_stats(FILE *fp, mvt_tile_view &tile, size_t size, bool compressed, int z, unsigned x, unsigned y) {
+	fprintf(fp, "{ \"zoom\": %d, \"x\": %u, \"y\": %u, \"bytes\": %zu, \"compressed\": %s", z, x, y, size, compressed ? "true" : "false");
 
-	printf(", \"layers\": { ");
+	fprintf(fp, ", \"layers\": { ");
 	for (size_t i = 0; i < tile.layers.size(); i++) {
 		if (i != 0) {
-			printf(", ");
+			fprintf(fp, ", ");
 		}
-		fprintq(stdout, tile.layers[i].name.c_str());
+		fprintq(fp, tile.layers[i].name.c_str());
 
 		int points = 0, lines = 0, polygons = 0;
-		for (size_t j = 0; j < tile.layers[i].features.size(); j++) {
-			if (tile.layers[i].features[j].type == mvt_point) {
-				points++;
-			} else if (tile.layers[i].features[j].type == mvt_linestring) {
-				lines++;
-			} else if (tile.layers[i].features[j].type == mvt_polygon) {
-				polygons++;
-			}
-		}
+		tile.layers[i].count_types(points, lines, polygons);
 
-		printf(": { \"points\": %d, \"lines\": %d, \"polygons\": %d, \"extent\": %lld }", points, lines, polygons, tile.layers[i].extent);
+		fprintf(fp, ": { \"points\": %d, \"lines\": %d, \"polygons\": %d, \"extent\": %lld }", points, lines, polygons, tile.layers[i].extent);
 	}
 
-	printf(" } }\n");
+	fprintf(fp, " } }\n");
 }
 
-void handle(std::string message, int z, unsigned x, unsigned y, int describe, std::set<std::string> const &to_decode, bool pipeline, bool stats) {
-	mvt_tile tile;
+void handle(FILE *fp, std::string const &message, int z, unsigned x, unsigned y, int describe, std::set<std::string> const &to_decode, bool pipeline, bool stats) {
+	mvt_tile_view tile;
 	bool was_compressed;
 
 	try {
@@ -59,61 +56,69 @@ void handle(std::string message, int z, unsigned x, unsigned y, int describe, st
 			fprintf(stderr, "Couldn't parse tile %d/%u/%u\n", z, x, y);
 			exit(EXIT_FAILURE);
 		}
-	} catch (protozero::unknown_pbf_wire_type_exception e) {
+
+		if (stats) {
+			do_stats(fp, tile, message.size(), was_compressed, z, x, y);
+			return;
+		}
+	} catch (protozero::unknown_pbf_wire_type_exception const &e) {
 		fprintf(stderr, "PBF decoding error in tile %d/%u/%u\n", z, x, y);
 		exit(EXIT_FAILURE);
 	}
 
-	if (stats) {
-		do_stats(tile, message.size(), was_compressed, z, x, y);
-		return;
-	}
-
 	if (!pipeline) {
-		printf("{ \"type\": \"FeatureCollection\"");
+		fprintf(fp, "{ \"type\": \"FeatureCollection\"");
 
 		if (describe) {
-			printf(", \"properties\": { \"zoom\": %d, \"x\": %d, \"y\": %d", z, x, y);
+			fprintf(fp, ", \"properties\": { \"zoom\": %d, \"x\": %d, \"y\": %d", z, x, y);
 			if (!was_compressed) {
-				printf(", \"compressed\": false");
+				fprintf(fp, ", \"compressed\": false");
 			}
-			printf(" }");
+			fprintf(fp, " }");
 
 			if (projection != projections) {
-				printf(", \"crs\": { \"type\": \"name\", \"properties\": { \"name\": ");
-				fprintq(stdout, projection->alias);
-				printf(" } }");
+				fprintf(fp, ", \"crs\": { \"type\": \"name\", \"properties\": { \"name\": ");
+				fprintq(fp, projection->alias);
+				fprintf(fp, " } }");
 			}
 		}
 
-		printf(", \"features\": [\n");
+		fprintf(fp, ", \"features\": [\n");
 	}
 
 	bool first_layer = true;
 	for (size_t l = 0; l < tile.layers.size(); l++) {
-		mvt_layer &layer = tile.layers[l];
+		mvt_layer_view &view = tile.layers[l];
 
-		if (layer.extent <= 0) {
-			fprintf(stderr, "Impossible layer extent %lld in mbtiles\n", layer.extent);
+		if (view.extent <= 0) {
+			fprintf(stderr, "Impossible layer extent %lld in mbtiles\n", view.extent);
 			exit(EXIT_FAILURE);
 		}
 
-		if (to_decode.size() != 0 && !to_decode.count(layer.name)) {
+		if (to_decode.size() != 0 && !to_decode.count(view.name)) {
 			continue;
 		}
 
+		mvt_layer layer;
+		try {
+			view.decode(layer);
+		} catch (protozero::unknown_pbf_wire_type_exception const &e) {
+			fprintf(stderr, "PBF decoding error in tile %d/%u/%u\n", z, x, y);
+			exit(EXIT_FAILURE);
+		}
+
 		if (!pipeline) {
 			if (describe) {
 				if (!first_layer) {
-					printf(",\n");
+					fprintf(fp, ",\n");
 				}
 
-				printf("{ \"type\": \"FeatureCollection\"");
-				printf(", \"properties\": { \"layer\": ");
-				fprintq(stdout, layer.name.c_str());
-				printf(", \"version\": %d, \"extent\": %lld", layer.version, layer.extent);
-				printf(" }");
-				printf(", \"features\": [\n");
+				fprintf(fp, "{ \"type\": \"FeatureCollection\"");
+				fprintf(fp, ", \"properties\": { \"layer\": ");
+				fprintq(fp, layer.name.c_str());
+				fprintf(fp, ", \"version\": %d, \"extent\": %lld", layer.version, layer.extent);
+				fprintf(fp, " }");
+				fprintf(fp, ", \"features\": [\n");
 
 				first_layer = false;
 			}
@@ -125,17 +130,353 @@ void handle(std::string message, int z, unsigned x, unsigned y, int describe, st
 			exit(EXIT_FAILURE);
 		}
 
-		layer_to_geojson(stdout, layer, z, x, y, !pipeline, pipeline, pipeline, 0, 0, 0, !force);
+		layer_to_geojson(fp, layer, z, x, y, !pipeline, pipeline, pipeline, 0, 0, 0, !force);
 
 		if (!pipeline) {
 			if (describe) {
-				printf("] }\n");
+				fprintf(fp, "] }\n");
 			}
 		}
 	}
 
 	if (!pipeline) {
-		printf("] }\n");
+		fprintf(fp, "] }\n");
+	}
+}
+
+// How many tiles may be waiting to be decoded or written, per thread
+#define DECODE_QUEUE_TILES 100
+
+size_t CPUS = 1;
+int performance_stats = 0;
+
+// Tiles from a whole tileset are decoded and formatted on worker
+// threads, each into its own buffer, and a writer thread prints the
+// buffers in the order the tiles were read.
+
+struct decode_task {
+	size_t seq = 0;
+	int z = 0;
+	unsigned x = 0;
+	unsigned y = 0;
+	std::string data = "";
+	bool comma = false;
+};
+
+static pthread_mutex_t decode_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t decode_task_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t decode_output_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t decode_space_ready = PTHREAD_COND_INITIALIZER;
+
+static std::deque<decode_task> decode_tasks;
+static std::map<size_t, std::string> decode_outputs;
+static size_t decode_queued = 0;
+static size_t decode_written = 0;
+static bool decode_finishing = false;
+
+static std::set<std::string> const *decode_layers = NULL;
+static bool decode_pipeline = false;
+static bool decode_stats = false;
+
+static std::vector<pthread_t> decode_workers;
+static pthread_t decode_writer;
+
+static long long tiles_decoded = 0;
+static long long bytes_read = 0;
+static long long bytes_written = 0;
+static double decode_started = 0;
+
+static void lock() {
+	if (pthread_mutex_lock(&decode_lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void unlock() {
+	if (pthread_mutex_unlock(&decode_lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void decode_wait(pthread_cond_t *cond) {
+	if (pthread_cond_wait(cond, &decode_lock) != 0) {
+		perror("pthread_cond_wait");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void decode_broadcast(pthread_cond_t *cond) {
+	if (pthread_cond_broadcast(cond) != 0) {
+		perror("pthread_cond_broadcast");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void *run_decode_worker(void *) {
+	while (true) {
+		lock();
+
+		while (decode_tasks.size() == 0 && !decode_finishing) {
+			decode_wait(&decode_task_ready);
+		}
+
+		if (decode_tasks.size() == 0) {
+			unlock();
+			break;
+		}
+
+		decode_task task;
+		task.seq = decode_tasks.front().seq;
+		task.z = decode_tasks.front().z;
+		task.x = decode_tasks.front().x;
+		task.y = decode_tasks.front().y;
+		task.data.swap(decode_tasks.front().data);
+		task.comma = decode_tasks.front().comma;
+		decode_tasks.pop_front();
+
+		unlock();
+
+		char *buf = NULL;
+		size_t len = 0;
+		FILE *fp = open_memstream(&buf, &len);
+		if (fp == NULL) {
+			perror("open_memstream");
+			exit(EXIT_FAILURE);
+		}
+
+		if (task.comma) {
+			fprintf(fp, ",\n");
+		}
+		handle(fp, task.data, task.z, task.x, task.y, 1, *decode_layers, decode_pipeline, decode_stats);
+
+		if (fclose(fp) != 0) {
+			perror("fclose");
+			exit(EXIT_FAILURE);
+		}
+
+		std::string out(buf, len);
+		free(buf);
+
+		lock();
+		decode_outputs[task.seq].swap(out);
+		decode_broadcast(&decode_output_ready);
+		unlock();
+	}
+
+	return NULL;
+}
+
+static void *run_decode_writer(void *) {
+	while (true) {
+		lock();
+
+		while (decode_outputs.count(decode_written) == 0 && !(decode_finishing && decode_written == decode_queued)) {
+			decode_wait(&decode_output_ready);
+		}
+
+		if (decode_outputs.count(decode_written) == 0) {
+			unlock();
+			break;
+		}
+
+		auto o = decode_outputs.find(decode_written);
+		std::string out;
+		out.swap(o->second);
+		decode_outputs.erase(o);
+		decode_written++;
+
+		decode_broadcast(&decode_space_ready);
+		unlock();
+
+		if (fwrite(out.data(), sizeof(char), out.size(), stdout) != out.size()) {
+			perror("Write decoded tile");
+			exit(EXIT_FAILURE);
+		}
+		bytes_written += out.size();
+	}
+
+	return NULL;
+}
+
+// Start the threads that decode and print the tiles of a whole tileset
+void decode_start(std::set<std::string> const &to_decode, bool pipeline, bool stats) {
+	decode_layers = &to_decode;
+	decode_pipeline = pipeline;
+	decode_stats = stats;
+	decode_finishing = false;
+	decode_queued = decode_written = 0;
+	decode_started = timer_now();
+
+	// Anything already printed must come out before the tiles
+	fflush(stdout);
+
+	decode_workers.resize(CPUS);
+	for (size_t i = 0; i < decode_workers.size(); i++) {
+		if (pthread_create(&decode_workers[i], NULL, run_decode_worker, NULL) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (pthread_create(&decode_writer, NULL, run_decode_writer, NULL) != 0) {
+		perror("pthread_create");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Hand a tile to the decoding threads, waiting if too many are already waiting
+void queue_decode_task(int z, unsigned x, unsigned y, std::string const &data, bool comma) {
+	lock();
+
+	while (decode_queued - decode_written >= DECODE_QUEUE_TILES * CPUS) {
+		decode_wait(&decode_space_ready);
+	}
+
+	decode_tasks.push_back(decode_task());
+	decode_task &task = decode_tasks.back();
+	task.seq = decode_queued++;
+	task.z = z;
+	task.x = x;
+	task.y = y;
+	task.data = data;
+	task.comma = comma;
+
+	tiles_decoded++;
+	bytes_read += data.size();
+
+	decode_broadcast(&decode_task_ready);
+	unlock();
+}
+
+// Wait for every queued tile to be decoded and printed
+void decode_finish() {
+	lock();
+	decode_finishing = true;
+	decode_broadcast(&decode_task_ready);
+	decode_broadcast(&decode_output_ready);
+	unlock();
+
+	for (size_t i = 0; i < decode_workers.size(); i++) {
+		void *retval;
+		if (pthread_join(decode_workers[i], &retval) != 0) {
+			perror("pthread_join");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	lock();
+	decode_broadcast(&decode_output_ready);
+	unlock();
+
+	void *retval;
+	if (pthread_join(decode_writer, &retval) != 0) {
+		perror("pthread_join");
+		exit(EXIT_FAILURE);
+	}
+
+	if (performance_stats) {
+		double elapsed = timer_now() - decode_started;
+		fprintf(stderr, "Decoded %lld tiles with %zu threads in %.3f seconds: %.0f tiles/s, %.2f MB/s of tiles read, %.2f MB/s of output written\n",
+			tiles_decoded, CPUS, elapsed, elapsed > 0 ? tiles_decoded / elapsed : 0.0,
+			elapsed > 0 ? bytes_read / elapsed / 1e6 : 0.0, elapsed > 0 ? bytes_written / elapsed / 1e6 : 0.0);
+	}
+}
+
+void print_metadata_field(const char *name, const char *value, int &within) {
+	if (within) {
+		printf(",\n");
+	}
+	within = 1;
+
+	fprintq(stdout, name);
+	printf(": ");
+	fprintq(stdout, value);
+}
+
+void decode_archive(archive_reader *ar, int z, unsigned x, unsigned y, std::set<std::string> const &to_decode, bool pipeline, bool stats) {
+	int oz = z;
+	unsigned ox = x, oy = y;
+
+	if (z < 0) {
+		int within = 0;
+
+		if (!pipeline && !stats) {
+			printf("{ \"type\": \"FeatureCollection\", \"properties\": {\n");
+
+			std::string metadata = archive_read_metadata(ar);
+			json_pull *jp = json_begin_string(metadata.c_str());
+			json_object *j = json_read_tree(jp);
+
+			if (j != NULL && j->type == JSON_HASH) {
+				std::map<std::string, std::string> fields;
+				for (size_t i = 0; i < j->length; i++) {
+					if (j->keys[i]->type == JSON_STRING && j->values[i]->type == JSON_STRING) {
+						fields.insert(std::pair<std::string, std::string>(j->keys[i]->string, j->values[i]->string));
+					}
+				}
+
+				for (auto f = fields.begin(); f != fields.end(); ++f) {
+					print_metadata_field(f->first.c_str(), f->second.c_str(), within);
+				}
+			}
+
+			json_end(jp);
+		}
+
+		if (stats) {
+			printf("[\n");
+		}
+
+		if (!pipeline && !stats) {
+			printf("\n}, \"features\": [\n");
+		}
+
+		std::vector<archive_tile> tiles = archive_tiles(ar);
+
+		decode_start(to_decode, pipeline, stats);
+
+		within = 0;
+		for (size_t i = 0; i < tiles.size(); i++) {
+			if (tiles[i].z < minzoom || tiles[i].z > maxzoom) {
+				continue;
+			}
+
+			bool comma = false;
+			if (!pipeline || stats) {
+				comma = within;
+				within = 1;
+			}
+
+			queue_decode_task(tiles[i].z, tiles[i].x, tiles[i].y, std::string(ar->data + tiles[i].offset, tiles[i].len), comma);
+		}
+
+		decode_finish();
+
+		if (!pipeline && !stats) {
+			printf("] }\n");
+		}
+		if (stats) {
+			printf("]\n");
+		}
+	} else {
+		std::string tile;
+
+		while (z >= 0) {
+			if (archive_read_tile(ar, z, x, y, tile)) {
+				if (z != oz) {
+					fprintf(stderr, "%s: Warning: using tile %d/%u/%u instead of %d/%u/%u\n", ar->fname.c_str(), z, x, y, oz, ox, oy);
+				}
+
+				handle(stdout, tile, z, x, y, 0, to_decode, pipeline, stats);
+				break;
+			}
+
+			z--;
+			x /= 2;
+			y /= 2;
+		}
 	}
 }
 
@@ -144,6 +485,13 @@ void decode(char *fname, int z, unsigned x, unsigned y, std::set<std::string> co
 	int oz = z;
 	unsigned ox = x, oy = y;
 
+	archive_reader *ar = archive_open_read(fname);
+	if (ar != NULL) {
+		decode_archive(ar, z, x, y, to_decode, pipeline, stats);
+		archive_close_read(ar);
+		return;
+	}
+
 	int fd = open(fname, O_RDONLY | O_CLOEXEC);
 	if (fd >= 0) {
 		struct stat st;
@@ -154,7 +502,7 @@ void decode(char *fname, int z, unsigned x, unsigned y, std::set<std::string> co
 					if (strcmp(map, "SQLite format 3") != 0) {
 						if (z >= 0) {
 							std::string s = std::string(map, st.st_size);
-							handle(s, z, x, y, 1, to_decode, pipeline, stats);
+							handle(stdout, s, z, x, y, 1, to_decode, pipeline, stats);
 							munmap(map, st.st_size);
 							return;
 						} else {
@@ -181,6 +529,14 @@ void decode(char *fname, int z, unsigned x, unsigned y, std::set<std::string> co
 		exit(EXIT_FAILURE);
 	}
 
+	// Let SQLite read tiles straight out of the page cache
+	// instead of copying each page into its own cache first
+	char *err = NULL;
+	if (sqlite3_exec(db, "PRAGMA mmap_size = 2147418112;", NULL, NULL, &err) != SQLITE_OK) {
+		fprintf(stderr, "%s: mmap_size: %s\n", fname, err);
+		sqlite3_free(err);
+	}
+
 	if (z < 0) {
 		int within = 0;
 
@@ -195,11 +551,6 @@ void decode(char *fname, int z, unsigned x, unsigned y, std::set<std::string> co
 			}
 
 			while (sqlite3_step(stmt2) == SQLITE_ROW) {
-				if (within) {
-					printf(",\n");
-				}
-				within = 1;
-
 				const unsigned char *name = sqlite3_column_text(stmt2, 0);
 				const unsigned char *value = sqlite3_column_text(stmt2, 1);
 
@@ -208,9 +559,7 @@ void decode(char *fname, int z, unsigned x, unsigned y, std::set<std::string> co
 					exit(EXIT_FAILURE);
 				}
 
-				fprintq(stdout, (char *) name);
-				printf(": ");
-				fprintq(stdout, (char *) value);
+				print_metadata_field((char *) name, (char *) value, within);
 			}
 
 			sqlite3_finalize(stmt2);
@@ -234,18 +583,13 @@ void decode(char *fname, int z, unsigned x, unsigned y, std::set<std::string> co
 			printf("\n}, \"features\": [\n");
 		}
 
+		decode_start(to_decode, pipeline, stats);
+
 		within = 0;
 		while (sqlite3_step(stmt) == SQLITE_ROW) {
-			if (!pipeline && !stats) {
-				if (within) {
-					printf(",\n");
-				}
-				within = 1;
-			}
-			if (stats) {
-				if (within) {
-					printf(",\n");
-				}
+			bool comma = false;
+			if (!pipeline || stats) {
+				comma = within;
 				within = 1;
 			}
 
@@ -262,9 +606,11 @@ void decode(char *fname, int z, unsigned x, unsigned y, std::set<std::string> co
 			ty = (1LL << tz) - 1 - ty;
 			const char *s = (const char *) sqlite3_column_blob(stmt, 0);
 
-			handle(std::string(s, len), tz, tx, ty, 1, to_decode, pipeline, stats);
+			queue_decode_task(tz, tx, ty, std::string(s, len), comma);
 		}
 
+		decode_finish();
+
 		if (!pipeline && !stats) {
 			printf("] }\n");
 		}
@@ -295,7 +641,7 @@ void decode(char *fname, int z, unsigned x, unsigned y, std::set<std::string> co
 					fprintf(stderr, "%s: Warning: using tile %d/%u/%u instead of %d/%u/%u\n", fname, z, x, y, oz, ox, oy);
 				}
 
-				handle(std::string(s, len), z, x, y, 0, to_decode, pipeline, stats);
+				handle(stdout, std::string(s, len), z, x, y, 0, to_decode, pipeline, stats);
 				handled = 1;
 			}
 
@@ -314,7 +660,7 @@ void decode(char *fname, int z, unsigned x, unsigned y, std::set<std::string> co
 }
 
 void usage(char **argv) {
-	fprintf(stderr, "Usage: %s [-s projection] [-Z minzoom] [-z maxzoom] [-l layer ...] file.mbtiles [zoom x y]\n", argv[0]);
+	fprintf(stderr, "Usage: %s [-s projection] [-Z minzoom] [-z maxzoom] [-l layer ...] file.mbtiles|archive [zoom x y]\n", argv[0]);
 	exit(EXIT_FAILURE);
 }
 
@@ -334,6 +680,7 @@ int main(int argc, char **argv) {
 		{"tag-layer-and-zoom", no_argument, 0, 'c'},
 		{"stats", no_argument, 0, 'S'},
 		{"force", no_argument, 0, 'f'},
+		{"performance-stats", no_argument, &performance_stats, 1},
 		{0, 0, 0, 0},
 	};
 
@@ -386,6 +733,16 @@ int main(int argc, char **argv) {
 		}
 	}
 
+	CPUS = sysconf(_SC_NPROCESSORS_ONLN);
+
+	const char *TIPPECANOE_MAX_THREADS = getenv("TIPPECANOE_MAX_THREADS");
+	if (TIPPECANOE_MAX_THREADS != NULL) {
+		CPUS = atoi(TIPPECANOE_MAX_THREADS);
+	}
+	if (CPUS < 1) {
+		CPUS = 1;
+	}
+
 	if (argc == optind + 4) {
 		decode(argv[optind], atoi(argv[optind + 1]), atoi(argv[optind + 2]), atoi(argv[optind + 3]), to_decode, pipeline, stats);
 	} else if (argc == optind + 1) {
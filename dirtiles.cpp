@@ -6,6 +6,8 @@
 #include <string.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <sys/stat.h>
 #include "dirtiles.hpp"
 
@@ -18,25 +20,133 @@ std::string dir_read_tile(std::string pbfPath) {
 	return (contents.str());
 }
 
-void dir_write_tile(const char *outdir, int z, int tx, int ty, std::string const &pbf) {
+// How many z/x directories each writer keeps open
+#define DIR_COLUMN_FDS 16
+
+void dir_writer_open(dir_writer *dw, const char *outdir) {
+	dw->outdir = outdir;
 	mkdir(outdir, S_IRWXU | S_IRWXG | S_IRWXO);
-	std::string curdir(outdir);
-	std::string slash("/");
-	std::string newdir = curdir + slash + std::to_string(z);
-	mkdir(newdir.c_str(), S_IRWXU | S_IRWXG | S_IRWXO);
-	newdir = newdir + "/" + std::to_string(tx);
-	mkdir(newdir.c_str(), S_IRWXU | S_IRWXG | S_IRWXO);
-	newdir = newdir + "/" + std::to_string(ty) + ".pbf";
 
-	struct stat st;
-	if (stat(newdir.c_str(), &st) == 0) {
-		fprintf(stderr, "Can't write tile to already existing %s\n", newdir.c_str());
+	dw->root_fd = open(outdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dw->root_fd < 0) {
+		perror(outdir);
 		exit(EXIT_FAILURE);
 	}
+}
 
-	std::ofstream pbfFile(newdir, std::ios::out | std::ios::binary);
-	pbfFile.write(pbf.data(), pbf.size());
-	pbfFile.close();
+static void make_dir(dir_writer *dw, int fd, std::string const &name, std::pair<int, int> key) {
+	if (dw->made.count(key) == 0) {
+		if (mkdirat(fd, name.c_str(), S_IRWXU | S_IRWXG | S_IRWXO) == 0) {
+			dw->dirs_made++;
+		} else if (errno != EEXIST) {
+			std::string path = dw->outdir + "/" + name;
+			perror(path.c_str());
+			exit(EXIT_FAILURE);
+		}
+
+		dw->made.insert(key);
+	}
+}
+
+// The file descriptor of the z/x directory, opening it, and making it
+// if necessary, and closing the least recently used one if too many are open
+static int column_fd(dir_writer *dw, int z, int tx) {
+	std::pair<int, int> key(z, tx);
+
+	auto f = dw->column_fds.find(key);
+	if (f != dw->column_fds.end()) {
+		if (dw->column_lru.front() != key) {
+			dw->column_lru.remove(key);
+			dw->column_lru.push_front(key);
+		}
+		return f->second;
+	}
+
+	std::string zdir = std::to_string(z);
+	std::string xdir = zdir + "/" + std::to_string(tx);
+	make_dir(dw, dw->root_fd, zdir, std::pair<int, int>(z, -1));
+	make_dir(dw, dw->root_fd, xdir, key);
+
+	int fd = openat(dw->root_fd, xdir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		std::string path = dw->outdir + "/" + xdir;
+		perror(path.c_str());
+		exit(EXIT_FAILURE);
+	}
+	dw->columns_opened++;
+
+	if (dw->column_lru.size() >= DIR_COLUMN_FDS) {
+		std::pair<int, int> old = dw->column_lru.back();
+		dw->column_lru.pop_back();
+
+		auto o = dw->column_fds.find(old);
+		if (close(o->second) != 0) {
+			perror("close directory");
+			exit(EXIT_FAILURE);
+		}
+		dw->column_fds.erase(o);
+	}
+
+	dw->column_fds.insert(std::pair<std::pair<int, int>, int>(key, fd));
+	dw->column_lru.push_front(key);
+	return fd;
+}
+
+void dir_writer_write(dir_writer *dw, int z, int tx, int ty, std::string const &pbf) {
+	int dfd = column_fd(dw, z, tx);
+	std::string name = std::to_string(ty) + ".pbf";
+
+	int fd = openat(dfd, name.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+	if (fd < 0) {
+		std::string path = dw->outdir + "/" + std::to_string(z) + "/" + std::to_string(tx) + "/" + name;
+
+		if (errno == EEXIST) {
+			fprintf(stderr, "Can't write tile to already existing %s\n", path.c_str());
+		} else {
+			perror(path.c_str());
+		}
+		exit(EXIT_FAILURE);
+	}
+
+	size_t off = 0;
+	while (off < pbf.size()) {
+		ssize_t written = write(fd, pbf.data() + off, pbf.size() - off);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("write tile");
+			exit(EXIT_FAILURE);
+		}
+		off += written;
+	}
+
+	if (close(fd) != 0) {
+		perror("close tile");
+		exit(EXIT_FAILURE);
+	}
+
+	dw->files++;
+	dw->bytes += pbf.size();
+}
+
+void dir_writer_close(dir_writer *dw) {
+	for (auto f = dw->column_fds.begin(); f != dw->column_fds.end(); ++f) {
+		if (close(f->second) != 0) {
+			perror("close directory");
+			exit(EXIT_FAILURE);
+		}
+	}
+	dw->column_fds.clear();
+	dw->column_lru.clear();
+
+	if (dw->root_fd >= 0) {
+		if (close(dw->root_fd) != 0) {
+			perror("close directory");
+			exit(EXIT_FAILURE);
+		}
+		dw->root_fd = -1;
+	}
 }
 
 bool numeric(const char *s) {
@@ -1,11 +1,33 @@
 #include <string>
+#include <map>
+#include <set>
+#include <list>
 
 #ifndef DIRTILES_HPP
 #define DIRTILES_HPP
 
+// Writes tiles into a z/x/y.pbf directory tree. It remembers which
+// directories it has already made, and keeps the most recently used
+// z/x directories open so that tiles are created relative to them with
+// openat() instead of resolving the whole path for each tile.
+struct dir_writer {
+	std::string outdir = "";
+	int root_fd = -1;
+	std::set<std::pair<int, int>> made{};  // z/x directories that exist; x is -1 for z
+	std::map<std::pair<int, int>, int> column_fds{};
+	std::list<std::pair<int, int>> column_lru{};
+
+	long long files = 0;
+	long long bytes = 0;
+	long long dirs_made = 0;
+	long long columns_opened = 0;
+};
+
 std::string dir_read_tile(std::string pbfPath);
 
-void dir_write_tile(const char *outdir, int z, int tx, int ty, std::string const &pbf);
+void dir_writer_open(dir_writer *dw, const char *outdir);
+void dir_writer_write(dir_writer *dw, int z, int tx, int ty, std::string const &pbf);
+void dir_writer_close(dir_writer *dw);
 
 void check_dir(const char *d, bool rm);
 
@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include "estimate.hpp"
+#include "main.hpp"
+
+// Tiles that have to have been compressed at a zoom level
+// before its compression ratio is trusted for predictions
+#define MIN_CALIBRATION 16
+
+struct size_model {
+	long long units = 0;
+	long long bytes = 0;
+	long long tiles = 0;
+};
+
+static pthread_mutex_t model_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// What has been learned so far, and what was known when the current pass began.
+// Predictions only use the frozen copy, so they don't depend on the order
+// in which the tiling threads happen to finish their tiles.
+static size_model learning[MAX_ZOOM + 1];
+static size_model frozen[MAX_ZOOM + 1];
+
+static long long predictions = 0;
+static long long hits = 0;
+static long long too_small = 0;
+static long long too_big = 0;
+static double error_sum = 0;
+static long long skipped = 0;
+
+static int varint_size(unsigned long long n) {
+	int size = 1;
+	while (n >= 0x80) {
+		n >>= 7;
+		size++;
+	}
+	return size;
+}
+
+static unsigned long long zigzag(long long n) {
+	return (n << 1) ^ (n >> 63);
+}
+
+/**
+ * Returns roughly how many bytes the tile would take up encoded
+ * but not compressed, from its feature count, its geometry after
+ * simplification, and the sizes of its layers' key and value pools.
+ */
+long long tile_size_units(mvt_tile const &tile) {
+	long long units = 0;
+
+	for (size_t i = 0; i < tile.layers.size(); i++) {
+		mvt_layer const &layer = tile.layers[i];
+		units += 12 + layer.name.size();
+
+		for (size_t k = 0; k < layer.keys.size(); k++) {
+			units += 2 + layer.keys[k].size();
+		}
+
+		for (size_t v = 0; v < layer.values.size(); v++) {
+			mvt_value const &val = layer.values[v];
+
+			if (val.type == mvt_string) {
+				units += 4 + val.string_value.size();
+			} else if (val.type == mvt_float) {
+				units += 7;
+			} else if (val.type == mvt_double) {
+				units += 11;
+			} else if (val.type == mvt_int || val.type == mvt_uint) {
+				units += 3 + varint_size(val.numeric_value.uint_value);
+			} else if (val.type == mvt_sint) {
+				units += 3 + varint_size(zigzag(val.numeric_value.sint_value));
+			} else {
+				units += 4;
+			}
+		}
+
+		for (size_t f = 0; f < layer.features.size(); f++) {
+			mvt_feature const &feature = layer.features[f];
+			units += 10;
+
+			if (feature.has_id) {
+				units += 1 + varint_size(feature.id);
+			}
+
+			for (size_t t = 0; t < feature.tags.size(); t++) {
+				units += varint_size(feature.tags[t]);
+			}
+
+			long long px = 0, py = 0;
+			int op = -1;
+			for (size_t g = 0; g < feature.geometry.size(); g++) {
+				mvt_geometry const &geom = feature.geometry[g];
+
+				if (geom.op != op) {
+					units++;
+					op = geom.op;
+				}
+
+				if (geom.op == mvt_moveto || geom.op == mvt_lineto) {
+					units += varint_size(zigzag(geom.x - px)) + varint_size(zigzag(geom.y - py));
+					px = geom.x;
+					py = geom.y;
+				}
+			}
+		}
+	}
+
+	return units;
+}
+
+/**
+ * Predicts the compressed size of a tile at zoom z from its size units,
+ * using the compression ratio of the tiles already made at z, or if
+ * there are too few of those, at z and the zoom levels nearest below it.
+ * Returns -1 if there have not yet been enough tiles to calibrate it.
+ */
+long long estimate_tile_size(long long units, int z) {
+	size_model sum;
+
+	for (int i = z; i >= 0; i--) {
+		sum.units += frozen[i].units;
+		sum.bytes += frozen[i].bytes;
+		sum.tiles += frozen[i].tiles;
+
+		if (sum.tiles >= MIN_CALIBRATION && sum.units > 0) {
+			return units * (double) sum.bytes / sum.units;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * Records the actual compressed size of a tile, both to calibrate
+ * later predictions and to score the prediction that was made for it.
+ */
+void calibrate_tile_size(long long units, long long estimate, long long actual, size_t limit, int z) {
+	if (pthread_mutex_lock(&model_lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
+
+	learning[z].units += units;
+	learning[z].bytes += actual;
+	learning[z].tiles++;
+
+	if (estimate >= 0) {
+		predictions++;
+
+		bool predicted_over = estimate > (long long) limit;
+		bool actual_over = actual > (long long) limit;
+
+		if (predicted_over == actual_over) {
+			hits++;
+		} else if (actual_over) {
+			too_small++;
+		} else {
+			too_big++;
+		}
+
+		if (actual > 0) {
+			error_sum += llabs(estimate - actual) / (double) actual;
+		}
+	}
+
+	if (pthread_mutex_unlock(&model_lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void estimate_skipped_encoding() {
+	if (pthread_mutex_lock(&model_lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
+
+	skipped++;
+
+	if (pthread_mutex_unlock(&model_lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/**
+ * Makes everything learned so far available for predictions.
+ * Called between passes, when no tiling threads are running.
+ */
+void freeze_tile_size_model() {
+	for (int i = 0; i <= MAX_ZOOM; i++) {
+		frozen[i] = learning[i];
+	}
+}
+
+void report_tile_size_estimates() {
+	fprintf(stderr, "Tile size estimates: %lld predictions, %lld right about fitting, %lld too small, %lld too big, %.1f%% average error, %lld encodings skipped\n",
+		predictions, hits, too_small, too_big, predictions > 0 ? 100 * error_sum / predictions : 0.0, skipped);
+}
@@ -0,0 +1,14 @@
+#ifndef ESTIMATE_HPP
+#define ESTIMATE_HPP
+
+#include <stddef.h>
+#include "mvt.hpp"
+
+long long tile_size_units(mvt_tile const &tile);
+long long estimate_tile_size(long long units, int z);
+void calibrate_tile_size(long long units, long long estimate, long long actual, size_t limit, int z);
+void estimate_skipped_encoding();
+void freeze_tile_size_model();
+void report_tile_size_estimates();
+
+#endif
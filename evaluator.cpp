@@ -5,18 +5,18 @@
 #include "mvt.hpp"
 #include "evaluator.hpp"
 
-int compare(mvt_value one, json_object *two, bool &fail) {
+int compare(mvt_value const &one, filter_constant const &two, bool &fail) {
 	if (one.type == mvt_string) {
-		if (two->type != JSON_STRING) {
+		if (two.type != JSON_STRING) {
 			fail = true;
 			return false;  // string vs non-string
 		}
 
-		return strcmp(one.string_value.c_str(), two->string);
+		return strcmp(one.string_value.c_str(), two.string.c_str());
 	}
 
 	if (one.type == mvt_double || one.type == mvt_float || one.type == mvt_int || one.type == mvt_uint || one.type == mvt_sint) {
-		if (two->type != JSON_NUMBER) {
+		if (two.type != JSON_NUMBER) {
 			fail = true;
 			return false;  // number vs non-number
 		}
@@ -37,9 +37,9 @@ int compare(mvt_value one, json_object *two, bool &fail) {
 			exit(EXIT_FAILURE);
 		}
 
-		if (v < two->number) {
+		if (v < two.number) {
 			return -1;
-		} else if (v > two->number) {
+		} else if (v > two.number) {
 			return 1;
 		} else {
 			return 0;
@@ -47,17 +47,17 @@ int compare(mvt_value one, json_object *two, bool &fail) {
 	}
 
 	if (one.type == mvt_bool) {
-		if (two->type != JSON_TRUE && two->type != JSON_FALSE) {
+		if (two.type != JSON_TRUE && two.type != JSON_FALSE) {
 			fail = true;
 			return false;  // bool vs non-bool
 		}
 
-		bool b = two->type != JSON_FALSE;
+		bool b = two.type != JSON_FALSE;
 		return one.numeric_value.bool_value > b;
 	}
 
 	if (one.type == mvt_null) {
-		if (two->type != JSON_NULL) {
+		if (two.type != JSON_NULL) {
 			fail = true;
 			return false;  // null vs non-null
 		}
@@ -69,190 +69,112 @@ int compare(mvt_value one, json_object *two, bool &fail) {
 	exit(EXIT_FAILURE);
 }
 
-bool eval(std::map<std::string, mvt_value> const &feature, json_object *f) {
-	if (f == NULL || f->type != JSON_ARRAY) {
-		fprintf(stderr, "Filter is not an array: %s\n", json_stringify(f));
-		exit(EXIT_FAILURE);
-	}
-
-	if (f->length < 1) {
-		fprintf(stderr, "Array too small in filter: %s\n", json_stringify(f));
-		exit(EXIT_FAILURE);
-	}
-
-	if (f->array[0]->type != JSON_STRING) {
-		fprintf(stderr, "Filter operation is not a string: %s\n", json_stringify(f));
-		exit(EXIT_FAILURE);
+static void warn_once(bool &warned, const char *message, filter_node const &n) {
+	if (!warned) {
+		fprintf(stderr, "Warning: %s: %s\n", message, n.text.c_str());
+		warned = true;
 	}
+}
 
-	if (strcmp(f->array[0]->string, "has") == 0 ||
-	    strcmp(f->array[0]->string, "!has") == 0) {
-		if (f->length != 2) {
-			fprintf(stderr, "Wrong number of array elements in filter: %s\n", json_stringify(f));
-			exit(EXIT_FAILURE);
-		}
-
-		if (strcmp(f->array[0]->string, "has") == 0) {
-			if (f->array[1]->type != JSON_STRING) {
-				fprintf(stderr, "\"has\" key is not a string: %s\n", json_stringify(f));
-				exit(EXIT_FAILURE);
-			}
-			return feature.count(std::string(f->array[1]->string)) != 0;
-		}
+bool eval(filter_program const *filter, size_t node, std::vector<const mvt_value *> const &slots) {
+	filter_node const &n = filter->nodes[node];
 
-		if (strcmp(f->array[0]->string, "!has") == 0) {
-			if (f->array[1]->type != JSON_STRING) {
-				fprintf(stderr, "\"!has\" key is not a string: %s\n", json_stringify(f));
-				exit(EXIT_FAILURE);
-			}
-			return feature.count(std::string(f->array[1]->string)) == 0;
-		}
-	}
+	switch (n.op) {
+	case FILTER_HAS:
+		return slots[n.key] != NULL;
 
-	if (strcmp(f->array[0]->string, "==") == 0 ||
-	    strcmp(f->array[0]->string, "!=") == 0 ||
-	    strcmp(f->array[0]->string, ">") == 0 ||
-	    strcmp(f->array[0]->string, ">=") == 0 ||
-	    strcmp(f->array[0]->string, "<") == 0 ||
-	    strcmp(f->array[0]->string, "<=") == 0) {
-		if (f->length != 3) {
-			fprintf(stderr, "Wrong number of array elements in filter: %s\n", json_stringify(f));
-			exit(EXIT_FAILURE);
-		}
-		if (f->array[1]->type != JSON_STRING) {
-			fprintf(stderr, "\"!has\" key is not a string: %s\n", json_stringify(f));
-			exit(EXIT_FAILURE);
-		}
+	case FILTER_NOT_HAS:
+		return slots[n.key] == NULL;
 
-		auto ff = feature.find(std::string(f->array[1]->string));
-		if (ff == feature.end()) {
+	case FILTER_EQ:
+	case FILTER_NE:
+	case FILTER_GT:
+	case FILTER_GE:
+	case FILTER_LT:
+	case FILTER_LE: {
+		const mvt_value *v = slots[n.key];
+		if (v == NULL) {
 			static bool warned = false;
-			if (!warned) {
-				const char *s = json_stringify(f);
-				fprintf(stderr, "Warning: attribute not found for comparison: %s\n", s);
-				free((void *) s);
-				warned = true;
-			}
-			if (strcmp(f->array[0]->string, "!=") == 0) {
+			warn_once(warned, "attribute not found for comparison", n);
+			if (n.op == FILTER_NE) {
 				return true;  //  attributes that aren't found are not equal
 			}
 			return false;  // not found: comparison is false
 		}
 
 		bool fail = false;
-		int cmp = compare(ff->second, f->array[2], fail);
+		int cmp = compare(*v, n.constants[0], fail);
 
 		if (fail) {
 			static bool warned = false;
-			if (!warned) {
-				const char *s = json_stringify(f);
-				fprintf(stderr, "Warning: mismatched type in comparison: %s\n", s);
-				free((void *) s);
-				warned = true;
-			}
-			if (strcmp(f->array[0]->string, "!=") == 0) {
+			warn_once(warned, "mismatched type in comparison", n);
+			if (n.op == FILTER_NE) {
 				return true;  // mismatched types are not equal
 			}
 			return false;
 		}
 
-		if (strcmp(f->array[0]->string, "==") == 0) {
+		switch (n.op) {
+		case FILTER_EQ:
 			return cmp == 0;
-		}
-		if (strcmp(f->array[0]->string, "!=") == 0) {
+		case FILTER_NE:
 			return cmp != 0;
-		}
-		if (strcmp(f->array[0]->string, ">") == 0) {
+		case FILTER_GT:
 			return cmp > 0;
-		}
-		if (strcmp(f->array[0]->string, ">=") == 0) {
+		case FILTER_GE:
 			return cmp >= 0;
-		}
-		if (strcmp(f->array[0]->string, "<") == 0) {
+		case FILTER_LT:
 			return cmp < 0;
-		}
-		if (strcmp(f->array[0]->string, "<=") == 0) {
+		default:
 			return cmp <= 0;
 		}
-
-		fprintf(stderr, "Internal error: can't happen: %s\n", json_stringify(f));
-		exit(EXIT_FAILURE);
 	}
 
-	if (strcmp(f->array[0]->string, "all") == 0 ||
-	    strcmp(f->array[0]->string, "any") == 0 ||
-	    strcmp(f->array[0]->string, "none") == 0) {
-		bool v;
-
-		if (strcmp(f->array[0]->string, "all") == 0) {
-			v = true;
-		} else {
-			v = false;
+	case FILTER_ALL:
+		for (size_t i = 0; i < n.children.size(); i++) {
+			if (!eval(filter, n.children[i], slots)) {
+				return false;
+			}
 		}
-
-		for (size_t i = 1; i < f->length; i++) {
-			bool out = eval(feature, f->array[i]);
-
-			if (strcmp(f->array[0]->string, "all") == 0) {
-				v = v && out;
-				if (!v) {
-					break;
-				}
-			} else {
-				v = v || out;
-				if (v) {
-					break;
-				}
+		return true;
+
+	case FILTER_ANY:
+	case FILTER_NONE: {
+		bool v = false;
+		for (size_t i = 0; i < n.children.size(); i++) {
+			if (eval(filter, n.children[i], slots)) {
+				v = true;
+				break;
 			}
 		}
 
-		if (strcmp(f->array[0]->string, "none") == 0) {
+		if (n.op == FILTER_NONE) {
 			return !v;
 		} else {
 			return v;
 		}
 	}
 
-	if (strcmp(f->array[0]->string, "in") == 0 ||
-	    strcmp(f->array[0]->string, "!in") == 0) {
-		if (f->length < 2) {
-			fprintf(stderr, "Array too small in filter: %s\n", json_stringify(f));
-			exit(EXIT_FAILURE);
-		}
-
-		if (f->array[1]->type != JSON_STRING) {
-			fprintf(stderr, "\"!has\" key is not a string: %s\n", json_stringify(f));
-			exit(EXIT_FAILURE);
-		}
-
-		auto ff = feature.find(std::string(f->array[1]->string));
-		if (ff == feature.end()) {
+	case FILTER_IN:
+	case FILTER_NOT_IN: {
+		const mvt_value *v = slots[n.key];
+		if (v == NULL) {
 			static bool warned = false;
-			if (!warned) {
-				const char *s = json_stringify(f);
-				fprintf(stderr, "Warning: attribute not found for comparison: %s\n", s);
-				free((void *) s);
-				warned = true;
-			}
-			if (strcmp(f->array[0]->string, "!in") == 0) {
+			warn_once(warned, "attribute not found for comparison", n);
+			if (n.op == FILTER_NOT_IN) {
 				return true;  // attributes that aren't found are not in
 			}
 			return false;  // not found: comparison is false
 		}
 
 		bool found = false;
-		for (size_t i = 2; i < f->length; i++) {
+		for (size_t i = 0; i < n.constants.size(); i++) {
 			bool fail = false;
-			int cmp = compare(ff->second, f->array[i], fail);
+			int cmp = compare(*v, n.constants[i], fail);
 
 			if (fail) {
 				static bool warned = false;
-				if (!warned) {
-					const char *s = json_stringify(f);
-					fprintf(stderr, "Warning: mismatched type in comparison: %s\n", s);
-					free((void *) s);
-					warned = true;
-				}
+				warn_once(warned, "mismatched type in comparison", n);
 				cmp = 1;
 			}
 
@@ -262,37 +184,197 @@ bool eval(std::map<std::string, mvt_value> const &feature, json_object *f) {
 			}
 		}
 
-		if (strcmp(f->array[0]->string, "in") == 0) {
+		if (n.op == FILTER_IN) {
 			return found;
 		} else {
 			return !found;
 		}
 	}
+	}
 
-	fprintf(stderr, "Unknown filter %s\n", json_stringify(f));
+	fprintf(stderr, "Internal error: bad filter operation %d\n", n.op);
 	exit(EXIT_FAILURE);
 }
 
-bool evaluate(std::map<std::string, mvt_value> const &feature, std::string const &layer, json_object *filter) {
+static size_t intern_key(filter_program *filter, const char *key) {
+	auto f = filter->key_slots.find(key);
+	if (f != filter->key_slots.end()) {
+		return f->second;
+	}
+
+	filter->keys.push_back(key);
+	filter->key_slots.insert(std::pair<std::string, size_t>(key, filter->keys.size() - 1));
+	return filter->keys.size() - 1;
+}
+
+static filter_constant compile_constant(json_object *j) {
+	filter_constant c;
+	c.type = j->type;
+
+	if (j->type == JSON_STRING) {
+		c.string = j->string;
+	} else if (j->type == JSON_NUMBER) {
+		c.number = j->number;
+	}
+
+	return c;
+}
+
+static size_t compile(filter_program *filter, json_object *f) {
+	if (f == NULL || f->type != JSON_ARRAY) {
+		fprintf(stderr, "Filter is not an array: %s\n", json_stringify(f));
+		exit(EXIT_FAILURE);
+	}
+
+	if (f->length < 1) {
+		fprintf(stderr, "Array too small in filter: %s\n", json_stringify(f));
+		exit(EXIT_FAILURE);
+	}
+
+	if (f->array[0]->type != JSON_STRING) {
+		fprintf(stderr, "Filter operation is not a string: %s\n", json_stringify(f));
+		exit(EXIT_FAILURE);
+	}
+
+	filter_node n;
+	const char *op = f->array[0]->string;
+
+	const char *s = json_stringify(f);
+	n.text = s;
+	free((void *) s);
+
+	if (strcmp(op, "has") == 0 || strcmp(op, "!has") == 0) {
+		if (f->length != 2) {
+			fprintf(stderr, "Wrong number of array elements in filter: %s\n", json_stringify(f));
+			exit(EXIT_FAILURE);
+		}
+		if (f->array[1]->type != JSON_STRING) {
+			fprintf(stderr, "\"%s\" key is not a string: %s\n", op, json_stringify(f));
+			exit(EXIT_FAILURE);
+		}
+
+		n.op = strcmp(op, "has") == 0 ? FILTER_HAS : FILTER_NOT_HAS;
+		n.key = intern_key(filter, f->array[1]->string);
+	} else if (strcmp(op, "==") == 0 || strcmp(op, "!=") == 0 ||
+		   strcmp(op, ">") == 0 || strcmp(op, ">=") == 0 ||
+		   strcmp(op, "<") == 0 || strcmp(op, "<=") == 0) {
+		if (f->length != 3) {
+			fprintf(stderr, "Wrong number of array elements in filter: %s\n", json_stringify(f));
+			exit(EXIT_FAILURE);
+		}
+		if (f->array[1]->type != JSON_STRING) {
+			fprintf(stderr, "\"%s\" key is not a string: %s\n", op, json_stringify(f));
+			exit(EXIT_FAILURE);
+		}
+
+		if (strcmp(op, "==") == 0) {
+			n.op = FILTER_EQ;
+		} else if (strcmp(op, "!=") == 0) {
+			n.op = FILTER_NE;
+		} else if (strcmp(op, ">") == 0) {
+			n.op = FILTER_GT;
+		} else if (strcmp(op, ">=") == 0) {
+			n.op = FILTER_GE;
+		} else if (strcmp(op, "<") == 0) {
+			n.op = FILTER_LT;
+		} else {
+			n.op = FILTER_LE;
+		}
+
+		n.key = intern_key(filter, f->array[1]->string);
+		n.constants.push_back(compile_constant(f->array[2]));
+	} else if (strcmp(op, "all") == 0 || strcmp(op, "any") == 0 || strcmp(op, "none") == 0) {
+		if (strcmp(op, "all") == 0) {
+			n.op = FILTER_ALL;
+		} else if (strcmp(op, "any") == 0) {
+			n.op = FILTER_ANY;
+		} else {
+			n.op = FILTER_NONE;
+		}
+
+		for (size_t i = 1; i < f->length; i++) {
+			n.children.push_back(compile(filter, f->array[i]));
+		}
+	} else if (strcmp(op, "in") == 0 || strcmp(op, "!in") == 0) {
+		if (f->length < 2) {
+			fprintf(stderr, "Array too small in filter: %s\n", json_stringify(f));
+			exit(EXIT_FAILURE);
+		}
+		if (f->array[1]->type != JSON_STRING) {
+			fprintf(stderr, "\"%s\" key is not a string: %s\n", op, json_stringify(f));
+			exit(EXIT_FAILURE);
+		}
+
+		n.op = strcmp(op, "in") == 0 ? FILTER_IN : FILTER_NOT_IN;
+		n.key = intern_key(filter, f->array[1]->string);
+		for (size_t i = 2; i < f->length; i++) {
+			n.constants.push_back(compile_constant(f->array[i]));
+		}
+	} else {
+		fprintf(stderr, "Unknown filter %s\n", json_stringify(f));
+		exit(EXIT_FAILURE);
+	}
+
+	filter->nodes.push_back(n);
+	return filter->nodes.size() - 1;
+}
+
+filter_program *compile_filter(json_object *filter) {
 	if (filter == NULL || filter->type != JSON_HASH) {
 		fprintf(stderr, "Error: filter is not a hash: %s\n", json_stringify(filter));
 		exit(EXIT_FAILURE);
 	}
 
-	bool ok = true;
-	json_object *f;
+	filter_program *p = new filter_program;
 
-	f = json_hash_get(filter, layer.c_str());
-	if (ok && f != NULL) {
-		ok = eval(feature, f);
+	for (size_t i = 0; i < filter->length; i++) {
+		if (filter->keys[i] == NULL || filter->keys[i]->type != JSON_STRING) {
+			continue;
+		}
+
+		std::string layer = filter->keys[i]->string;
+		if (layer == "*") {
+			if (p->all_layers < 0) {
+				p->all_layers = compile(p, filter->values[i]);
+			}
+		} else if (p->layers.count(layer) == 0) {
+			size_t root = compile(p, filter->values[i]);
+			p->layers.insert(std::pair<std::string, size_t>(layer, root));
+		}
 	}
 
-	f = json_hash_get(filter, "*");
-	if (ok && f != NULL) {
-		ok = eval(feature, f);
+	return p;
+}
+
+// The slot that the value of the named attribute should be stored in
+// for evaluation, or -1 if the filter does not refer to that attribute
+ssize_t filter_slot(filter_program const *filter, std::string const &key) {
+	auto f = filter->key_slots.find(key);
+	if (f == filter->key_slots.end()) {
+		return -1;
+	}
+	return f->second;
+}
+
+bool filter_uses_layer(filter_program const *filter, std::string const &layer) {
+	return filter->all_layers >= 0 || filter->layers.count(layer) != 0;
+}
+
+bool evaluate(filter_program const *filter, std::string const &layer, std::vector<const mvt_value *> const &slots) {
+	auto f = filter->layers.find(layer);
+	if (f != filter->layers.end()) {
+		if (!eval(filter, f->second, slots)) {
+			return false;
+		}
+	}
+
+	if (filter->all_layers >= 0) {
+		if (!eval(filter, filter->all_layers, slots)) {
+			return false;
+		}
 	}
 
-	return ok;
+	return true;
 }
 
 json_object *read_filter(const char *fname) {
@@ -1,12 +1,60 @@
 #ifndef EVALUATOR_HPP
-#define EVALUATOR HPP
+#define EVALUATOR_HPP
 
 #include <map>
 #include <string>
+#include <vector>
+#include <unordered_map>
+#include <sys/types.h>
 #include "jsonpull/jsonpull.h"
 #include "mvt.hpp"
 
-bool evaluate(std::map<std::string, mvt_value> const &feature, std::string const &layer, json_object *filter);
+enum filter_op {
+	FILTER_HAS,
+	FILTER_NOT_HAS,
+	FILTER_EQ,
+	FILTER_NE,
+	FILTER_GT,
+	FILTER_GE,
+	FILTER_LT,
+	FILTER_LE,
+	FILTER_ALL,
+	FILTER_ANY,
+	FILTER_NONE,
+	FILTER_IN,
+	FILTER_NOT_IN,
+};
+
+// A constant from the filter, in the form it is compared against
+struct filter_constant {
+	int type = JSON_NULL;
+	double number = 0;
+	std::string string = "";
+};
+
+struct filter_node {
+	filter_op op;
+	size_t key = 0;			      // attribute slot, for comparisons
+	std::vector<filter_constant> constants;  // right-hand sides, for comparisons
+	std::vector<size_t> children;	      // subexpressions, for all/any/none
+	std::string text = "";		      // the original expression, for warnings
+};
+
+// A filter compiled once from its JSON form. Every attribute name
+// that the filter mentions is assigned a slot, and features are
+// evaluated against an array of values indexed by slot.
+struct filter_program {
+	std::vector<filter_node> nodes;
+	std::vector<std::string> keys;
+	std::unordered_map<std::string, size_t> key_slots;
+	std::map<std::string, size_t> layers;
+	ssize_t all_layers = -1;
+};
+
+filter_program *compile_filter(json_object *filter);
+ssize_t filter_slot(filter_program const *filter, std::string const &key);
+bool filter_uses_layer(filter_program const *filter, std::string const &layer);
+bool evaluate(filter_program const *filter, std::string const &layer, std::vector<const mvt_value *> const &slots);
 json_object *parse_filter(const char *s);
 json_object *read_filter(const char *fname);
 
@@ -31,7 +31,19 @@ struct queued_feature {
 	std::string layername = "";
 };
 
+// Features are queued into one batch while the worker pool parses
+// the previous one, so that scanning the input overlaps with parsing.
 static std::vector<queued_feature> feature_queue;
+static std::vector<queued_feature> running_queue;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+
+static std::vector<pthread_t> pool_threads;
+static size_t pool_generation = 0;
+static size_t pool_running = 0;
+static bool pool_finishing = false;
 
 void ensureDim(size_t dim) {
 	if (dim < 2) {
@@ -421,63 +433,141 @@ void readFeature(protozero::pbf_reader &pbf, size_t dim, double e, std::vector<s
 	}
 }
 
-struct queue_run_arg {
-	size_t start;
-	size_t end;
-	size_t segment;
+static void lock() {
+	if (pthread_mutex_lock(&pool_lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
+}
 
-	queue_run_arg(size_t start1, size_t end1, size_t segment1)
-	    : start(start1), end(end1), segment(segment1) {
+static void unlock() {
+	if (pthread_mutex_unlock(&pool_lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
 	}
-};
+}
 
 void *run_parse_feature(void *v) {
-	struct queue_run_arg *qra = (struct queue_run_arg *) v;
+	size_t segment = (size_t) v;
+	size_t generation = 0;
+
+	while (true) {
+		lock();
 
-	for (size_t i = qra->start; i < qra->end; i++) {
-		struct queued_feature &qf = feature_queue[i];
-		readFeature(qf.pbf, qf.dim, qf.e, *qf.keys, &(*qf.sst)[qra->segment], qf.layer, qf.layername);
+		while (pool_generation == generation && !pool_finishing) {
+			if (pthread_cond_wait(&pool_start, &pool_lock) != 0) {
+				perror("pthread_cond_wait");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		if (pool_generation == generation) {
+			unlock();
+			break;
+		}
+
+		generation = pool_generation;
+		unlock();
+
+		size_t start = running_queue.size() * segment / CPUS;
+		size_t end = running_queue.size() * (segment + 1) / CPUS;
+
+		for (size_t i = start; i < end; i++) {
+			struct queued_feature &qf = running_queue[i];
+			readFeature(qf.pbf, qf.dim, qf.e, *qf.keys, &(*qf.sst)[segment], qf.layer, qf.layername);
+		}
+
+		lock();
+		pool_running--;
+		if (pool_running == 0) {
+			if (pthread_cond_signal(&pool_done) != 0) {
+				perror("pthread_cond_signal");
+				exit(EXIT_FAILURE);
+			}
+		}
+		unlock();
 	}
 
 	return NULL;
 }
 
+void startPool() {
+	pool_finishing = false;
+	pool_threads.resize(CPUS);
+
+	for (size_t i = 0; i < CPUS; i++) {
+		if (pthread_create(&pool_threads[i], NULL, run_parse_feature, (void *) i) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+// Wait for the batch that the pool is working on, if any, to finish
+void waitQueue() {
+	lock();
+	while (pool_running != 0) {
+		if (pthread_cond_wait(&pool_done, &pool_lock) != 0) {
+			perror("pthread_cond_wait");
+			exit(EXIT_FAILURE);
+		}
+	}
+	unlock();
+
+	if (running_queue.size() != 0) {
+		*((*(running_queue[0].sst))[0].layer_seq) = *((*(running_queue[0].sst))[CPUS - 1].layer_seq);
+		running_queue.clear();
+	}
+}
+
+// Hand the features queued so far to the pool, after the previous
+// batch finishes, and return so that reading can continue meanwhile
 void runQueue() {
+	waitQueue();
+
 	if (feature_queue.size() == 0) {
 		return;
 	}
 
-	std::vector<struct queue_run_arg> qra;
-
-	std::vector<pthread_t> pthreads;
-	pthreads.resize(CPUS);
-
+	// The sequence numbers for each segment can only be assigned once
+	// the previous batch has finished, since features can be filtered out
 	for (size_t i = 0; i < CPUS; i++) {
 		*((*(feature_queue[0].sst))[i].layer_seq) = *((*(feature_queue[0].sst))[0].layer_seq) + feature_queue.size() * i / CPUS;
+	}
 
-		qra.push_back(queue_run_arg(
-			feature_queue.size() * i / CPUS,
-			feature_queue.size() * (i + 1) / CPUS,
-			i));
+	running_queue.swap(feature_queue);
+
+	lock();
+	pool_generation++;
+	pool_running = CPUS;
+	if (pthread_cond_broadcast(&pool_start) != 0) {
+		perror("pthread_cond_broadcast");
+		exit(EXIT_FAILURE);
 	}
+	unlock();
+}
 
-	for (size_t i = 0; i < CPUS; i++) {
-		if (pthread_create(&pthreads[i], NULL, run_parse_feature, &qra[i]) != 0) {
-			perror("pthread_create");
-			exit(EXIT_FAILURE);
-		}
+void finishPool() {
+	runQueue();
+	waitQueue();
+
+	lock();
+	pool_finishing = true;
+	if (pthread_cond_broadcast(&pool_start) != 0) {
+		perror("pthread_cond_broadcast");
+		exit(EXIT_FAILURE);
 	}
+	unlock();
 
 	for (size_t i = 0; i < CPUS; i++) {
 		void *retval;
 
-		if (pthread_join(pthreads[i], &retval) != 0) {
+		if (pthread_join(pool_threads[i], &retval) != 0) {
 			perror("pthread_join");
 		}
 	}
 
-	*((*(feature_queue[0].sst))[0].layer_seq) = *((*(feature_queue[0].sst))[CPUS - 1].layer_seq);
-	feature_queue.clear();
+	pool_threads.clear();
 }
 
 void queueFeature(protozero::pbf_reader &pbf, size_t dim, double e, std::vector<std::string> &keys, std::vector<struct serialization_state> *sst, int layer, std::string layername) {
@@ -537,9 +627,13 @@ void parse_geobuf(std::vector<struct serialization_state> *sst, const char *src,
 	double e = 1e6;
 	std::vector<std::string> keys;
 
+	startPool();
+
 	while (pbf.next()) {
 		switch (pbf.tag()) {
 		case 1:
+			// The pool may still be reading features that refer to the keys
+			waitQueue();
 			keys.push_back(pbf.get_string());
 			break;
 
@@ -564,6 +658,9 @@ void parse_geobuf(std::vector<struct serialization_state> *sst, const char *src,
 		}
 
 		case 6: {
+			// Thread 0's serialization state must not be in use by the pool
+			waitQueue();
+
 			protozero::pbf_reader geometry_reader(pbf.get_message());
 			std::vector<drawvec_type> dv = readGeometry(geometry_reader, dim, e, keys);
 			for (size_t i = 0; i < dv.size(); i++) {
@@ -578,5 +675,5 @@ void parse_geobuf(std::vector<struct serialization_state> *sst, const char *src,
 		}
 	}
 
-	runQueue();
+	finishPool();
 }
@@ -58,7 +58,7 @@ int serialize_geojson_feature(struct serialization_state *sst, json_object *geom
 	}
 
 	json_object *coordinates = json_hash_get(geometry, "coordinates");
-	if (coordinates == NULL || coordinates->type != JSON_ARRAY) {
+	if (coordinates == NULL || (coordinates->type != JSON_ARRAY && coordinates->type != JSON_PACKED)) {
 		fprintf(stderr, "%s:%d: feature without coordinates array\n", sst->fname, sst->line);
 		json_context(feature);
 		return 0;
@@ -179,7 +179,8 @@ int serialize_geojson_feature(struct serialization_state *sst, json_object *geom
 		}
 	}
 
-	drawvec dv;
+	drawvec &dv = sst->geometry;
+	dv.clear();
 	parse_geometry(t, coordinates, dv, VT_MOVETO, sst->fname, sst->line, feature);
 
 	serial_feature sf;
@@ -234,11 +235,69 @@ void check_crs(json_object *j, const char *reading) {
 	}
 }
 
+// Whether anything within the envelope of a FeatureCollection, other
+// than its "crs", has a "type" and so might be a feature or geometry
+static bool envelope_has_types(json_object *j, bool top) {
+	if (j->type == JSON_HASH) {
+		for (size_t i = 0; i < j->length; i++) {
+			if (top && j->keys[i]->type == JSON_STRING && strcmp(j->keys[i]->string, "crs") == 0) {
+				continue;
+			}
+			if (!top && j->keys[i]->type == JSON_STRING && strcmp(j->keys[i]->string, "type") == 0) {
+				return true;
+			}
+			if (envelope_has_types(j->values[i], false)) {
+				return true;
+			}
+		}
+	} else if (j->type == JSON_ARRAY) {
+		for (size_t i = 0; i < j->length; i++) {
+			if (envelope_has_types(j->array[i], false)) {
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+// Parses what surrounds the features array of a FeatureCollection that is
+// going to be read in pieces, to check its projection. Returns false if
+// the envelope does not parse, or has something in it that would need
+// to be read as a feature, so the file must be read as a whole.
+bool parse_geojson_envelope(const char *map, size_t features_start, size_t features_end, size_t len, const char *reading) {
+	std::string envelope(map, features_start);
+	envelope.append(map + features_end, len - features_end);
+
+	json_pull *jp = json_begin_string(envelope.c_str());
+	json_object *j = json_read_tree(jp);
+	if (j == NULL || j->type != JSON_HASH || envelope_has_types(j, true)) {
+		json_end(jp);
+		return false;
+	}
+
+	json_object *type = json_hash_get(j, "type");
+	if (type != NULL && type->type == JSON_STRING && strcmp(type->string, "FeatureCollection") == 0) {
+		check_crs(j, reading);
+	}
+
+	json_end(jp);
+	return true;
+}
+
 void parse_json(struct serialization_state *sst, json_pull *jp, int layer, std::string layername) {
 	long long found_hashes = 0;
 	long long found_features = 0;
 	long long found_geometries = 0;
 
+	// Each feature is freed once it has been serialized, so nothing
+	// the parser returns needs to outlive the next feature
+	json_use_arena(jp);
+
+	// Coordinates go straight from the input to arrays of numbers,
+	// without an object for each one
+	json_pack_arrays(jp, "coordinates");
+
 	while (1) {
 		json_object *j = json_read(jp);
 		if (j == NULL) {
@@ -304,6 +363,7 @@ void parse_json(struct serialization_state *sst, json_pull *jp, int layer, std::
 
 				serialize_geojson_feature(sst, j, NULL, NULL, layer, NULL, j, layername);
 				json_free(j);
+				json_arena_reset(jp);
 				continue;
 			}
 		}
@@ -312,6 +372,7 @@ void parse_json(struct serialization_state *sst, json_pull *jp, int layer, std::
 			if (strcmp(type->string, "FeatureCollection") == 0) {
 				check_crs(j, sst->fname);
 				json_free(j);
+				json_arena_reset(jp);
 			}
 
 			continue;
@@ -327,6 +388,7 @@ void parse_json(struct serialization_state *sst, json_pull *jp, int layer, std::
 			fprintf(stderr, "%s:%d: feature with no geometry\n", sst->fname, jp->line);
 			json_context(j);
 			json_free(j);
+			json_arena_reset(jp);
 			continue;
 		}
 
@@ -335,6 +397,7 @@ void parse_json(struct serialization_state *sst, json_pull *jp, int layer, std::
 			fprintf(stderr, "%s:%d: feature without properties hash\n", sst->fname, jp->line);
 			json_context(j);
 			json_free(j);
+			json_arena_reset(jp);
 			continue;
 		}
 
@@ -352,6 +415,7 @@ void parse_json(struct serialization_state *sst, json_pull *jp, int layer, std::
 		}
 
 		json_free(j);
+		json_arena_reset(jp);
 
 		/* XXX check for any non-features in the outer object */
 	}
@@ -24,6 +24,9 @@ struct parse_json_args {
 struct json_pull *json_begin_map(char *map, long long len);
 void json_end_map(struct json_pull *jp);
 
+void check_crs(json_object *j, const char *reading);
+bool parse_geojson_envelope(const char *map, size_t features_start, size_t features_end, size_t len, const char *reading);
+
 void parse_json(struct serialization_state *sst, json_pull *jp, int layer, std::string layername);
 void *run_parse_json(void *v);
 
@@ -4,10 +4,16 @@
 #include <ctype.h>
 #include <string.h>
 #include <stdarg.h>
+#include <locale.h>
 #include "jsonpull.h"
 
 #define BUFFER 10000
 
+// Arena chunks are kept for reuse after a reset, up to this many
+#define ARENA_CHUNK 65536
+#define ARENA_SPARE 16
+#define ARENA_HEADER ((sizeof(json_arena_chunk) + 15) & ~15)
+
 json_pull *json_begin(ssize_t (*read)(struct json_pull *, char *buffer, size_t n), void *source) {
 	json_pull *j = malloc(sizeof(json_pull));
 	if (j == NULL) {
@@ -25,6 +31,24 @@ json_pull *json_begin(ssize_t (*read)(struct json_pull *, char *buffer, size_t n
 	j->buffer_head = 0;
 	j->buffer_tail = 0;
 
+	j->arena = 0;
+	j->arena_chunks = NULL;
+	j->arena_spare = NULL;
+	j->arena_used = 0;
+	j->arena_live = 0;
+	j->scratch = NULL;
+	j->scratch_alloc = 0;
+
+	j->pack_key = NULL;
+	j->pack_shape = NULL;
+	j->pack_shape_alloc = 0;
+	j->pack_numbers = NULL;
+	j->pack_numbers_alloc = 0;
+
+	j->allocations = 0;
+	j->allocated_bytes = 0;
+	j->resets = 0;
+
 	j->buffer = malloc(BUFFER);
 	if (j->buffer == NULL) {
 		perror("Out of memory");
@@ -85,12 +109,79 @@ json_pull *json_begin_string(const char *s) {
 	return json_begin(read_string, (void *) s);
 }
 
+static void free_chunks(json_arena_chunk *c) {
+	while (c != NULL) {
+		json_arena_chunk *next = c->next;
+		free(c);
+		c = next;
+	}
+}
+
 void json_end(json_pull *p) {
-	json_free(p->root);
+	if (p->arena) {
+		free_chunks(p->arena_chunks);
+		free_chunks(p->arena_spare);
+		free(p->scratch);
+	} else {
+		json_free(p->root);
+	}
+
+	free(p->pack_shape);
+	free(p->pack_numbers);
 	free(p->buffer);
 	free(p);
 }
 
+// Switch the parser, before it has read anything, to allocating from
+// an arena. Objects it returns are then only valid until the next
+// json_arena_reset(), and json_free() only unlinks them from the tree.
+void json_use_arena(json_pull *j) {
+	j->arena = 1;
+}
+
+// Read arrays that are the value of the given key in a hash, other than
+// within the value of "properties", as JSON_PACKED instead of
+// as a tree of objects. This is for GeoJSON coordinates, which are most
+// of the tokens in a typical file but only ever used as numbers.
+void json_pack_arrays(json_pull *j, const char *key) {
+	j->pack_key = key;
+}
+
+static void *arena_alloc(json_pull *j, size_t size) {
+	size = (size + 15) & ~15;
+
+	json_arena_chunk *c = j->arena_chunks;
+	if (c == NULL || c->used + size > c->size) {
+		if (j->arena_spare != NULL && size <= j->arena_spare->size) {
+			c = j->arena_spare;
+			j->arena_spare = c->next;
+		} else {
+			size_t want = ARENA_CHUNK;
+			if (size > want) {
+				want = size;
+			}
+
+			c = malloc(ARENA_HEADER + want);
+			if (c == NULL) {
+				perror("Out of memory");
+				exit(EXIT_FAILURE);
+			}
+			c->size = want;
+			j->allocations++;
+		}
+
+		c->used = 0;
+		c->next = j->arena_chunks;
+		j->arena_chunks = c;
+	}
+
+	void *ret = (char *) c + ARENA_HEADER + c->used;
+	c->used += size;
+	j->arena_used += size;
+	j->allocated_bytes += size;
+	return ret;
+}
+
 static inline int read_wrap(json_pull *j) {
 	int c = next(j);
 
@@ -103,14 +194,75 @@ static inline int read_wrap(json_pull *j) {
 
 #define SIZE_FOR(i, size) ((size_t)((((i) + 31) & ~31) * size))
 
+// Vectors in the arena can't be grown in place, so they double instead
+static size_t arena_slots(size_t n) {
+	if (n == 0) {
+		return 0;
+	}
+
+	size_t slots = 32;
+	while (slots < n) {
+		slots *= 2;
+	}
+	return slots;
+}
+
+// Make room for one more element at the end of a vector of n
+static json_object **grow_vector(json_pull *j, json_object **v, size_t n, const char *what) {
+	if (j != NULL && j->arena) {
+		if (arena_slots(n + 1) != arena_slots(n)) {
+			if (arena_slots(n + 1) < arena_slots(n)) {
+				fprintf(stderr, "%s size overflow\n", what);
+				exit(EXIT_FAILURE);
+			}
+
+			json_object **nv = arena_alloc(j, arena_slots(n + 1) * sizeof(json_object *));
+			if (n > 0) {
+				memcpy(nv, v, n * sizeof(json_object *));
+			}
+			v = nv;
+		}
+	} else if (SIZE_FOR(n + 1, sizeof(json_object *)) != SIZE_FOR(n, sizeof(json_object *))) {
+		if (SIZE_FOR(n + 1, sizeof(json_object *)) < SIZE_FOR(n, sizeof(json_object *))) {
+			fprintf(stderr, "%s size overflow\n", what);
+			exit(EXIT_FAILURE);
+		}
+		v = realloc(v, SIZE_FOR(n + 1, sizeof(json_object *)));
+		if (v == NULL) {
+			perror("Out of memory");
+			exit(EXIT_FAILURE);
+		}
+		if (j != NULL) {
+			j->allocations++;
+			j->allocated_bytes += SIZE_FOR(n + 1, sizeof(json_object *));
+		}
+	}
+
+	return v;
+}
+
 static json_object *fabricate_object(json_pull *jp, json_object *parent, json_type type) {
-	json_object *o = malloc(sizeof(struct json_object));
-	if (o == NULL) {
-		perror("Out of memory");
-		exit(EXIT_FAILURE);
+	json_object *o;
+	if (jp != NULL && jp->arena) {
+		o = arena_alloc(jp, sizeof(struct json_object));
+		o->in_arena = 1;
+	} else {
+		o = malloc(sizeof(struct json_object));
+		if (o == NULL) {
+			perror("Out of memory");
+			exit(EXIT_FAILURE);
+		}
+		o->in_arena = 0;
+		if (jp != NULL) {
+			jp->allocations++;
+			jp->allocated_bytes += sizeof(struct json_object);
+		}
 	}
 	o->type = type;
 	o->parent = parent;
+	o->string = NULL;
+	o->number = 0;
+	o->numbers = NULL;
 	o->array = NULL;
 	o->keys = NULL;
 	o->values = NULL;
@@ -126,23 +278,12 @@ static json_object *add_object(json_pull *j, json_type type) {
 	if (c != NULL) {
 		if (c->type == JSON_ARRAY) {
 			if (c->expect == JSON_ITEM) {
-				if (SIZE_FOR(c->length + 1, sizeof(json_object *)) != SIZE_FOR(c->length, sizeof(json_object *))) {
-					if (SIZE_FOR(c->length + 1, sizeof(json_object *)) < SIZE_FOR(c->length, sizeof(json_object *))) {
-						fprintf(stderr, "Array size overflow\n");
-						exit(EXIT_FAILURE);
-					}
-					c->array = realloc(c->array, SIZE_FOR(c->length + 1, sizeof(json_object *)));
-					if (c->array == NULL) {
-						perror("Out of memory");
-						exit(EXIT_FAILURE);
-					}
-				}
-
+				c->array = grow_vector(j, c->array, c->length, "Array");
 				c->array[c->length++] = o;
 				c->expect = JSON_COMMA;
 			} else {
 				j->error = "Expected a comma, not a list item";
-				free(o);
+				json_free(o);
 				return NULL;
 			}
 		} else if (c->type == JSON_HASH) {
@@ -152,22 +293,12 @@ static json_object *add_object(json_pull *j, json_type type) {
 			} else if (c->expect == JSON_KEY) {
 				if (type != JSON_STRING) {
 					j->error = "Hash key is not a string";
-					free(o);
+					json_free(o);
 					return NULL;
 				}
 
-				if (SIZE_FOR(c->length + 1, sizeof(json_object *)) != SIZE_FOR(c->length, sizeof(json_object *))) {
-					if (SIZE_FOR(c->length + 1, sizeof(json_object *)) < SIZE_FOR(c->length, sizeof(json_object *))) {
-						fprintf(stderr, "Hash size overflow\n");
-						exit(EXIT_FAILURE);
-					}
-					c->keys = realloc(c->keys, SIZE_FOR(c->length + 1, sizeof(json_object *)));
-					c->values = realloc(c->values, SIZE_FOR(c->length + 1, sizeof(json_object *)));
-					if (c->keys == NULL || c->values == NULL) {
-						perror("Out of memory");
-						exit(EXIT_FAILURE);
-					}
-				}
+				c->keys = grow_vector(j, c->keys, c->length, "Hash");
+				c->values = grow_vector(j, c->values, c->length, "Hash");
 
 				c->keys[c->length] = o;
 				c->values[c->length] = NULL;
@@ -175,7 +306,7 @@ static json_object *add_object(json_pull *j, json_type type) {
 				c->expect = JSON_COLON;
 			} else {
 				j->error = "Expected a comma or colon";
-				free(o);
+				json_free(o);
 				return NULL;
 			}
 		}
@@ -211,6 +342,7 @@ struct string {
 	char *buf;
 	size_t n;
 	size_t nalloc;
+	size_t grown;
 };
 
 static void string_init(struct string *s) {
@@ -222,6 +354,7 @@ static void string_init(struct string *s) {
 	}
 	s->n = 0;
 	s->buf[0] = '\0';
+	s->grown = 0;
 }
 
 static void string_append(struct string *s, char c) {
@@ -232,6 +365,7 @@ static void string_append(struct string *s, char c) {
 			fprintf(stderr, "String size overflowed\n");
 			exit(EXIT_FAILURE);
 		}
+		s->grown++;
 		s->buf = realloc(s->buf, s->nalloc);
 		if (s->buf == NULL) {
 			perror("Out of memory");
@@ -253,6 +387,7 @@ static void string_append_string(struct string *s, char *add) {
 			fprintf(stderr, "String size overflowed\n");
 			exit(EXIT_FAILURE);
 		}
+		s->grown++;
 		s->buf = realloc(s->buf, s->nalloc);
 		if (s->buf == NULL) {
 			perror("Out of memory");
@@ -271,6 +406,315 @@ static void string_free(struct string *s) {
 	free(s->buf);
 }
 
+// Strings being parsed are accumulated in a buffer that belongs
+// to the parser if it has an arena, and are copied into the arena
+// once they are complete.
+
+static void string_begin(json_pull *j, struct string *s) {
+	if (j->arena && j->scratch != NULL) {
+		s->buf = j->scratch;
+		s->nalloc = j->scratch_alloc;
+		s->n = 0;
+		s->buf[0] = '\0';
+		s->grown = 0;
+		j->scratch = NULL;
+	} else {
+		string_init(s);
+		j->allocations++;
+	}
+}
+
+static void string_release(json_pull *j, struct string *s) {
+	j->allocations += s->grown;
+
+	if (j->arena) {
+		free(j->scratch);
+		j->scratch = s->buf;
+		j->scratch_alloc = s->nalloc;
+	} else {
+		string_free(s);
+	}
+}
+
+static char *string_keep(json_pull *j, struct string *s) {
+	if (j->arena) {
+		char *ret = arena_alloc(j, s->n + 1);
+		memcpy(ret, s->buf, s->n + 1);
+		string_release(j, s);
+		return ret;
+	} else {
+		j->allocations += s->grown;
+		j->allocated_bytes += s->nalloc;
+		return s->buf;
+	}
+}
+
+// Powers of ten that are exactly representable as doubles
+static const double exact_powers[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+// strtod(), but with a period as the decimal point whatever the locale
+static double strtod_c(const char *s) {
+	const char *point = localeconv()->decimal_point;
+	const char *period = strchr(s, '.');
+	if (period == NULL || strcmp(point, ".") == 0) {
+		return strtod(s, NULL);
+	}
+
+	size_t before = period - s;
+	char *copy = malloc(strlen(s) + strlen(point) + 1);
+	if (copy == NULL) {
+		perror("Out of memory");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(copy, s, before);
+	strcpy(copy + before, point);
+	strcat(copy, period + 1);
+
+	double d = strtod(copy, NULL);
+	free(copy);
+	return d;
+}
+
+// Convert the text of a number that has already been checked against
+// the JSON grammar. If the significant digits fit in the 53 bits of a
+// double and the power of ten is exact, one multiplication or division
+// gives the correctly rounded result, as strtod() would. That covers
+// nearly all coordinates; anything longer is left to strtod().
+double json_number(const char *s) {
+	const char *cp = s;
+	int neg = 0;
+	unsigned long long mantissa = 0;
+	int digits = 0;
+	int truncated = 0;
+	long exponent = 0;
+
+	if (*cp == '-') {
+		neg = 1;
+		cp++;
+	}
+
+	for (; *cp >= '0' && *cp <= '9'; cp++) {
+		if (digits < 19) {
+			mantissa = mantissa * 10 + (*cp - '0');
+			digits += (mantissa != 0);
+		} else {
+			truncated = 1;
+		}
+	}
+
+	if (*cp == '.') {
+		for (cp++; *cp >= '0' && *cp <= '9'; cp++) {
+			if (digits < 19) {
+				mantissa = mantissa * 10 + (*cp - '0');
+				digits += (mantissa != 0);
+				exponent--;
+			} else {
+				truncated = 1;
+			}
+		}
+	}
+
+	if (*cp == 'e' || *cp == 'E') {
+		int eneg = 0;
+		long e = 0;
+
+		cp++;
+		if (*cp == '+') {
+			cp++;
+		} else if (*cp == '-') {
+			eneg = 1;
+			cp++;
+		}
+		for (; *cp >= '0' && *cp <= '9'; cp++) {
+			if (e < 100000) {
+				e = e * 10 + (*cp - '0');
+			}
+		}
+
+		exponent += eneg ? -e : e;
+	}
+
+	if (mantissa == 0 && !truncated) {
+		return neg ? -0.0 : 0.0;
+	}
+
+	if (!truncated && mantissa <= (1ULL << 53) && exponent >= -22 && exponent <= 22) {
+		double d = mantissa;
+		if (exponent < 0) {
+			d /= exact_powers[-exponent];
+		} else {
+			d *= exact_powers[exponent];
+		}
+		return neg ? -d : d;
+	}
+
+	return strtod_c(s);
+}
+
+// If the number that begins with the character just read is entirely
+// within the buffer and follows the grammar, return its length, so it
+// can be copied all at once. Otherwise return 0, and it will be read
+// one character at a time.
+static size_t number_in_buffer(json_pull *j) {
+	const char *start = j->buffer + j->buffer_head - 1;
+	const char *end = j->buffer + j->buffer_tail;
+	const char *cp = start;
+
+	if (*cp == '-') {
+		cp++;
+		if (cp >= end) {
+			return 0;
+		}
+	}
+
+	if (*cp == '0') {
+		cp++;
+	} else if (*cp >= '1' && *cp <= '9') {
+		for (cp++; cp < end && *cp >= '0' && *cp <= '9'; cp++) {
+			;
+		}
+	} else {
+		return 0;
+	}
+
+	if (cp < end && *cp == '.') {
+		cp++;
+		if (cp >= end || *cp < '0' || *cp > '9') {
+			return 0;
+		}
+		for (cp++; cp < end && *cp >= '0' && *cp <= '9'; cp++) {
+			;
+		}
+	}
+
+	if (cp < end && (*cp == 'e' || *cp == 'E')) {
+		cp++;
+		if (cp < end && (*cp == '+' || *cp == '-')) {
+			cp++;
+		}
+		if (cp >= end || *cp < '0' || *cp > '9') {
+			return 0;
+		}
+		for (cp++; cp < end && *cp >= '0' && *cp <= '9'; cp++) {
+			;
+		}
+	}
+
+	// The number might continue in the next read
+	if (cp >= end) {
+		return 0;
+	}
+
+	return cp - start;
+}
+
+static char *copy_string(json_pull *j, const char *s, size_t len) {
+	char *ret;
+
+	if (j->arena) {
+		ret = arena_alloc(j, len + 1);
+	} else {
+		ret = malloc(len + 1);
+		if (ret == NULL) {
+			perror("Out of memory");
+			exit(EXIT_FAILURE);
+		}
+		j->allocations++;
+		j->allocated_bytes += len + 1;
+	}
+
+	memcpy(ret, s, len);
+	ret[len] = '\0';
+	return ret;
+}
+
+// Read the rest of a number that begins with c into val,
+// one character at a time
+static int read_number(json_pull *j, int c, struct string *val) {
+	if (c == '-') {
+		string_append(val, c);
+		c = read_wrap(j);
+	}
+
+	if (c == '0') {
+		string_append(val, c);
+	} else if (c >= '1' && c <= '9') {
+		string_append(val, c);
+		c = peek(j);
+
+		while (c >= '0' && c <= '9') {
+			string_append(val, read_wrap(j));
+			c = peek(j);
+		}
+	}
+
+	if (peek(j) == '.') {
+		string_append(val, read_wrap(j));
+
+		c = peek(j);
+		if (c < '0' || c > '9') {
+			j->error = "Decimal point without digits";
+			return 0;
+		}
+		while (c >= '0' && c <= '9') {
+			string_append(val, read_wrap(j));
+			c = peek(j);
+		}
+	}
+
+	c = peek(j);
+	if (c == 'e' || c == 'E') {
+		string_append(val, read_wrap(j));
+
+		c = peek(j);
+		if (c == '+' || c == '-') {
+			string_append(val, read_wrap(j));
+		}
+
+		c = peek(j);
+		if (c < '0' || c > '9') {
+			j->error = "Exponent without digits";
+			return 0;
+		}
+		while (c >= '0' && c <= '9') {
+			string_append(val, read_wrap(j));
+			c = peek(j);
+		}
+	}
+
+	return 1;
+}
+
+static json_object *read_packed(json_pull *j);
+
+// Is the array about to be read the value of the key to pack?
+static int packing(json_pull *j) {
+	json_object *c = j->container;
+	if (c == NULL || c->type != JSON_HASH || c->expect != JSON_VALUE) {
+		return 0;
+	}
+
+	json_object *key = c->keys[c->length - 1];
+	if (strcmp(key->string, j->pack_key) != 0) {
+		return 0;
+	}
+
+	// Attributes keep the text of their numbers
+	json_object *o;
+	for (o = c; o->parent != NULL; o = o->parent) {
+		json_object *p = o->parent;
+		if (p->type == JSON_HASH && p->length > 0 && p->values[p->length - 1] == o) {
+			if (strcmp(p->keys[p->length - 1]->string, "properties") == 0) {
+				return 0;
+			}
+		}
+	}
+
+	return 1;
+}
+
 json_object *json_read_separators(json_pull *j, json_separator_callback cb, void *state) {
 	int c;
 
@@ -316,6 +760,10 @@ again:
 	/////////////////////////// Arrays
 
 	if (c == '[') {
+		if (j->pack_key != NULL && cb == NULL && packing(j)) {
+			return read_packed(j);
+		}
+
 		json_object *o = add_object(j, JSON_ARRAY);
 		if (o == NULL) {
 			return NULL;
@@ -496,69 +944,32 @@ again:
 	/////////////////////////// Numbers
 
 	if (c == '-' || (c >= '0' && c <= '9')) {
-		struct string val;
-		string_init(&val);
-
-		if (c == '-') {
-			string_append(&val, c);
-			c = read_wrap(j);
-		}
-
-		if (c == '0') {
-			string_append(&val, c);
-		} else if (c >= '1' && c <= '9') {
-			string_append(&val, c);
-			c = peek(j);
-
-			while (c >= '0' && c <= '9') {
-				string_append(&val, read_wrap(j));
-				c = peek(j);
+		size_t len = number_in_buffer(j);
+		if (len > 0) {
+			json_object *n = add_object(j, JSON_NUMBER);
+			if (n != NULL) {
+				n->string = copy_string(j, j->buffer + j->buffer_head - 1, len);
+				n->length = len;
+				n->number = json_number(n->string);
 			}
+			j->buffer_head += len - 1;
+			return n;
 		}
 
-		if (peek(j) == '.') {
-			string_append(&val, read_wrap(j));
-
-			c = peek(j);
-			if (c < '0' || c > '9') {
-				j->error = "Decimal point without digits";
-				string_free(&val);
-				return NULL;
-			}
-			while (c >= '0' && c <= '9') {
-				string_append(&val, read_wrap(j));
-				c = peek(j);
-			}
-		}
-
-		c = peek(j);
-		if (c == 'e' || c == 'E') {
-			string_append(&val, read_wrap(j));
-
-			c = peek(j);
-			if (c == '+' || c == '-') {
-				string_append(&val, read_wrap(j));
-			}
-
-			c = peek(j);
-			if (c < '0' || c > '9') {
-				j->error = "Exponent without digits";
-				string_free(&val);
-				return NULL;
-			}
-			while (c >= '0' && c <= '9') {
-				string_append(&val, read_wrap(j));
-				c = peek(j);
-			}
+		struct string val;
+		string_begin(j, &val);
+		if (!read_number(j, c, &val)) {
+			string_release(j, &val);
+			return NULL;
 		}
 
 		json_object *n = add_object(j, JSON_NUMBER);
 		if (n != NULL) {
-			n->number = atof(val.buf);
-			n->string = val.buf;
+			n->number = json_number(val.buf);
 			n->length = val.n;
+			n->string = string_keep(j, &val);
 		} else {
-			string_free(&val);
+			string_release(j, &val);
 		}
 		return n;
 	}
@@ -567,7 +978,7 @@ again:
 
 	if (c == '"') {
 		struct string val;
-		string_init(&val);
+		string_begin(j, &val);
 
 		int surrogate = -1;
 		while ((c = read_wrap(j)) != EOF) {
@@ -590,7 +1001,7 @@ again:
 						hex[i] = read_wrap(j);
 						if (hex[i] < '0' || (hex[i] > '9' && hex[i] < 'A') || (hex[i] > 'F' && hex[i] < 'a') || hex[i] > 'f') {
 							j->error = "Invalid \\u hex character";
-							string_free(&val);
+							string_release(j, &val);
 							return NULL;
 						}
 					}
@@ -665,13 +1076,13 @@ again:
 						string_append(&val, '\t');
 					} else {
 						j->error = "Found backslash followed by unknown character";
-						string_free(&val);
+						string_release(j, &val);
 						return NULL;
 					}
 				}
 			} else if (c < ' ') {
 				j->error = "Found control character in string";
-				string_free(&val);
+				string_release(j, &val);
 				return NULL;
 			} else {
 				if (surrogate >= 0) {
@@ -686,16 +1097,16 @@ again:
 		}
 		if (c == EOF) {
 			j->error = "String without closing quote mark";
-			string_free(&val);
+			string_release(j, &val);
 			return NULL;
 		}
 
 		json_object *s = add_object(j, JSON_STRING);
 		if (s != NULL) {
-			s->string = val.buf;
 			s->length = val.n;
+			s->string = string_keep(j, &val);
 		} else {
-			string_free(&val);
+			string_release(j, &val);
 		}
 		return s;
 	}
@@ -720,6 +1131,174 @@ json_object *json_read_tree(json_pull *p) {
 	return NULL;
 }
 
+static void pack_shape(json_pull *j, size_t *n, char c) {
+	// Leave room for the terminating '\0'
+	if (*n + 2 > j->pack_shape_alloc) {
+		j->pack_shape_alloc = j->pack_shape_alloc == 0 ? 256 : j->pack_shape_alloc * 2;
+		j->pack_shape = realloc(j->pack_shape, j->pack_shape_alloc);
+		if (j->pack_shape == NULL) {
+			perror("Out of memory");
+			exit(EXIT_FAILURE);
+		}
+		j->allocations++;
+	}
+
+	j->pack_shape[(*n)++] = c;
+}
+
+static void pack_number(json_pull *j, size_t *n, double d) {
+	if (*n + 1 > j->pack_numbers_alloc) {
+		j->pack_numbers_alloc = j->pack_numbers_alloc == 0 ? 256 : j->pack_numbers_alloc * 2;
+		j->pack_numbers = realloc(j->pack_numbers, j->pack_numbers_alloc * sizeof(double));
+		if (j->pack_numbers == NULL) {
+			perror("Out of memory");
+			exit(EXIT_FAILURE);
+		}
+		j->allocations++;
+	}
+
+	j->pack_numbers[(*n)++] = d;
+}
+
+// Read the rest of an array whose [ has been read, as JSON_PACKED.
+// The shape and the numbers are accumulated in buffers that belong
+// to the parser and copied out when the array is complete.
+static json_object *read_packed(json_pull *j) {
+	size_t nshape = 0, nnumbers = 0;
+	int depth = 1;
+	int expect = JSON_VALUE;  // an item or the end of the array
+	int c;
+
+	pack_shape(j, &nshape, '[');
+
+	while (depth > 0) {
+		do {
+			c = read_wrap(j);
+		} while (c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == 0x1E);
+
+		if (c == EOF) {
+			j->error = "Reached EOF without all containers being closed";
+			return NULL;
+		}
+
+		if (c == ']') {
+			if (expect == JSON_ITEM) {
+				j->error = "Found ] without final element";
+				return NULL;
+			}
+
+			pack_shape(j, &nshape, ']');
+			depth--;
+			expect = JSON_COMMA;
+			continue;
+		}
+
+		if (c == ',') {
+			if (expect != JSON_COMMA) {
+				j->error = "Found unexpected comma";
+				return NULL;
+			}
+
+			expect = JSON_ITEM;
+			continue;
+		}
+
+		if (expect == JSON_COMMA) {
+			j->error = "Expected a comma, not a list item";
+			return NULL;
+		}
+
+		if (c == '[') {
+			pack_shape(j, &nshape, '[');
+			depth++;
+			expect = JSON_VALUE;
+			continue;
+		}
+
+		if (c == '-' || (c >= '0' && c <= '9')) {
+			double d;
+			char text[50];
+			size_t len = number_in_buffer(j);
+
+			if (len > 0 && len < sizeof(text)) {
+				memcpy(text, j->buffer + j->buffer_head - 1, len);
+				text[len] = '\0';
+				d = json_number(text);
+				j->buffer_head += len - 1;
+			} else {
+				struct string val;
+				string_begin(j, &val);
+				if (!read_number(j, c, &val)) {
+					string_release(j, &val);
+					return NULL;
+				}
+				d = json_number(val.buf);
+				string_release(j, &val);
+			}
+
+			pack_number(j, &nnumbers, d);
+			pack_shape(j, &nshape, 'n');
+			expect = JSON_COMMA;
+			continue;
+		}
+
+		// Anything else is read as a tree of its own, and then discarded.
+		// The character just read is still in the buffer, so it can be
+		// read again. Nothing within it is packed, since the buffers
+		// for packing are in use.
+
+		j->buffer_head--;
+
+		json_object *container = j->container;
+		json_object *root = j->root;
+		const char *pack_key = j->pack_key;
+		j->container = NULL;
+		j->root = NULL;
+		j->pack_key = NULL;
+
+		json_object *v = json_read_tree(j);
+		json_object *other = j->root;
+
+		j->container = container;
+		j->root = root;
+		j->pack_key = pack_key;
+		json_free(other);
+
+		if (v == NULL) {
+			if (j->error == NULL) {
+				j->error = "Reached EOF without all containers being closed";
+			}
+			return NULL;
+		}
+
+		pack_shape(j, &nshape, 'x');
+		expect = JSON_COMMA;
+	}
+
+	json_object *o = add_object(j, JSON_PACKED);
+	if (o == NULL) {
+		return NULL;
+	}
+
+	o->string = copy_string(j, j->pack_shape, nshape);
+	o->length = nshape;
+
+	if (j->arena) {
+		o->numbers = arena_alloc(j, nnumbers * sizeof(double));
+	} else {
+		o->numbers = malloc(nnumbers * sizeof(double) + 1);
+		if (o->numbers == NULL) {
+			perror("Out of memory");
+			exit(EXIT_FAILURE);
+		}
+		j->allocations++;
+		j->allocated_bytes += nnumbers * sizeof(double);
+	}
+	memcpy(o->numbers, j->pack_numbers, nnumbers * sizeof(double));
+
+	return o;
+}
+
 void json_free(json_object *o) {
 	size_t i;
 
@@ -727,6 +1306,16 @@ void json_free(json_object *o) {
 		return;
 	}
 
+	if (o->in_arena) {
+		// The memory goes back to the arena when it is reset.
+		// Just detach the contents so that json_disconnect()
+		// doesn't have to visit them.
+
+		o->length = 0;
+		json_disconnect(o);
+		return;
+	}
+
 	// Free any data linked from here
 
 	if (o->type == JSON_ARRAY) {
@@ -759,6 +1348,9 @@ void json_free(json_object *o) {
 		free(v);
 	} else if (o->type == JSON_STRING || o->type == JSON_NUMBER) {
 		free(o->string);
+	} else if (o->type == JSON_PACKED) {
+		free(o->string);
+		free(o->numbers);
 	}
 
 	json_disconnect(o);
@@ -780,7 +1372,11 @@ static void json_disconnect_parser(json_object *o) {
 		}
 	}
 
-	o->parser = NULL;
+	// Memory in an arena belongs to the parser, so the parser
+	// can't go away before the object does
+	if (!o->in_arena) {
+		o->parser = NULL;
+	}
 }
 
 void json_disconnect(json_object *o) {
@@ -820,8 +1416,12 @@ void json_disconnect(json_object *o) {
 			if (i < o->parent->length) {
 				if (o->parent->keys[i] != NULL && o->parent->keys[i]->type == JSON_NULL) {
 					if (o->parent->values[i] != NULL && o->parent->values[i]->type == JSON_NULL) {
-						free(o->parent->keys[i]);
-						free(o->parent->values[i]);
+						if (!o->parent->keys[i]->in_arena) {
+							free(o->parent->keys[i]);
+						}
+						if (!o->parent->values[i]->in_arena) {
+							free(o->parent->values[i]);
+						}
 
 						memmove(o->parent->keys + i, o->parent->keys + i + 1, o->parent->length - i - 1);
 						memmove(o->parent->values + i, o->parent->values + i + 1, o->parent->length - i - 1);
@@ -840,6 +1440,138 @@ void json_disconnect(json_object *o) {
 	o->parent = NULL;
 }
 
+// Replace the text of a string or number
+void json_set_string(json_object *o, const char *s) {
+	size_t len = strlen(s);
+
+	if (o->in_arena) {
+		o->string = arena_alloc(o->parser, len + 1);
+		memcpy(o->string, s, len + 1);
+	} else {
+		free(o->string);
+		o->string = strdup(s);
+		if (o->string == NULL) {
+			perror("Out of memory");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	o->length = len;
+}
+
+static json_object **arena_copy_vector(json_pull *j, json_object **v, size_t n) {
+	if (n == 0) {
+		return NULL;
+	}
+
+	json_object **nv = arena_alloc(j, arena_slots(n) * sizeof(json_object *));
+	memcpy(nv, v, n * sizeof(json_object *));
+	return nv;
+}
+
+static json_object *arena_copy(json_pull *j, json_object *o, json_object *parent, json_object **container) {
+	if (o == NULL) {
+		// Hash value not read yet
+		return NULL;
+	}
+
+	json_object *n = arena_alloc(j, sizeof(json_object));
+	*n = *o;
+	n->parent = parent;
+
+	if (o == j->container) {
+		*container = n;
+	}
+
+	if (o->type == JSON_ARRAY) {
+		n->array = arena_copy_vector(j, o->array, o->length);
+
+		size_t i;
+		for (i = 0; i < n->length; i++) {
+			n->array[i] = arena_copy(j, o->array[i], n, container);
+		}
+	} else if (o->type == JSON_HASH) {
+		n->keys = arena_copy_vector(j, o->keys, o->length);
+		n->values = arena_copy_vector(j, o->values, o->length);
+
+		size_t i;
+		for (i = 0; i < n->length; i++) {
+			n->keys[i] = arena_copy(j, o->keys[i], n, container);
+			n->values[i] = arena_copy(j, o->values[i], n, container);
+		}
+	} else if (o->type == JSON_STRING || o->type == JSON_NUMBER) {
+		n->string = arena_alloc(j, o->length + 1);
+		memcpy(n->string, o->string, o->length + 1);
+	} else if (o->type == JSON_PACKED) {
+		size_t count = 0, i;
+		for (i = 0; i < o->length; i++) {
+			count += (o->string[i] == 'n');
+		}
+
+		n->string = arena_alloc(j, o->length + 1);
+		memcpy(n->string, o->string, o->length + 1);
+		n->numbers = arena_alloc(j, count * sizeof(double));
+		memcpy(n->numbers, o->numbers, count * sizeof(double));
+	}
+
+	return n;
+}
+
+// Release everything in the arena except the part of the tree that
+// the parser still holds: the containers enclosing the current position,
+// and whatever has been read into them and not freed. The parser keeps
+// its chunks for reuse, so a parser that frees each feature after using
+// it stops allocating memory once it has seen its largest feature.
+void json_arena_reset(json_pull *j) {
+	j->resets++;
+
+	if (!j->arena) {
+		return;
+	}
+
+	// If the caller is holding on to much of the tree, wait until
+	// there is more garbage before copying it again
+	if (j->arena_used < 2 * j->arena_live) {
+		return;
+	}
+
+	json_arena_chunk *old = j->arena_chunks;
+	j->arena_chunks = NULL;
+	j->arena_used = 0;
+
+	json_object *container = NULL;
+	j->root = arena_copy(j, j->root, NULL, &container);
+	if (container == NULL && j->container != NULL) {
+		fprintf(stderr, "Internal error: JSON container is not part of the tree\n");
+		exit(EXIT_FAILURE);
+	}
+	j->container = container;
+	j->arena_live = j->arena_used;
+
+	// Copying isn't parsing
+	j->allocated_bytes -= j->arena_live;
+
+	size_t spare = 0;
+	json_arena_chunk *c;
+	for (c = j->arena_spare; c != NULL; c = c->next) {
+		spare++;
+	}
+
+	while (old != NULL) {
+		json_arena_chunk *next = old->next;
+
+		if (old->size == ARENA_CHUNK && spare < ARENA_SPARE) {
+			old->next = j->arena_spare;
+			j->arena_spare = old;
+			spare++;
+		} else {
+			free(old);
+		}
+
+		old = next;
+	}
+}
+
 static void json_print_one(struct string *val, json_object *o) {
 	if (o == NULL) {
 		string_append_string(val, "...");
@@ -878,6 +1610,33 @@ static void json_print_one(struct string *val, json_object *o) {
 	}
 }
 
+static void json_print_packed(struct string *val, json_object *o) {
+	size_t i, n = 0;
+
+	for (i = 0; i < o->length; i++) {
+		char c = o->string[i];
+
+		if (c != ']' && i > 0 && o->string[i - 1] != '[') {
+			string_append(val, ',');
+		}
+
+		if (c == 'n') {
+			// The shortest text that reads back as the same number
+			char buf[50];
+			snprintf(buf, sizeof(buf), "%.15g", o->numbers[n]);
+			if (strtod_c(buf) != o->numbers[n]) {
+				snprintf(buf, sizeof(buf), "%.17g", o->numbers[n]);
+			}
+			string_append_string(val, buf);
+			n++;
+		} else if (c == 'x') {
+			string_append_string(val, "...");
+		} else {
+			string_append(val, c);
+		}
+	}
+}
+
 static void json_print(struct string *val, json_object *o) {
 	if (o == NULL) {
 		// Hash value in incompletely read hash
@@ -905,6 +1664,8 @@ static void json_print(struct string *val, json_object *o) {
 			}
 		}
 		string_append(val, ']');
+	} else if (o->type == JSON_PACKED) {
+		json_print_packed(val, o);
 	} else {
 		json_print_one(val, o);
 	}
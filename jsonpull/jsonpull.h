@@ -15,6 +15,9 @@ typedef enum json_type {
 	JSON_FALSE,
 	JSON_NULL,
 
+	// Nested arrays of numbers, read all at once by json_pack_arrays()
+	JSON_PACKED,
+
 	// These and JSON_HASH and JSON_ARRAY can be called back by json_read_with_separators()
 	JSON_COMMA,
 	JSON_COLON,
@@ -33,14 +36,26 @@ typedef struct json_object {
 	char *string;
 	double number;
 
+	// For JSON_PACKED, string is the shape of the arrays, with
+	// '[' and ']' for each array, 'n' for each number, and 'x'
+	// for anything else, and numbers holds the numbers.
+	double *numbers;
+
 	struct json_object **array;
 	struct json_object **keys;
 	struct json_object **values;
 	size_t length;
 
 	int expect;
+	int in_arena;
 } json_object;
 
+typedef struct json_arena_chunk {
+	struct json_arena_chunk *next;
+	size_t size;
+	size_t used;
+} json_arena_chunk;
+
 typedef struct json_pull {
 	char *error;
 	int line;
@@ -53,6 +68,28 @@ typedef struct json_pull {
 
 	json_object *container;
 	json_object *root;
+
+	// With an arena, the parse tree is carved out of large chunks
+	// instead of being malloc()ed piece by piece, and is released
+	// all at once by json_arena_reset().
+	int arena;
+	json_arena_chunk *arena_chunks;
+	json_arena_chunk *arena_spare;
+	size_t arena_used;
+	size_t arena_live;
+	char *scratch;
+	size_t scratch_alloc;
+
+	const char *pack_key;
+	char *pack_shape;
+	size_t pack_shape_alloc;
+	double *pack_numbers;
+	size_t pack_numbers_alloc;
+
+	// For checking allocation behavior
+	unsigned long long allocations;      // calls to malloc() or realloc()
+	unsigned long long allocated_bytes;  // bytes of objects, vectors, and strings
+	unsigned long long resets;           // calls to json_arena_reset()
 } json_pull;
 
 json_pull *json_begin_file(FILE *f);
@@ -61,6 +98,10 @@ json_pull *json_begin_string(const char *s);
 json_pull *json_begin(ssize_t (*read)(struct json_pull *, char *buffer, size_t n), void *source);
 void json_end(json_pull *p);
 
+void json_use_arena(json_pull *j);
+void json_arena_reset(json_pull *j);
+void json_pack_arrays(json_pull *j, const char *key);
+
 typedef void (*json_separator_callback)(json_type type, json_pull *j, void *state);
 
 json_object *json_read_tree(json_pull *j);
@@ -70,6 +111,8 @@ void json_free(json_object *j);
 void json_disconnect(json_object *j);
 
 json_object *json_hash_get(json_object *o, const char *s);
+void json_set_string(json_object *o, const char *s);
+double json_number(const char *s);
 
 char *json_stringify(json_object *o);
 
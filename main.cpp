@@ -56,7 +56,11 @@
 #include "options.hpp"
 #include "mvt.hpp"
 #include "dirtiles.hpp"
+#include "archive.hpp"
 #include "evaluator.hpp"
+#include "timer.hpp"
+#include "sort.hpp"
+#include "scan.hpp"
 
 static int low_detail = 12;
 static int full_detail = -1;
@@ -64,9 +68,11 @@ static int min_detail = 7;
 
 int quiet = 0;
 int quiet_progress = 0;
+int performance_stats = 0;
 int geometry_scale = 0;
 double simplification = 1;
 size_t max_tile_size = 500000;
+long long stream_buffer_size = 256LL * 1024 * 1024;
 
 int prevent[256];
 int additional[256];
@@ -163,25 +169,6 @@ void init_cpus() {
 	}
 }
 
-int indexcmp(const void *v1, const void *v2) {
-	const struct index *i1 = (const struct index *) v1;
-	const struct index *i2 = (const struct index *) v2;
-
-	if (i1->ix < i2->ix) {
-		return -1;
-	} else if (i1->ix > i2->ix) {
-		return 1;
-	}
-
-	if (i1->seq < i2->seq) {
-		return -1;
-	} else if (i1->seq > i2->seq) {
-		return 1;
-	}
-
-	return 0;
-}
-
 struct mergelist {
 	long long start;
 	long long end;
@@ -255,43 +242,332 @@ int calc_feature_minzoom(struct index *ix, struct drop_state *ds, int maxzoom, d
 	return feature_minzoom;
 }
 
-static void merge(struct mergelist *merges, size_t nmerges, unsigned char *map, FILE *indexfile, int bytes, char *geom_map, FILE *geom_out, long long *geompos, long long *progress, long long *progress_max, long long *progress_reported, int maxzoom, double gamma, struct drop_state *ds) {
-	struct mergelist *head = NULL;
+// Time spent in each phase of sorting the features, for --performance-stats
+static double radix_split_time = 0;
+static double radix_sort_time = 0;
+static double radix_merge_time = 0;
+static double radix_minzoom_time = 0;
+static double radix_copy_time = 0;
+
+// Parse tree allocation by the GeoJSON parsers, for --performance-stats
+static pthread_mutex_t json_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long long json_allocations = 0;
+static unsigned long long json_allocated_bytes = 0;
+static unsigned long long json_features = 0;
+
+static void add_json_stats(json_pull *jp) {
+	if (pthread_mutex_lock(&json_stats_lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
 
-	for (size_t i = 0; i < nmerges; i++) {
-		if (merges[i].start < merges[i].end) {
-			insert(&(merges[i]), &head, map);
+	json_allocations += jp->allocations;
+	json_allocated_bytes += jp->allocated_bytes;
+	json_features += jp->resets;
+
+	if (pthread_mutex_unlock(&json_stats_lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Streamed input that went to the parsers from memory
+// and by way of temporary files, for --performance-stats
+static long long stream_bytes_in_memory = 0;
+static long long stream_bytes_spilled = 0;
+
+static void pwrite_check(int fd, const char *buf, size_t len, long long off, const char *fname) {
+	while (len > 0) {
+		ssize_t written = pwrite(fd, buf, len, off);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror(fname);
+			exit(EXIT_FAILURE);
 		}
+
+		buf += written;
+		len -= written;
+		off += written;
 	}
+}
 
-	while (head != NULL) {
-		struct index ix = *((struct index *) (map + head->start));
-		long long pos = *geompos;
-		fwrite_check(geom_map + ix.start, 1, ix.end - ix.start, geom_out, "merge geometry");
-		*geompos += ix.end - ix.start;
-		int feature_minzoom = calc_feature_minzoom(&ix, ds, maxzoom, gamma);
-		serialize_byte(geom_out, feature_minzoom, geompos, "merge geometry");
+static bool indexlt(const struct index &a, const struct index &b) {
+	return indexcmp(&a, &b) < 0;
+}
 
-		// Count this as an 75%-accomplishment, since we already 25%-counted it
-		*progress += (ix.end - ix.start) * 3 / 4;
-		if (!quiet && !quiet_progress && 100 * *progress / *progress_max != *progress_reported) {
-			fprintf(stderr, "Reordering geometry: %lld%% \r", 100 * *progress / *progress_max);
-			*progress_reported = 100 * *progress / *progress_max;
+// Index of the first record in a sorted run that is not less than the key
+static long long run_lower_bound(unsigned char *map, long long start, long long end, int bytes, const struct index *key) {
+	long long lo = start / bytes, hi = end / bytes;
+
+	while (lo < hi) {
+		long long mid = lo + (hi - lo) / 2;
+		if (indexcmp(map + mid * bytes, key) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo * bytes;
+}
+
+struct merge_arg {
+	int task;
+	std::vector<struct mergelist> merges;  // this partition's part of each sorted run
+	unsigned char *map;
+	int bytes;
+
+	struct index *out;  // where this partition's records go in the merged index
+	long long count;
+	long long geom_bytes;
+
+	char *geom_map;
+	int geom_fd;
+	long long geom_off;  // file offset of this partition's geometry in the output
+	long long geompos;   // and its position as recorded in the output index
+	signed char *minzooms;
+
+	volatile long long *progress;  // one per task
+	size_t ntasks;
+	long long progress_base;
+	long long *progress_max;
+	long long *progress_reported;
+};
+
+void *run_merge_index(void *v) {
+	struct merge_arg *a = (struct merge_arg *) v;
+	struct mergelist *head = NULL;
+
+	for (size_t i = 0; i < a->merges.size(); i++) {
+		if (a->merges[i].start < a->merges[i].end) {
+			insert(&(a->merges[i]), &head, a->map);
 		}
+	}
 
-		ix.start = pos;
-		ix.end = *geompos;
-		fwrite_check(&ix, bytes, 1, indexfile, "merge temporary");
-		head->start += bytes;
+	struct index *out = a->out;
+	while (head != NULL) {
+		*out = *((struct index *) (a->map + head->start));
+		a->geom_bytes += out->end - out->start + 1;  // +1 for the minzoom
+		out++;
+		head->start += a->bytes;
 
 		struct mergelist *m = head;
 		head = m->next;
 		m->next = NULL;
 
 		if (m->start < m->end) {
-			insert(m, &head, map);
+			insert(m, &head, a->map);
 		}
 	}
+
+	return NULL;
+}
+
+#define MERGE_BUFFER (1024 * 1024)
+
+void *run_merge_geometry(void *v) {
+	struct merge_arg *a = (struct merge_arg *) v;
+	std::string buf;
+	long long off = a->geom_off;
+	long long pos = a->geompos;
+
+	for (long long i = 0; i < a->count; i++) {
+		struct index *ix = &a->out[i];
+		buf.append(a->geom_map + ix->start, ix->end - ix->start);
+		buf.push_back(a->minzooms[i]);
+
+		// Count this as an 75%-accomplishment, since we already 25%-counted it
+		a->progress[a->task] += (ix->end - ix->start) * 3 / 4;
+
+		long long len = ix->end - ix->start + 1;
+		ix->start = pos;
+		ix->end = pos + len;
+		pos += len;
+
+		if (buf.size() >= MERGE_BUFFER) {
+			pwrite_check(a->geom_fd, buf.data(), buf.size(), off, "merge geometry");
+			off += buf.size();
+			buf.clear();
+
+			if (a->task == 0 && !quiet && !quiet_progress) {
+				long long progress = a->progress_base;
+				for (size_t j = 0; j < a->ntasks; j++) {
+					progress += a->progress[j];
+				}
+				if (100 * progress / *(a->progress_max) != *(a->progress_reported)) {
+					fprintf(stderr, "Reordering geometry: %lld%% \r", 100 * progress / *(a->progress_max));
+					*(a->progress_reported) = 100 * progress / *(a->progress_max);
+				}
+			}
+		}
+	}
+
+	pwrite_check(a->geom_fd, buf.data(), buf.size(), off, "merge geometry");
+	return NULL;
+}
+
+// How much of the merged index to hold in memory at once
+#define MERGE_WINDOW (64LL * 1024 * 1024)
+
+// Merge the sorted runs into the output in parallel. The key space is divided
+// at quantiles sampled from the runs so that each thread merges a contiguous
+// range of the output index and geometry. Only the choice of each feature's
+// minzoom, which depends on the features before it, is left sequential.
+//
+// The output is made one window of ranges at a time, so that the merged
+// index and its minzooms only take MERGE_WINDOW of memory beyond what the
+// sort already used, however big the runs are.
+static void merge(struct mergelist *merges, size_t nmerges, unsigned char *map, FILE *indexfile, int bytes, char *geom_map, FILE *geom_out, long long *geompos, long long *progress, long long *progress_max, long long *progress_reported, int maxzoom, double gamma, struct drop_state *ds) {
+	double merge_start = timer_now();
+	size_t parts = CPUS;
+
+	long long total = 0;
+	for (size_t i = 0; i < nmerges; i++) {
+		total += (merges[i].end - merges[i].start) / bytes;
+	}
+
+	size_t windows = (total * sizeof(struct index) + MERGE_WINDOW - 1) / MERGE_WINDOW;
+	if (windows < 1) {
+		windows = 1;
+	}
+	size_t ranges = parts * windows;
+
+	std::vector<struct index> samples;
+	for (size_t i = 0; i < nmerges; i++) {
+		long long n = (merges[i].end - merges[i].start) / bytes;
+		for (size_t j = 0; j < 16 * ranges && n > 0; j++) {
+			samples.push_back(*((struct index *) (map + merges[i].start + (j * n / (16 * ranges)) * bytes)));
+		}
+	}
+	std::sort(samples.begin(), samples.end(), indexlt);
+
+	std::vector<struct index> out;
+	std::vector<signed char> minzooms;
+	radix_merge_time += timer_now() - merge_start;
+
+	for (size_t w = 0; w < windows; w++) {
+		merge_start = timer_now();
+
+		std::vector<merge_arg> args(parts);
+		volatile long long part_progress[parts];
+		long long count = 0;
+
+		for (size_t p = 0; p < parts; p++) {
+			size_t r = w * parts + p;
+
+			args[p].task = p;
+			args[p].map = map;
+			args[p].bytes = bytes;
+			args[p].count = 0;
+			args[p].geom_bytes = 0;
+			args[p].geom_map = geom_map;
+			args[p].progress = part_progress;
+			args[p].ntasks = parts;
+			args[p].progress_base = *progress;
+			args[p].progress_max = progress_max;
+			args[p].progress_reported = progress_reported;
+			part_progress[p] = 0;
+
+			for (size_t i = 0; i < nmerges; i++) {
+				struct mergelist m;
+				m.start = merges[i].start;
+				m.end = merges[i].end;
+				m.next = NULL;
+
+				if (r > 0) {
+					m.start = run_lower_bound(map, merges[i].start, merges[i].end, bytes, &samples[r * samples.size() / ranges]);
+				}
+				if (r + 1 < ranges) {
+					m.end = run_lower_bound(map, merges[i].start, merges[i].end, bytes, &samples[(r + 1) * samples.size() / ranges]);
+				}
+
+				args[p].count += (m.end - m.start) / bytes;
+				args[p].merges.push_back(m);
+			}
+
+			count += args[p].count;
+		}
+
+		out.resize(count);
+		count = 0;
+		for (size_t p = 0; p < parts; p++) {
+			args[p].out = out.data() + count;
+			count += args[p].count;
+		}
+
+		pthread_t pthreads[parts];
+		for (size_t p = 0; p < parts; p++) {
+			if (pthread_create(&pthreads[p], NULL, run_merge_index, &args[p]) != 0) {
+				perror("pthread_create");
+				exit(EXIT_FAILURE);
+			}
+		}
+		for (size_t p = 0; p < parts; p++) {
+			void *retval;
+
+			if (pthread_join(pthreads[p], &retval) != 0) {
+				perror("pthread_join merge index");
+			}
+		}
+
+		double minzoom_start = timer_now();
+		radix_merge_time += minzoom_start - merge_start;
+
+		minzooms.resize(out.size());
+		for (size_t i = 0; i < out.size(); i++) {
+			minzooms[i] = calc_feature_minzoom(&out[i], ds, maxzoom, gamma);
+		}
+
+		double copy_start = timer_now();
+		radix_minzoom_time += copy_start - minzoom_start;
+
+		if (fflush(geom_out) != 0) {
+			perror("flush merge geometry");
+			exit(EXIT_FAILURE);
+		}
+		long long off = ftello(geom_out);
+		if (off < 0) {
+			perror("ftell merge geometry");
+			exit(EXIT_FAILURE);
+		}
+
+		long long first = 0;
+		for (size_t p = 0; p < parts; p++) {
+			args[p].geom_fd = fileno(geom_out);
+			args[p].geom_off = off;
+			args[p].geompos = *geompos;
+			args[p].minzooms = minzooms.data() + first;
+
+			off += args[p].geom_bytes;
+			*geompos += args[p].geom_bytes;
+			first += args[p].count;
+
+			if (pthread_create(&pthreads[p], NULL, run_merge_geometry, &args[p]) != 0) {
+				perror("pthread_create");
+				exit(EXIT_FAILURE);
+			}
+		}
+		for (size_t p = 0; p < parts; p++) {
+			void *retval;
+
+			if (pthread_join(pthreads[p], &retval) != 0) {
+				perror("pthread_join merge geometry");
+			}
+
+			*progress += part_progress[p];
+		}
+
+		if (fseeko(geom_out, off, SEEK_SET) != 0) {
+			perror("seek merge geometry");
+			exit(EXIT_FAILURE);
+		}
+
+		fwrite_check(out.data(), bytes, out.size(), indexfile, "merge temporary");
+
+		radix_copy_time += timer_now() - copy_start;
+	}
 }
 
 struct sort_arg {
@@ -332,7 +608,13 @@ void *run_sort(void *v) {
 		madvise(map, end - start, MADV_RANDOM);
 		madvise(map, end - start, MADV_WILLNEED);
 
-		qsort(map, (end - start) / a->bytes, a->bytes, indexcmp);
+		struct index *scratch = (struct index *) malloc(end - start);
+		if (scratch == NULL) {
+			perror("malloc in run_sort");
+			exit(EXIT_FAILURE);
+		}
+		sort_index((struct index *) map, (end - start) / a->bytes, scratch);
+		free(scratch);
 
 		// Sorting and then copying avoids disk access to
 		// write out intermediate stages of the sort.
@@ -354,16 +636,33 @@ void *run_sort(void *v) {
 	return NULL;
 }
 
-void do_read_parallel(char *map, long long len, long long initial_offset, const char *reading, std::vector<struct reader> *readers, volatile long long *progress_seq, std::set<std::string> *exclude, std::set<std::string> *include, int exclude_all, json_object *filter, int basezoom, int source, std::vector<std::map<std::string, layermap_entry> > *layermaps, int *initialized, unsigned *initial_x, unsigned *initial_y, int maxzoom, std::string layername, bool uses_gamma, std::map<std::string, int> const *attribute_types, int separator, double *dist_sum, size_t *dist_count, bool want_dist, bool filters) {
+void do_read_parallel(char *map, long long len, long long initial_offset, const char *reading, std::vector<struct reader> *readers, volatile long long *progress_seq, std::set<std::string> *exclude, std::set<std::string> *include, int exclude_all, filter_program *filter, int basezoom, int source, std::vector<std::map<std::string, layermap_entry> > *layermaps, int *initialized, unsigned *initial_x, unsigned *initial_y, int maxzoom, std::string layername, bool uses_gamma, std::map<std::string, int> const *attribute_types, int separator, double *dist_sum, size_t *dist_count, bool want_dist, bool filters, feature_collection_split const *split) {
 	long long segs[CPUS + 1];
-	segs[0] = 0;
-	segs[CPUS] = len;
+	long long lines[CPUS];
 
-	for (size_t i = 1; i < CPUS; i++) {
-		segs[i] = len * i / CPUS;
+	if (split != NULL) {
+		// Pieces of the features array of a FeatureCollection,
+		// each beginning just after the end of a feature
+		segs[0] = split->features_start;
+		segs[CPUS] = split->features_end;
+		lines[0] = split->start_line - 1;
 
-		while (segs[i] < len && map[segs[i]] != separator) {
-			segs[i]++;
+		for (size_t i = 1; i < CPUS; i++) {
+			segs[i] = split->cuts[i - 1];
+			lines[i] = split->lines[i - 1] - 1;
+		}
+	} else {
+		segs[0] = 0;
+		segs[CPUS] = len;
+		lines[0] = 0;
+
+		for (size_t i = 1; i < CPUS; i++) {
+			segs[i] = len * i / CPUS;
+			lines[i] = 0;
+
+			while (segs[i] < len && map[segs[i]] != separator) {
+				segs[i]++;
+			}
 		}
 	}
 
@@ -419,6 +718,7 @@ void do_read_parallel(char *map, long long len, long long initial_offset, const
 			source,
 			&layername,
 			&sst[i]));
+		pja[i].jp->line += lines[i];
 	}
 
 	for (size_t i = 0; i < CPUS; i++) {
@@ -438,6 +738,7 @@ void do_read_parallel(char *map, long long len, long long initial_offset, const
 		*dist_sum += dist_sums[i];
 		*dist_count += dist_counts[i];
 
+		add_json_stats(pja[i].jp);
 		json_end_map(pja[i].jp);
 	}
 }
@@ -445,6 +746,7 @@ void do_read_parallel(char *map, long long len, long long initial_offset, const
 struct read_parallel_arg {
 	int fd = 0;
 	FILE *fp = NULL;
+	char *buf = NULL;  // if the input is in memory instead of in fd
 	long long offset = 0;
 	long long len = 0;
 	volatile int *is_parsing = NULL;
@@ -456,7 +758,7 @@ struct read_parallel_arg {
 	std::set<std::string> *exclude = NULL;
 	std::set<std::string> *include = NULL;
 	int exclude_all = 0;
-	json_object *filter = NULL;
+	filter_program *filter = NULL;
 	int maxzoom = 0;
 	int basezoom = 0;
 	int source = 0;
@@ -475,32 +777,41 @@ struct read_parallel_arg {
 
 void *run_read_parallel(void *v) {
 	struct read_parallel_arg *rpa = (struct read_parallel_arg *) v;
+	char *map;
 
-	struct stat st;
-	if (fstat(rpa->fd, &st) != 0) {
-		perror("stat read temp");
-	}
-	if (rpa->len != st.st_size) {
-		fprintf(stderr, "wrong number of bytes in temporary: %lld vs %lld\n", rpa->len, (long long) st.st_size);
-	}
-	rpa->len = st.st_size;
+	if (rpa->buf != NULL) {
+		map = rpa->buf;
+	} else {
+		struct stat st;
+		if (fstat(rpa->fd, &st) != 0) {
+			perror("stat read temp");
+		}
+		if (rpa->len != st.st_size) {
+			fprintf(stderr, "wrong number of bytes in temporary: %lld vs %lld\n", rpa->len, (long long) st.st_size);
+		}
+		rpa->len = st.st_size;
 
-	char *map = (char *) mmap(NULL, rpa->len, PROT_READ, MAP_PRIVATE, rpa->fd, 0);
-	if (map == NULL || map == MAP_FAILED) {
-		perror("map intermediate input");
-		exit(EXIT_FAILURE);
+		map = (char *) mmap(NULL, rpa->len, PROT_READ, MAP_PRIVATE, rpa->fd, 0);
+		if (map == NULL || map == MAP_FAILED) {
+			perror("map intermediate input");
+			exit(EXIT_FAILURE);
+		}
+		madvise(map, rpa->len, MADV_RANDOM);  // sequential, but from several pointers at once
 	}
-	madvise(map, rpa->len, MADV_RANDOM);  // sequential, but from several pointers at once
 
-	do_read_parallel(map, rpa->len, rpa->offset, rpa->reading, rpa->readers, rpa->progress_seq, rpa->exclude, rpa->include, rpa->exclude_all, rpa->filter, rpa->basezoom, rpa->source, rpa->layermaps, rpa->initialized, rpa->initial_x, rpa->initial_y, rpa->maxzoom, rpa->layername, rpa->uses_gamma, rpa->attribute_types, rpa->separator, rpa->dist_sum, rpa->dist_count, rpa->want_dist, rpa->filters);
+	do_read_parallel(map, rpa->len, rpa->offset, rpa->reading, rpa->readers, rpa->progress_seq, rpa->exclude, rpa->include, rpa->exclude_all, rpa->filter, rpa->basezoom, rpa->source, rpa->layermaps, rpa->initialized, rpa->initial_x, rpa->initial_y, rpa->maxzoom, rpa->layername, rpa->uses_gamma, rpa->attribute_types, rpa->separator, rpa->dist_sum, rpa->dist_count, rpa->want_dist, rpa->filters, NULL);
 
-	madvise(map, rpa->len, MADV_DONTNEED);
-	if (munmap(map, rpa->len) != 0) {
-		perror("munmap source file");
-	}
-	if (fclose(rpa->fp) != 0) {
-		perror("close source file");
-		exit(EXIT_FAILURE);
+	if (rpa->buf != NULL) {
+		free(rpa->buf);
+	} else {
+		madvise(map, rpa->len, MADV_DONTNEED);
+		if (munmap(map, rpa->len) != 0) {
+			perror("munmap source file");
+		}
+		if (fclose(rpa->fp) != 0) {
+			perror("close source file");
+			exit(EXIT_FAILURE);
+		}
 	}
 
 	*(rpa->is_parsing) = 0;
@@ -509,7 +820,36 @@ void *run_read_parallel(void *v) {
 	return NULL;
 }
 
-void start_parsing(int fd, FILE *fp, long long offset, long long len, volatile int *is_parsing, pthread_t *parallel_parser, bool &parser_created, const char *reading, std::vector<struct reader> *readers, volatile long long *progress_seq, std::set<std::string> *exclude, std::set<std::string> *include, int exclude_all, json_object *filter, int basezoom, int source, std::vector<std::map<std::string, layermap_entry> > &layermaps, int *initialized, unsigned *initial_x, unsigned *initial_y, int maxzoom, std::string layername, bool uses_gamma, std::map<std::string, int> const *attribute_types, int separator, double *dist_sum, size_t *dist_count, bool want_dist, bool filters) {
+// Opens an already-unlinked temporary file for streamed input
+static FILE *open_read_temp(const char *tmpdir, int *fd) {
+	char readname[strlen(tmpdir) + strlen("/read.XXXXXXXX") + 1];
+	sprintf(readname, "%s%s", tmpdir, "/read.XXXXXXXX");
+	*fd = mkstemp_cloexec(readname);
+	if (*fd < 0) {
+		perror(readname);
+		exit(EXIT_FAILURE);
+	}
+	FILE *fp = fdopen(*fd, "w");
+	if (fp == NULL) {
+		perror(readname);
+		exit(EXIT_FAILURE);
+	}
+	unlink(readname);
+	return fp;
+}
+
+// The length of buf through its last separator, or 0 if there is none.
+// The first `searched` bytes are already known not to contain one.
+static size_t after_last_separator(const char *buf, size_t searched, size_t len, int separator) {
+	for (size_t i = len; i > searched; i--) {
+		if (buf[i - 1] == separator) {
+			return i;
+		}
+	}
+	return 0;
+}
+
+void start_parsing(int fd, FILE *fp, char *buf, long long offset, long long len, volatile int *is_parsing, pthread_t *parallel_parser, bool &parser_created, const char *reading, std::vector<struct reader> *readers, volatile long long *progress_seq, std::set<std::string> *exclude, std::set<std::string> *include, int exclude_all, filter_program *filter, int basezoom, int source, std::vector<std::map<std::string, layermap_entry> > &layermaps, int *initialized, unsigned *initial_x, unsigned *initial_y, int maxzoom, std::string layername, bool uses_gamma, std::map<std::string, int> const *attribute_types, int separator, double *dist_sum, size_t *dist_count, bool want_dist, bool filters) {
 	// This has to kick off an intermediate thread to start the parser threads,
 	// so the main thread can get back to reading the next input stage while
 	// the intermediate thread waits for the completion of the parser threads.
@@ -524,6 +864,7 @@ void start_parsing(int fd, FILE *fp, long long offset, long long len, volatile i
 
 	rpa->fd = fd;
 	rpa->fp = fp;
+	rpa->buf = buf;
 	rpa->offset = offset;
 	rpa->len = len;
 	rpa->is_parsing = is_parsing;
@@ -606,6 +947,8 @@ void radix1(int *geomfds_in, int *indexfds_in, int inputs, int prefix, int split
 		unlink(indexname);
 	}
 
+	double split_start = timer_now();
+
 	for (i = 0; i < inputs; i++) {
 		struct stat geomst, indexst;
 		if (fstat(geomfds_in[i], &geomst) < 0) {
@@ -692,6 +1035,8 @@ void radix1(int *geomfds_in, int *indexfds_in, int inputs, int prefix, int split
 		*availfiles += 2;
 	}
 
+	radix_split_time += timer_now() - split_start;
+
 	for (i = 0; i < splits; i++) {
 		int already_closed = 0;
 
@@ -706,7 +1051,9 @@ void radix1(int *geomfds_in, int *indexfds_in, int inputs, int prefix, int split
 		}
 
 		if (indexst.st_size > 0) {
-			if (indexst.st_size + geomst.st_size < mem) {
+			// Sorting needs a private copy of the index and a scratch
+			// buffer of the same size for the radix sort to work in
+			if (2 * indexst.st_size + geomst.st_size < mem) {
 				long long indexpos = indexst.st_size;
 				int bytes = sizeof(struct index);
 
@@ -730,6 +1077,7 @@ void radix1(int *geomfds_in, int *indexfds_in, int inputs, int prefix, int split
 					merges[a].start = merges[a].end = 0;
 				}
 
+				double sort_start = timer_now();
 				pthread_t pthreads[CPUS];
 				std::vector<sort_arg> args;
 
@@ -760,6 +1108,8 @@ void radix1(int *geomfds_in, int *indexfds_in, int inputs, int prefix, int split
 					}
 				}
 
+				radix_sort_time += timer_now() - sort_start;
+
 				struct indexmap *indexmap = (struct indexmap *) mmap(NULL, indexst.st_size, PROT_READ, MAP_PRIVATE, indexfds[i], 0);
 				if (indexmap == MAP_FAILED) {
 					fprintf(stderr, "fd %lld, len %lld\n", (long long) indexfds[i], (long long) indexst.st_size);
@@ -789,6 +1139,7 @@ void radix1(int *geomfds_in, int *indexfds_in, int inputs, int prefix, int split
 					exit(EXIT_FAILURE);
 				}
 			} else if (indexst.st_size == sizeof(struct index) || prefix + splitbits >= 64) {
+				double copy_start = timer_now();
 				struct index *indexmap = (struct index *) mmap(NULL, indexst.st_size, PROT_READ, MAP_PRIVATE, indexfds[i], 0);
 				if (indexmap == MAP_FAILED) {
 					fprintf(stderr, "fd %lld, len %lld\n", (long long) indexfds[i], (long long) indexst.st_size);
@@ -826,6 +1177,8 @@ void radix1(int *geomfds_in, int *indexfds_in, int inputs, int prefix, int split
 					fwrite_check(&ix, sizeof(struct index), 1, indexfile, "index");
 				}
 
+				radix_copy_time += timer_now() - copy_start;
+
 				madvise(indexmap, indexst.st_size, MADV_DONTNEED);
 				if (munmap(indexmap, indexst.st_size) < 0) {
 					perror("unmap index");
@@ -958,6 +1311,10 @@ void radix(std::vector<struct reader> &readers, int nreaders, FILE *geomfile, FI
 		fprintf(stderr, "Internal error: miscounted available file descriptors: %lld vs %lld\n", availfiles - 2 * nreaders, availfiles);
 		exit(EXIT_FAILURE);
 	}
+
+	if (performance_stats) {
+		fprintf(stderr, "Reordering geometry: %.3f seconds splitting, %.3f sorting, %.3f merging indices, %.3f choosing minzooms, %.3f copying geometry\n", radix_split_time, radix_sort_time, radix_merge_time, radix_minzoom_time, radix_copy_time);
+	}
 }
 
 void choose_first_zoom(long long *file_bbox, std::vector<struct reader> &readers, unsigned *iz, unsigned *ix, unsigned *iy, int minzoom, int buffer) {
@@ -1011,7 +1368,7 @@ void choose_first_zoom(long long *file_bbox, std::vector<struct reader> &readers
 	}
 }
 
-int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzoom, int basezoom, double basezoom_marker_width, sqlite3 *outdb, const char *outdir, std::set<std::string> *exclude, std::set<std::string> *include, int exclude_all, json_object *filter, double droprate, int buffer, const char *tmpdir, double gamma, int read_parallel, int forcetable, const char *attribution, bool uses_gamma, long long *file_bbox, const char *prefilter, const char *postfilter, const char *description, bool guess_maxzoom, std::map<std::string, int> const *attribute_types, const char *pgm) {
+int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzoom, int basezoom, double basezoom_marker_width, sqlite3 *outdb, const char *outdir, archive_writer *outarchive, std::set<std::string> *exclude, std::set<std::string> *include, int exclude_all, filter_program *filter, double droprate, int buffer, const char *tmpdir, double gamma, int read_parallel, int forcetable, const char *attribution, bool uses_gamma, long long *file_bbox, const char *prefilter, const char *postfilter, const char *description, bool guess_maxzoom, std::map<std::string, int> const *attribute_types, const char *pgm) {
 	int ret = EXIT_SUCCESS;
 
 	std::vector<struct reader> readers;
@@ -1092,11 +1449,6 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 		unlink(geomname);
 		unlink(indexname);
 
-		// To distinguish a null value
-		{
-			struct stringpool p;
-			memfile_write(r->treefile, &p, sizeof(struct stringpool));
-		}
 		// Keep metadata file from being completely empty if no attributes
 		serialize_int(r->metafile, 0, &r->metapos, "meta");
 
@@ -1294,9 +1646,18 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 			}
 		}
 
+		feature_collection_split split;
+		bool split_features = false;
+
 		if (map != NULL && map != MAP_FAILED && st.st_size - off > 0) {
 			if (map[0] == 0x1E) {
 				read_parallel_this = 0x1E;
+			} else if (CPUS > 1 && split_feature_collection(map, st.st_size - off, CPUS, split, scan_best()) &&
+				   parse_geojson_envelope(map, split.features_start, split.features_end, st.st_size - off, reading.c_str())) {
+				// A FeatureCollection can be read in parallel even if it
+				// is not line-delimited, by cutting it between features
+				split_features = true;
+				read_parallel_this = '\n';
 			}
 
 			if (!read_parallel_this) {
@@ -1312,7 +1673,7 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 		}
 
 		if (map != NULL && map != MAP_FAILED && read_parallel_this) {
-			do_read_parallel(map, st.st_size - off, overall_offset, reading.c_str(), &readers, &progress_seq, exclude, include, exclude_all, filter, basezoom, layer, &layermaps, initialized, initial_x, initial_y, maxzoom, sources[layer].layer, uses_gamma, attribute_types, read_parallel_this, &dist_sum, &dist_count, guess_maxzoom, prefilter != NULL || postfilter != NULL);
+			do_read_parallel(map, st.st_size - off, overall_offset, reading.c_str(), &readers, &progress_seq, exclude, include, exclude_all, filter, basezoom, layer, &layermaps, initialized, initial_x, initial_y, maxzoom, sources[layer].layer, uses_gamma, attribute_types, read_parallel_this, &dist_sum, &dist_count, guess_maxzoom, prefilter != NULL || postfilter != NULL, split_features ? &split : NULL);
 			overall_offset += st.st_size - off;
 			checkdisk(&readers);
 
@@ -1340,77 +1701,119 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 			}
 
 			if (read_parallel_this) {
-				// Serial reading of chunks that are then parsed in parallel
-
-				char readname[strlen(tmpdir) + strlen("/read.XXXXXXXX") + 1];
-				sprintf(readname, "%s%s", tmpdir, "/read.XXXXXXXX");
-				int readfd = mkstemp_cloexec(readname);
-				if (readfd < 0) {
-					perror(readname);
-					exit(EXIT_FAILURE);
-				}
-				FILE *readfp = fdopen(readfd, "w");
-				if (readfp == NULL) {
-					perror(readname);
-					exit(EXIT_FAILURE);
-				}
-				unlink(readname);
+				// Serial reading of chunks that are then parsed in parallel.
+				//
+				// The input is read into memory, and each time the parsers are
+				// ready for more, everything up through the last separator
+				// that has been read is handed to them from there.
+				// If the parsers fall far enough behind that more than
+				// stream_buffer_size is waiting for them, complete records
+				// go to a temporary file instead until they catch up.
 
 				volatile int is_parsing = 0;
-				long long ahead = 0;
 				long long initial_offset = overall_offset;
 				pthread_t parallel_parser;
 				bool parser_created = false;
 
-#define READ_BUF 2000
+#define READ_BUF (1024 * 1024)
 #define PARSE_MIN 10000000
 #define PARSE_MAX (1LL * 1024 * 1024 * 1024)
 
-				char buf[READ_BUF];
-				int n;
-
-				while ((n = fread(buf, sizeof(char), READ_BUF, fp)) > 0) {
-					fwrite_check(buf, sizeof(char), n, readfp, reading.c_str());
-					ahead += n;
-
-					if (buf[n - 1] == read_parallel_this && ahead > PARSE_MIN) {
-						// Don't let the streaming reader get too far ahead of the parsers.
-						// If the buffered input gets huge, even if the parsers are still running,
-						// wait for the parser thread instead of continuing to stream input.
-
-						if (is_parsing == 0 || ahead >= PARSE_MAX) {
-							if (parser_created) {
-								if (pthread_join(parallel_parser, NULL) != 0) {
-									perror("pthread_join 1088");
-									exit(EXIT_FAILURE);
-								}
-								parser_created = false;
-							}
+				char *buf = NULL;
+				size_t buf_len = 0;
+				size_t buf_alloc = 0;
+				size_t complete = 0;  // through the last separator in buf
+
+				int readfd = -1;
+				FILE *readfp = NULL;
+				long long spilled = 0;
+
+				while (true) {
+					if (buf_len + READ_BUF > buf_alloc) {
+						buf_alloc = std::max(buf_alloc * 2, buf_len + READ_BUF);
+						buf = (char *) realloc(buf, buf_alloc);
+						if (buf == NULL) {
+							perror("Out of memory reading input");
+							exit(EXIT_FAILURE);
+						}
+					}
 
-							fflush(readfp);
-							start_parsing(readfd, readfp, initial_offset, ahead, &is_parsing, &parallel_parser, parser_created, reading.c_str(), &readers, &progress_seq, exclude, include, exclude_all, filter, basezoom, layer, layermaps, initialized, initial_x, initial_y, maxzoom, sources[layer].layer, gamma != 0, attribute_types, read_parallel_this, &dist_sum, &dist_count, guess_maxzoom, prefilter != NULL || postfilter != NULL);
+					size_t n = fread(buf + buf_len, sizeof(char), READ_BUF, fp);
+					if (n == 0) {
+						break;
+					}
+					size_t searched = buf_len;
+					buf_len += n;
 
-							initial_offset += ahead;
-							overall_offset += ahead;
-							checkdisk(&readers);
-							ahead = 0;
+					size_t found = after_last_separator(buf, searched, buf_len, read_parallel_this);
+					if (found > 0) {
+						complete = found;
+					}
+
+					if (readfp != NULL && complete > 0) {
+						fwrite_check(buf, sizeof(char), complete, readfp, reading.c_str());
+						spilled += complete;
+						memmove(buf, buf + complete, buf_len - complete);
+						buf_len -= complete;
+						complete = 0;
+					}
 
-							sprintf(readname, "%s%s", tmpdir, "/read.XXXXXXXX");
-							readfd = mkstemp_cloexec(readname);
-							if (readfd < 0) {
-								perror(readname);
+					long long ahead = spilled + complete;
+					if (ahead <= PARSE_MIN) {
+						continue;
+					}
+
+					// Don't let the streaming reader get too far ahead of the parsers.
+					// If the buffered input gets huge, even if the parsers are still running,
+					// wait for the parser thread instead of continuing to stream input.
+
+					if (is_parsing == 0 || spilled >= PARSE_MAX) {
+						if (parser_created) {
+							if (pthread_join(parallel_parser, NULL) != 0) {
+								perror("pthread_join 1088");
 								exit(EXIT_FAILURE);
 							}
-							readfp = fdopen(readfd, "w");
-							if (readfp == NULL) {
-								perror(readname);
+							parser_created = false;
+						}
+
+						if (readfp != NULL) {
+							fflush(readfp);
+							start_parsing(readfd, readfp, NULL, initial_offset, ahead, &is_parsing, &parallel_parser, parser_created, reading.c_str(), &readers, &progress_seq, exclude, include, exclude_all, filter, basezoom, layer, layermaps, initialized, initial_x, initial_y, maxzoom, sources[layer].layer, gamma != 0, attribute_types, read_parallel_this, &dist_sum, &dist_count, guess_maxzoom, prefilter != NULL || postfilter != NULL);
+							stream_bytes_spilled += ahead;
+							readfp = NULL;
+							spilled = 0;
+						} else {
+							// The parsers get this buffer, and reading continues
+							// in a new one with whatever came after the separator
+							char *rest = (char *) malloc(std::max(buf_len - complete, (size_t) READ_BUF));
+							if (rest == NULL) {
+								perror("Out of memory reading input");
 								exit(EXIT_FAILURE);
 							}
-							unlink(readname);
+							memcpy(rest, buf + complete, buf_len - complete);
+
+							start_parsing(-1, NULL, buf, initial_offset, ahead, &is_parsing, &parallel_parser, parser_created, reading.c_str(), &readers, &progress_seq, exclude, include, exclude_all, filter, basezoom, layer, layermaps, initialized, initial_x, initial_y, maxzoom, sources[layer].layer, gamma != 0, attribute_types, read_parallel_this, &dist_sum, &dist_count, guess_maxzoom, prefilter != NULL || postfilter != NULL);
+							stream_bytes_in_memory += ahead;
+
+							buf = rest;
+							buf_len -= complete;
+							buf_alloc = std::max(buf_len, (size_t) READ_BUF);
+							complete = 0;
 						}
+
+						initial_offset += ahead;
+						overall_offset += ahead;
+						checkdisk(&readers);
+					} else if (readfp == NULL && (long long) buf_len > stream_buffer_size) {
+						readfp = open_read_temp(tmpdir, &readfd);
+						fwrite_check(buf, sizeof(char), complete, readfp, reading.c_str());
+						spilled = complete;
+						memmove(buf, buf + complete, buf_len - complete);
+						buf_len -= complete;
+						complete = 0;
 					}
 				}
-				if (n < 0) {
+				if (ferror(fp)) {
 					perror(reading.c_str());
 				}
 
@@ -1422,10 +1825,23 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 					parser_created = false;
 				}
 
-				fflush(readfp);
+				// Whatever is left, whether or not it ends with a separator
+
+				long long ahead = spilled + buf_len;
+				if (readfp != NULL) {
+					fwrite_check(buf, sizeof(char), buf_len, readfp, reading.c_str());
+					free(buf);
+					fflush(readfp);
+				}
 
 				if (ahead > 0) {
-					start_parsing(readfd, readfp, initial_offset, ahead, &is_parsing, &parallel_parser, parser_created, reading.c_str(), &readers, &progress_seq, exclude, include, exclude_all, filter, basezoom, layer, layermaps, initialized, initial_x, initial_y, maxzoom, sources[layer].layer, gamma != 0, attribute_types, read_parallel_this, &dist_sum, &dist_count, guess_maxzoom, prefilter != NULL || postfilter != NULL);
+					if (readfp != NULL) {
+						start_parsing(readfd, readfp, NULL, initial_offset, ahead, &is_parsing, &parallel_parser, parser_created, reading.c_str(), &readers, &progress_seq, exclude, include, exclude_all, filter, basezoom, layer, layermaps, initialized, initial_x, initial_y, maxzoom, sources[layer].layer, gamma != 0, attribute_types, read_parallel_this, &dist_sum, &dist_count, guess_maxzoom, prefilter != NULL || postfilter != NULL);
+						stream_bytes_spilled += ahead;
+					} else {
+						start_parsing(-1, NULL, buf, initial_offset, ahead, &is_parsing, &parallel_parser, parser_created, reading.c_str(), &readers, &progress_seq, exclude, include, exclude_all, filter, basezoom, layer, layermaps, initialized, initial_x, initial_y, maxzoom, sources[layer].layer, gamma != 0, attribute_types, read_parallel_this, &dist_sum, &dist_count, guess_maxzoom, prefilter != NULL || postfilter != NULL);
+						stream_bytes_in_memory += ahead;
+					}
 
 					if (parser_created) {
 						if (pthread_join(parallel_parser, NULL) != 0) {
@@ -1436,6 +1852,15 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 
 					overall_offset += ahead;
 					checkdisk(&readers);
+				} else {
+					if (readfp != NULL) {
+						if (fclose(readfp) != 0) {
+							perror("close read temp");
+							exit(EXIT_FAILURE);
+						}
+					} else {
+						free(buf);
+					}
 				}
 			} else {
 				// Plain serial reading
@@ -1468,6 +1893,7 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 				sst.attribute_types = attribute_types;
 
 				parse_json(&sst, jp, layer, sources[layer].layer);
+				add_json_stats(jp);
 				json_end(jp);
 				overall_offset = layer_seq;
 				checkdisk(&readers);
@@ -1485,6 +1911,14 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 		//     (stderr, "Read 10000.00 million features\r", *progress_seq / 1000000.0);
 	}
 
+	if (performance_stats && stream_bytes_in_memory + stream_bytes_spilled > 0) {
+		fprintf(stderr, "Streaming input: %lld bytes parsed from memory, %lld bytes by way of temporary files\n", stream_bytes_in_memory, stream_bytes_spilled);
+	}
+
+	if (performance_stats && json_features > 0) {
+		fprintf(stderr, "Parsing GeoJSON: %llu features, %.1f allocations and %.0f bytes of parse tree per feature\n", json_features, (double) json_allocations / json_features, (double) json_allocated_bytes / json_features);
+	}
+
 	for (size_t i = 0; i < CPUS; i++) {
 		if (fclose(readers[i].metafile) != 0) {
 			perror("fclose meta");
@@ -1693,6 +2127,9 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 		if (outdb != NULL) {
 			mbtiles_close(outdb, pgm);
 		}
+		if (outarchive != NULL) {
+			archive_close(outarchive);
+		}
 		exit(EXIT_FAILURE);
 	}
 
@@ -2010,7 +2447,7 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 	}
 
 	unsigned midx = 0, midy = 0;
-	int written = traverse_zooms(fd, size, meta, stringpool, &midx, &midy, maxzoom, minzoom, outdb, outdir, buffer, fname, tmpdir, gamma, full_detail, low_detail, min_detail, meta_off, pool_off, initial_x, initial_y, simplification, layermaps, prefilter, postfilter);
+	int written = traverse_zooms(fd, size, meta, stringpool, &midx, &midy, maxzoom, minzoom, outdb, outdir, outarchive, buffer, fname, tmpdir, gamma, full_detail, low_detail, min_detail, meta_off, pool_off, initial_x, initial_y, simplification, layermaps, prefilter, postfilter);
 
 	if (maxzoom != written) {
 		fprintf(stderr, "\n\n\n*** NOTE TILES ONLY COMPLETE THROUGH ZOOM %d ***\n\n\n", written);
@@ -2077,7 +2514,7 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 		}
 	}
 
-	mbtiles_write_metadata(outdb, outdir, fname, minzoom, maxzoom, minlat, minlon, maxlat, maxlon, midlat, midlon, forcetable, attribution, merged_lm, true, description, !prevent[P_TILE_STATS]);
+	mbtiles_write_metadata(outdb, outdir, outarchive, fname, minzoom, maxzoom, minlat, minlon, maxlat, maxlon, midlat, midlon, forcetable, attribution, merged_lm, true, description, !prevent[P_TILE_STATS]);
 
 	return ret;
 }
@@ -2135,7 +2572,9 @@ int main(int argc, char **argv) {
 	char *layername = NULL;
 	char *out_mbtiles = NULL;
 	char *out_dir = NULL;
+	char *out_archive = NULL;
 	sqlite3 *outdb = NULL;
+	archive_writer *outarchive = NULL;
 	int maxzoom = 14;
 	int minzoom = 0;
 	int basezoom = -1;
@@ -2168,8 +2607,10 @@ int main(int argc, char **argv) {
 		{"Output tileset", 0, 0, 0},
 		{"output", required_argument, 0, 'o'},
 		{"output-to-directory", required_argument, 0, 'e'},
+		{"output-to-archive", required_argument, 0, 'k'},
 		{"force", no_argument, 0, 'f'},
 		{"allow-existing", no_argument, 0, 'F'},
+		{"deduplicate-tiles", no_argument, &additional[A_DEDUPLICATE_TILES], 1},
 
 		{"Tileset description and attribution", 0, 0, 0},
 		{"name", required_argument, 0, 'n'},
@@ -2182,6 +2623,7 @@ int main(int argc, char **argv) {
 
 		{"Parallel processing of input", 0, 0, 0},
 		{"read-parallel", no_argument, 0, 'P'},
+		{"stream-buffer-size", required_argument, 0, '~'},
 
 		{"Projection of input", 0, 0, 0},
 		{"projection", required_argument, 0, 's'},
@@ -2216,6 +2658,7 @@ int main(int argc, char **argv) {
 		{"drop-smallest-as-needed", no_argument, &additional[A_DROP_SMALLEST_AS_NEEDED], 1},
 		{"coalesce-smallest-as-needed", no_argument, &additional[A_COALESCE_SMALLEST_AS_NEEDED], 1},
 		{"force-feature-limit", no_argument, &prevent[P_DYNAMIC_DROP], 1},
+		{"single-pass-as-needed", no_argument, &additional[A_SINGLE_PASS_AS_NEEDED], 1},
 
 		{"Dropping tightly overlapping features", 0, 0, 0},
 		{"gamma", required_argument, 0, 'g'},
@@ -2251,20 +2694,24 @@ int main(int argc, char **argv) {
 		{"Filtering tile contents", 0, 0, 0},
 		{"prefilter", required_argument, 0, 'C'},
 		{"postfilter", required_argument, 0, 'c'},
+		{"persistent-filters", no_argument, &additional[A_PERSISTENT_FILTERS], 1},
 
 		{"Setting or disabling tile size limits", 0, 0, 0},
 		{"maximum-tile-bytes", required_argument, 0, 'M'},
 		{"no-feature-limit", no_argument, &prevent[P_FEATURE_LIMIT], 1},
 		{"no-tile-size-limit", no_argument, &prevent[P_KILOBYTE_LIMIT], 1},
+		{"estimate-tile-sizes", no_argument, &additional[A_ESTIMATE_TILE_SIZES], 1},
 		{"no-tile-compression", no_argument, &prevent[P_TILE_COMPRESSION], 1},
 		{"no-tile-stats", no_argument, &prevent[P_TILE_STATS], 1},
 
 		{"Temporary storage", 0, 0, 0},
 		{"temporary-directory", required_argument, 0, 't'},
+		{"compress-temporary-files", no_argument, &additional[A_COMPRESS_TEMPORARY_FILES], 1},
 
 		{"Progress indicator", 0, 0, 0},
 		{"quiet", no_argument, 0, 'q'},
 		{"no-progress-indicator", no_argument, 0, 'Q'},
+		{"performance-stats", no_argument, &performance_stats, 1},
 		{"version", no_argument, 0, 'v'},
 
 		{"", 0, 0, 0},
@@ -2287,7 +2734,8 @@ int main(int argc, char **argv) {
 			if (long_options_orig[lo].val != 0) {
 				long_options[out++] = long_options_orig[lo];
 
-				if (long_options_orig[lo].val > ' ') {
+				// '~' marks options that only have a long form
+				if (long_options_orig[lo].val > ' ' && long_options_orig[lo].val != '~') {
 					getopt_str[cout++] = long_options_orig[lo].val;
 
 					if (long_options_orig[lo].has_arg == required_argument) {
@@ -2316,11 +2764,28 @@ int main(int argc, char **argv) {
 		}
 	}
 
-	while ((i = getopt_long(argc, argv, getopt_str, long_options, NULL)) != -1) {
+	int option_index = 0;
+	while ((i = getopt_long(argc, argv, getopt_str, long_options, &option_index)) != -1) {
 		switch (i) {
 		case 0:
 			break;
 
+		case '~': {
+			const char *opt = long_options[option_index].name;
+			if (strcmp(opt, "stream-buffer-size") == 0) {
+				char *end;
+				stream_buffer_size = strtoll(optarg, &end, 10);
+				if (end == optarg || *end != '\0' || stream_buffer_size < 0) {
+					fprintf(stderr, "%s: Couldn't understand --stream-buffer-size=%s\n", argv[0], optarg);
+					exit(EXIT_FAILURE);
+				}
+			} else {
+				fprintf(stderr, "%s: Unrecognized option --%s\n", argv[0], opt);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		}
+
 		case 'n':
 			name = optarg;
 			break;
@@ -2398,27 +2863,27 @@ int main(int argc, char **argv) {
 			break;
 
 		case 'o':
-			if (out_mbtiles != NULL) {
-				fprintf(stderr, "%s: Can't specify both %s and %s as output\n", argv[0], out_mbtiles, optarg);
-				exit(EXIT_FAILURE);
-			}
-			if (out_dir != NULL) {
-				fprintf(stderr, "%s: Can't specify both %s and %s as output\n", argv[0], out_dir, optarg);
+			if (out_mbtiles != NULL || out_dir != NULL || out_archive != NULL) {
+				fprintf(stderr, "%s: Can't specify both %s and %s as output\n", argv[0], out_mbtiles != NULL ? out_mbtiles : out_dir != NULL ? out_dir : out_archive, optarg);
 				exit(EXIT_FAILURE);
 			}
 			out_mbtiles = optarg;
 			break;
 
 		case 'e':
-			if (out_mbtiles != NULL) {
-				fprintf(stderr, "%s: Can't specify both %s and %s as output\n", argv[0], out_mbtiles, optarg);
+			if (out_mbtiles != NULL || out_dir != NULL || out_archive != NULL) {
+				fprintf(stderr, "%s: Can't specify both %s and %s as output\n", argv[0], out_mbtiles != NULL ? out_mbtiles : out_dir != NULL ? out_dir : out_archive, optarg);
 				exit(EXIT_FAILURE);
 			}
-			if (out_dir != NULL) {
-				fprintf(stderr, "%s: Can't specify both %s and %s as output\n", argv[0], out_dir, optarg);
+			out_dir = optarg;
+			break;
+
+		case 'k':
+			if (out_mbtiles != NULL || out_dir != NULL || out_archive != NULL) {
+				fprintf(stderr, "%s: Can't specify both %s and %s as output\n", argv[0], out_mbtiles != NULL ? out_mbtiles : out_dir != NULL ? out_dir : out_archive, optarg);
 				exit(EXIT_FAILURE);
 			}
-			out_dir = optarg;
+			out_archive = optarg;
 			break;
 
 		case 'x':
@@ -2646,13 +3111,8 @@ int main(int argc, char **argv) {
 		fprintf(stderr, "Forcing -g0 since -B or -r is not known\n");
 	}
 
-	if (out_mbtiles == NULL && out_dir == NULL) {
-		fprintf(stderr, "%s: must specify -o out.mbtiles or -e directory\n", argv[0]);
-		exit(EXIT_FAILURE);
-	}
-
-	if (out_mbtiles != NULL && out_dir != NULL) {
-		fprintf(stderr, "%s: Options -o and -e cannot be used together\n", argv[0]);
+	if (out_mbtiles == NULL && out_dir == NULL && out_archive == NULL) {
+		fprintf(stderr, "%s: must specify -o out.mbtiles, -e directory, or -k archive\n", argv[0]);
 		exit(EXIT_FAILURE);
 	}
 
@@ -2661,7 +3121,7 @@ int main(int argc, char **argv) {
 			unlink(out_mbtiles);
 		}
 
-		outdb = mbtiles_open(out_mbtiles, argv, forcetable);
+		outdb = mbtiles_open(out_mbtiles, argv, forcetable, additional[A_DEDUPLICATE_TILES]);
 	}
 	if (out_dir != NULL) {
 		if (force) {
@@ -2669,6 +3129,13 @@ int main(int argc, char **argv) {
 		}
 		check_dir(out_dir, false);
 	}
+	if (out_archive != NULL) {
+		if (force) {
+			unlink(out_archive);
+		}
+
+		outarchive = archive_open(out_archive);
+	}
 
 	int ret = EXIT_SUCCESS;
 
@@ -2694,11 +3161,19 @@ int main(int argc, char **argv) {
 
 	long long file_bbox[4] = {UINT_MAX, UINT_MAX, 0, 0};
 
-	ret = read_input(sources, name ? name : out_mbtiles ? out_mbtiles : out_dir, maxzoom, minzoom, basezoom, basezoom_marker_width, outdb, out_dir, &exclude, &include, exclude_all, filter, droprate, buffer, tmpdir, gamma, read_parallel, forcetable, attribution, gamma != 0, file_bbox, prefilter, postfilter, description, guess_maxzoom, &attribute_types, argv[0]);
+	filter_program *compiled_filter = NULL;
+	if (filter != NULL) {
+		compiled_filter = compile_filter(filter);
+	}
+
+	ret = read_input(sources, name ? name : out_mbtiles ? out_mbtiles : out_dir ? out_dir : out_archive, maxzoom, minzoom, basezoom, basezoom_marker_width, outdb, out_dir, outarchive, &exclude, &include, exclude_all, compiled_filter, droprate, buffer, tmpdir, gamma, read_parallel, forcetable, attribution, gamma != 0, file_bbox, prefilter, postfilter, description, guess_maxzoom, &attribute_types, argv[0]);
 
 	if (outdb != NULL) {
 		mbtiles_close(outdb, argv[0]);
 	}
+	if (outarchive != NULL) {
+		archive_close(outarchive);
+	}
 
 #ifdef MTRACE
 	muntrace();
@@ -2713,6 +3188,7 @@ int main(int argc, char **argv) {
 
 	if (filter != NULL) {
 		json_free(filter);
+		delete compiled_filter;
 	}
 
 	return ret;
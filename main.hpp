@@ -22,6 +22,7 @@ void checkdisk(std::vector<struct reader> *r);
 extern int geometry_scale;
 extern int quiet;
 extern int quiet_progress;
+extern int performance_stats;
 
 extern size_t CPUS;
 extern size_t TEMP_FILES;
@@ -14,9 +14,33 @@
 #include "mvt.hpp"
 #include "mbtiles.hpp"
 #include "text.hpp"
+#include "archive.hpp"
 #include "milo/dtoa_milo.h"
 
-sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable) {
+// Whether "tiles" is a table, or a view of the map and images tables
+// with each distinct tile stored only once, or doesn't exist yet
+static std::string mbtiles_tiles_type(sqlite3 *outdb) {
+	sqlite3_stmt *stmt;
+	std::string type;
+
+	const char *query = "SELECT type from sqlite_master where name = 'tiles';";
+	if (sqlite3_prepare_v2(outdb, query, -1, &stmt, NULL) != SQLITE_OK) {
+		fprintf(stderr, "sqlite3 schema query failed: %s\n", sqlite3_errmsg(outdb));
+		exit(EXIT_FAILURE);
+	}
+
+	if (sqlite3_step(stmt) == SQLITE_ROW) {
+		const char *s = (const char *) sqlite3_column_text(stmt, 0);
+		if (s != NULL) {
+			type = s;
+		}
+	}
+
+	sqlite3_finalize(stmt);
+	return type;
+}
+
+sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable, bool deduplicate) {
 	sqlite3 *outdb;
 
 	if (sqlite3_open(dbname, &outdb) != SQLITE_OK) {
@@ -42,11 +66,42 @@ sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable) {
 		if (!forcetable) {
 			exit(EXIT_FAILURE);
 		}
+		sqlite3_free(err);
 	}
-	if (sqlite3_exec(outdb, "CREATE TABLE tiles (zoom_level integer, tile_column integer, tile_row integer, tile_data blob);", NULL, NULL, &err) != SQLITE_OK) {
-		fprintf(stderr, "%s: create tiles table: %s\n", argv[0], err);
-		if (!forcetable) {
-			exit(EXIT_FAILURE);
+	if (deduplicate && forcetable && mbtiles_tiles_type(outdb) != "") {
+		// Keep adding to the tiles in whatever form they already have
+		deduplicate = false;
+	}
+
+	if (deduplicate) {
+		if (sqlite3_exec(outdb, "CREATE TABLE map (zoom_level integer, tile_column integer, tile_row integer, tile_id text);", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: create map table: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_FAILURE);
+			}
+			sqlite3_free(err);
+		}
+		if (sqlite3_exec(outdb, "CREATE TABLE images (tile_data blob, tile_id text);", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: create images table: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_FAILURE);
+			}
+			sqlite3_free(err);
+		}
+		if (sqlite3_exec(outdb, "CREATE VIEW tiles AS SELECT map.zoom_level AS zoom_level, map.tile_column AS tile_column, map.tile_row AS tile_row, images.tile_data AS tile_data FROM map JOIN images ON images.tile_id = map.tile_id;", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: create tiles view: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_FAILURE);
+			}
+			sqlite3_free(err);
+		}
+	} else {
+		if (sqlite3_exec(outdb, "CREATE TABLE tiles (zoom_level integer, tile_column integer, tile_row integer, tile_data blob);", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: create tiles table: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_FAILURE);
+			}
+			sqlite3_free(err);
 		}
 	}
 	if (sqlite3_exec(outdb, "create unique index name on metadata (name);", NULL, NULL, &err) != SQLITE_OK) {
@@ -54,35 +109,142 @@ sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable) {
 		if (!forcetable) {
 			exit(EXIT_FAILURE);
 		}
+		sqlite3_free(err);
 	}
-	if (sqlite3_exec(outdb, "create unique index tile_index on tiles (zoom_level, tile_column, tile_row);", NULL, NULL, &err) != SQLITE_OK) {
-		fprintf(stderr, "%s: index tiles: %s\n", argv[0], err);
-		if (!forcetable) {
-			exit(EXIT_FAILURE);
+	if (deduplicate) {
+		if (sqlite3_exec(outdb, "create unique index map_index on map (zoom_level, tile_column, tile_row);", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: index map: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_FAILURE);
+			}
+			sqlite3_free(err);
+		}
+		if (sqlite3_exec(outdb, "create unique index images_id on images (tile_id);", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: index images: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_FAILURE);
+			}
+			sqlite3_free(err);
+		}
+	} else {
+		if (sqlite3_exec(outdb, "create unique index tile_index on tiles (zoom_level, tile_column, tile_row);", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: index tiles: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_FAILURE);
+			}
+			sqlite3_free(err);
 		}
 	}
 
 	return outdb;
 }
 
-void mbtiles_write_tile(sqlite3 *outdb, int z, int tx, int ty, const char *data, int size) {
-	sqlite3_stmt *stmt;
+// Identifies a tile's contents in the images table. Two independently
+// seeded hashes plus the length make an accidental match implausible.
+static std::string tile_id(const char *data, int size) {
+	char buf[2 * 16 + 1 + 20 + 1];
+	sprintf(buf, "%016llx%016llx-%d", murmur64(data, size, 0x5bd1e995ULL), murmur64(data, size, 0x2545f4914f6cdd1dULL), size);
+	return std::string(buf);
+}
+
+/**
+ * Prepares the statements that insert tiles into outdb, once for all
+ * the tiles instead of again for each one. The statements belong to the
+ * thread that writes the tiles, and must be finalized with
+ * mbtiles_writer_close before the database is closed.
+ */
+void mbtiles_writer_open(mbtiles_writer *mw, sqlite3 *outdb) {
+	mw->db = outdb;
+
 	const char *query = "insert into tiles (zoom_level, tile_column, tile_row, tile_data) values (?, ?, ?, ?)";
-	if (sqlite3_prepare_v2(outdb, query, -1, &stmt, NULL) != SQLITE_OK) {
+	if (mbtiles_tiles_type(outdb) == "view") {
+		query = "insert into map (zoom_level, tile_column, tile_row, tile_id) values (?, ?, ?, ?)";
+
+		const char *image_query = "insert or ignore into images (tile_id, tile_data) values (?, ?)";
+		if (sqlite3_prepare_v2(outdb, image_query, -1, &mw->image_stmt, NULL) != SQLITE_OK) {
+			fprintf(stderr, "sqlite3 insert prep failed\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (sqlite3_prepare_v2(outdb, query, -1, &mw->insert_stmt, NULL) != SQLITE_OK) {
 		fprintf(stderr, "sqlite3 insert prep failed\n");
 		exit(EXIT_FAILURE);
 	}
+}
+
+void mbtiles_writer_close(mbtiles_writer *mw) {
+	if (mw->insert_stmt != NULL) {
+		if (sqlite3_finalize(mw->insert_stmt) != SQLITE_OK) {
+			fprintf(stderr, "sqlite3 finalize failed: %s\n", sqlite3_errmsg(mw->db));
+		}
+		mw->insert_stmt = NULL;
+	}
+	if (mw->image_stmt != NULL) {
+		if (sqlite3_finalize(mw->image_stmt) != SQLITE_OK) {
+			fprintf(stderr, "sqlite3 finalize failed: %s\n", sqlite3_errmsg(mw->db));
+		}
+		mw->image_stmt = NULL;
+	}
+	mw->db = NULL;
+}
+
+void mbtiles_write_tile(mbtiles_writer *mw, int z, int tx, int ty, const char *data, int size) {
+	sqlite3 *outdb = mw->db;
+	sqlite3_stmt *insert_stmt = mw->insert_stmt;
+	sqlite3_stmt *image_stmt = mw->image_stmt;
+
+	sqlite3_bind_int(insert_stmt, 1, z);
+	sqlite3_bind_int(insert_stmt, 2, tx);
+	sqlite3_bind_int(insert_stmt, 3, (1 << z) - 1 - ty);
+
+	if (image_stmt != NULL) {
+		std::string id = tile_id(data, size);
+
+		sqlite3_bind_text(image_stmt, 1, id.c_str(), id.size(), SQLITE_TRANSIENT);
+		sqlite3_bind_blob(image_stmt, 2, data, size, NULL);
+
+		if (sqlite3_step(image_stmt) != SQLITE_DONE) {
+			fprintf(stderr, "sqlite3 insert failed: %s\n", sqlite3_errmsg(outdb));
+		}
+		if (sqlite3_reset(image_stmt) != SQLITE_OK) {
+			fprintf(stderr, "sqlite3 reset failed: %s\n", sqlite3_errmsg(outdb));
+		}
+		if (sqlite3_clear_bindings(image_stmt) != SQLITE_OK) {
+			fprintf(stderr, "sqlite3 clear bindings failed: %s\n", sqlite3_errmsg(outdb));
+		}
 
-	sqlite3_bind_int(stmt, 1, z);
-	sqlite3_bind_int(stmt, 2, tx);
-	sqlite3_bind_int(stmt, 3, (1 << z) - 1 - ty);
-	sqlite3_bind_blob(stmt, 4, data, size, NULL);
+		sqlite3_bind_text(insert_stmt, 4, id.c_str(), id.size(), SQLITE_TRANSIENT);
+	} else {
+		sqlite3_bind_blob(insert_stmt, 4, data, size, NULL);
+	}
 
-	if (sqlite3_step(stmt) != SQLITE_DONE) {
+	if (sqlite3_step(insert_stmt) != SQLITE_DONE) {
 		fprintf(stderr, "sqlite3 insert failed: %s\n", sqlite3_errmsg(outdb));
 	}
-	if (sqlite3_finalize(stmt) != SQLITE_OK) {
-		fprintf(stderr, "sqlite3 finalize failed: %s\n", sqlite3_errmsg(outdb));
+	if (sqlite3_reset(insert_stmt) != SQLITE_OK) {
+		fprintf(stderr, "sqlite3 reset failed: %s\n", sqlite3_errmsg(outdb));
+	}
+	if (sqlite3_clear_bindings(insert_stmt) != SQLITE_OK) {
+		fprintf(stderr, "sqlite3 clear bindings failed: %s\n", sqlite3_errmsg(outdb));
+	}
+}
+
+void mbtiles_begin(sqlite3 *outdb) {
+	char *err = NULL;
+	if (sqlite3_exec(outdb, "BEGIN TRANSACTION;", NULL, NULL, &err) != SQLITE_OK) {
+		fprintf(stderr, "sqlite3 begin transaction failed: %s\n", err);
+		sqlite3_free(err);
+		exit(EXIT_FAILURE);
+	}
+}
+
+void mbtiles_commit(sqlite3 *outdb) {
+	char *err = NULL;
+	if (sqlite3_exec(outdb, "COMMIT;", NULL, NULL, &err) != SQLITE_OK) {
+		fprintf(stderr, "sqlite3 commit failed: %s\n", err);
+		sqlite3_free(err);
+		exit(EXIT_FAILURE);
 	}
 }
 
@@ -306,7 +468,7 @@ std::string tilestats(std::map<std::string, layermap_entry> const &layermap1, si
 	return out2;
 }
 
-void mbtiles_write_metadata(sqlite3 *outdb, const char *outdir, const char *fname, int minzoom, int maxzoom, double minlat, double minlon, double maxlat, double maxlon, double midlat, double midlon, int forcetable, const char *attribution, std::map<std::string, layermap_entry> const &layermap, bool vector, const char *description, bool do_tilestats) {
+void mbtiles_write_metadata(sqlite3 *outdb, const char *outdir, archive_writer *outarchive, const char *fname, int minzoom, int maxzoom, double minlat, double minlon, double maxlat, double maxlon, double midlat, double midlon, int forcetable, const char *attribution, std::map<std::string, layermap_entry> const &layermap, bool vector, const char *description, bool do_tilestats) {
 	char *sql, *err;
 
 	sqlite3 *db = outdb;
@@ -485,15 +647,8 @@ void mbtiles_write_metadata(sqlite3 *outdb, const char *outdir, const char *fnam
 		sqlite3_free(sql);
 	}
 
-	if (outdir != NULL) {
-		std::string metadata = std::string(outdir) + "/metadata.json";
-		FILE *fp = fopen(metadata.c_str(), "w");
-		if (fp == NULL) {
-			perror(metadata.c_str());
-			exit(EXIT_FAILURE);
-		}
-
-		fprintf(fp, "{\n");
+	if (outdir != NULL || outarchive != NULL) {
+		std::string json = "{\n";
 
 		sqlite3_stmt *stmt;
 		bool first = true;
@@ -512,16 +667,29 @@ void mbtiles_write_metadata(sqlite3 *outdb, const char *outdir, const char *fnam
 				quote(value, v);
 
 				if (!first) {
-					fprintf(fp, ",\n");
+					json += ",\n";
 				}
-				fprintf(fp, "    \"%s\": \"%s\"", key.c_str(), value.c_str());
+				json += "    \"" + key + "\": \"" + value + "\"";
 				first = false;
 			}
 			sqlite3_finalize(stmt);
 		}
 
-		fprintf(fp, "\n}\n");
-		fclose(fp);
+		json += "\n}\n";
+
+		if (outdir != NULL) {
+			std::string metadata = std::string(outdir) + "/metadata.json";
+			FILE *fp = fopen(metadata.c_str(), "w");
+			if (fp == NULL) {
+				perror(metadata.c_str());
+				exit(EXIT_FAILURE);
+			}
+
+			fwrite(json.c_str(), sizeof(char), json.size(), fp);
+			fclose(fp);
+		} else {
+			archive_write_metadata(outarchive, json);
+		}
 	}
 
 	if (outdb == NULL) {
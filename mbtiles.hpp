@@ -35,11 +35,22 @@ struct layermap_entry {
 	}
 };
 
-sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable);
+sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable, bool deduplicate);
 
-void mbtiles_write_tile(sqlite3 *outdb, int z, int tx, int ty, const char *data, int size);
+// The prepared statements for writing tiles into one database
+struct mbtiles_writer {
+	sqlite3 *db = NULL;
+	sqlite3_stmt *insert_stmt = NULL;
+	sqlite3_stmt *image_stmt = NULL;  // only if tiles are deduplicated
+};
+
+void mbtiles_writer_open(mbtiles_writer *mw, sqlite3 *outdb);
+void mbtiles_write_tile(mbtiles_writer *mw, int z, int tx, int ty, const char *data, int size);
+void mbtiles_writer_close(mbtiles_writer *mw);
+void mbtiles_begin(sqlite3 *outdb);
+void mbtiles_commit(sqlite3 *outdb);
 
-void mbtiles_write_metadata(sqlite3 *outdb, const char *outdir, const char *fname, int minzoom, int maxzoom, double minlat, double minlon, double maxlat, double maxlon, double midlat, double midlon, int forcetable, const char *attribution, std::map<std::string, layermap_entry> const &layermap, bool vector, const char *description, bool do_tilestats);
+void mbtiles_write_metadata(sqlite3 *outdb, const char *outdir, struct archive_writer *outarchive, const char *fname, int minzoom, int maxzoom, double minlat, double minlon, double maxlat, double maxlon, double midlat, double midlon, int forcetable, const char *attribution, std::map<std::string, layermap_entry> const &layermap, bool vector, const char *description, bool do_tilestats);
 
 void mbtiles_close(sqlite3 *outdb, const char *pgm);
 
@@ -27,7 +27,6 @@ struct memfile *memfile_open(int fd) {
 	mf->map = map;
 	mf->len = INITIAL;
 	mf->off = 0;
-	mf->tree = 0;
 
 	return mf;
 }
@@ -6,7 +6,6 @@ struct memfile {
 	char *map = NULL;
 	long long len = 0;
 	long long off = 0;
-	unsigned long tree = 0;
 };
 
 struct memfile *memfile_open(int fd);
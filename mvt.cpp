@@ -84,186 +84,313 @@ int compress(std::string const &input, std::string &output) {
 	return 0;
 }
 
-bool mvt_tile::decode(std::string &message, bool &was_compressed) {
+bool mvt_tile_view::decode(std::string const &message, bool &was_compressed) {
 	layers.clear();
-	std::string src;
+	const char *src;
+	size_t srclen;
 
 	if (is_compressed(message)) {
-		std::string uncompressed;
 		decompress(message, uncompressed);
-		src = uncompressed;
+		src = uncompressed.data();
+		srclen = uncompressed.size();
 		was_compressed = true;
 	} else {
-		src = message;
+		uncompressed.clear();
+		src = message.data();
+		srclen = message.size();
 		was_compressed = false;
 	}
 
-	protozero::pbf_reader reader(src);
+	protozero::pbf_reader reader(src, srclen);
 
 	while (reader.next()) {
 		switch (reader.tag()) {
 		case 3: /* layer */
 		{
-			protozero::pbf_reader layer_reader(reader.get_message());
-			mvt_layer layer;
+			std::pair<const char *, protozero::pbf_length_type> data = reader.get_data();
+			mvt_layer_view layer;
+			layer.data = data.first;
+			layer.len = data.second;
 
+			// Skip over the keys, values, and features
+			protozero::pbf_reader layer_reader(data.first, data.second);
 			while (layer_reader.next()) {
 				switch (layer_reader.tag()) {
 				case 1: /* name */
 					layer.name = layer_reader.get_string();
 					break;
 
-				case 3: /* key */
-					layer.keys.push_back(layer_reader.get_string());
+				case 5: /* extent */
+					layer.extent = layer_reader.get_uint32();
 					break;
 
-				case 4: /* value */
-				{
-					protozero::pbf_reader value_reader(layer_reader.get_message());
-					mvt_value value;
-
-					while (value_reader.next()) {
-						switch (value_reader.tag()) {
-						case 1: /* string */
-							value.type = mvt_string;
-							value.string_value = value_reader.get_string();
-							break;
-
-						case 2: /* float */
-							value.type = mvt_float;
-							value.numeric_value.float_value = value_reader.get_float();
-							break;
-
-						case 3: /* double */
-							value.type = mvt_double;
-							value.numeric_value.double_value = value_reader.get_double();
-							break;
-
-						case 4: /* int */
-							value.type = mvt_int;
-							value.numeric_value.int_value = value_reader.get_int64();
-							break;
-
-						case 5: /* uint */
-							value.type = mvt_uint;
-							value.numeric_value.uint_value = value_reader.get_uint64();
-							break;
-
-						case 6: /* sint */
-							value.type = mvt_sint;
-							value.numeric_value.sint_value = value_reader.get_sint64();
-							break;
-
-						case 7: /* bool */
-							value.type = mvt_bool;
-							value.numeric_value.bool_value = value_reader.get_bool();
-							break;
-
-						default:
-							value_reader.skip();
-							break;
-						}
-					}
+				case 15: /* version */
+					layer.version = layer_reader.get_uint32();
+					break;
 
-					layer.values.push_back(value);
+				default:
+					layer_reader.skip();
 					break;
 				}
+			}
 
-				case 5: /* extent */
-					layer.extent = layer_reader.get_uint32();
+			layers.push_back(layer);
+			break;
+		}
+
+		default:
+			reader.skip();
+			break;
+		}
+	}
+
+	return true;
+}
+
+// If geometry is false, the features are left without their geometry,
+// for callers that only need the attributes
+bool mvt_layer_view::decode(mvt_layer &layer, bool geometry) const {
+	layer = mvt_layer();
+	protozero::pbf_reader layer_reader(data, len);
+
+	while (layer_reader.next()) {
+		switch (layer_reader.tag()) {
+		case 1: /* name */
+			layer.name = layer_reader.get_string();
+			break;
+
+		case 3: /* key */
+			layer.keys.push_back(layer_reader.get_string());
+			break;
+
+		case 4: /* value */
+		{
+			protozero::pbf_reader value_reader(layer_reader.get_message());
+			mvt_value value;
+
+			while (value_reader.next()) {
+				switch (value_reader.tag()) {
+				case 1: /* string */
+					value.type = mvt_string;
+					value.string_value = value_reader.get_string();
 					break;
 
-				case 15: /* version */
-					layer.version = layer_reader.get_uint32();
+				case 2: /* float */
+					value.type = mvt_float;
+					value.numeric_value.float_value = value_reader.get_float();
+					break;
+
+				case 3: /* double */
+					value.type = mvt_double;
+					value.numeric_value.double_value = value_reader.get_double();
+					break;
+
+				case 4: /* int */
+					value.type = mvt_int;
+					value.numeric_value.int_value = value_reader.get_int64();
+					break;
+
+				case 5: /* uint */
+					value.type = mvt_uint;
+					value.numeric_value.uint_value = value_reader.get_uint64();
 					break;
 
-				case 2: /* feature */
+				case 6: /* sint */
+					value.type = mvt_sint;
+					value.numeric_value.sint_value = value_reader.get_sint64();
+					break;
+
+				case 7: /* bool */
+					value.type = mvt_bool;
+					value.numeric_value.bool_value = value_reader.get_bool();
+					break;
+
+				default:
+					value_reader.skip();
+					break;
+				}
+			}
+
+			layer.values.push_back(value);
+			break;
+		}
+
+		case 5: /* extent */
+			layer.extent = layer_reader.get_uint32();
+			break;
+
+		case 15: /* version */
+			layer.version = layer_reader.get_uint32();
+			break;
+
+		case 2: /* feature */
+		{
+			protozero::pbf_reader feature_reader(layer_reader.get_message());
+			mvt_feature feature;
+			std::vector<uint32_t> geoms;
+
+			while (feature_reader.next()) {
+				switch (feature_reader.tag()) {
+				case 1: /* id */
+					feature.id = feature_reader.get_uint64();
+					feature.has_id = true;
+					break;
+
+				case 2: /* tag */
 				{
-					protozero::pbf_reader feature_reader(layer_reader.get_message());
-					mvt_feature feature;
-					std::vector<uint32_t> geoms;
-
-					while (feature_reader.next()) {
-						switch (feature_reader.tag()) {
-						case 1: /* id */
-							feature.id = feature_reader.get_uint64();
-							feature.has_id = true;
-							break;
-
-						case 2: /* tag */
-						{
-							auto pi = feature_reader.get_packed_uint32();
-							for (auto it = pi.first; it != pi.second; ++it) {
-								feature.tags.push_back(*it);
-							}
-							break;
-						}
-
-						case 3: /* feature type */
-							feature.type = feature_reader.get_enum();
-							break;
-
-						case 4: /* geometry */
-						{
-							auto pi = feature_reader.get_packed_uint32();
-							for (auto it = pi.first; it != pi.second; ++it) {
-								geoms.push_back(*it);
-							}
-							break;
-						}
-
-						default:
-							feature_reader.skip();
-							break;
-						}
+					auto pi = feature_reader.get_packed_uint32();
+					for (auto it = pi.first; it != pi.second; ++it) {
+						feature.tags.push_back(*it);
 					}
+					break;
+				}
+
+				case 3: /* feature type */
+					feature.type = feature_reader.get_enum();
+					break;
 
-					long long px = 0, py = 0;
-					for (size_t g = 0; g < geoms.size(); g++) {
-						uint32_t geom = geoms[g];
-						uint32_t op = geom & 7;
-						uint32_t count = geom >> 3;
-
-						if (op == mvt_moveto || op == mvt_lineto) {
-							for (size_t k = 0; k < count && g + 2 < geoms.size(); k++) {
-								px += protozero::decode_zigzag32(geoms[g + 1]);
-								py += protozero::decode_zigzag32(geoms[g + 2]);
-								g += 2;
-
-								feature.geometry.push_back(mvt_geometry(op, px, py));
-							}
-						} else {
-							feature.geometry.push_back(mvt_geometry(op, 0, 0));
-						}
+				case 4: /* geometry */
+				{
+					if (!geometry) {
+						feature_reader.skip();
+						break;
 					}
 
-					layer.features.push_back(feature);
+					auto pi = feature_reader.get_packed_uint32();
+					for (auto it = pi.first; it != pi.second; ++it) {
+						geoms.push_back(*it);
+					}
 					break;
 				}
 
 				default:
-					layer_reader.skip();
+					feature_reader.skip();
 					break;
 				}
 			}
 
-			for (size_t i = 0; i < layer.keys.size(); i++) {
-				layer.key_map.insert(std::pair<std::string, size_t>(layer.keys[i], i));
+			long long px = 0, py = 0;
+			for (size_t g = 0; g < geoms.size(); g++) {
+				uint32_t geom = geoms[g];
+				uint32_t op = geom & 7;
+				uint32_t count = geom >> 3;
+
+				if (op == mvt_moveto || op == mvt_lineto) {
+					for (size_t k = 0; k < count && g + 2 < geoms.size(); k++) {
+						px += protozero::decode_zigzag32(geoms[g + 1]);
+						py += protozero::decode_zigzag32(geoms[g + 2]);
+						g += 2;
+
+						feature.geometry.push_back(mvt_geometry(op, px, py));
+					}
+				} else {
+					feature.geometry.push_back(mvt_geometry(op, 0, 0));
+				}
 			}
-			for (size_t i = 0; i < layer.values.size(); i++) {
-				layer.value_map.insert(std::pair<mvt_value, size_t>(layer.values[i], i));
+
+			layer.features.push_back(feature);
+			break;
+		}
+
+		default:
+			layer_reader.skip();
+			break;
+		}
+	}
+
+	return true;
+}
+
+// Count the features of each geometry type without decoding their
+// attributes or geometry
+void mvt_layer_view::count_types(int &points, int &lines, int &polygons) const {
+	protozero::pbf_reader layer_reader(data, len);
+
+	while (layer_reader.next()) {
+		if (layer_reader.tag() != 2) { /* feature */
+			layer_reader.skip();
+			continue;
+		}
+
+		protozero::pbf_reader feature_reader(layer_reader.get_message());
+		int type = 0;
+
+		while (feature_reader.next()) {
+			if (feature_reader.tag() == 3) { /* feature type */
+				type = feature_reader.get_enum();
+			} else {
+				feature_reader.skip();
 			}
+		}
 
-			layers.push_back(layer);
+		if (type == mvt_point) {
+			points++;
+		} else if (type == mvt_linestring) {
+			lines++;
+		} else if (type == mvt_polygon) {
+			polygons++;
+		}
+	}
+}
+
+// The layer's encoding, copied field by field but with a new name
+std::string mvt_layer_view::encode(std::string const &newname) const {
+	std::string out;
+	protozero::pbf_writer writer(out);
+	protozero::pbf_reader reader(data, len);
+
+	writer.add_string(1, newname); /* name */
+
+	while (reader.next()) {
+		if (reader.tag() == 1) { /* name */
+			reader.skip();
+			continue;
+		}
+
+		switch (reader.wire_type()) {
+		case protozero::pbf_wire_type::varint:
+			writer.add_uint64(reader.tag(), reader.get_uint64());
+			break;
+
+		case protozero::pbf_wire_type::fixed64:
+			writer.add_fixed64(reader.tag(), reader.get_fixed64());
+			break;
+
+		case protozero::pbf_wire_type::length_delimited: {
+			std::pair<const char *, protozero::pbf_length_type> field = reader.get_data();
+			writer.add_bytes(reader.tag(), field.first, field.second);
 			break;
 		}
 
+		case protozero::pbf_wire_type::fixed32:
+			writer.add_fixed32(reader.tag(), reader.get_fixed32());
+			break;
+
 		default:
 			reader.skip();
 			break;
 		}
 	}
 
+	return out;
+}
+
+bool mvt_tile::decode(std::string &message, bool &was_compressed) {
+	mvt_tile_view view;
+
+	if (!view.decode(message, was_compressed)) {
+		return false;
+	}
+
+	layers.clear();
+	layers.resize(view.layers.size());
+
+	for (size_t i = 0; i < view.layers.size(); i++) {
+		if (!view.layers[i].decode(layers[i])) {
+			return false;
+		}
+	}
+
 	return true;
 }
 
@@ -273,6 +400,11 @@ std::string mvt_tile::encode() {
 	protozero::pbf_writer writer(data);
 
 	for (size_t i = 0; i < layers.size(); i++) {
+		if (layers[i].encoded.size() != 0) {
+			writer.add_message(3, layers[i].encoded);
+			continue;
+		}
+
 		std::string layer_string;
 		protozero::pbf_writer layer_writer(layer_string);
 
@@ -450,6 +582,17 @@ std::string mvt_value::toString() {
 void mvt_layer::tag(mvt_feature &feature, std::string key, mvt_value value) {
 	size_t ko, vo;
 
+	if (key_map.size() == 0) {
+		for (size_t i = 0; i < keys.size(); i++) {
+			key_map.insert(std::pair<std::string, size_t>(keys[i], i));
+		}
+	}
+	if (value_map.size() == 0) {
+		for (size_t i = 0; i < values.size(); i++) {
+			value_map.insert(std::pair<mvt_value, size_t>(values[i], i));
+		}
+	}
+
 	std::map<std::string, size_t>::iterator ki = key_map.find(key);
 	std::map<mvt_value, size_t>::iterator vi = value_map.find(value);
 
@@ -96,14 +96,51 @@ struct mvt_layer {
 	std::vector<mvt_value> values{};
 	long long extent = 0;
 
+	// If not empty, the layer's complete encoding, which mvt_tile::encode()
+	// copies into the tile instead of encoding the layer's features
+	std::string encoded = "";
+
 	// Add a key-value pair to a feature, using this layer's constant pool
 	void tag(mvt_feature &feature, std::string key, mvt_value value);
 
-	// For tracking the key-value constants already used in this layer
+	// For tracking the key-value constants already used in this layer.
+	// Decoding doesn't fill these in; tag() builds them if it needs them.
 	std::map<std::string, size_t> key_map{};
 	std::map<mvt_value, size_t> value_map{};
 };
 
+// A layer within an encoded tile. Only its name, version, and extent
+// are decoded up front; its features are decoded on request from the
+// layer's bytes, which remain in the buffer of the tile view.
+struct mvt_layer_view {
+	int version = 0;
+	std::string name = "";
+	long long extent = 0;
+
+	const char *data = NULL;
+	size_t len = 0;
+
+	bool decode(mvt_layer &layer, bool geometry = true) const;
+	void count_types(int &points, int &lines, int &polygons) const;
+	std::string encode(std::string const &newname) const;
+};
+
+struct mvt_tile_view {
+	std::vector<mvt_layer_view> layers{};
+
+	// If the tile was compressed, the layer views point into this
+	// decompressed copy. Otherwise they point into the original message,
+	// which must outlive the view.
+	std::string uncompressed = "";
+
+	mvt_tile_view() {
+	}
+	mvt_tile_view(mvt_tile_view const &) = delete;
+	mvt_tile_view &operator=(mvt_tile_view const &) = delete;
+
+	bool decode(std::string const &message, bool &was_compressed);
+};
+
 struct mvt_tile {
 	std::vector<mvt_layer> layers{};
 
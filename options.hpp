@@ -19,6 +19,11 @@
 #define A_GRID_LOW_ZOOMS ((int) 'L')
 #define A_DETECT_WRAPAROUND ((int) 'w')
 #define A_EXTEND_ZOOMS ((int) 'e')
+#define A_ESTIMATE_TILE_SIZES ((int) 'E')
+#define A_DEDUPLICATE_TILES ((int) 'u')
+#define A_COMPRESS_TEMPORARY_FILES ((int) 'C')
+#define A_SINGLE_PASS_AS_NEEDED ((int) 'P')
+#define A_PERSISTENT_FILTERS ((int) 'F')
 
 #define P_SIMPLIFY ((int) 's')
 #define P_SIMPLIFY_LOW ((int) 'S')
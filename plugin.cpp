@@ -32,9 +32,11 @@ extern "C" {
 #include "plugin.hpp"
 #include "write_json.hpp"
 #include "read_json.hpp"
+#include "timer.hpp"
 
 struct writer_arg {
 	int write_to;
+	FILE *persistent;
 	std::vector<mvt_layer> *layers;
 	unsigned z;
 	unsigned x;
@@ -45,6 +47,15 @@ struct writer_arg {
 void *run_writer(void *a) {
 	writer_arg *wa = (writer_arg *) a;
 
+	if (wa->persistent != NULL) {
+		begin_filter_tile(wa->persistent, wa->z, wa->x, wa->y);
+		for (size_t i = 0; i < wa->layers->size(); i++) {
+			layer_to_geojson(wa->persistent, (*(wa->layers))[i], wa->z, wa->x, wa->y, false, true, false, 0, 0, 0, true);
+		}
+		end_filter_tile(wa->persistent);
+		return NULL;
+	}
+
 	FILE *fp = fdopen(wa->write_to, "w");
 	if (fp == NULL) {
 		perror("fdopen (pipe writer)");
@@ -82,16 +93,19 @@ static std::vector<mvt_geometry> to_feature(drawvec &geom) {
 	return out;
 }
 
-// Reads from the postfilter
-std::vector<mvt_layer> parse_layers(int fd, int z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, int extent) {
-	std::map<std::string, mvt_layer> ret;
-
-	FILE *f = fdopen(fd, "r");
-	if (f == NULL) {
-		perror("fdopen filter output");
-		exit(EXIT_FAILURE);
+// Whether a filter's output is the marker at the end of a tile
+static bool is_tile_end(json_object *j) {
+	if (j->parent != NULL || j->type != JSON_HASH) {
+		return false;
 	}
-	json_pull *jp = json_begin_file(f);
+
+	json_object *type = json_hash_get(j, "type");
+	return type != NULL && type->type == JSON_STRING && strcmp(type->string, "TileEnd") == 0;
+}
+
+// Reads from the postfilter, until the end of its output or of the tile
+static std::vector<mvt_layer> parse_layers(json_pull *jp, int z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, int extent) {
+	std::map<std::string, mvt_layer> ret;
 
 	while (1) {
 		json_object *j = json_read(jp);
@@ -108,6 +122,11 @@ std::vector<mvt_layer> parse_layers(int fd, int z, unsigned x, unsigned y, std::
 			break;
 		}
 
+		if (is_tile_end(j)) {
+			json_free(j);
+			break;
+		}
+
 		json_object *type = json_hash_get(j, "type");
 		if (type == NULL || type->type != JSON_STRING) {
 			continue;
@@ -276,16 +295,29 @@ std::vector<mvt_layer> parse_layers(int fd, int z, unsigned x, unsigned y, std::
 		json_free(j);
 	}
 
+	std::vector<mvt_layer> final;
+	for (auto a : ret) {
+		final.push_back(a.second);
+	}
+	return final;
+}
+
+std::vector<mvt_layer> parse_layers(int fd, int z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, int extent) {
+	FILE *f = fdopen(fd, "r");
+	if (f == NULL) {
+		perror("fdopen filter output");
+		exit(EXIT_FAILURE);
+	}
+	json_pull *jp = json_begin_file(f);
+
+	std::vector<mvt_layer> final = parse_layers(jp, z, x, y, layermaps, tiling_seg, layer_unmaps, extent);
+
 	json_end(jp);
 	if (fclose(f) != 0) {
 		perror("fclose postfilter output");
 		exit(EXIT_FAILURE);
 	}
 
-	std::vector<mvt_layer> final;
-	for (auto a : ret) {
-		final.push_back(a.second);
-	}
 	return final;
 }
 
@@ -309,6 +341,12 @@ serial_feature parse_feature(json_pull *jp, int z, unsigned x, unsigned y, std::
 			return sf;
 		}
 
+		if (is_tile_end(j)) {
+			json_free(j);
+			sf.t = -1;
+			return sf;
+		}
+
 		json_object *type = json_hash_get(j, "type");
 		if (type == NULL || type->type != JSON_STRING) {
 			continue;
@@ -512,7 +550,8 @@ serial_feature parse_feature(json_pull *jp, int z, unsigned x, unsigned y, std::
 
 static pthread_mutex_t pipe_lock = PTHREAD_MUTEX_INITIALIZER;
 
-void setup_filter(const char *filter, int *write_to, int *read_from, pid_t *pid, unsigned z, unsigned x, unsigned y) {
+// The arguments, if any, are passed to the filter as $1, $2, ...
+static void start_filter(const char *filter, int *write_to, int *read_from, pid_t *pid, std::vector<std::string> const &filter_args) {
 	// This will create two pipes, a new thread, and a new process.
 	//
 	// The new process will read from one pipe and write to the other, and execute the filter.
@@ -534,9 +573,11 @@ void setup_filter(const char *filter, int *write_to, int *read_from, pid_t *pid,
 		exit(EXIT_FAILURE);
 	}
 
-	std::string z_str = std::to_string(z);
-	std::string x_str = std::to_string(x);
-	std::string y_str = std::to_string(y);
+	std::vector<const char *> argv = {"sh", "-c", filter, "sh"};
+	for (size_t i = 0; i < filter_args.size(); i++) {
+		argv.push_back(filter_args[i].c_str());
+	}
+	argv.push_back(NULL);
 
 	*pid = fork();
 	if (*pid < 0) {
@@ -572,7 +613,7 @@ void setup_filter(const char *filter, int *write_to, int *read_from, pid_t *pid,
 
 		// XXX close other fds?
 
-		if (execlp("sh", "sh", "-c", filter, "sh", z_str.c_str(), x_str.c_str(), y_str.c_str(), NULL) != 0) {
+		if (execvp("sh", (char *const *) argv.data()) != 0) {
 			perror("exec");
 			exit(EXIT_FAILURE);
 		}
@@ -606,13 +647,149 @@ void setup_filter(const char *filter, int *write_to, int *read_from, pid_t *pid,
 	}
 }
 
-std::vector<mvt_layer> filter_layers(const char *filter, std::vector<mvt_layer> &layers, unsigned z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, int extent) {
+void setup_filter(const char *filter, int *write_to, int *read_from, pid_t *pid, unsigned z, unsigned x, unsigned y) {
+	start_filter(filter, write_to, read_from, pid, {std::to_string(z), std::to_string(x), std::to_string(y)});
+}
+
+// Reads from a persistent filter, where the end of the output
+// can only mean that the filter failed
+static ssize_t read_filter(json_pull *j, char *buffer, size_t n) {
+	while (1) {
+		ssize_t nread = read(*((int *) j->source), buffer, n);
+		if (nread < 0 && errno == EINTR) {
+			continue;
+		}
+		if (nread < 0) {
+			perror("read from filter");
+			exit(EXIT_FAILURE);
+		}
+		if (nread == 0) {
+			fprintf(stderr, "Filter exited before the end of the tile\n");
+			exit(EXIT_FAILURE);
+		}
+		return nread;
+	}
+}
+
+void start_filter_process(const char *filter, filter_process *fp) {
 	int write_to, read_from;
-	pid_t pid;
-	setup_filter(filter, &write_to, &read_from, &pid, z, x, y);
+	start_filter(filter, &write_to, &read_from, &fp->pid, {});
+
+	fp->to = fdopen(write_to, "w");
+	if (fp->to == NULL) {
+		perror("fdopen persistent filter");
+		exit(EXIT_FAILURE);
+	}
+	fp->from = read_from;
+	fp->jp = json_begin(read_filter, &fp->from);
+}
+
+void finish_filter_process(filter_process *fp) {
+	if (fp->pid == 0) {
+		return;
+	}
+
+	if (fclose(fp->to) != 0) {
+		perror("fclose persistent filter");
+		exit(EXIT_FAILURE);
+	}
+	json_end(fp->jp);
+	if (close(fp->from) != 0) {
+		perror("close persistent filter");
+		exit(EXIT_FAILURE);
+	}
+
+	while (1) {
+		int stat_loc;
+		if (waitpid(fp->pid, &stat_loc, 0) < 0) {
+			perror("waitpid for filter\n");
+			exit(EXIT_FAILURE);
+		}
+		if (WIFEXITED(stat_loc) || WIFSIGNALED(stat_loc)) {
+			break;
+		}
+	}
+
+	fp->pid = 0;
+}
+
+void begin_filter_tile(FILE *fp, unsigned z, unsigned x, unsigned y) {
+	fprintf(fp, "{\"type\":\"TileStart\",\"zoom\":%u,\"x\":%u,\"y\":%u}\n", z, x, y);
+}
+
+void end_filter_tile(FILE *fp) {
+	fprintf(fp, "{\"type\":\"TileEnd\"}\n");
+	if (fflush(fp) != 0) {
+		perror("write to persistent filter");
+		exit(EXIT_FAILURE);
+	}
+}
+
+struct filter_stats {
+	size_t tiles = 0;
+	size_t processes = 0;
+	double elapsed = 0;
+	double longest = 0;
+};
+
+static filter_stats prefilter_stats, postfilter_stats;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void record_filter_tile(bool postfilter, double elapsed, bool started) {
+	if (pthread_mutex_lock(&stats_lock) != 0) {
+		perror("pthread_mutex_lock (filter stats)");
+		exit(EXIT_FAILURE);
+	}
+
+	filter_stats &fs = postfilter ? postfilter_stats : prefilter_stats;
+	fs.tiles++;
+	fs.elapsed += elapsed;
+	if (elapsed > fs.longest) {
+		fs.longest = elapsed;
+	}
+	if (started) {
+		fs.processes++;
+	}
+
+	if (pthread_mutex_unlock(&stats_lock) != 0) {
+		perror("pthread_mutex_unlock (filter stats)");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void report_filter(const char *name, filter_stats const &fs) {
+	if (fs.tiles > 0) {
+		fprintf(stderr, "%s: %zu tiles through %zu processes, %.1f tiles per second, %.3f ms per tile, %.3f ms the longest\n", name, fs.tiles, fs.processes, fs.elapsed > 0 ? fs.tiles / fs.elapsed : 0, fs.elapsed * 1000 / fs.tiles, fs.longest * 1000);
+	}
+}
+
+void report_filter_stats() {
+	report_filter("Prefilter", prefilter_stats);
+	report_filter("Postfilter", postfilter_stats);
+}
+
+std::vector<mvt_layer> filter_layers(const char *filter, filter_process *persistent, std::vector<mvt_layer> &layers, unsigned z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, int extent) {
+	double start = timer_now();
+	bool started = false;
+	int write_to = -1, read_from = -1;
+	pid_t pid = 0;
+
+	if (persistent != NULL) {
+		if (persistent->pid == 0) {
+			start_filter_process(filter, persistent);
+			started = true;
+		}
+	} else {
+		setup_filter(filter, &write_to, &read_from, &pid, z, x, y);
+		started = true;
+	}
 
 	writer_arg wa;
 	wa.write_to = write_to;
+	wa.persistent = NULL;
+	if (persistent != NULL) {
+		wa.persistent = persistent->to;
+	}
 	wa.layers = &layers;
 	wa.z = z;
 	wa.x = x;
@@ -625,16 +802,21 @@ std::vector<mvt_layer> filter_layers(const char *filter, std::vector<mvt_layer>
 		exit(EXIT_FAILURE);
 	}
 
-	std::vector<mvt_layer> nlayers = parse_layers(read_from, z, x, y, layermaps, tiling_seg, layer_unmaps, extent);
+	std::vector<mvt_layer> nlayers;
+	if (persistent != NULL) {
+		nlayers = parse_layers(persistent->jp, z, x, y, layermaps, tiling_seg, layer_unmaps, extent);
+	} else {
+		nlayers = parse_layers(read_from, z, x, y, layermaps, tiling_seg, layer_unmaps, extent);
 
-	while (1) {
-		int stat_loc;
-		if (waitpid(pid, &stat_loc, 0) < 0) {
-			perror("waitpid for filter\n");
-			exit(EXIT_FAILURE);
-		}
-		if (WIFEXITED(stat_loc) || WIFSIGNALED(stat_loc)) {
-			break;
+		while (1) {
+			int stat_loc;
+			if (waitpid(pid, &stat_loc, 0) < 0) {
+				perror("waitpid for filter\n");
+				exit(EXIT_FAILURE);
+			}
+			if (WIFEXITED(stat_loc) || WIFSIGNALED(stat_loc)) {
+				break;
+			}
 		}
 	}
 
@@ -644,5 +826,6 @@ std::vector<mvt_layer> filter_layers(const char *filter, std::vector<mvt_layer>
 		exit(EXIT_FAILURE);
 	}
 
+	record_filter_tile(true, timer_now() - start, started);
 	return nlayers;
 }
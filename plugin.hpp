@@ -1,3 +1,21 @@
-std::vector<mvt_layer> filter_layers(const char *filter, std::vector<mvt_layer> &layer, unsigned z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, int extent);
+// A filter that is started once and then given one tile after another,
+// each between a TileStart and a TileEnd marker, which it must pass back
+// after its output for the tile.
+struct filter_process {
+	pid_t pid = 0;
+	FILE *to = NULL;
+	int from = -1;
+	json_pull *jp = NULL;
+};
+
+std::vector<mvt_layer> filter_layers(const char *filter, filter_process *persistent, std::vector<mvt_layer> &layer, unsigned z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, int extent);
 void setup_filter(const char *filter, int *write_to, int *read_from, pid_t *pid, unsigned z, unsigned x, unsigned y);
 serial_feature parse_feature(json_pull *jp, int z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, bool filters);
+
+void start_filter_process(const char *filter, filter_process *fp);
+void finish_filter_process(filter_process *fp);
+void begin_filter_tile(FILE *fp, unsigned z, unsigned x, unsigned y);
+void end_filter_tile(FILE *fp);
+
+void record_filter_tile(bool postfilter, double elapsed, bool started);
+void report_filter_stats();
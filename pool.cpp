@@ -1,84 +1,120 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <limits.h>
-#include <math.h>
 #include "memfile.hpp"
 #include "pool.hpp"
 
-int swizzlecmp(const char *a, const char *b) {
-	ssize_t alen = strlen(a);
-	ssize_t blen = strlen(b);
+#define INITIAL_SLOTS 1024
 
-	if (strcmp(a, b) == 0) {
-		return 0;
-	}
+static unsigned long long poolhash(const char *s, size_t len, char type) {
+	// 64-bit FNV-1a
+	unsigned long long h = 14695981039346656037ULL;
 
-	long long hash1 = 0, hash2 = 0;
-	for (ssize_t i = alen - 1; i >= 0; i--) {
-		hash1 = (hash1 * 37 + a[i]) & INT_MAX;
-	}
-	for (ssize_t i = blen - 1; i >= 0; i--) {
-		hash2 = (hash2 * 37 + b[i]) & INT_MAX;
-	}
+	h ^= (unsigned char) type;
+	h *= 1099511628211ULL;
 
-	int h1 = hash1, h2 = hash2;
-	if (h1 == h2) {
-		return strcmp(a, b);
+	for (size_t i = 0; i < len; i++) {
+		h ^= (unsigned char) s[i];
+		h *= 1099511628211ULL;
 	}
 
-	return h1 - h2;
+	return h;
 }
 
-long long addpool(struct memfile *poolfile, struct memfile *treefile, const char *s, char type) {
-	unsigned long *sp = &treefile->tree;
-	size_t depth = 0;
+static struct pool_header *header(struct memfile *treefile) {
+	return (struct pool_header *) treefile->map;
+}
 
-	// In typical data, traversal depth generally stays under 2.5x
-	size_t max = 3 * log(treefile->off / sizeof(struct stringpool)) / log(2);
-	if (max < 30) {
-		max = 30;
-	}
+static struct stringpool *slots(struct memfile *treefile) {
+	return (struct stringpool *) (treefile->map + sizeof(struct pool_header));
+}
 
-	while (*sp != 0) {
-		int cmp = swizzlecmp(s, poolfile->map + ((struct stringpool *) (treefile->map + *sp))->off + 1);
+static void write_empty_slots(struct memfile *treefile, unsigned long long n) {
+	struct stringpool empty[256];
 
-		if (cmp == 0) {
-			cmp = type - (poolfile->map + ((struct stringpool *) (treefile->map + *sp))->off)[0];
+	while (n > 0) {
+		unsigned long long here = n;
+		if (here > sizeof(empty) / sizeof(empty[0])) {
+			here = sizeof(empty) / sizeof(empty[0]);
 		}
 
-		if (cmp < 0) {
-			sp = &(((struct stringpool *) (treefile->map + *sp))->left);
-		} else if (cmp > 0) {
-			sp = &(((struct stringpool *) (treefile->map + *sp))->right);
-		} else {
-			return ((struct stringpool *) (treefile->map + *sp))->off;
+		if (memfile_write(treefile, empty, here * sizeof(struct stringpool)) < 0) {
+			perror("memfile write");
+			exit(EXIT_FAILURE);
 		}
 
-		depth++;
-		if (depth > max) {
-			// Search is very deep, so string is probably unique.
-			// Add it to the pool without adding it to the search tree.
+		n -= here;
+	}
+}
 
-			long long off = poolfile->off;
-			if (memfile_write(poolfile, &type, 1) < 0) {
-				perror("memfile write");
-				exit(EXIT_FAILURE);
-			}
-			if (memfile_write(poolfile, (void *) s, strlen(s) + 1) < 0) {
-				perror("memfile write");
-				exit(EXIT_FAILURE);
+static void init_table(struct memfile *treefile) {
+	struct pool_header ph;
+	ph.count = 0;
+	ph.size = INITIAL_SLOTS;
+
+	if (memfile_write(treefile, &ph, sizeof(struct pool_header)) < 0) {
+		perror("memfile write");
+		exit(EXIT_FAILURE);
+	}
+
+	write_empty_slots(treefile, INITIAL_SLOTS);
+}
+
+// Doubles the size of the table. The new table is built after the
+// end of the old one and then moved down to replace it, so the table
+// never needs more than the memory-mapped file to hold it.
+static void grow_table(struct memfile *treefile) {
+	unsigned long long oldsize = header(treefile)->size;
+	unsigned long long newsize = oldsize * 2;
+
+	long long newstart = treefile->off;
+	write_empty_slots(treefile, newsize);
+
+	// The map may have moved while the file grew
+	struct stringpool *oldslots = slots(treefile);
+	struct stringpool *newslots = (struct stringpool *) (treefile->map + newstart);
+
+	for (unsigned long long i = 0; i < oldsize; i++) {
+		if (oldslots[i].off != 0) {
+			unsigned long long j = oldslots[i].hash & (newsize - 1);
+			while (newslots[j].off != 0) {
+				j = (j + 1) & (newsize - 1);
 			}
-			return off;
+			newslots[j] = oldslots[i];
 		}
 	}
 
-	// *sp is probably in the memory-mapped file, and will move if the file grows.
-	long long ssp;
-	if (sp == &treefile->tree) {
-		ssp = -1;
-	} else {
-		ssp = ((char *) sp) - treefile->map;
+	memmove(oldslots, newslots, newsize * sizeof(struct stringpool));
+	header(treefile)->size = newsize;
+	treefile->off = sizeof(struct pool_header) + newsize * sizeof(struct stringpool);
+}
+
+/**
+ * Returns the offset of the string s, with the specified type, in the
+ * pool, adding it to the pool if it isn't already there.
+ */
+long long addpool(struct memfile *poolfile, struct memfile *treefile, const char *s, char type) {
+	if (treefile->off == 0) {
+		init_table(treefile);
+	}
+
+	size_t len = strlen(s);
+	unsigned long long hash = poolhash(s, len, type);
+
+	unsigned long long size = header(treefile)->size;
+	struct stringpool *sp = slots(treefile);
+	unsigned long long i = hash & (size - 1);
+
+	while (sp[i].off != 0) {
+		if (sp[i].hash == hash) {
+			const char *there = poolfile->map + sp[i].off - 1;
+
+			if (there[0] == type && strcmp(there + 1, s) == 0) {
+				return sp[i].off - 1;
+			}
+		}
+
+		i = (i + 1) & (size - 1);
 	}
 
 	long long off = poolfile->off;
@@ -86,36 +122,19 @@ long long addpool(struct memfile *poolfile, struct memfile *treefile, const char
 		perror("memfile write");
 		exit(EXIT_FAILURE);
 	}
-	if (memfile_write(poolfile, (void *) s, strlen(s) + 1) < 0) {
+	if (memfile_write(poolfile, (void *) s, len + 1) < 0) {
 		perror("memfile write");
 		exit(EXIT_FAILURE);
 	}
 
-	if (off >= LONG_MAX || treefile->off >= LONG_MAX) {
-		// Tree or pool is bigger than 2GB
-		static bool warned = false;
-		if (!warned) {
-			fprintf(stderr, "Warning: string pool is very large.\n");
-			warned = true;
-		}
-		return off;
-	}
-
-	struct stringpool tsp;
-	tsp.left = 0;
-	tsp.right = 0;
-	tsp.off = off;
+	sp[i].hash = hash;
+	sp[i].off = off + 1;
+	header(treefile)->count++;
 
-	long long p = treefile->off;
-	if (memfile_write(treefile, &tsp, sizeof(struct stringpool)) < 0) {
-		perror("memfile write");
-		exit(EXIT_FAILURE);
+	// Keep the table no more than 70% full so probe sequences stay short
+	if (header(treefile)->count * 10 > size * 7) {
+		grow_table(treefile);
 	}
 
-	if (ssp == -1) {
-		treefile->tree = p;
-	} else {
-		*((long long *) (treefile->map + ssp)) = p;
-	}
 	return off;
 }
@@ -1,10 +1,17 @@
 #ifndef POOL_HPP
 #define POOL_HPP
 
+// The string pool index is an open-addressing hash table,
+// a pool_header followed by header.size stringpool slots.
+
+struct pool_header {
+	unsigned long long count = 0;
+	unsigned long long size = 0;
+};
+
 struct stringpool {
-	unsigned long left = 0;
-	unsigned long right = 0;
-	unsigned long off = 0;
+	unsigned long long hash = 0;
+	unsigned long long off = 0;  // offset in the pool + 1, or 0 if the slot is empty
 };
 
 long long addpool(struct memfile *poolfile, struct memfile *treefile, const char *s, char type);
@@ -41,7 +41,108 @@ void json_context(json_object *j) {
 	free(s);  // stringify
 }
 
+// Where parse_packed_geometry() is within a JSON_PACKED array
+struct packed_cursor {
+	size_t shape = 0;
+	size_t number = 0;
+};
+
+// Move past the element at the cursor, and anything it contains
+static void skip_packed(json_object *j, packed_cursor &pc) {
+	int depth = 0;
+
+	do {
+		char c = j->string[pc.shape++];
+		if (c == '[') {
+			depth++;
+		} else if (c == ']') {
+			depth--;
+		} else if (c == 'n') {
+			pc.number++;
+		}
+	} while (depth > 0);
+}
+
+// The same as parse_geometry(), but for coordinates that the parser
+// has packed into an array of numbers
+static void parse_packed_geometry(int t, json_object *j, packed_cursor &pc, drawvec &out, int op, const char *fname, int line, json_object *feature) {
+	if (j->string[pc.shape] != '[') {
+		fprintf(stderr, "%s:%d: expected array for type %d\n", fname, line, t);
+		json_context(feature);
+		skip_packed(j, pc);
+		return;
+	}
+	pc.shape++;
+
+	int within = geometry_within[t];
+	if (within >= 0) {
+		for (size_t i = 0; j->string[pc.shape] != ']'; i++) {
+			if (within == GEOM_POINT) {
+				if (i == 0 || mb_geometry[t] == GEOM_MULTIPOINT) {
+					op = VT_MOVETO;
+				} else {
+					op = VT_LINETO;
+				}
+			}
+
+			parse_packed_geometry(within, j, pc, out, op, fname, line, feature);
+		}
+		pc.shape++;
+	} else {
+		size_t length = 0;
+		bool numeric = true;
+		double lon = 0, lat = 0;
+
+		for (; j->string[pc.shape] != ']'; length++) {
+			if (length < 2) {
+				if (j->string[pc.shape] == 'n') {
+					if (length == 0) {
+						lon = j->numbers[pc.number];
+					} else {
+						lat = j->numbers[pc.number];
+					}
+				} else {
+					numeric = false;
+				}
+			}
+
+			skip_packed(j, pc);
+		}
+		pc.shape++;
+
+		if (length >= 2 && numeric) {
+			long long x, y;
+			projection->project(lon, lat, 32, &x, &y);
+
+			if (length > 2) {
+				static int warned = 0;
+
+				if (!warned) {
+					fprintf(stderr, "%s:%d: ignoring dimensions beyond two\n", fname, line);
+					json_context(feature);
+					warned = 1;
+				}
+			}
+
+			out.push_back(draw(op, x, y));
+		} else {
+			fprintf(stderr, "%s:%d: malformed point\n", fname, line);
+			json_context(feature);
+		}
+	}
+
+	if (t == GEOM_POLYGON) {
+		out.push_back(draw(VT_CLOSEPATH, 0, 0));
+	}
+}
+
 void parse_geometry(int t, json_object *j, drawvec &out, int op, const char *fname, int line, json_object *feature) {
+	if (j != NULL && j->type == JSON_PACKED) {
+		packed_cursor pc;
+		parse_packed_geometry(t, j, pc, out, op, fname, line, feature);
+		return;
+	}
+
 	if (j == NULL || j->type != JSON_ARRAY) {
 		fprintf(stderr, "%s:%d: expected array for type %d\n", fname, line, t);
 		json_context(feature);
@@ -116,8 +217,7 @@ void canonicalize(json_object *o) {
 		} else {
 			s = milo::dtoa_milo(o->number);
 		}
-		free(o->string);
-		o->string = strdup(s.c_str());
+		json_set_string(o, s.c_str());
 	} else if (o->type == JSON_HASH) {
 		for (size_t i = 0; i < o->length; i++) {
 			canonicalize(o->values[i]);
@@ -0,0 +1,346 @@
+#include <stdint.h>
+#include <string.h>
+#include "scan.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+// Bitmasks of the interesting characters in a 64-byte block,
+// one bit per byte, with the first byte in the low bit.
+struct block_masks {
+	uint64_t quote;
+	uint64_t backslash;
+	uint64_t open;
+	uint64_t close;
+	uint64_t newline;
+};
+
+static void masks_scalar(const unsigned char *p, block_masks &m) {
+	m.quote = m.backslash = m.open = m.close = m.newline = 0;
+
+	for (size_t i = 0; i < 64; i++) {
+		uint64_t bit = 1ULL << i;
+
+		switch (p[i]) {
+		case '"':
+			m.quote |= bit;
+			break;
+
+		case '\\':
+			m.backslash |= bit;
+			break;
+
+		case '{':
+		case '[':
+			m.open |= bit;
+			break;
+
+		case '}':
+		case ']':
+			m.close |= bit;
+			break;
+
+		case '\n':
+			m.newline |= bit;
+			break;
+		}
+	}
+}
+
+// [ and { differ only in the 0x20 bit, as do ] and }, so each pair
+// can be found with one comparison after setting that bit.
+
+#ifdef __SSE2__
+static inline uint64_t movemask_sse2(__m128i a, __m128i b, __m128i c, __m128i d) {
+	return ((uint64_t) (unsigned) _mm_movemask_epi8(a)) |
+	       ((uint64_t) (unsigned) _mm_movemask_epi8(b) << 16) |
+	       ((uint64_t) (unsigned) _mm_movemask_epi8(c) << 32) |
+	       ((uint64_t) (unsigned) _mm_movemask_epi8(d) << 48);
+}
+
+static inline uint64_t eq_sse2(__m128i const v[4], char c) {
+	__m128i k = _mm_set1_epi8(c);
+	return movemask_sse2(_mm_cmpeq_epi8(v[0], k), _mm_cmpeq_epi8(v[1], k), _mm_cmpeq_epi8(v[2], k), _mm_cmpeq_epi8(v[3], k));
+}
+
+static void masks_sse2(const unsigned char *p, block_masks &m) {
+	__m128i v[4], lower[4];
+	__m128i bit = _mm_set1_epi8(0x20);
+
+	for (size_t i = 0; i < 4; i++) {
+		v[i] = _mm_loadu_si128((const __m128i *) (p + 16 * i));
+		lower[i] = _mm_or_si128(v[i], bit);
+	}
+
+	m.quote = eq_sse2(v, '"');
+	m.backslash = eq_sse2(v, '\\');
+	m.newline = eq_sse2(v, '\n');
+	m.open = eq_sse2(lower, '{');
+	m.close = eq_sse2(lower, '}');
+}
+#endif
+
+#ifdef SCAN_X86
+__attribute__((target("avx2"))) static inline uint64_t eq_avx2(__m256i lo, __m256i hi, char c) {
+	__m256i k = _mm256_set1_epi8(c);
+	return ((uint64_t) (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, k))) |
+	       ((uint64_t) (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, k)) << 32);
+}
+
+__attribute__((target("avx2"))) static void masks_avx2(const unsigned char *p, block_masks &m) {
+	__m256i lo = _mm256_loadu_si256((const __m256i *) p);
+	__m256i hi = _mm256_loadu_si256((const __m256i *) (p + 32));
+	__m256i bit = _mm256_set1_epi8(0x20);
+
+	m.quote = eq_avx2(lo, hi, '"');
+	m.backslash = eq_avx2(lo, hi, '\\');
+	m.newline = eq_avx2(lo, hi, '\n');
+	m.open = eq_avx2(_mm256_or_si256(lo, bit), _mm256_or_si256(hi, bit), '{');
+	m.close = eq_avx2(_mm256_or_si256(lo, bit), _mm256_or_si256(hi, bit), '}');
+}
+#endif
+
+bool scan_available(scan_kind kind) {
+	switch (kind) {
+	case SCAN_SCALAR:
+		return true;
+
+	case SCAN_SSE2:
+#ifdef __SSE2__
+		return true;
+#else
+		return false;
+#endif
+
+	case SCAN_AVX2:
+#ifdef SCAN_X86
+		return __builtin_cpu_supports("avx2");
+#else
+		return false;
+#endif
+	}
+
+	return false;
+}
+
+scan_kind scan_best() {
+	if (scan_available(SCAN_AVX2)) {
+		return SCAN_AVX2;
+	}
+	if (scan_available(SCAN_SSE2)) {
+		return SCAN_SSE2;
+	}
+	return SCAN_SCALAR;
+}
+
+// Which characters are escaped by a backslash: those that follow an
+// odd-length run of backslashes. A run that begins on an odd bit ends
+// up spanning an even bit once it is added to its own start, and the
+// carry out of the top says whether the next block begins escaped.
+static inline uint64_t find_escaped(uint64_t backslash, uint64_t &prev_escaped) {
+	if (backslash == 0) {
+		uint64_t escaped = prev_escaped;
+		prev_escaped = 0;
+		return escaped;
+	}
+
+	backslash &= ~prev_escaped;
+	uint64_t follows_escape = (backslash << 1) | prev_escaped;
+
+	const uint64_t even_bits = 0x5555555555555555ULL;
+	uint64_t odd_starts = backslash & ~even_bits & ~follows_escape;
+	uint64_t sequences_starting_on_even_bits = odd_starts + backslash;
+	prev_escaped = sequences_starting_on_even_bits < odd_starts;
+
+	uint64_t invert_mask = sequences_starting_on_even_bits << 1;
+	return (even_bits ^ invert_mask) & follows_escape;
+}
+
+// Each bit becomes the parity of the quotes up to and including it,
+// so it is set for the opening quote and the contents of each string
+static inline uint64_t prefix_xor(uint64_t x) {
+	x ^= x << 1;
+	x ^= x << 2;
+	x ^= x << 4;
+	x ^= x << 8;
+	x ^= x << 16;
+	x ^= x << 32;
+	return x;
+}
+
+static inline bool is_space(unsigned char c) {
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// Whether the [ at pos, at the top level of the root object, is the
+// value for the "features" key
+static bool is_features_key(const unsigned char *map, size_t first, size_t pos) {
+	static const char key[] = "\"features\"";
+	size_t keylen = sizeof(key) - 1;
+
+	size_t p = pos;
+	while (p > first && is_space(map[p - 1])) {
+		p--;
+	}
+	if (p <= first || map[p - 1] != ':') {
+		return false;
+	}
+	p--;
+	while (p > first && is_space(map[p - 1])) {
+		p--;
+	}
+	if (p < first + 1 + keylen || memcmp(map + p - keylen, key, keylen) != 0) {
+		return false;
+	}
+	p -= keylen;
+	while (p > first && is_space(map[p - 1])) {
+		p--;
+	}
+
+	return map[p - 1] == '{' || map[p - 1] == ',';
+}
+
+static inline int popcount(uint64_t x) {
+	return __builtin_popcountll(x);
+}
+
+template <void (*masks)(const unsigned char *, block_masks &)>
+static bool split(const unsigned char *map, size_t len, size_t segments, feature_collection_split &out) {
+	size_t first = 0;
+	while (first < len && is_space(map[first])) {
+		first++;
+	}
+	if (first >= len || map[first] != '{') {
+		return false;
+	}
+
+	size_t last = len;
+	while (last > first + 1 && is_space(map[last - 1])) {
+		last--;
+	}
+	if (map[last - 1] != '}') {
+		return false;
+	}
+
+	out.cuts.clear();
+	out.lines.clear();
+
+	bool found = false;
+	bool in_features = false;
+	long long depth = 0;
+	long long line = 1;
+	long long end_line = 1;
+	size_t segment = 1;
+	size_t target = len / segments;
+
+	uint64_t prev_escaped = 0;
+	uint64_t prev_in_string = 0;
+	unsigned char pad[64];
+
+	for (size_t base = 0; base < len; base += 64) {
+		block_masks m;
+
+		if (len - base >= 64) {
+			masks(map + base, m);
+		} else {
+			memset(pad, ' ', sizeof(pad));
+			memcpy(pad, map + base, len - base);
+			masks(pad, m);
+		}
+
+		uint64_t escaped = find_escaped(m.backslash, prev_escaped);
+		uint64_t in_string = prefix_xor(m.quote & ~escaped) ^ prev_in_string;
+		prev_in_string = (uint64_t) ((int64_t) in_string >> 63);
+
+		uint64_t structural = (m.open | m.close) & ~in_string;
+
+		while (structural != 0) {
+			int i = __builtin_ctzll(structural);
+			structural &= structural - 1;
+			size_t pos = base + i;
+
+			if ((m.open >> i) & 1) {
+				if (depth == 0 && pos != first) {
+					// A second top-level value
+					return false;
+				}
+
+				if (depth == 1 && map[pos] == '[' && is_features_key(map, first, pos)) {
+					if (found) {
+						return false;
+					}
+
+					found = true;
+					in_features = true;
+					out.features_start = pos + 1;
+					out.start_line = line + popcount(m.newline & ((1ULL << i) - 1));
+				}
+
+				depth++;
+			} else {
+				depth--;
+
+				if (depth < 0) {
+					return false;
+				}
+
+				if (in_features && depth == 2 && segment < segments && pos + 1 >= target) {
+					out.cuts.push_back(pos + 1);
+					out.lines.push_back(line + popcount(m.newline & ((2ULL << i) - 1)));
+
+					while (segment < segments && target <= pos + 1) {
+						segment++;
+						target = len * segment / segments;
+					}
+				} else if (in_features && depth == 1) {
+					in_features = false;
+					out.features_end = pos;
+					end_line = line + popcount(m.newline & ((1ULL << i) - 1));
+				}
+			}
+		}
+
+		line += popcount(m.newline);
+	}
+
+	if (!found || in_features || depth != 0 || prev_in_string != 0) {
+		return false;
+	}
+
+	while (out.cuts.size() + 1 < segments) {
+		out.cuts.push_back(out.features_end);
+		out.lines.push_back(end_line);
+	}
+
+	return true;
+}
+
+bool split_feature_collection(const char *map, size_t len, size_t segments, feature_collection_split &out, scan_kind kind) {
+	const unsigned char *m = (const unsigned char *) map;
+
+	if (segments < 1) {
+		segments = 1;
+	}
+
+	switch (kind) {
+#ifdef SCAN_X86
+	case SCAN_AVX2:
+		if (scan_available(SCAN_AVX2)) {
+			return split<masks_avx2>(m, len, segments, out);
+		}
+		break;
+#endif
+
+#ifdef __SSE2__
+	case SCAN_SSE2:
+		return split<masks_sse2>(m, len, segments, out);
+#endif
+
+	default:
+		break;
+	}
+
+	return split<masks_scalar>(m, len, segments, out);
+}
@@ -0,0 +1,43 @@
+#ifndef SCAN_HPP
+#define SCAN_HPP
+
+#include <stddef.h>
+#include <vector>
+
+// Finds where a GeoJSON FeatureCollection can be cut into pieces that
+// can each be parsed on their own: after the closing brace of a member
+// of the top-level "features" array.
+//
+// The scan looks at 64 bytes at a time, building bitmasks of the quotes,
+// backslashes, brackets, and newlines in each block with whatever vector
+// instructions the CPU has, and then works out which quotes are escaped
+// and which brackets are inside strings from the masks rather than
+// from the individual bytes.
+
+enum scan_kind {
+	SCAN_SCALAR,
+	SCAN_SSE2,
+	SCAN_AVX2,
+};
+
+struct feature_collection_split {
+	size_t features_start = 0;  // just after the [ of the features array
+	size_t features_end = 0;    // the ] of the features array
+	long long start_line = 1;   // the line number of features_start
+
+	// Offsets where pieces of the features array begin, each just after
+	// the end of a feature, and the line number of each of those offsets.
+	// The first piece begins at features_start, and the last one ends
+	// at features_end.
+	std::vector<size_t> cuts{};
+	std::vector<long long> lines{};
+};
+
+scan_kind scan_best();
+bool scan_available(scan_kind kind);
+
+// Returns false if the text is not a single JSON object with a "features"
+// array, in which case it can't be split and must be parsed as a whole.
+bool split_feature_collection(const char *map, size_t len, size_t segments, feature_collection_split &out, scan_kind kind);
+
+#endif
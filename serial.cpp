@@ -9,6 +9,7 @@
 #include <map>
 #include <algorithm>
 #include <limits.h>
+#include <zlib.h>
 #include "protozero/varint.hpp"
 #include "geometry.hpp"
 #include "mbtiles.hpp"
@@ -85,21 +86,20 @@ void deserialize_long_long(char **f, long long *n) {
 }
 
 void deserialize_ulong_long(char **f, unsigned long long *zigzag) {
-	*zigzag = 0;
+	const unsigned char *p = (const unsigned char *) *f;
+	unsigned long long n = 0;
 	int shift = 0;
 
-	while (1) {
-		if ((**f & 0x80) == 0) {
-			*zigzag |= ((unsigned long long) **f) << shift;
-			*f += 1;
-			shift += 7;
-			break;
-		} else {
-			*zigzag |= ((unsigned long long) (**f & 0x7F)) << shift;
-			*f += 1;
-			shift += 7;
-		}
+	while (*p & 0x80) {
+		n |= ((unsigned long long) (*p & 0x7F)) << shift;
+		shift += 7;
+		p++;
 	}
+	n |= ((unsigned long long) *p) << shift;
+	p++;
+
+	*zigzag = n;
+	*f = (char *) p;
 }
 
 void deserialize_uint(char **f, unsigned *n) {
@@ -112,78 +112,80 @@ void deserialize_byte(char **f, signed char *n) {
 	*f += sizeof(signed char);
 }
 
-int deserialize_long_long_io(FILE *f, long long *n, long long *geompos) {
-	unsigned long long zigzag = 0;
-	int ret = deserialize_ulong_long_io(f, &zigzag, geompos);
-	*n = protozero::decode_zigzag64(zigzag);
-	return ret;
-}
+// Size of the buffer that a feature is serialized into before it is
+// written. Most features fit, so they take only one stdio call to write.
+#define SERIAL_BUFFER 16384
 
-int deserialize_ulong_long_io(FILE *f, unsigned long long *zigzag, long long *geompos) {
-	*zigzag = 0;
-	int shift = 0;
+struct serial_buffer {
+	FILE *out = NULL;
+	long long *fpos = NULL;
+	const char *fname = NULL;
+	std::string *str = NULL;  // to append to instead of writing to out
 
-	while (1) {
-		int c = getc(f);
-		if (c == EOF) {
-			return 0;
-		}
-		(*geompos)++;
+	size_t len = 0;
+	char buf[SERIAL_BUFFER];
 
-		if ((c & 0x80) == 0) {
-			*zigzag |= ((unsigned long long) c) << shift;
-			shift += 7;
-			break;
-		} else {
-			*zigzag |= ((unsigned long long) (c & 0x7F)) << shift;
-			shift += 7;
-		}
+	serial_buffer(FILE *out_, long long *fpos_, const char *fname_)
+	    : out(out_), fpos(fpos_), fname(fname_) {
 	}
 
-	return 1;
-}
+	serial_buffer(std::string *str_)
+	    : str(str_) {
+	}
 
-int deserialize_int_io(FILE *f, int *n, long long *geompos) {
-	long long ll = 0;
-	int ret = deserialize_long_long_io(f, &ll, geompos);
-	*n = ll;
-	return ret;
-}
+	void flush() {
+		if (len > 0) {
+			if (str != NULL) {
+				str->append(buf, len);
+			} else {
+				fwrite_check(buf, sizeof(char), len, out, fname);
+				*fpos += len;
+			}
+			len = 0;
+		}
+	}
 
-int deserialize_uint_io(FILE *f, unsigned *n, long long *geompos) {
-	if (fread(n, sizeof(unsigned), 1, f) != 1) {
-		return 0;
+	void byte(signed char n) {
+		if (len + 1 > SERIAL_BUFFER) {
+			flush();
+		}
+		buf[len++] = n;
 	}
-	*geompos += sizeof(unsigned);
-	return 1;
-}
 
-int deserialize_byte_io(FILE *f, signed char *n, long long *geompos) {
-	int c = getc(f);
-	if (c == EOF) {
-		return 0;
+	void ulong_long(unsigned long long n) {
+		if (len + protozero::max_varint_length > SERIAL_BUFFER) {
+			flush();
+		}
+		while (n >= 0x80) {
+			buf[len++] = (n & 0x7F) | 0x80;
+			n >>= 7;
+		}
+		buf[len++] = n;
 	}
-	*n = c;
-	(*geompos)++;
-	return 1;
-}
 
-static void write_geometry(drawvec const &dv, long long *fpos, FILE *out, const char *fname, long long wx, long long wy) {
+	void long_long(long long n) {
+		ulong_long(protozero::encode_zigzag64(n));
+	}
+};
+
+static void write_geometry(drawvec const &dv, serial_buffer &sb, long long wx, long long wy) {
 	for (size_t i = 0; i < dv.size(); i++) {
 		if (dv[i].op == VT_MOVETO || dv[i].op == VT_LINETO) {
-			serialize_byte(out, dv[i].op, fpos, fname);
-			serialize_long_long(out, dv[i].x - wx, fpos, fname);
-			serialize_long_long(out, dv[i].y - wy, fpos, fname);
+			sb.byte(dv[i].op);
+			sb.long_long(dv[i].x - wx);
+			sb.long_long(dv[i].y - wy);
 			wx = dv[i].x;
 			wy = dv[i].y;
 		} else {
-			serialize_byte(out, dv[i].op, fpos, fname);
+			sb.byte(dv[i].op);
 		}
 	}
 }
 
-void serialize_feature(FILE *geomfile, serial_feature *sf, long long *geompos, const char *fname, long long wx, long long wy, bool include_minzoom) {
-	serialize_byte(geomfile, sf->t, geompos, fname);
+// The geometry goes into gb, which is the same as sb
+// unless the feature is going into a geom_block
+static void serialize_feature(serial_buffer &sb, serial_buffer &gb, serial_feature *sf, long long wx, long long wy, bool include_minzoom) {
+	sb.byte(sf->t);
 
 	long long layer = 0;
 	layer |= sf->layer << 6;
@@ -194,34 +196,34 @@ void serialize_feature(FILE *geomfile, serial_feature *sf, long long *geompos, c
 	layer |= sf->has_tippecanoe_minzoom << 1;
 	layer |= sf->has_tippecanoe_maxzoom << 0;
 
-	serialize_long_long(geomfile, layer, geompos, fname);
+	sb.long_long(layer);
 	if (sf->seq != 0) {
-		serialize_long_long(geomfile, sf->seq, geompos, fname);
+		sb.long_long(sf->seq);
 	}
 	if (sf->has_tippecanoe_minzoom) {
-		serialize_int(geomfile, sf->tippecanoe_minzoom, geompos, fname);
+		sb.long_long(sf->tippecanoe_minzoom);
 	}
 	if (sf->has_tippecanoe_maxzoom) {
-		serialize_int(geomfile, sf->tippecanoe_maxzoom, geompos, fname);
+		sb.long_long(sf->tippecanoe_maxzoom);
 	}
 	if (sf->has_id) {
-		serialize_ulong_long(geomfile, sf->id, geompos, fname);
+		sb.ulong_long(sf->id);
 	}
 
-	serialize_int(geomfile, sf->segment, geompos, fname);
+	sb.long_long(sf->segment);
 
-	write_geometry(sf->geometry, geompos, geomfile, fname, wx, wy);
-	serialize_byte(geomfile, VT_END, geompos, fname);
+	write_geometry(sf->geometry, gb, wx, wy);
+	gb.byte(VT_END);
 	if (sf->index != 0) {
-		serialize_ulong_long(geomfile, sf->index, geompos, fname);
+		sb.ulong_long(sf->index);
 	}
 	if (sf->extent != 0) {
-		serialize_long_long(geomfile, sf->extent, geompos, fname);
+		sb.long_long(sf->extent);
 	}
 
-	serialize_int(geomfile, sf->m, geompos, fname);
+	sb.long_long(sf->m);
 	if (sf->m != 0) {
-		serialize_long_long(geomfile, sf->metapos, geompos, fname);
+		sb.long_long(sf->metapos);
 	}
 
 	if (sf->metapos < 0 && sf->m != sf->keys.size()) {
@@ -230,28 +232,114 @@ void serialize_feature(FILE *geomfile, serial_feature *sf, long long *geompos, c
 	}
 
 	for (size_t i = 0; i < sf->keys.size(); i++) {
-		serialize_long_long(geomfile, sf->keys[i], geompos, fname);
-		serialize_long_long(geomfile, sf->values[i], geompos, fname);
+		sb.long_long(sf->keys[i]);
+		sb.long_long(sf->values[i]);
 	}
 
 	if (include_minzoom) {
-		serialize_byte(geomfile, sf->feature_minzoom, geompos, fname);
+		sb.byte(sf->feature_minzoom);
 	}
+
+	sb.flush();
+	if (&gb != &sb) {
+		gb.flush();
+	}
+}
+
+void serialize_feature(FILE *geomfile, serial_feature *sf, long long *geompos, const char *fname, long long wx, long long wy, bool include_minzoom) {
+	serial_buffer sb(geomfile, geompos, fname);
+	serialize_feature(sb, sb, sf, wx, wy, include_minzoom);
+}
+
+void serialize_feature(geom_block &out, serial_feature *sf, long long wx, long long wy, bool include_minzoom) {
+	serial_buffer sb(&out.headers);
+	serial_buffer gb(&out.coords);
+	serialize_feature(sb, gb, sf, wx, wy, include_minzoom);
+}
+
+/**
+ * Compresses the serialized features in block, headers and then
+ * geometries, and writes them to out, preceded by their uncompressed
+ * length, the length of the headers, and the compressed length.
+ */
+void write_geom_block(FILE *out, geom_block &block, long long *fpos, const char *fname) {
+	size_t headers_len = block.headers.size();
+	block.headers.append(block.coords);
+
+	uLongf len = compressBound(block.headers.size());
+	std::string compressed;
+	compressed.resize(len);
+
+	if (compress2((Bytef *) &compressed[0], &len, (const Bytef *) block.headers.data(), block.headers.size(), Z_BEST_SPEED) != Z_OK) {
+		fprintf(stderr, "%s: Compression of temporary geometry failed\n", fname);
+		exit(EXIT_FAILURE);
+	}
+
+	serialize_ulong_long(out, block.headers.size(), fpos, fname);
+	serialize_ulong_long(out, headers_len, fpos, fname);
+	serialize_ulong_long(out, len, fpos, fname);
+	fwrite_check(compressed.data(), sizeof(char), len, out, fname);
+	*fpos += len;
+
+	block.headers.clear();
+	block.coords.clear();
+}
+
+static void read_geom_block(geom_reader &r) {
+	char *f = r.base + r.pos;
+	unsigned long long rawlen, headers_len, len;
+	deserialize_ulong_long(&f, &rawlen);
+	deserialize_ulong_long(&f, &headers_len);
+	deserialize_ulong_long(&f, &len);
+
+	if (f + len > r.base + r.len || headers_len > rawlen) {
+		fprintf(stderr, "Internal error: Unexpected end of file in geometry\n");
+		exit(EXIT_FAILURE);
+	}
+
+	r.block.resize(rawlen);
+	uLongf destlen = rawlen;
+	if (uncompress((Bytef *) &r.block[0], &destlen, (const Bytef *) f, len) != Z_OK || destlen != rawlen) {
+		fprintf(stderr, "Internal error: Corrupt block of temporary geometry\n");
+		exit(EXIT_FAILURE);
+	}
+
+	r.pos = f + len - r.base;
+	r.blockpos = 0;
+	r.headers_len = headers_len;
+	r.coordpos = headers_len;
 }
 
-serial_feature deserialize_feature(FILE *geoms, long long *geompos_in, char *metabase, long long *meta_off, unsigned z, unsigned tx, unsigned ty, unsigned *initial_x, unsigned *initial_y) {
+serial_feature deserialize_feature(geom_reader &r, char *metabase, long long *meta_off, unsigned z, unsigned tx, unsigned ty, unsigned *initial_x, unsigned *initial_y) {
 	serial_feature sf;
 
-	deserialize_byte_io(geoms, &sf.t, geompos_in);
+	char *geoms = r.base;
+	long long *geompos_in = &r.pos;
+	char *end = r.base + r.len;
+	if (r.compressed) {
+		if (r.blockpos >= r.headers_len) {
+			read_geom_block(r);
+		}
+
+		geoms = &r.block[0];
+		geompos_in = &r.blockpos;
+		end = geoms + r.block.size();
+	}
+
+	char *f = geoms + *geompos_in;
+	char *g = geoms + r.coordpos;  // where the geometry is, if it is not inline
+
+	deserialize_byte(&f, &sf.t);
 	if (sf.t < 0) {
+		*geompos_in = f - geoms;
 		return sf;
 	}
 
-	deserialize_long_long_io(geoms, &sf.layer, geompos_in);
+	deserialize_long_long(&f, &sf.layer);
 
 	sf.seq = 0;
 	if (sf.layer & (1 << 5)) {
-		deserialize_long_long_io(geoms, &sf.seq, geompos_in);
+		deserialize_long_long(&f, &sf.seq);
 	}
 
 	sf.tippecanoe_minzoom = -1;
@@ -259,27 +347,32 @@ serial_feature deserialize_feature(FILE *geoms, long long *geompos_in, char *met
 	sf.id = 0;
 	sf.has_id = false;
 	if (sf.layer & (1 << 1)) {
-		deserialize_int_io(geoms, &sf.tippecanoe_minzoom, geompos_in);
+		deserialize_int(&f, &sf.tippecanoe_minzoom);
 	}
 	if (sf.layer & (1 << 0)) {
-		deserialize_int_io(geoms, &sf.tippecanoe_maxzoom, geompos_in);
+		deserialize_int(&f, &sf.tippecanoe_maxzoom);
 	}
 	if (sf.layer & (1 << 2)) {
 		sf.has_id = true;
-		deserialize_ulong_long_io(geoms, &sf.id, geompos_in);
+		deserialize_ulong_long(&f, &sf.id);
 	}
 
-	deserialize_int_io(geoms, &sf.segment, geompos_in);
+	deserialize_int(&f, &sf.segment);
 
 	sf.index = 0;
 	sf.extent = 0;
 
-	sf.geometry = decode_geometry(geoms, geompos_in, z, tx, ty, sf.bbox, initial_x[sf.segment], initial_y[sf.segment]);
+	if (r.compressed) {
+		sf.geometry = decode_geometry(&g, end, z, tx, ty, sf.bbox, initial_x[sf.segment], initial_y[sf.segment]);
+		r.coordpos = g - geoms;
+	} else {
+		sf.geometry = decode_geometry(&f, end, z, tx, ty, sf.bbox, initial_x[sf.segment], initial_y[sf.segment]);
+	}
 	if (sf.layer & (1 << 4)) {
-		deserialize_ulong_long_io(geoms, &sf.index, geompos_in);
+		deserialize_ulong_long(&f, &sf.index);
 	}
 	if (sf.layer & (1 << 3)) {
-		deserialize_long_long_io(geoms, &sf.extent, geompos_in);
+		deserialize_long_long(&f, &sf.extent);
 	}
 
 	sf.layer >>= 6;
@@ -287,11 +380,11 @@ serial_feature deserialize_feature(FILE *geoms, long long *geompos_in, char *met
 	sf.metapos = 0;
 	{
 		int m;
-		deserialize_int_io(geoms, &m, geompos_in);
+		deserialize_int(&f, &m);
 		sf.m = m;
 	}
 	if (sf.m != 0) {
-		deserialize_long_long_io(geoms, &sf.metapos, geompos_in);
+		deserialize_long_long(&f, &sf.metapos);
 	}
 
 	if (sf.metapos >= 0) {
@@ -307,15 +400,16 @@ serial_feature deserialize_feature(FILE *geoms, long long *geompos_in, char *met
 	} else {
 		for (size_t i = 0; i < sf.m; i++) {
 			long long k, v;
-			deserialize_long_long_io(geoms, &k, geompos_in);
-			deserialize_long_long_io(geoms, &v, geompos_in);
+			deserialize_long_long(&f, &k);
+			deserialize_long_long(&f, &v);
 			sf.keys.push_back(k);
 			sf.values.push_back(v);
 		}
 	}
 
-	deserialize_byte_io(geoms, &sf.feature_minzoom, geompos_in);
+	deserialize_byte(&f, &sf.feature_minzoom);
 
+	*geompos_in = f - geoms;
 	return sf;
 }
 
@@ -533,38 +627,44 @@ int serialize_feature(struct serialization_state *sst, serial_feature &sf) {
 		coerce_value(sf.full_keys[i], sf.full_values[i].type, sf.full_values[i].s, sst->attribute_types);
 	}
 
-	if (sst->filter != NULL) {
-		std::map<std::string, mvt_value> attributes;
+	if (sst->filter != NULL && filter_uses_layer(sst->filter, sf.layername)) {
+		// Only the attributes that the filter refers to are converted,
+		// into the slots that the compiled filter expects them in.
+		std::vector<mvt_value> values(sst->filter->keys.size());
+		std::vector<const mvt_value *> slots(sst->filter->keys.size(), NULL);
 
 		for (size_t i = 0; i < sf.full_keys.size(); i++) {
-			std::string key = sf.full_keys[i];
-			mvt_value val = stringified_to_mvt_value(sf.full_values[i].type, sf.full_values[i].s.c_str());
+			ssize_t slot = filter_slot(sst->filter, sf.full_keys[i]);
 
-			attributes.insert(std::pair<std::string, mvt_value>(key, val));
+			if (slot >= 0 && slots[slot] == NULL) {
+				values[slot] = stringified_to_mvt_value(sf.full_values[i].type, sf.full_values[i].s.c_str());
+				slots[slot] = &values[slot];
+			}
 		}
 
-		if (sf.has_id) {
-			mvt_value v;
-			v.type = mvt_uint;
-			v.numeric_value.uint_value = sf.id;
-
-			attributes.insert(std::pair<std::string, mvt_value>("$id", v));
+		ssize_t slot = filter_slot(sst->filter, "$id");
+		if (sf.has_id && slot >= 0 && slots[slot] == NULL) {
+			values[slot].type = mvt_uint;
+			values[slot].numeric_value.uint_value = sf.id;
+			slots[slot] = &values[slot];
 		}
 
-		mvt_value v;
-		v.type = mvt_string;
+		slot = filter_slot(sst->filter, "$type");
+		if (slot >= 0 && slots[slot] == NULL) {
+			values[slot].type = mvt_string;
 
-		if (sf.t == mvt_point) {
-			v.string_value = "Point";
-		} else if (sf.t == mvt_linestring) {
-			v.string_value = "LineString";
-		} else if (sf.t == mvt_polygon) {
-			v.string_value = "Polygon";
-		}
+			if (sf.t == mvt_point) {
+				values[slot].string_value = "Point";
+			} else if (sf.t == mvt_linestring) {
+				values[slot].string_value = "LineString";
+			} else if (sf.t == mvt_polygon) {
+				values[slot].string_value = "Polygon";
+			}
 
-		attributes.insert(std::pair<std::string, mvt_value>("$type", v));
+			slots[slot] = &values[slot];
+		}
 
-		if (!evaluate(attributes, sf.layername, sst->filter)) {
+		if (!evaluate(sst->filter, sf.layername, slots)) {
 			return 0;
 		}
 	}
@@ -3,12 +3,15 @@
 
 #include <stddef.h>
 #include <stdio.h>
+#include <string>
 #include <vector>
 #include <sys/stat.h>
 #include "geometry.hpp"
 #include "mbtiles.hpp"
 #include "jsonpull/jsonpull.h"
 
+struct filter_program;
+
 size_t fwrite_check(const void *ptr, size_t size, size_t nitems, FILE *stream, const char *fname);
 
 void serialize_int(FILE *out, int n, long long *fpos, const char *fname);
@@ -24,12 +27,6 @@ void deserialize_ulong_long(char **f, unsigned long long *n);
 void deserialize_uint(char **f, unsigned *n);
 void deserialize_byte(char **f, signed char *n);
 
-int deserialize_int_io(FILE *f, int *n, long long *geompos);
-int deserialize_long_long_io(FILE *f, long long *n, long long *geompos);
-int deserialize_ulong_long_io(FILE *f, unsigned long long *n, long long *geompos);
-int deserialize_uint_io(FILE *f, unsigned *n, long long *geompos);
-int deserialize_byte_io(FILE *f, signed char *n, long long *geompos);
-
 struct serial_val {
 	int type = 0;
 	std::string s = "";
@@ -68,8 +65,40 @@ struct serial_feature {
 	std::string layername = "";
 };
 
+// Where the features for a tile are read from: the tile's data in the
+// mapped temporary file, and if the features are in compressed blocks,
+// the current block, uncompressed
+struct geom_reader {
+	char *base = NULL;
+	long long pos = 0;
+	long long len = 0;  // of the data at base
+
+	bool compressed = false;
+	std::string block = "";
+	long long blockpos = 0;      // of the next feature header in the block
+	long long headers_len = 0;   // the feature headers come first in the block,
+	long long coordpos = 0;      // and the geometries follow them
+};
+
+// Features collected to be compressed together. The geometries are kept
+// apart from the rest of each feature, so that the coordinate deltas are
+// next to each other and the feature headers are next to each other.
+struct geom_block {
+	std::string headers = "";
+	std::string coords = "";
+
+	size_t size() const {
+		return headers.size() + coords.size();
+	}
+};
+
+// How much uncompressed feature data to collect before compressing it
+#define GEOM_BLOCK (256 * 1024)
+
 void serialize_feature(FILE *geomfile, serial_feature *sf, long long *geompos, const char *fname, long long wx, long long wy, bool include_minzoom);
-serial_feature deserialize_feature(FILE *geoms, long long *geompos_in, char *metabase, long long *meta_off, unsigned z, unsigned tx, unsigned ty, unsigned *initial_x, unsigned *initial_y);
+void serialize_feature(geom_block &out, serial_feature *sf, long long wx, long long wy, bool include_minzoom);
+void write_geom_block(FILE *out, geom_block &block, long long *fpos, const char *fname);
+serial_feature deserialize_feature(geom_reader &r, char *metabase, long long *meta_off, unsigned z, unsigned tx, unsigned ty, unsigned *initial_x, unsigned *initial_y);
 
 struct reader {
 	int metafd = -1;
@@ -126,7 +155,9 @@ struct serialization_state {
 	std::set<std::string> *exclude = NULL;
 	std::set<std::string> *include = NULL;
 	int exclude_all = 0;
-	json_object *filter = NULL;
+	filter_program *filter = NULL;
+
+	drawvec geometry{};  // reused for the geometry of each feature as it is parsed
 };
 
 int serialize_feature(struct serialization_state *sst, serial_feature &sf);
@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "main.hpp"
+#include "sort.hpp"
+
+int indexcmp(const void *v1, const void *v2) {
+	const struct index *i1 = (const struct index *) v1;
+	const struct index *i2 = (const struct index *) v2;
+
+	if (i1->ix < i2->ix) {
+		return -1;
+	} else if (i1->ix > i2->ix) {
+		return 1;
+	}
+
+	if (i1->seq < i2->seq) {
+		return -1;
+	} else if (i1->seq > i2->seq) {
+		return 1;
+	}
+
+	return 0;
+}
+
+static bool seqlt(const struct index &a, const struct index &b) {
+	return a.seq < b.seq;
+}
+
+/**
+ * Sorts index records into the same order as qsort() with indexcmp(),
+ * by a least-significant-digit radix sort of the spatial key followed
+ * by ordering by sequence number any records whose keys are equal.
+ *
+ * The scratch space must have room for the same number of records.
+ * Digits that are the same in every record, as the high-order digits
+ * are once the input has been split by prefix, take no pass at all.
+ */
+void sort_index(struct index *base, size_t n, struct index *scratch) {
+	if (n < 2) {
+		return;
+	}
+
+	size_t counts[8][256];
+	memset(counts, 0, sizeof(counts));
+
+	for (size_t i = 0; i < n; i++) {
+		unsigned long long ix = base[i].ix;
+		for (size_t d = 0; d < 8; d++) {
+			counts[d][(ix >> (8 * d)) & 0xFF]++;
+		}
+	}
+
+	struct index *from = base;
+	struct index *to = scratch;
+
+	for (size_t d = 0; d < 8; d++) {
+		if (counts[d][(base[0].ix >> (8 * d)) & 0xFF] == n) {
+			continue;
+		}
+
+		size_t pos[256];
+		size_t sum = 0;
+		for (size_t b = 0; b < 256; b++) {
+			pos[b] = sum;
+			sum += counts[d][b];
+		}
+
+		for (size_t i = 0; i < n; i++) {
+			to[pos[(from[i].ix >> (8 * d)) & 0xFF]++] = from[i];
+		}
+
+		std::swap(from, to);
+	}
+
+	if (from != base) {
+		memcpy((void *) base, (void *) from, n * sizeof(struct index));
+	}
+
+	for (size_t i = 0; i < n;) {
+		size_t j = i + 1;
+		while (j < n && base[j].ix == base[i].ix) {
+			j++;
+		}
+
+		if (j - i > 1) {
+			std::sort(base + i, base + j, seqlt);
+		}
+
+		i = j;
+	}
+}
@@ -0,0 +1,11 @@
+#ifndef SORT_HPP
+#define SORT_HPP
+
+#include <stddef.h>
+
+struct index;
+
+int indexcmp(const void *v1, const void *v2);
+void sort_index(struct index *base, size_t n, struct index *scratch);
+
+#endif
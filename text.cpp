@@ -1,5 +1,6 @@
 #include "text.hpp"
 #include <stdio.h>
+#include <string.h>
 
 /**
  * Returns an empty string if `s` is valid utf8;
@@ -122,3 +123,39 @@ std::string truncate16(std::string const &s, size_t runes) {
 
 	return std::string(s, 0, lastgood - start);
 }
+
+// MurmurHash64A, by Austin Appleby, who placed it in the public domain
+unsigned long long murmur64(const char *data, size_t len, unsigned long long seed) {
+	const unsigned long long m = 0xc6a4a7935bd1e995ULL;
+	const int r = 47;
+
+	unsigned long long h = seed ^ (len * m);
+	size_t i = 0;
+
+	for (; i + 8 <= len; i += 8) {
+		unsigned long long k;
+		memcpy(&k, data + i, sizeof(k));
+
+		k *= m;
+		k ^= k >> r;
+		k *= m;
+
+		h ^= k;
+		h *= m;
+	}
+
+	unsigned long long rest = 0;
+	for (size_t j = len - i; j > 0; j--) {
+		rest = (rest << 8) | (unsigned char) data[i + j - 1];
+	}
+	if (len - i > 0) {
+		h ^= rest;
+		h *= m;
+	}
+
+	h ^= h >> r;
+	h *= m;
+	h ^= h >> r;
+
+	return h;
+}
@@ -6,5 +6,6 @@
 std::string check_utf8(std::string text);
 const char *utf8_next(const char *s, long *c);
 std::string truncate16(std::string const &s, size_t runes);
+unsigned long long murmur64(const char *data, size_t len, unsigned long long seed);
 
 #endif
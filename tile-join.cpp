@@ -13,6 +13,8 @@
 #include <string>
 #include <map>
 #include <set>
+#include <deque>
+#include <queue>
 #include <zlib.h>
 #include <math.h>
 #include <pthread.h>
@@ -22,6 +24,7 @@
 #include "mbtiles.hpp"
 #include "geometry.hpp"
 #include "dirtiles.hpp"
+#include "archive.hpp"
 #include "evaluator.hpp"
 #include "csv.hpp"
 #include <fstream>
@@ -34,6 +37,7 @@
 int pk = false;
 int pC = false;
 int pg = false;
+int deduplicate = false;
 size_t CPUS;
 int quiet = false;
 int maxzoom = 32;
@@ -47,34 +51,184 @@ struct stats {
 	double minlat, minlon, maxlat, maxlon;
 };
 
-void handle(std::string message, int z, unsigned x, unsigned y, std::map<std::string, layermap_entry> &layermap, std::vector<std::string> &header, std::map<std::string, std::vector<std::string>> &mapping, std::set<std::string> &exclude, std::set<std::string> &keep_layers, std::set<std::string> &remove_layers, int ifmatched, mvt_tile &outtile, json_object *filter) {
-	mvt_tile tile;
-	int features_added = 0;
-	bool was_compressed;
+// The string form of an attribute value, and its type for the metadata,
+// or -1 if the value has no type
+int stringify_value(mvt_value const &val, std::string &value) {
+	if (val.type == mvt_string) {
+		value = val.string_value;
+		return mvt_string;
+	} else if (val.type == mvt_int) {
+		aprintf(&value, "%lld", (long long) val.numeric_value.int_value);
+		return mvt_double;
+	} else if (val.type == mvt_double) {
+		aprintf(&value, "%s", milo::dtoa_milo(val.numeric_value.double_value).c_str());
+		return mvt_double;
+	} else if (val.type == mvt_float) {
+		aprintf(&value, "%s", milo::dtoa_milo(val.numeric_value.float_value).c_str());
+		return mvt_double;
+	} else if (val.type == mvt_bool) {
+		aprintf(&value, "%s", val.numeric_value.bool_value ? "true" : "false");
+		return mvt_bool;
+	} else if (val.type == mvt_sint) {
+		aprintf(&value, "%lld", (long long) val.numeric_value.sint_value);
+		return mvt_double;
+	} else if (val.type == mvt_uint) {
+		aprintf(&value, "%llu", (long long) val.numeric_value.uint_value);
+		return mvt_double;
+	} else {
+		return -1;
+	}
+}
 
-	if (!tile.decode(message, was_compressed)) {
-		fprintf(stderr, "Couldn't decompress tile %d/%u/%u\n", z, x, y);
-		exit(EXIT_FAILURE);
+std::string output_layer_name(std::string const &name, std::set<std::string> &keep_layers, std::set<std::string> &remove_layers) {
+	std::string out = name;
+
+	auto found = renames.find(name);
+	if (found != renames.end()) {
+		out = found->second;
 	}
 
-	for (size_t l = 0; l < tile.layers.size(); l++) {
-		mvt_layer &layer = tile.layers[l];
+	if (keep_layers.size() > 0 && keep_layers.count(out) == 0) {
+		return "";
+	}
+	if (remove_layers.count(out) != 0) {
+		return "";
+	}
 
-		auto found = renames.find(layer.name);
-		if (found != renames.end()) {
-			layer.name = found->second;
+	return out;
+}
+
+// Whether rebuilding the layer would leave out any of its attributes:
+// only the first of any repeated keys in a feature is kept, and
+// values of no known type are dropped
+bool rebuild_drops_attributes(mvt_layer const &layer) {
+	for (size_t f = 0; f < layer.features.size(); f++) {
+		mvt_feature const &feat = layer.features[f];
+
+		for (size_t t = 0; t + 1 < feat.tags.size(); t += 2) {
+			mvt_value_type type = layer.values[feat.tags[t + 1]].type;
+			if (type != mvt_string && type != mvt_float && type != mvt_double && type != mvt_int && type != mvt_uint && type != mvt_sint && type != mvt_bool) {
+				return true;
+			}
+
+			for (size_t t2 = 0; t2 < t; t2 += 2) {
+				if (layer.keys[feat.tags[t2]] == layer.keys[feat.tags[t]]) {
+					return true;
+				}
+			}
 		}
+	}
+
+	return false;
+}
+
+// Returns true if every layer of the tile was copied unchanged, so that
+// the original tile can be used as the output
+bool handle(mvt_tile_view &tile, std::map<std::string, size_t> const &layer_count, int z, unsigned x, unsigned y, std::map<std::string, layermap_entry> &layermap, std::vector<std::string> &header, std::map<std::string, std::vector<std::string>> &mapping, std::set<std::string> &exclude, std::set<std::string> &keep_layers, std::set<std::string> &remove_layers, int ifmatched, mvt_tile &outtile, filter_program *filter) {
+	int features_added = 0;
+	bool unchanged = true;
+
+	for (size_t l = 0; l < tile.layers.size(); l++) {
+		std::string name = output_layer_name(tile.layers[l].name, keep_layers, remove_layers);
 
-		if (keep_layers.size() > 0 && keep_layers.count(layer.name) == 0) {
+		// Layers that are left out are never decoded
+		if (name.size() == 0) {
+			unchanged = false;
 			continue;
 		}
-		if (remove_layers.count(layer.name) != 0) {
+
+		// A layer that no other input layer is merged into, and that no
+		// filter or join applies to, can be copied into the output tile as it is
+		bool passthrough = layer_count.find(name)->second == 1 &&
+				   (filter == NULL || !filter_uses_layer(filter, name)) &&
+				   (header.size() == 0 || !ifmatched);
+
+		mvt_layer layer;
+		if (!tile.layers[l].decode(layer, !passthrough)) {
+			fprintf(stderr, "Couldn't decode tile %d/%u/%u\n", z, x, y);
+			exit(EXIT_FAILURE);
+		}
+		layer.name = name;
+
+		if (passthrough) {
+			for (size_t k = 0; k < layer.keys.size(); k++) {
+				if (exclude.count(layer.keys[k]) != 0 || (header.size() > 0 && layer.keys[k] == header[0])) {
+					passthrough = false;
+					break;
+				}
+			}
+
+			// The copy has to match what rebuilding the layer would produce
+			if (passthrough && rebuild_drops_attributes(layer)) {
+				passthrough = false;
+			}
+
+			if (!passthrough) {
+				tile.layers[l].decode(layer);
+				layer.name = name;
+			}
+		}
+
+		if (passthrough) {
+			if (layer.features.size() == 0) {
+				unchanged = false;
+				continue;
+			}
+
+			auto file_keys = layermap.find(layer.name);
+			if (file_keys == layermap.end()) {
+				layermap.insert(std::pair<std::string, layermap_entry>(layer.name, layermap_entry(layermap.size())));
+				file_keys = layermap.find(layer.name);
+				file_keys->second.minzoom = z;
+				file_keys->second.maxzoom = z;
+			}
+
+			for (size_t f = 0; f < layer.features.size(); f++) {
+				mvt_feature &feat = layer.features[f];
+
+				for (size_t t = 0; t + 1 < feat.tags.size(); t += 2) {
+					type_and_string tas;
+					tas.type = stringify_value(layer.values[feat.tags[t + 1]], tas.string);
+					add_to_file_keys(file_keys->second.file_keys, layer.keys[feat.tags[t]], tas);
+				}
+
+				if (feat.type == mvt_point) {
+					file_keys->second.points++;
+				} else if (feat.type == mvt_linestring) {
+					file_keys->second.lines++;
+				} else if (feat.type == mvt_polygon) {
+					file_keys->second.polygons++;
+				}
+			}
+
+			if (z < file_keys->second.minzoom) {
+				file_keys->second.minzoom = z;
+			}
+			if (z > file_keys->second.maxzoom) {
+				file_keys->second.maxzoom = z;
+			}
+
+			mvt_layer outlayer;
+			outlayer.name = layer.name;
+			outlayer.version = layer.version;
+			outlayer.extent = layer.extent;
+			if (layer.name == tile.layers[l].name) {
+				outlayer.encoded = std::string(tile.layers[l].data, tile.layers[l].len);
+			} else {
+				outlayer.encoded = tile.layers[l].encode(layer.name);
+				unchanged = false;
+			}
+
+			features_added += layer.features.size();
+			outtile.layers.push_back(outlayer);
 			continue;
 		}
 
+		unchanged = false;
+
 		size_t ol;
 		for (ol = 0; ol < outtile.layers.size(); ol++) {
-			if (tile.layers[l].name == outtile.layers[ol].name) {
+			if (layer.name == outtile.layers[ol].name) {
 				break;
 			}
 		}
@@ -104,41 +258,59 @@ void handle(std::string message, int z, unsigned x, unsigned y, std::map<std::st
 
 		auto file_keys = layermap.find(layer.name);
 
+		// Look up the filter slot for each of the layer's keys once,
+		// rather than for each feature
+		bool filtered = filter != NULL && filter_uses_layer(filter, layer.name);
+		std::vector<ssize_t> key_slots;
+		std::vector<const mvt_value *> slots;
+		ssize_t id_slot = -1, type_slot = -1;
+		mvt_value id_value, type_value;
+
+		if (filtered) {
+			for (size_t k = 0; k < layer.keys.size(); k++) {
+				key_slots.push_back(filter_slot(filter, layer.keys[k]));
+			}
+
+			id_slot = filter_slot(filter, "$id");
+			type_slot = filter_slot(filter, "$type");
+			id_value.type = mvt_uint;
+			type_value.type = mvt_string;
+		}
+
 		for (size_t f = 0; f < layer.features.size(); f++) {
 			mvt_feature feat = layer.features[f];
 
-			if (filter != NULL) {
-				std::map<std::string, mvt_value> attributes;
+			if (filtered) {
+				slots.clear();
+				slots.resize(filter->keys.size(), NULL);
 
 				for (size_t t = 0; t + 1 < feat.tags.size(); t += 2) {
-					std::string key = layer.keys[feat.tags[t]];
-					mvt_value &val = layer.values[feat.tags[t + 1]];
+					ssize_t slot = key_slots[feat.tags[t]];
 
-					attributes.insert(std::pair<std::string, mvt_value>(key, val));
+					if (slot >= 0 && slots[slot] == NULL) {
+						slots[slot] = &layer.values[feat.tags[t + 1]];
+					}
 				}
 
-				if (feat.has_id) {
-					mvt_value v;
-					v.type = mvt_uint;
-					v.numeric_value.uint_value = feat.id;
-
-					attributes.insert(std::pair<std::string, mvt_value>("$id", v));
+				if (feat.has_id && id_slot >= 0 && slots[id_slot] == NULL) {
+					id_value.numeric_value.uint_value = feat.id;
+					slots[id_slot] = &id_value;
 				}
 
-				mvt_value v;
-				v.type = mvt_string;
-
-				if (feat.type == mvt_point) {
-					v.string_value = "Point";
-				} else if (feat.type == mvt_linestring) {
-					v.string_value = "LineString";
-				} else if (feat.type == mvt_polygon) {
-					v.string_value = "Polygon";
+				if (type_slot >= 0 && slots[type_slot] == NULL) {
+					if (feat.type == mvt_point) {
+						type_value.string_value = "Point";
+					} else if (feat.type == mvt_linestring) {
+						type_value.string_value = "LineString";
+					} else if (feat.type == mvt_polygon) {
+						type_value.string_value = "Polygon";
+					} else {
+						type_value.string_value = "";
+					}
+					slots[type_slot] = &type_value;
 				}
 
-				attributes.insert(std::pair<std::string, mvt_value>("$type", v));
-
-				if (!evaluate(attributes, layer.name, filter)) {
+				if (!evaluate(filter, layer.name, slots)) {
 					continue;
 				}
 			}
@@ -158,32 +330,7 @@ void handle(std::string message, int z, unsigned x, unsigned y, std::map<std::st
 				const char *key = layer.keys[feat.tags[t]].c_str();
 				mvt_value &val = layer.values[feat.tags[t + 1]];
 				std::string value;
-				int type = -1;
-
-				if (val.type == mvt_string) {
-					value = val.string_value;
-					type = mvt_string;
-				} else if (val.type == mvt_int) {
-					aprintf(&value, "%lld", (long long) val.numeric_value.int_value);
-					type = mvt_double;
-				} else if (val.type == mvt_double) {
-					aprintf(&value, "%s", milo::dtoa_milo(val.numeric_value.double_value).c_str());
-					type = mvt_double;
-				} else if (val.type == mvt_float) {
-					aprintf(&value, "%s", milo::dtoa_milo(val.numeric_value.float_value).c_str());
-					type = mvt_double;
-				} else if (val.type == mvt_bool) {
-					aprintf(&value, "%s", val.numeric_value.bool_value ? "true" : "false");
-					type = mvt_bool;
-				} else if (val.type == mvt_sint) {
-					aprintf(&value, "%lld", (long long) val.numeric_value.sint_value);
-					type = mvt_double;
-				} else if (val.type == mvt_uint) {
-					aprintf(&value, "%llu", (long long) val.numeric_value.uint_value);
-					type = mvt_double;
-				} else {
-					continue;
-				}
+				int type = stringify_value(val, value);
 
 				if (type < 0) {
 					continue;
@@ -301,8 +448,10 @@ void handle(std::string message, int z, unsigned x, unsigned y, std::map<std::st
 	}
 
 	if (features_added == 0) {
-		return;
+		return false;
 	}
+
+	return unchanged;
 }
 
 double min(double a, double b) {
@@ -335,7 +484,10 @@ struct reader {
 
 	sqlite3 *db = NULL;
 	sqlite3_stmt *stmt = NULL;
-	struct reader *next = NULL;
+
+	archive_reader *archive = NULL;
+	std::vector<archive_tile> archive_tiles{};
+	size_t archive_next = 0;
 
 	bool operator<(const struct reader &r) const {
 		if (zoom < r.zoom) {
@@ -505,10 +657,30 @@ struct reader *read_dir(struct reader *readers, const char *name, int level, int
 	return readers;
 }
 
+// Read the archive reader's next tile, or mark it as finished with zoom 32
+static void advance_archive(reader *r) {
+	if (r->archive_next < r->archive_tiles.size()) {
+		archive_tile const &t = r->archive_tiles[r->archive_next++];
+
+		r->zoom = t.z;
+		r->x = t.x;
+		r->y = t.y;
+		r->sorty = (1LL << r->zoom) - 1 - r->y;
+		r->data = std::string(r->archive->data + t.offset, t.len);
+	} else {
+		r->zoom = 32;
+	}
+}
+
 struct reader *begin_reading(char *fname) {
 	DIR *dir;
 	struct reader *r = new reader;
-	if ((dir = opendir(fname)) != NULL) {
+	archive_reader *archive = archive_open_read(fname);
+	if (archive != NULL) {
+		r->archive = archive;
+		r->archive_tiles = archive_tiles(archive);
+		advance_archive(r);
+	} else if ((dir = opendir(fname)) != NULL) {
 		r = read_dir(r, fname, 0, 0);
 
 		std::vector<std::string> path_parts;
@@ -517,7 +689,6 @@ struct reader *begin_reading(char *fname) {
 
 		r->db = NULL;
 		r->stmt = NULL;
-		r->next = NULL;
 		r->pbf_count = 0;
 		r->zoom = std::stoll(path_parts[p - 3]);
 		r->x = std::stoll(path_parts[p - 2]);
@@ -544,7 +715,6 @@ struct reader *begin_reading(char *fname) {
 
 		r->db = db;
 		r->stmt = stmt;
-		r->next = NULL;
 
 		if (sqlite3_step(stmt) == SQLITE_ROW) {
 			r->zoom = sqlite3_column_int(stmt, 0);
@@ -599,9 +769,6 @@ struct zxy {
 };
 
 struct arg {
-	std::map<zxy, std::vector<std::string>> inputs{};
-	std::map<zxy, std::string> outputs{};
-
 	std::map<std::string, layermap_entry> *layermap = NULL;
 
 	std::vector<std::string> *header = NULL;
@@ -610,55 +777,365 @@ struct arg {
 	std::set<std::string> *keep_layers = NULL;
 	std::set<std::string> *remove_layers = NULL;
 	int ifmatched = 0;
-	json_object *filter = NULL;
+	filter_program *filter = NULL;
 };
 
+// A tile that is to be joined from all the input tiles at the same z/x/y
+struct join_task {
+	size_t seq = 0;
+	zxy tile = zxy(0, 0, 0);
+	std::vector<std::string> inputs{};
+};
+
+// The merge of the inputs queues tasks for the worker threads, which
+// hand their finished tiles to the writer thread to write in order.
+// Tasks that have been queued but not yet written are limited to
+// JOIN_QUEUE_TILES for each CPU.
+#define JOIN_QUEUE_TILES 100
+
+static pthread_mutex_t join_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t join_task_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t join_output_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t join_space_ready = PTHREAD_COND_INITIALIZER;
+
+static std::deque<join_task> join_tasks;
+static std::map<size_t, std::pair<zxy, std::string>> join_outputs;  // by sequence number; empty if nothing to write
+static size_t join_queued = 0;
+static size_t join_written = 0;
+static bool join_finishing = false;
+
+static void join_lock_acquire() {
+	if (pthread_mutex_lock(&join_lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void join_lock_release() {
+	if (pthread_mutex_unlock(&join_lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void join_wait(pthread_cond_t *cond) {
+	if (pthread_cond_wait(cond, &join_lock) != 0) {
+		perror("pthread_cond_wait");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void join_broadcast(pthread_cond_t *cond) {
+	if (pthread_cond_broadcast(cond) != 0) {
+		perror("pthread_cond_broadcast");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Join the input tiles for one z/x/y into the encoded output tile,
+// which is left empty if there is nothing to write
+std::string join_tile(arg *a, zxy const &tile, std::vector<std::string> &inputs) {
+	std::deque<mvt_tile_view> views;
+	std::map<std::string, size_t> layer_count;
+	bool was_compressed = false;
+
+	for (size_t i = 0; i < inputs.size(); i++) {
+		views.emplace_back();
+
+		if (!views.back().decode(inputs[i], was_compressed)) {
+			fprintf(stderr, "Couldn't decompress tile %lld/%lld/%lld\n", tile.z, tile.x, tile.y);
+			exit(EXIT_FAILURE);
+		}
+
+		for (size_t l = 0; l < views.back().layers.size(); l++) {
+			std::string name = output_layer_name(views.back().layers[l].name, *(a->keep_layers), *(a->remove_layers));
+			if (name.size() != 0) {
+				layer_count[name]++;
+			}
+		}
+	}
+
+	mvt_tile joined;
+	bool unchanged = false;
+
+	for (size_t i = 0; i < views.size(); i++) {
+		unchanged = handle(views[i], layer_count, tile.z, tile.x, tile.y, *(a->layermap), *(a->header), *(a->mapping), *(a->exclude), *(a->keep_layers), *(a->remove_layers), a->ifmatched, joined, a->filter);
+	}
+
+	bool anything = false;
+	mvt_tile outtile;
+	for (size_t i = 0; i < joined.layers.size(); i++) {
+		if (joined.layers[i].features.size() > 0 || joined.layers[i].encoded.size() > 0) {
+			outtile.layers.push_back(mvt_layer());
+			std::swap(outtile.layers.back(), joined.layers[i]);
+			anything = true;
+		}
+	}
+
+	if (!anything) {
+		return "";
+	}
+
+	std::string compressed;
+
+	if (views.size() == 1 && unchanged && was_compressed == !pC) {
+		// Nothing about the tile changed, so it doesn't need to be reencoded
+		compressed.swap(inputs[0]);
+	} else {
+		std::string pbf = outtile.encode();
+
+		if (!pC) {
+			compress(pbf, compressed);
+		} else {
+			compressed = pbf;
+		}
+	}
+
+	if (!pk && compressed.size() > 500000) {
+		fprintf(stderr, "Tile %lld/%lld/%lld size is %lld, >500000. Skipping this tile\n.", tile.z, tile.x, tile.y, (long long) compressed.size());
+		return "";
+	}
+
+	return compressed;
+}
+
 void *join_worker(void *v) {
 	arg *a = (arg *) v;
 
-	for (auto ai = a->inputs.begin(); ai != a->inputs.end(); ++ai) {
-		mvt_tile tile;
+	while (true) {
+		join_lock_acquire();
 
-		for (size_t i = 0; i < ai->second.size(); i++) {
-			handle(ai->second[i], ai->first.z, ai->first.x, ai->first.y, *(a->layermap), *(a->header), *(a->mapping), *(a->exclude), *(a->keep_layers), *(a->remove_layers), a->ifmatched, tile, a->filter);
+		while (join_tasks.size() == 0 && !join_finishing) {
+			join_wait(&join_task_ready);
 		}
 
-		ai->second.clear();
+		if (join_tasks.size() == 0) {
+			join_lock_release();
+			break;
+		}
+
+		join_task t;
+		t.seq = join_tasks.front().seq;
+		t.tile = join_tasks.front().tile;
+		t.inputs.swap(join_tasks.front().inputs);
+		join_tasks.pop_front();
+
+		join_lock_release();
+
+		std::string out = join_tile(a, t.tile, t.inputs);
+
+		join_lock_acquire();
+		join_outputs.insert(std::pair<size_t, std::pair<zxy, std::string>>(t.seq, std::pair<zxy, std::string>(t.tile, std::string())));
+		join_outputs.find(t.seq)->second.second.swap(out);
+		join_broadcast(&join_output_ready);
+		join_lock_release();
+	}
+
+	return NULL;
+}
+
+struct join_writer_arg {
+	archive_writer *outarchive;
+	sqlite3 *outdb;
+	const char *outdir;
+};
+
+void *join_writer(void *v) {
+	join_writer_arg *a = (join_writer_arg *) v;
+
+	dir_writer dw;
+	mbtiles_writer mw;
+	if (a->outdb != NULL) {
+		mbtiles_writer_open(&mw, a->outdb);
+	} else if (a->outdir != NULL) {
+		dir_writer_open(&dw, a->outdir);
+	}
 
-		bool anything = false;
-		mvt_tile outtile;
-		for (size_t i = 0; i < tile.layers.size(); i++) {
-			if (tile.layers[i].features.size() > 0) {
-				outtile.layers.push_back(tile.layers[i]);
-				anything = true;
+	while (true) {
+		join_lock_acquire();
+
+		while (join_outputs.count(join_written) == 0 && !(join_finishing && join_written == join_queued)) {
+			join_wait(&join_output_ready);
+		}
+
+		if (join_outputs.count(join_written) == 0) {
+			join_lock_release();
+			break;
+		}
+
+		auto o = join_outputs.find(join_written);
+		zxy tile = o->second.first;
+		std::string data;
+		data.swap(o->second.second);
+		join_outputs.erase(o);
+		join_written++;
+
+		join_broadcast(&join_space_ready);
+		join_lock_release();
+
+		if (data.size() != 0) {
+			if (a->outdb != NULL) {
+				mbtiles_write_tile(&mw, tile.z, tile.x, tile.y, data.data(), data.size());
+			} else if (a->outdir != NULL) {
+				dir_writer_write(&dw, tile.z, tile.x, tile.y, data);
+			} else if (a->outarchive != NULL) {
+				archive_write_tile(a->outarchive, tile.z, tile.x, tile.y, data.data(), data.size());
 			}
 		}
+	}
 
-		if (anything) {
-			std::string pbf = outtile.encode();
-			std::string compressed;
+	if (a->outdb != NULL) {
+		mbtiles_writer_close(&mw);
+	} else if (a->outdir != NULL) {
+		dir_writer_close(&dw);
+	}
 
-			if (!pC) {
-				compress(pbf, compressed);
-			} else {
-				compressed = pbf;
+	return NULL;
+}
+
+void queue_join_task(zxy const &tile, std::vector<std::string> &inputs) {
+	join_lock_acquire();
+
+	while (join_queued - join_written >= JOIN_QUEUE_TILES * CPUS) {
+		join_wait(&join_space_ready);
+	}
+
+	if (join_queued % (JOIN_QUEUE_TILES * CPUS) == 0) {
+		if (!quiet) {
+			fprintf(stderr, "%lld/%lld/%lld  \r", tile.z, tile.x, tile.y);
+		}
+	}
+
+	join_tasks.push_back(join_task());
+	join_tasks.back().seq = join_queued++;
+	join_tasks.back().tile = tile;
+	join_tasks.back().inputs.swap(inputs);
+
+	join_broadcast(&join_task_ready);
+	join_lock_release();
+}
+
+// Read the reader's next tile, or mark it as finished with zoom 32
+void advance_reader(reader *r) {
+	if (r->archive != NULL) {
+		advance_archive(r);
+	} else if (r->db != NULL) {
+		if (sqlite3_step(r->stmt) == SQLITE_ROW) {
+			r->zoom = sqlite3_column_int(r->stmt, 0);
+			r->x = sqlite3_column_int(r->stmt, 1);
+			r->sorty = sqlite3_column_int(r->stmt, 2);
+			r->y = (1LL << r->zoom) - 1 - r->sorty;
+			const char *data = (const char *) sqlite3_column_blob(r->stmt, 3);
+			size_t len = sqlite3_column_bytes(r->stmt, 3);
+
+			r->data = std::string(data, len);
+		} else {
+			r->zoom = 32;
+		}
+	} else {
+		r->pbf_count++;
+
+		if (r->pbf_count != static_cast<int>(r->pbf_path.size())) {
+			std::vector<std::string> path_parts;
+			path_parts = split_slash(r->pbf_path[r->pbf_count]);
+			int p = path_parts.size();
+			r->zoom = std::stoll(path_parts[p - 3]);
+			r->x = std::stoll(path_parts[p - 2]);
+			r->y = std::stoll(path_parts[p - 1].substr(0, path_parts[p - 1].find_last_of(".")));
+			r->sorty = (1LL << r->zoom) - 1 - r->y;
+			r->data = dir_read_tile(r->pbf_path[r->pbf_count]);
+			path_parts.clear();
+		} else {
+			r->zoom = 32;
+		}
+	}
+}
+
+// Readers in the heap, with the order they were added to it,
+// so that readers with equal tiles come out first-in, first-out
+typedef std::pair<reader *, size_t> queued_reader;
+
+struct readercmp {
+	// std::priority_queue puts the greatest element first
+	bool operator()(queued_reader const &a, queued_reader const &b) const {
+		if (*b.first < *a.first) {
+			return true;
+		}
+		if (*a.first < *b.first) {
+			return false;
+		}
+		return b.second < a.second;
+	}
+};
+
+static bool reader_less(reader *a, reader *b) {
+	return *a < *b;
+}
+
+// Combine the zoom range, center, bounds, attribution, description,
+// and name from the metadata.json of a directory or a tile archive
+static void read_json_metadata(json_pull *jp, struct stats *st, std::string &attribution, std::string &description, std::string &name) {
+	json_object *j, *k;
+	double minlat, minlon, maxlat, maxlon;
+
+	while ((j = json_read(jp)) != NULL) {
+		if (j->type == JSON_HASH) {
+			if ((k = json_hash_get(j, "minzoom")) != NULL) {
+				const std::string minzoom_tmp = k->string;
+				int minz = max(std::stoi(minzoom_tmp), minzoom);
+				st->minzoom = min(st->minzoom, minz);
 			}
 
-			if (!pk && compressed.size() > 500000) {
-				fprintf(stderr, "Tile %lld/%lld/%lld size is %lld, >500000. Skipping this tile\n.", ai->first.z, ai->first.x, ai->first.y, (long long) compressed.size());
-			} else {
-				a->outputs.insert(std::pair<zxy, std::string>(ai->first, compressed));
+			if ((k = json_hash_get(j, "maxzoom")) != NULL) {
+				const std::string maxzoom_tmp = k->string;
+				int maxz = min(std::stoi(maxzoom_tmp), maxzoom);
+				st->maxzoom = max(st->maxzoom, maxz);
+			}
+
+			if ((k = json_hash_get(j, "center")) != NULL) {
+				const std::string center = k->string;
+				const unsigned char *s = (const unsigned char *) center.c_str();
+				sscanf((char *) s, "%lf,%lf", &st->midlon, &st->midlat);
+			}
+
+			if ((k = json_hash_get(j, "attribution")) != NULL) {
+				attribution = k->string;
+			}
+
+			if ((k = json_hash_get(j, "description")) != NULL) {
+				description = k->string;
+			}
+
+			if ((k = json_hash_get(j, "name")) != NULL) {
+				const std::string name_tmp = k->string;
+				if (name.size() == 0) {
+					name = name_tmp;
+				} else {
+					name += " + " + name_tmp;
+				}
+			}
+
+			if ((k = json_hash_get(j, "bounds")) != NULL) {
+				const std::string bounds = k->string;
+				const unsigned char *s = (const unsigned char *) bounds.c_str();
+				if (sscanf((char *) s, "%lf,%lf,%lf,%lf", &minlon, &minlat, &maxlon, &maxlat) == 4) {
+					st->minlon = min(minlon, st->minlon);
+					st->maxlon = max(maxlon, st->maxlon);
+					st->minlat = min(minlat, st->minlat);
+					st->maxlat = max(maxlat, st->maxlat);
+				}
 			}
 		}
 	}
-
-	return NULL;
 }
 
-void handle_tasks(std::map<zxy, std::vector<std::string>> &tasks, std::vector<std::map<std::string, layermap_entry>> &layermaps, sqlite3 *outdb, const char *outdir, std::vector<std::string> &header, std::map<std::string, std::vector<std::string>> &mapping, std::set<std::string> &exclude, int ifmatched, std::set<std::string> &keep_layers, std::set<std::string> &remove_layers, json_object *filter) {
-	pthread_t pthreads[CPUS];
-	std::vector<arg> args;
+void decode(std::vector<reader *> &readers, std::map<std::string, layermap_entry> &layermap, sqlite3 *outdb, const char *outdir, archive_writer *outarchive, struct stats *st, std::vector<std::string> &header, std::map<std::string, std::vector<std::string>> &mapping, std::set<std::string> &exclude, int ifmatched, std::string &attribution, std::string &description, std::set<std::string> &keep_layers, std::set<std::string> &remove_layers, std::string &name, filter_program *filter) {
+	std::vector<std::map<std::string, layermap_entry>> layermaps;
+	for (size_t i = 0; i < CPUS; i++) {
+		layermaps.push_back(std::map<std::string, layermap_entry>());
+	}
 
+	std::vector<arg> args;
 	for (size_t i = 0; i < CPUS; i++) {
 		args.push_back(arg());
 
@@ -672,21 +1149,10 @@ void handle_tasks(std::map<zxy, std::vector<std::string>> &tasks, std::vector<st
 		args[i].filter = filter;
 	}
 
-	size_t count = 0;
-	// This isn't careful about distributing tasks evenly across CPUs,
-	// but, from testing, it actually takes a little longer to do
-	// the proper allocation than is saved by perfectly balanced threads.
-	for (auto ai = tasks.begin(); ai != tasks.end(); ++ai) {
-		args[count].inputs.insert(*ai);
-		count = (count + 1) % CPUS;
-
-		if (ai == tasks.begin()) {
-			if (!quiet) {
-				fprintf(stderr, "%lld/%lld/%lld  \r", ai->first.z, ai->first.x, ai->first.y);
-			}
-		}
-	}
+	join_finishing = false;
+	join_queued = join_written = 0;
 
+	std::vector<pthread_t> pthreads(CPUS);
 	for (size_t i = 0; i < CPUS; i++) {
 		if (pthread_create(&pthreads[i], NULL, join_worker, &args[i]) != 0) {
 			perror("pthread_create");
@@ -694,40 +1160,43 @@ void handle_tasks(std::map<zxy, std::vector<std::string>> &tasks, std::vector<st
 		}
 	}
 
-	for (size_t i = 0; i < CPUS; i++) {
-		void *retval;
-
-		if (pthread_join(pthreads[i], &retval) != 0) {
-			perror("pthread_join");
-		}
+	join_writer_arg wa;
+	wa.outdb = outdb;
+	wa.outdir = outdir;
+	wa.outarchive = outarchive;
 
-		for (auto ai = args[i].outputs.begin(); ai != args[i].outputs.end(); ++ai) {
-			if (outdb != NULL) {
-				mbtiles_write_tile(outdb, ai->first.z, ai->first.x, ai->first.y, ai->second.data(), ai->second.size());
-			} else if (outdir != NULL) {
-				dir_write_tile(outdir, ai->first.z, ai->first.x, ai->first.y, ai->second);
-			}
-		}
+	pthread_t writer;
+	if (pthread_create(&writer, NULL, join_writer, &wa) != 0) {
+		perror("pthread_create");
+		exit(EXIT_FAILURE);
 	}
-}
 
-void decode(struct reader *readers, std::map<std::string, layermap_entry> &layermap, sqlite3 *outdb, const char *outdir, struct stats *st, std::vector<std::string> &header, std::map<std::string, std::vector<std::string>> &mapping, std::set<std::string> &exclude, int ifmatched, std::string &attribution, std::string &description, std::set<std::string> &keep_layers, std::set<std::string> &remove_layers, std::string &name, json_object *filter) {
-	std::vector<std::map<std::string, layermap_entry>> layermaps;
-	for (size_t i = 0; i < CPUS; i++) {
-		layermaps.push_back(std::map<std::string, layermap_entry>());
+	// Readers are merged through a heap. Once they run out of tiles,
+	// they are kept in the order that they finished, which decides
+	// (after sorting) the order their metadata is combined in.
+	std::priority_queue<queued_reader, std::vector<queued_reader>, readercmp> heap;
+	std::vector<reader *> finished;
+	size_t pushed = 0;
+
+	for (size_t i = 0; i < readers.size(); i++) {
+		if (readers[i]->zoom < 32) {
+			heap.push(queued_reader(readers[i], pushed++));
+		} else {
+			finished.push_back(readers[i]);
+		}
 	}
 
-	std::map<zxy, std::vector<std::string>> tasks;
+	std::vector<std::string> inputs;
 	double minlat = INT_MAX;
 	double minlon = INT_MAX;
 	double maxlat = INT_MIN;
 	double maxlon = INT_MIN;
 	int zoom_for_bbox = -1;
 
-	while (readers != NULL && readers->zoom < 32) {
-		reader *r = readers;
-		readers = readers->next;
-		r->next = NULL;
+	while (heap.size() > 0) {
+		reader *r = heap.top().first;
+		heap.pop();
+
 		if (r->zoom != zoom_for_bbox) {
 			// Only use highest zoom for bbox calculation
 			// to avoid z0 always covering the world
@@ -745,63 +1214,47 @@ void decode(struct reader *readers, std::map<std::string, layermap_entry> &layer
 		maxlat = max(lat1, maxlat);
 		maxlon = max(lon2, maxlon);
 
+		zxy tile = zxy(r->zoom, r->x, r->y);
 		if (r->zoom >= minzoom && r->zoom <= maxzoom) {
-			zxy tile = zxy(r->zoom, r->x, r->y);
-			if (tasks.count(tile) == 0) {
-				tasks.insert(std::pair<zxy, std::vector<std::string>>(tile, std::vector<std::string>()));
-			}
-			auto f = tasks.find(tile);
-			f->second.push_back(r->data);
+			inputs.push_back(r->data);
 		}
 
-		if (readers == NULL || readers->zoom != r->zoom || readers->x != r->x || readers->y != r->y) {
-			if (tasks.size() > 100 * CPUS) {
-				handle_tasks(tasks, layermaps, outdb, outdir, header, mapping, exclude, ifmatched, keep_layers, remove_layers, filter);
-				tasks.clear();
-			}
+		advance_reader(r);
+		if (r->zoom < 32) {
+			heap.push(queued_reader(r, pushed++));
+		} else {
+			finished.push_back(r);
 		}
 
-		if (r->db != NULL) {
-			if (sqlite3_step(r->stmt) == SQLITE_ROW) {
-				r->zoom = sqlite3_column_int(r->stmt, 0);
-				r->x = sqlite3_column_int(r->stmt, 1);
-				r->sorty = sqlite3_column_int(r->stmt, 2);
-				r->y = (1LL << r->zoom) - 1 - r->sorty;
-				const char *data = (const char *) sqlite3_column_blob(r->stmt, 3);
-				size_t len = sqlite3_column_bytes(r->stmt, 3);
-
-				r->data = std::string(data, len);
-			} else {
-				r->zoom = 32;
-			}
-		} else {
-			r->pbf_count++;
-
-			if (r->pbf_count != static_cast<int>(r->pbf_path.size())) {
-				std::vector<std::string> path_parts;
-				path_parts = split_slash(r->pbf_path[r->pbf_count]);
-				int p = path_parts.size();
-				r->zoom = std::stoll(path_parts[p - 3]);
-				r->x = std::stoll(path_parts[p - 2]);
-				r->y = std::stoll(path_parts[p - 1].substr(0, path_parts[p - 1].find_last_of(".")));
-				r->sorty = (1LL << r->zoom) - 1 - r->y;
-				r->data = dir_read_tile(r->pbf_path[r->pbf_count]);
-				path_parts.clear();
-			} else {
-				r->zoom = 32;
+		if (heap.size() == 0 || heap.top().first->zoom != tile.z || heap.top().first->x != tile.x || heap.top().first->y != tile.y) {
+			if (inputs.size() != 0) {
+				queue_join_task(tile, inputs);
+				inputs.clear();
 			}
 		}
+	}
 
-		struct reader **rr;
+	join_lock_acquire();
+	join_finishing = true;
+	join_broadcast(&join_task_ready);
+	join_broadcast(&join_output_ready);
+	join_lock_release();
 
-		for (rr = &readers; *rr != NULL; rr = &((*rr)->next)) {
-			if (*r < **rr) {
-				break;
-			}
+	for (size_t i = 0; i < CPUS; i++) {
+		void *retval;
+
+		if (pthread_join(pthreads[i], &retval) != 0) {
+			perror("pthread_join");
 		}
+	}
+
+	join_lock_acquire();
+	join_broadcast(&join_output_ready);
+	join_lock_release();
 
-		r->next = *rr;
-		*rr = r;
+	void *retval;
+	if (pthread_join(writer, &retval) != 0) {
+		perror("pthread_join");
 	}
 
 	st->minlon = min(minlon, st->minlon);
@@ -809,14 +1262,21 @@ void decode(struct reader *readers, std::map<std::string, layermap_entry> &layer
 	st->minlat = min(minlat, st->minlat);
 	st->maxlat = max(maxlat, st->maxlat);
 
-	handle_tasks(tasks, layermaps, outdb, outdir, header, mapping, exclude, ifmatched, keep_layers, remove_layers, filter);
 	layermap = merge_layermaps(layermaps);
 
-	struct reader *next;
-	for (struct reader *r = readers; r != NULL; r = next) {
-		next = r->next;
+	std::stable_sort(finished.begin(), finished.end(), reader_less);
+
+	for (size_t ri = 0; ri < finished.size(); ri++) {
+		reader *r = finished[ri];
+
+		if (r->archive != NULL) {
+			std::string metadata = archive_read_metadata(r->archive);
+			json_pull *jp = json_begin_string(metadata.c_str());
+			read_json_metadata(jp, st, attribution, description, name);
+			json_end(jp);
 
-		if (r->db != NULL) {
+			archive_close_read(r->archive);
+		} else if (r->db != NULL) {
 			sqlite3_finalize(r->stmt);
 
 			if (sqlite3_prepare_v2(r->db, "SELECT value from metadata where name = 'minzoom'", -1, &r->stmt, NULL) == SQLITE_OK) {
@@ -913,58 +1373,7 @@ void decode(struct reader *readers, std::map<std::string, layermap_entry> &layer
 			}
 
 			json_pull *jp = json_begin_file(f);
-			json_object *j, *k;
-
-			while ((j = json_read(jp)) != NULL) {
-				if (j->type == JSON_HASH) {
-					if ((k = json_hash_get(j, "minzoom")) != NULL) {
-						const std::string minzoom_tmp = k->string;
-						int minz = max(std::stoi(minzoom_tmp), minzoom);
-						st->minzoom = min(st->minzoom, minz);
-					}
-
-					if ((k = json_hash_get(j, "maxzoom")) != NULL) {
-						const std::string maxzoom_tmp = k->string;
-						int maxz = min(std::stoi(maxzoom_tmp), maxzoom);
-						st->maxzoom = max(st->maxzoom, maxz);
-					}
-
-					if ((k = json_hash_get(j, "center")) != NULL) {
-						const std::string center = k->string;
-						const unsigned char *s = (const unsigned char *) center.c_str();
-						sscanf((char *) s, "%lf,%lf", &st->midlon, &st->midlat);
-					}
-
-					if ((k = json_hash_get(j, "attribution")) != NULL) {
-						attribution = k->string;
-					}
-
-					if ((k = json_hash_get(j, "description")) != NULL) {
-						description = k->string;
-					}
-
-					if ((k = json_hash_get(j, "name")) != NULL) {
-						const std::string name_tmp = k->string;
-						if (name.size() == 0) {
-							name = name_tmp;
-						} else {
-							name += " + " + name_tmp;
-						}
-					}
-
-					if ((k = json_hash_get(j, "bounds")) != NULL) {
-						const std::string bounds = k->string;
-						const unsigned char *s = (const unsigned char *) bounds.c_str();
-						if (sscanf((char *) s, "%lf,%lf,%lf,%lf", &minlon, &minlat, &maxlon, &maxlat) == 4) {
-							st->minlon = min(minlon, st->minlon);
-							st->maxlon = max(maxlon, st->maxlon);
-							st->minlat = min(minlat, st->minlat);
-							st->maxlat = max(maxlat, st->maxlat);
-						}
-					}
-				}
-			}
-			json_free(j);
+			read_json_metadata(jp, st, attribution, description, name);
 			json_end(jp);
 			fclose(f);
 		}
@@ -981,7 +1390,9 @@ void usage(char **argv) {
 int main(int argc, char **argv) {
 	char *out_mbtiles = NULL;
 	char *out_dir = NULL;
+	char *out_archive = NULL;
 	sqlite3 *outdb = NULL;
+	archive_writer *outarchive = NULL;
 	char *csv = NULL;
 	int force = 0;
 	int ifmatched = 0;
@@ -1009,7 +1420,9 @@ int main(int argc, char **argv) {
 	struct option long_options[] = {
 		{"output", required_argument, 0, 'o'},
 		{"output-to-directory", required_argument, 0, 'e'},
+		{"output-to-archive", required_argument, 0, 'k'},
 		{"force", no_argument, 0, 'f'},
+		{"deduplicate-tiles", no_argument, &deduplicate, 1},
 		{"if-matched", no_argument, 0, 'i'},
 		{"attribution", required_argument, 0, 'A'},
 		{"name", required_argument, 0, 'n'},
@@ -1061,6 +1474,10 @@ int main(int argc, char **argv) {
 			out_dir = optarg;
 			break;
 
+		case 'k':
+			out_archive = optarg;
+			break;
+
 		case 'f':
 			force = 1;
 			break;
@@ -1156,13 +1573,13 @@ int main(int argc, char **argv) {
 		usage(argv);
 	}
 
-	if (out_mbtiles == NULL && out_dir == NULL) {
-		fprintf(stderr, "%s: must specify -o out.mbtiles or -e directory\n", argv[0]);
+	if (out_mbtiles == NULL && out_dir == NULL && out_archive == NULL) {
+		fprintf(stderr, "%s: must specify -o out.mbtiles, -e directory, or -k archive\n", argv[0]);
 		usage(argv);
 	}
 
-	if (out_mbtiles != NULL && out_dir != NULL) {
-		fprintf(stderr, "%s: Options -o and -e cannot be used together\n", argv[0]);
+	if ((out_mbtiles != NULL) + (out_dir != NULL) + (out_archive != NULL) > 1) {
+		fprintf(stderr, "%s: Options -o, -e, and -k cannot be used together\n", argv[0]);
 		usage(argv);
 	}
 
@@ -1170,7 +1587,7 @@ int main(int argc, char **argv) {
 		if (force) {
 			unlink(out_mbtiles);
 		}
-		outdb = mbtiles_open(out_mbtiles, argv, 0);
+		outdb = mbtiles_open(out_mbtiles, argv, 0, deduplicate);
 	}
 	if (out_dir != NULL) {
 		if (force) {
@@ -1178,6 +1595,12 @@ int main(int argc, char **argv) {
 		}
 		check_dir(out_dir, false);
 	}
+	if (out_archive != NULL) {
+		if (force) {
+			unlink(out_archive);
+		}
+		outarchive = archive_open(out_archive);
+	}
 
 	struct stats st;
 	memset(&st, 0, sizeof(st));
@@ -1189,23 +1612,21 @@ int main(int argc, char **argv) {
 	std::string description;
 	std::string name;
 
-	struct reader *readers = NULL;
+	std::vector<reader *> readers;
 
 	for (i = optind; i < argc; i++) {
-		reader *r = begin_reading(argv[i]);
-		struct reader **rr;
+		readers.push_back(begin_reading(argv[i]));
+	}
 
-		for (rr = &readers; *rr != NULL; rr = &((*rr)->next)) {
-			if (*r < **rr) {
-				break;
-			}
-		}
+	// Put the readers in their tile order, keeping ties in the order they were listed
+	std::stable_sort(readers.begin(), readers.end(), reader_less);
 
-		r->next = *rr;
-		*rr = r;
+	filter_program *compiled_filter = NULL;
+	if (filter != NULL) {
+		compiled_filter = compile_filter(filter);
 	}
 
-	decode(readers, layermap, outdb, out_dir, &st, header, mapping, exclude, ifmatched, attribution, description, keep_layers, remove_layers, name, filter);
+	decode(readers, layermap, outdb, out_dir, outarchive, &st, header, mapping, exclude, ifmatched, attribution, description, keep_layers, remove_layers, name, compiled_filter);
 
 	if (set_attribution.size() != 0) {
 		attribution = set_attribution;
@@ -1217,14 +1638,18 @@ int main(int argc, char **argv) {
 		name = set_name;
 	}
 
-	mbtiles_write_metadata(outdb, out_dir, name.c_str(), st.minzoom, st.maxzoom, st.minlat, st.minlon, st.maxlat, st.maxlon, st.midlat, st.midlon, 0, attribution.size() != 0 ? attribution.c_str() : NULL, layermap, true, description.c_str(), !pg);
+	mbtiles_write_metadata(outdb, out_dir, outarchive, name.c_str(), st.minzoom, st.maxzoom, st.minlat, st.minlon, st.maxlat, st.maxlon, st.midlat, st.midlon, 0, attribution.size() != 0 ? attribution.c_str() : NULL, layermap, true, description.c_str(), !pg);
 
 	if (outdb != NULL) {
 		mbtiles_close(outdb, argv[0]);
 	}
+	if (outarchive != NULL) {
+		archive_close(outarchive);
+	}
 
 	if (filter != NULL) {
 		json_free(filter);
+		delete compiled_filter;
 	}
 
 	return 0;
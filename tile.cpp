@@ -6,10 +6,13 @@
 #include <fstream>
 #include <string>
 #include <stack>
+#include <deque>
 #include <vector>
 #include <map>
 #include <set>
 #include <algorithm>
+#include <limits>
+#include <utility>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -29,6 +32,7 @@
 #include "mvt.hpp"
 #include "mbtiles.hpp"
 #include "dirtiles.hpp"
+#include "archive.hpp"
 #include "geometry.hpp"
 #include "tile.hpp"
 #include "pool.hpp"
@@ -37,6 +41,9 @@
 #include "options.hpp"
 #include "main.hpp"
 #include "write_json.hpp"
+#include "timer.hpp"
+#include "estimate.hpp"
+#include "writer.hpp"
 
 extern "C" {
 #include "jsonpull/jsonpull.h"
@@ -49,7 +56,6 @@ extern "C" {
 #define XSTRINGIFY(s) STRINGIFY(s)
 #define STRINGIFY(s) #s
 
-pthread_mutex_t db_lock = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t var_lock = PTHREAD_MUTEX_INITIALIZER;
 
 std::vector<mvt_geometry> to_feature(drawvec &geom) {
@@ -200,7 +206,7 @@ int metacmp(int m1, const std::vector<long long> &keys1, const std::vector<long
 	}
 }
 
-void rewrite(drawvec &geom, int z, int nextzoom, int maxzoom, long long *bbox, unsigned tx, unsigned ty, int buffer, int *within, long long *geompos, FILE **geomfile, const char *fname, signed char t, int layer, long long metastart, signed char feature_minzoom, int child_shards, int max_zoom_increment, long long seq, int tippecanoe_minzoom, int tippecanoe_maxzoom, int segment, unsigned *initial_x, unsigned *initial_y, int m, std::vector<long long> &metakeys, std::vector<long long> &metavals, bool has_id, unsigned long long id, unsigned long long index, long long extent) {
+void rewrite(drawvec &geom, int z, int nextzoom, int maxzoom, long long *bbox, unsigned tx, unsigned ty, int buffer, int *within, long long *geompos, FILE **geomfile, geom_block *blocks, const char *fname, signed char t, int layer, long long metastart, signed char feature_minzoom, int child_shards, int max_zoom_increment, long long seq, int tippecanoe_minzoom, int tippecanoe_maxzoom, int segment, unsigned *initial_x, unsigned *initial_y, int m, std::vector<long long> &metakeys, std::vector<long long> &metavals, bool has_id, unsigned long long id, unsigned long long index, long long extent) {
 	if (geom.size() > 0 && (nextzoom <= maxzoom || additional[A_EXTEND_ZOOMS])) {
 		int xo, yo;
 		int span = 1 << (nextzoom - z);
@@ -301,13 +307,42 @@ void rewrite(drawvec &geom, int z, int nextzoom, int maxzoom, long long *bbox, u
 						}
 					}
 
-					serialize_feature(geomfile[j], &sf, &geompos[j], fname, initial_x[segment] >> geometry_scale, initial_y[segment] >> geometry_scale, true);
+					if (blocks != NULL) {
+						serialize_feature(blocks[j], &sf, initial_x[segment] >> geometry_scale, initial_y[segment] >> geometry_scale, true);
+						if (blocks[j].size() >= GEOM_BLOCK) {
+							write_geom_block(geomfile[j], blocks[j], &geompos[j], fname);
+						}
+					} else {
+						serialize_feature(geomfile[j], &sf, &geompos[j], fname, initial_x[segment] >> geometry_scale, initial_y[segment] >> geometry_scale, true);
+					}
 				}
 			}
 		}
 	}
 }
 
+// Most memory to use, across all the tiling threads, for keeping features
+// read for a tile in case it has to be made again at a lower detail or
+// with fewer features
+#define RETAIN_MAX (256LL * 1024 * 1024)
+
+// The heap memory that a retained feature holds on to
+static long long retained_feature_size(serial_feature const &sf) {
+	long long size = sf.geometry.capacity() * sizeof(draw);
+	size += (sf.keys.capacity() + sf.values.capacity()) * sizeof(long long);
+	size += sf.full_keys.capacity() * sizeof(std::string) + sf.full_values.capacity() * sizeof(serial_val);
+	size += sf.layername.capacity();
+
+	for (size_t i = 0; i < sf.full_keys.size(); i++) {
+		size += sf.full_keys[i].capacity();
+	}
+	for (size_t i = 0; i < sf.full_values.size(); i++) {
+		size += sf.full_values[i].s.capacity();
+	}
+
+	return size;
+}
+
 struct partial {
 	std::vector<drawvec> geoms = std::vector<drawvec>();
 	std::vector<long long> keys = std::vector<long long>();
@@ -1126,13 +1161,40 @@ long long choose_minextent(std::vector<long long> &extents, double f) {
 	return extents[(extents.size() - 1) * (1 - f)];
 }
 
+// One tile's worth of data within one of the geometry files
+struct task {
+	int fileno = 0;
+	long long start = 0;
+	long long end = 0;
+};
+
+// A finished tile set aside, with --single-pass-as-needed, until the zoom-wide
+// dropping thresholds are known, along with what it would take to change it.
+struct held_tile {
+	task t;
+	int z = 0;
+	unsigned x = 0;
+	unsigned y = 0;
+	long long off = 0;  // of the compressed tile in the thread's hold file
+	long long len = 0;
+
+	bool thresholds_changed = false;		    // it raised the thresholds itself
+	bool had_features = false;			    // so any change in gamma or fraction would change it
+	unsigned long long min_gap = ULLONG_MAX;	    // the closest spacing of any feature kept by --drop-densest-as-needed
+	double min_extent = std::numeric_limits<double>::infinity();  // and the smallest feature kept by --drop-smallest-as-needed
+};
+
 struct write_tile_args {
-	struct task *tasks = NULL;
+	struct tile_scheduler *scheduler = NULL;
+	size_t thread = 0;
+	char **geom_map = NULL;
+	long long *geompos = NULL;
+	std::vector<long long> *tile_starts = NULL;
+	bool geom_compressed = false;	  // whether features being read are in compressed blocks
+	std::vector<geom_block> blocks{};  // features for each child shard, to be compressed
 	char *metabase = NULL;
 	char *stringpool = NULL;
 	int min_detail = 0;
-	sqlite3 *outdb = NULL;
-	const char *outdir = NULL;
 	int buffer = 0;
 	const char *fname = NULL;
 	FILE **geomfile = NULL;
@@ -1141,8 +1203,6 @@ struct write_tile_args {
 	double gamma = 0;
 	double gamma_out = 0;
 	int child_shards = 0;
-	int *geomfd = NULL;
-	off_t *geom_size = NULL;
 	volatile unsigned *midx = NULL;
 	volatile unsigned *midy = NULL;
 	int maxzoom = 0;
@@ -1172,6 +1232,13 @@ struct write_tile_args {
 	bool still_dropping = false;
 	int wrote_zoom = 0;
 	size_t tiling_seg = 0;
+	task current{};				  // where the tile being made came from
+	std::vector<held_tile> *held = NULL;  // if not NULL, tiles are set aside here instead of written
+	FILE *hold_file = NULL;
+	long long *hold_pos = NULL;
+	bool retiling = false;	// making held tiles again, so the next zoom is already written
+	filter_process *prefilter_process = NULL;  // with --persistent-filters, this thread's filters
+	filter_process *postfilter_process = NULL;
 };
 
 bool clip_to_tile(serial_feature &sf, int z, long long buffer) {
@@ -1250,14 +1317,14 @@ bool clip_to_tile(serial_feature &sf, int z, long long buffer) {
 	return false;
 }
 
-serial_feature next_feature(FILE *geoms, long long *geompos_in, char *metabase, long long *meta_off, int z, unsigned tx, unsigned ty, unsigned *initial_x, unsigned *initial_y, long long *original_features, long long *unclipped_features, int nextzoom, int maxzoom, int minzoom, int max_zoom_increment, size_t pass, size_t passes, volatile long long *along, long long alongminus, int buffer, int *within, bool *first_time, FILE **geomfile, long long *geompos, volatile double *oprogress, double todo, const char *fname, int child_shards) {
+serial_feature next_feature(geom_reader *geoms, char *metabase, long long *meta_off, int z, unsigned tx, unsigned ty, unsigned *initial_x, unsigned *initial_y, long long *original_features, long long *unclipped_features, int nextzoom, int maxzoom, int minzoom, int max_zoom_increment, size_t pass, size_t passes, volatile long long *along, long long alongminus, int buffer, int *within, bool *first_time, FILE **geomfile, long long *geompos, geom_block *blocks, volatile double *oprogress, double todo, const char *fname, int child_shards) {
 	while (1) {
-		serial_feature sf = deserialize_feature(geoms, geompos_in, metabase, meta_off, z, tx, ty, initial_x, initial_y);
+		serial_feature sf = deserialize_feature(*geoms, metabase, meta_off, z, tx, ty, initial_x, initial_y);
 		if (sf.t < 0) {
 			return sf;
 		}
 
-		double progress = floor(((((*geompos_in + *along - alongminus) / (double) todo) + (pass - (2 - passes))) / passes + z) / (maxzoom + 1) * 1000) / 10;
+		double progress = floor(((((geoms->pos + *along - alongminus) / (double) todo) + (pass - (2 - passes))) / passes + z) / (maxzoom + 1) * 1000) / 10;
 		if (progress >= *oprogress + 0.1) {
 			if (!quiet && !quiet_progress) {
 				fprintf(stderr, "  %3.1f%%  %d/%u/%u  \r", progress, z, tx, ty);
@@ -1277,7 +1344,7 @@ serial_feature next_feature(FILE *geoms, long long *geompos_in, char *metabase,
 
 		if (*first_time && pass == 1) { /* only write out the next zoom once, even if we retry */
 			if (sf.tippecanoe_maxzoom == -1 || sf.tippecanoe_maxzoom >= nextzoom) {
-				rewrite(sf.geometry, z, nextzoom, maxzoom, sf.bbox, tx, ty, buffer, within, geompos, geomfile, fname, sf.t, sf.layer, sf.metapos, sf.feature_minzoom, child_shards, max_zoom_increment, sf.seq, sf.tippecanoe_minzoom, sf.tippecanoe_maxzoom, sf.segment, initial_x, initial_y, sf.m, sf.keys, sf.values, sf.has_id, sf.id, sf.index, sf.extent);
+				rewrite(sf.geometry, z, nextzoom, maxzoom, sf.bbox, tx, ty, buffer, within, geompos, geomfile, blocks, fname, sf.t, sf.layer, sf.metapos, sf.feature_minzoom, child_shards, max_zoom_increment, sf.seq, sf.tippecanoe_minzoom, sf.tippecanoe_maxzoom, sf.segment, initial_x, initial_y, sf.m, sf.keys, sf.values, sf.has_id, sf.id, sf.index, sf.extent);
 			}
 		}
 
@@ -1300,8 +1367,7 @@ serial_feature next_feature(FILE *geoms, long long *geompos_in, char *metabase,
 }
 
 struct run_prefilter_args {
-	FILE *geoms = NULL;
-	long long *geompos_in = NULL;
+	geom_reader *geoms = NULL;
 	char *metabase = NULL;
 	long long *meta_off = NULL;
 	int z = 0;
@@ -1324,6 +1390,7 @@ struct run_prefilter_args {
 	bool *first_time = NULL;
 	FILE **geomfile = NULL;
 	long long *geompos = NULL;
+	geom_block *blocks = NULL;
 	volatile double *oprogress = NULL;
 	double todo = 0;
 	const char *fname = 0;
@@ -1332,13 +1399,18 @@ struct run_prefilter_args {
 	char *stringpool = NULL;
 	long long *pool_off = NULL;
 	FILE *prefilter_fp = NULL;
+	bool persistent = false;  // so prefilter_fp stays open for the next tile
 };
 
 void *run_prefilter(void *v) {
 	run_prefilter_args *rpa = (run_prefilter_args *) v;
 
+	if (rpa->persistent) {
+		begin_filter_tile(rpa->prefilter_fp, rpa->z, rpa->tx, rpa->ty);
+	}
+
 	while (1) {
-		serial_feature sf = next_feature(rpa->geoms, rpa->geompos_in, rpa->metabase, rpa->meta_off, rpa->z, rpa->tx, rpa->ty, rpa->initial_x, rpa->initial_y, rpa->original_features, rpa->unclipped_features, rpa->nextzoom, rpa->maxzoom, rpa->minzoom, rpa->max_zoom_increment, rpa->pass, rpa->passes, rpa->along, rpa->alongminus, rpa->buffer, rpa->within, rpa->first_time, rpa->geomfile, rpa->geompos, rpa->oprogress, rpa->todo, rpa->fname, rpa->child_shards);
+		serial_feature sf = next_feature(rpa->geoms, rpa->metabase, rpa->meta_off, rpa->z, rpa->tx, rpa->ty, rpa->initial_x, rpa->initial_y, rpa->original_features, rpa->unclipped_features, rpa->nextzoom, rpa->maxzoom, rpa->minzoom, rpa->max_zoom_increment, rpa->pass, rpa->passes, rpa->along, rpa->alongminus, rpa->buffer, rpa->within, rpa->first_time, rpa->geomfile, rpa->geompos, rpa->blocks, rpa->oprogress, rpa->todo, rpa->fname, rpa->child_shards);
 		if (sf.t < 0) {
 			break;
 		}
@@ -1374,6 +1446,11 @@ void *run_prefilter(void *v) {
 		layer_to_geojson(rpa->prefilter_fp, tmp_layer, 0, 0, 0, false, true, false, sf.index, sf.seq, sf.extent, true);
 	}
 
+	if (rpa->persistent) {
+		end_filter_tile(rpa->prefilter_fp);
+		return NULL;
+	}
+
 	if (fclose(rpa->prefilter_fp) != 0) {
 		if (errno == EPIPE) {
 			static bool warned = false;
@@ -1389,14 +1466,14 @@ void *run_prefilter(void *v) {
 	return NULL;
 }
 
-long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *stringpool, int z, unsigned tx, unsigned ty, int detail, int min_detail, sqlite3 *outdb, const char *outdir, int buffer, const char *fname, FILE **geomfile, int minzoom, int maxzoom, double todo, volatile long long *along, long long alongminus, double gamma, int child_shards, long long *meta_off, long long *pool_off, unsigned *initial_x, unsigned *initial_y, volatile int *running, double simplification, std::vector<std::map<std::string, layermap_entry>> *layermaps, std::vector<std::vector<std::string>> *layer_unmaps, size_t tiling_seg, size_t pass, size_t passes, unsigned long long mingap, long long minextent, double fraction, const char *prefilter, const char *postfilter, write_tile_args *arg) {
+long long write_tile(geom_reader *geoms, char *metabase, char *stringpool, int z, unsigned tx, unsigned ty, int detail, int min_detail, int buffer, const char *fname, FILE **geomfile, int minzoom, int maxzoom, double todo, volatile long long *along, long long alongminus, double gamma, int child_shards, long long *meta_off, long long *pool_off, unsigned *initial_x, unsigned *initial_y, volatile int *running, double simplification, std::vector<std::map<std::string, layermap_entry>> *layermaps, std::vector<std::vector<std::string>> *layer_unmaps, size_t tiling_seg, size_t pass, size_t passes, unsigned long long mingap, long long minextent, double fraction, const char *prefilter, const char *postfilter, write_tile_args *arg) {
 	int line_detail;
 	double merge_fraction = 1;
 	double mingap_fraction = 1;
 	double minextent_fraction = 1;
 
 	static volatile double oprogress = 0;
-	long long og = *geompos_in;
+	long long og = geoms->pos;
 
 	// XXX is there a way to do this without floating point?
 	int max_zoom_increment = std::log(child_shards) / std::log(4);
@@ -1420,7 +1497,27 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 
 	bool has_polygons = false;
 
-	bool first_time = true;
+	// The child tiles are appended to this thread's own shards. Remember where
+	// each of them will begin so the next zoom can dispatch them individually.
+	long long *geompos = arg->geompos;
+	geom_block *blocks = NULL;
+	if (arg->blocks.size() > 0) {
+		blocks = &arg->blocks[0];
+	}
+	long long child_start[child_shards];
+	for (int j = 0; j < child_shards; j++) {
+		child_start[j] = geompos[j];
+	}
+
+	// The features read for the tile, after clipping and prefiltering,
+	// kept so that they don't have to be read again if the tile is too big.
+	std::vector<serial_feature> retained;
+	long long retained_size = 0;
+	bool retaining = true;
+	bool replaying = false;
+
+	// The next zoom is only written out once, even if the tile is made again
+	bool first_time = !arg->retiling;
 	// This only loops if the tile data didn't fit, in which case the detail
 	// goes down and the progress indicator goes backward for the next try.
 	for (line_detail = detail; line_detail >= min_detail || line_detail == detail; line_detail--, oprogress = 0) {
@@ -1444,16 +1541,18 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 		std::vector<serial_feature> coalesced_geometry;
 
 		int within[child_shards];
-		long long geompos[child_shards];
 		memset(within, '\0', child_shards * sizeof(int));
-		memset(geompos, '\0', child_shards * sizeof(long long));
 
-		if (*geompos_in != og) {
-			if (fseek(geoms, og, SEEK_SET) != 0) {
-				perror("fseek geom");
-				exit(EXIT_FAILURE);
-			}
-			*geompos_in = og;
+		bool had_features = false;
+		unsigned long long min_gap = ULLONG_MAX;
+		double min_extent = std::numeric_limits<double>::infinity();
+
+		if (!replaying) {
+			geoms->pos = og;
+			geoms->block.clear();
+			geoms->blockpos = 0;
+			geoms->headers_len = 0;
+			geoms->coordpos = 0;
 		}
 
 		int prefilter_write = -1, prefilter_read = -1;
@@ -1463,17 +1562,28 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 		run_prefilter_args rpa;  // here so it stays in scope until joined
 		FILE *prefilter_read_fp = NULL;
 		json_pull *prefilter_jp = NULL;
-
-		if (prefilter != NULL) {
-			setup_filter(prefilter, &prefilter_write, &prefilter_read, &prefilter_pid, z, tx, ty);
-			prefilter_fp = fdopen(prefilter_write, "w");
-			if (prefilter_fp == NULL) {
-				perror("freopen prefilter");
-				exit(EXIT_FAILURE);
+		double prefilter_start = timer_now();
+		bool prefilter_started = false;
+
+		if (prefilter != NULL && !replaying) {
+			if (arg->prefilter_process != NULL) {
+				if (arg->prefilter_process->pid == 0) {
+					start_filter_process(prefilter, arg->prefilter_process);
+					prefilter_started = true;
+				}
+				prefilter_fp = arg->prefilter_process->to;
+				prefilter_jp = arg->prefilter_process->jp;
+			} else {
+				setup_filter(prefilter, &prefilter_write, &prefilter_read, &prefilter_pid, z, tx, ty);
+				prefilter_started = true;
+				prefilter_fp = fdopen(prefilter_write, "w");
+				if (prefilter_fp == NULL) {
+					perror("freopen prefilter");
+					exit(EXIT_FAILURE);
+				}
 			}
 
 			rpa.geoms = geoms;
-			rpa.geompos_in = geompos_in;
 			rpa.metabase = metabase;
 			rpa.meta_off = meta_off;
 			rpa.z = z;
@@ -1495,12 +1605,14 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 			rpa.within = within;
 			rpa.first_time = &first_time;
 			rpa.geomfile = geomfile;
+			rpa.blocks = blocks;
 			rpa.geompos = geompos;
 			rpa.oprogress = &oprogress;
 			rpa.todo = todo;
 			rpa.fname = fname;
 			rpa.child_shards = child_shards;
 			rpa.prefilter_fp = prefilter_fp;
+			rpa.persistent = arg->prefilter_process != NULL;
 			rpa.layer_unmaps = layer_unmaps;
 			rpa.stringpool = stringpool;
 			rpa.pool_off = pool_off;
@@ -1510,19 +1622,30 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 				exit(EXIT_FAILURE);
 			}
 
-			prefilter_read_fp = fdopen(prefilter_read, "r");
-			if (prefilter_read_fp == NULL) {
-				perror("fdopen prefilter output");
-				exit(EXIT_FAILURE);
+			if (!rpa.persistent) {
+				prefilter_read_fp = fdopen(prefilter_read, "r");
+				if (prefilter_read_fp == NULL) {
+					perror("fdopen prefilter output");
+					exit(EXIT_FAILURE);
+				}
+				prefilter_jp = json_begin_file(prefilter_read_fp);
 			}
-			prefilter_jp = json_begin_file(prefilter_read_fp);
 		}
 
+		size_t replayed = 0;
+
 		while (1) {
 			serial_feature sf;
 
-			if (prefilter == NULL) {
-				sf = next_feature(geoms, geompos_in, metabase, meta_off, z, tx, ty, initial_x, initial_y, &original_features, &unclipped_features, nextzoom, maxzoom, minzoom, max_zoom_increment, pass, passes, along, alongminus, buffer, within, &first_time, geomfile, geompos, &oprogress, todo, fname, child_shards);
+			if (replaying) {
+				if (replayed >= retained.size()) {
+					break;
+				}
+				// Copied, not moved, since there may be another attempt after this one.
+				// Everything after this moves the feature's data into the tile.
+				sf = retained[replayed++];
+			} else if (prefilter == NULL) {
+				sf = next_feature(geoms, metabase, meta_off, z, tx, ty, initial_x, initial_y, &original_features, &unclipped_features, nextzoom, maxzoom, minzoom, max_zoom_increment, pass, passes, along, alongminus, buffer, within, &first_time, geomfile, geompos, blocks, &oprogress, todo, fname, child_shards);
 			} else {
 				sf = parse_feature(prefilter_jp, z, tx, ty, layermaps, tiling_seg, layer_unmaps, postfilter != NULL);
 			}
@@ -1531,6 +1654,20 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 				break;
 			}
 
+			if (retaining && !replaying) {
+				retained.push_back(sf);
+				retained_size += retained_feature_size(sf);
+
+				if (retained_size + (long long) (retained.capacity() * sizeof(serial_feature)) > RETAIN_MAX / (long long) CPUS) {
+					// Too big to keep around. Read it again from the geometry file if necessary.
+					retaining = false;
+					retained.clear();
+					retained.shrink_to_fit();
+				}
+			}
+
+			had_features = true;
+
 			if (gamma > 0) {
 				if (manage_gap(sf.index, &previndex, scale, gamma, &gap)) {
 					continue;
@@ -1549,12 +1686,18 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 				if (sf.index - merge_previndex < mingap) {
 					continue;
 				}
+				if (sf.index - merge_previndex < min_gap) {
+					min_gap = sf.index - merge_previndex;
+				}
 			}
 			if (additional[A_DROP_SMALLEST_AS_NEEDED]) {
 				extents.push_back(sf.extent);
 				if (sf.extent + coalesced_area <= minextent && sf.t != VT_POINT) {
 					continue;
 				}
+				if (sf.extent + coalesced_area < min_extent && sf.t != VT_POINT) {
+					min_extent = sf.extent + coalesced_area;
+				}
 			}
 			if (additional[A_COALESCE_SMALLEST_AS_NEEDED]) {
 				extents.push_back(sf.extent);
@@ -1562,6 +1705,9 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 					coalesced_geometry.push_back(sf);
 					continue;
 				}
+				if (sf.extent + coalesced_area < min_extent) {
+					min_extent = sf.extent + coalesced_area;
+				}
 			}
 
 			if (coalesced_geometry.size() != 0) {
@@ -1603,7 +1749,7 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 
 			if (sf.geometry.size() > 0) {
 				partial p;
-				p.geoms.push_back(sf.geometry);
+				p.geoms.push_back(std::move(sf.geometry));
 				p.layer = sf.layer;
 				p.m = sf.m;
 				p.t = sf.t;
@@ -1613,10 +1759,10 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 				p.z = z;
 				p.line_detail = line_detail;
 				p.maxzoom = maxzoom;
-				p.keys = sf.keys;
-				p.values = sf.values;
-				p.full_keys = sf.full_keys;
-				p.full_values = sf.full_values;
+				p.keys = std::move(sf.keys);
+				p.values = std::move(sf.values);
+				p.full_keys = std::move(sf.full_keys);
+				p.full_values = std::move(sf.full_values);
 				p.spacing = spacing;
 				p.simplification = simplification;
 				p.id = sf.id;
@@ -1624,7 +1770,7 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 				p.index2 = merge_previndex;
 				p.index = sf.index;
 				p.renamed = -1;
-				partials.push_back(p);
+				partials.push_back(std::move(p));
 			}
 
 			merge_previndex = sf.index;
@@ -1644,20 +1790,22 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 			}
 		}
 
-		if (prefilter != NULL) {
-			json_end(prefilter_jp);
-			if (fclose(prefilter_read_fp) != 0) {
-				perror("close output from prefilter");
-				exit(EXIT_FAILURE);
-			}
-			while (1) {
-				int stat_loc;
-				if (waitpid(prefilter_pid, &stat_loc, 0) < 0) {
-					perror("waitpid for prefilter\n");
+		if (prefilter != NULL && !replaying) {
+			if (!rpa.persistent) {
+				json_end(prefilter_jp);
+				if (fclose(prefilter_read_fp) != 0) {
+					perror("close output from prefilter");
 					exit(EXIT_FAILURE);
 				}
-				if (WIFEXITED(stat_loc) || WIFSIGNALED(stat_loc)) {
-					break;
+				while (1) {
+					int stat_loc;
+					if (waitpid(prefilter_pid, &stat_loc, 0) < 0) {
+						perror("waitpid for prefilter\n");
+						exit(EXIT_FAILURE);
+					}
+					if (WIFEXITED(stat_loc) || WIFSIGNALED(stat_loc)) {
+						break;
+					}
 				}
 			}
 			void *ret;
@@ -1665,9 +1813,16 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 				perror("pthread_join prefilter writer");
 				exit(EXIT_FAILURE);
 			}
+
+			record_filter_tile(false, timer_now() - prefilter_start, prefilter_started);
 		}
 
 		first_time = false;
+		if (retaining) {
+			// Any further attempts at this tile can start from the features
+			// that were already read, clipped, and filtered.
+			replaying = true;
+		}
 		bool merge_successful = true;
 
 		if (additional[A_DETECT_SHARED_BORDERS] || (additional[A_MERGE_POLYGONS_AS_NEEDED] && merge_fraction < 1)) {
@@ -1759,7 +1914,13 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 		int j;
 		for (j = 0; j < child_shards; j++) {
 			if (within[j]) {
-				serialize_byte(geomfile[j], -2, &geompos[j], fname);
+				if (blocks != NULL) {
+					blocks[j].headers.push_back(-2);
+					write_geom_block(geomfile[j], blocks[j], &geompos[j], fname);
+				} else {
+					serialize_byte(geomfile[j], -2, &geompos[j], fname);
+				}
+				arg->tile_starts[j].push_back(child_start[j]);
 				within[j] = 0;
 			}
 		}
@@ -1882,7 +2043,7 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 		}
 
 		if (postfilter != NULL) {
-			tile.layers = filter_layers(postfilter, tile.layers, z, tx, ty, layermaps, tiling_seg, layer_unmaps, 1 << line_detail);
+			tile.layers = filter_layers(postfilter, arg->postfilter_process, tile.layers, z, tx, ty, layermaps, tiling_seg, layer_unmaps, 1 << line_detail);
 		}
 
 		if (z == 0 && unclipped_features < original_features / 2) {
@@ -1896,7 +2057,7 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 			totalsize += layer_features.size();
 		}
 
-		double progress = floor(((((*geompos_in + *along - alongminus) / (double) todo) + (pass - (2 - passes))) / passes + z) / (maxzoom + 1) * 1000) / 10;
+		double progress = floor(((((geoms->pos + *along - alongminus) / (double) todo) + (pass - (2 - passes))) / passes + z) / (maxzoom + 1) * 1000) / 10;
 		if (progress >= oprogress + 0.1) {
 			if (!quiet && !quiet_progress) {
 				fprintf(stderr, "  %3.1f%%  %d/%u/%u  \r", progress, z, tx, ty);
@@ -1981,21 +2142,57 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 			}
 
 			std::string compressed;
-			std::string pbf = tile.encode();
-
-			if (!prevent[P_TILE_COMPRESSION]) {
-				compress(pbf, compressed);
+			long long units = 0, estimate = -1, size;
+			bool estimated = false;
+
+			// The estimate is only needed to skip encoding or to report on it
+			bool estimating = !prevent[P_KILOBYTE_LIMIT] && (additional[A_ESTIMATE_TILE_SIZES] || performance_stats);
+
+			if (estimating) {
+				units = tile_size_units(tile);
+				estimate = estimate_tile_size(units, z);
+			}
+
+			// Only an attempt that is sure to be followed by a smaller one can
+			// be skipped; if this is the last chance, the tile must really be
+			// encoded in case it fits after all.
+			bool retry_follows = line_detail > min_detail ||
+					     (has_polygons && additional[A_MERGE_POLYGONS_AS_NEEDED] && merge_fraction > .05 && merge_successful) ||
+					     (additional[A_INCREASE_GAMMA_AS_NEEDED] && gamma < 10) ||
+					     additional[A_DROP_DENSEST_AS_NEEDED] ||
+					     prevent[P_DYNAMIC_DROP] || additional[A_DROP_FRACTION_AS_NEEDED];
+
+			if (additional[A_ESTIMATE_TILE_SIZES] && retry_follows && estimate > (long long) max_tile_size * 3 / 2) {
+				// Sure enough that it won't fit that it isn't worth encoding to find out
+				size = estimate;
+				estimated = true;
+				estimate_skipped_encoding();
 			} else {
-				compressed = pbf;
+				std::string pbf = tile.encode();
+
+				if (!prevent[P_TILE_COMPRESSION]) {
+					compress(pbf, compressed);
+				} else {
+					compressed = pbf;
+				}
+
+				size = compressed.size();
+				if (estimating) {
+					calibrate_tile_size(units, estimate, size, max_tile_size, z);
+				}
 			}
 
-			if (compressed.size() > max_tile_size && !prevent[P_KILOBYTE_LIMIT]) {
+			if (size > (long long) max_tile_size && !prevent[P_KILOBYTE_LIMIT]) {
 				if (!quiet) {
-					fprintf(stderr, "tile %d/%u/%u size is %lld with detail %d, >%zu    \n", z, tx, ty, (long long) compressed.size(), line_detail, max_tile_size);
+					if (estimated) {
+						fprintf(stderr, "tile %d/%u/%u size is estimated at %lld with detail %d, >%zu    \n", z, tx, ty, size, line_detail, max_tile_size);
+					} else {
+						fprintf(stderr, "tile %d/%u/%u size is %lld with detail %d, >%zu    \n", z, tx, ty, size, line_detail, max_tile_size);
+					}
 				}
 
 				if (has_polygons && additional[A_MERGE_POLYGONS_AS_NEEDED] && merge_fraction > .05 && merge_successful) {
-					merge_fraction = merge_fraction * max_tile_size / compressed.size() * 0.95;
+					merge_fraction = merge_fraction * max_tile_size / size * 0.95;
 					if (!quiet) {
 						fprintf(stderr, "Going to try merging %0.2f%% of the polygons to make it fit\n", 100 - merge_fraction * 100);
 					}
@@ -2017,7 +2214,7 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 					}
 					line_detail++;  // to keep it the same when the loop decrements it
 				} else if (additional[A_DROP_DENSEST_AS_NEEDED]) {
-					mingap_fraction = mingap_fraction * max_tile_size / compressed.size() * 0.90;
+					mingap_fraction = mingap_fraction * max_tile_size / size * 0.90;
 					unsigned long long mg = choose_mingap(indices, mingap_fraction);
 					if (mg <= mingap) {
 						mg = mingap * 1.5;
@@ -2032,7 +2229,7 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 					}
 					line_detail++;
 				} else if (additional[A_DROP_SMALLEST_AS_NEEDED] || additional[A_COALESCE_SMALLEST_AS_NEEDED]) {
-					minextent_fraction = minextent_fraction * max_tile_size / compressed.size() * 0.90;
+					minextent_fraction = minextent_fraction * max_tile_size / size * 0.90;
 					long long m = choose_minextent(extents, minextent_fraction);
 					if (m != minextent) {
 						minextent = m;
@@ -2050,7 +2247,7 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 					// The 95% is a guess to avoid too many retries
 					// and probably actually varies based on how much duplicated metadata there is
 
-					fraction = fraction * max_tile_size / compressed.size() * 0.95;
+					fraction = fraction * max_tile_size / size * 0.95;
 					if (!quiet) {
 						fprintf(stderr, "Going to try keeping %0.2f%% of the features to make it fit\n", fraction * 100);
 					}
@@ -2062,20 +2259,24 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 				}
 			} else {
 				if (pass == 1) {
-					if (pthread_mutex_lock(&db_lock) != 0) {
-						perror("pthread_mutex_lock");
-						exit(EXIT_FAILURE);
-					}
-
-					if (outdb != NULL) {
-						mbtiles_write_tile(outdb, z, tx, ty, compressed.data(), compressed.size());
-					} else if (outdir != NULL) {
-						dir_write_tile(outdir, z, tx, ty, compressed);
-					}
-
-					if (pthread_mutex_unlock(&db_lock) != 0) {
-						perror("pthread_mutex_unlock");
-						exit(EXIT_FAILURE);
+					if (arg->held != NULL) {
+						held_tile h;
+						h.t = arg->current;
+						h.z = z;
+						h.x = tx;
+						h.y = ty;
+						h.off = *arg->hold_pos;
+						h.len = compressed.size();
+						h.thresholds_changed = gamma != arg->gamma || mingap != arg->mingap || minextent != arg->minextent || fraction != arg->fraction;
+						h.had_features = had_features;
+						h.min_gap = min_gap;
+						h.min_extent = min_extent;
+
+						fwrite_check(compressed.data(), sizeof(char), compressed.size(), arg->hold_file, fname);
+						*arg->hold_pos += compressed.size();
+						arg->held->push_back(h);
+					} else {
+						writer_enqueue(z, tx, ty, compressed);
 					}
 				}
 
@@ -2090,52 +2291,108 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 	return -1;
 }
 
-struct task {
-	int fileno = 0;
-	struct task *next = NULL;
+// Tiles waiting for one tiling thread. The owning thread takes them from
+// the front; a thread that has run out of work of its own steals from the back.
+struct tile_queue {
+	std::deque<task> tasks{};
+	long long todo = 0;
+
+	size_t tiles = 0;
+	size_t stolen = 0;
+	double busy = 0;
 };
 
-void *run_thread(void *vargs) {
-	write_tile_args *arg = (write_tile_args *) vargs;
-	struct task *task;
+struct tile_scheduler {
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	std::vector<tile_queue> queues{};
+	volatile int *running = NULL;
+};
 
-	for (task = arg->tasks; task != NULL; task = task->next) {
-		int j = task->fileno;
+static bool next_task(tile_scheduler *ts, size_t thread, task *t) {
+	if (pthread_mutex_lock(&ts->lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
 
-		if (arg->geomfd[j] < 0) {
-			// only one source file for zoom level 0
-			continue;
+	bool found = false;
+	tile_queue &mine = ts->queues[thread];
+
+	if (mine.tasks.size() > 0) {
+		*t = mine.tasks.front();
+		mine.tasks.pop_front();
+		mine.todo -= t->end - t->start;
+		found = true;
+	} else {
+		// Steal from whichever thread has the most geometry left to get through
+		tile_queue *victim = NULL;
+		for (size_t i = 0; i < ts->queues.size(); i++) {
+			if (ts->queues[i].tasks.size() > 0 && (victim == NULL || ts->queues[i].todo > victim->todo)) {
+				victim = &ts->queues[i];
+			}
 		}
-		if (arg->geom_size[j] == 0) {
-			continue;
+
+		if (victim != NULL) {
+			*t = victim->tasks.back();
+			victim->tasks.pop_back();
+			victim->todo -= t->end - t->start;
+			mine.stolen++;
+			found = true;
 		}
+	}
 
-		// printf("%lld of geom_size\n", (long long) geom_size[j]);
+	if (!found) {
+		// So that the remaining threads can use more CPUs for each tile
+		(*ts->running)--;
+	}
 
-		FILE *geom = fdopen(arg->geomfd[j], "rb");
-		if (geom == NULL) {
-			perror("mmap geom");
-			exit(EXIT_FAILURE);
-		}
+	if (pthread_mutex_unlock(&ts->lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
+	}
+
+	return found;
+}
+
+void *run_thread(void *vargs) {
+	write_tile_args *arg = (write_tile_args *) vargs;
+	task t;
+
+	while (next_task(arg->scheduler, arg->thread, &t)) {
+		double start_time = timer_now();
+
+		// Read straight from the mapped file, with a private position,
+		// so that any thread can read any tile.
+		geom_reader geom;
+		geom.base = arg->geom_map[t.fileno] + t.start;
+		geom.compressed = arg->geom_compressed;
+		geom.len = t.end - t.start;
+		long long geomlen = geom.len;
 
-		long long geompos = 0;
 		long long prevgeom = 0;
 
-		while (1) {
+		while (geom.pos < geomlen) {
 			int z;
 			unsigned x, y;
 
-			if (!deserialize_int_io(geom, &z, &geompos)) {
-				break;
-			}
-			deserialize_uint_io(geom, &x, &geompos);
-			deserialize_uint_io(geom, &y, &geompos);
+			arg->current.fileno = t.fileno;
+			arg->current.start = t.start + geom.pos;
+
+			char *f = geom.base + geom.pos;
+			deserialize_int(&f, &z);
+			deserialize_uint(&f, &x);
+			deserialize_uint(&f, &y);
+			geom.pos = f - geom.base;
 
 			arg->wrote_zoom = z;
 
 			// fprintf(stderr, "%d/%u/%u\n", z, x, y);
 
-			long long len = write_tile(geom, &geompos, arg->metabase, arg->stringpool, z, x, y, z == arg->maxzoom ? arg->full_detail : arg->low_detail, arg->min_detail, arg->outdb, arg->outdir, arg->buffer, arg->fname, arg->geomfile, arg->minzoom, arg->maxzoom, arg->todo, arg->along, geompos, arg->gamma, arg->child_shards, arg->meta_off, arg->pool_off, arg->initial_x, arg->initial_y, arg->running, arg->simplification, arg->layermaps, arg->layer_unmaps, arg->tiling_seg, arg->pass, arg->passes, arg->mingap, arg->minextent, arg->fraction, arg->prefilter, arg->postfilter, arg);
+			size_t held_before = 0;
+			if (arg->held != NULL) {
+				held_before = arg->held->size();
+			}
+
+			long long len = write_tile(&geom, arg->metabase, arg->stringpool, z, x, y, z == arg->maxzoom ? arg->full_detail : arg->low_detail, arg->min_detail, arg->buffer, arg->fname, arg->geomfile, arg->minzoom, arg->maxzoom, arg->todo, arg->along, geom.pos, arg->gamma, arg->child_shards, arg->meta_off, arg->pool_off, arg->initial_x, arg->initial_y, arg->running, arg->simplification, arg->layermaps, arg->layer_unmaps, arg->tiling_seg, arg->pass, arg->passes, arg->mingap, arg->minextent, arg->fraction, arg->prefilter, arg->postfilter, arg);
 
 			if (len < 0) {
 				int *err = &arg->err;
@@ -2143,6 +2400,10 @@ void *run_thread(void *vargs) {
 				return err;
 			}
 
+			if (arg->held != NULL && arg->held->size() > held_before) {
+				arg->held->back().t.end = t.start + geom.pos;
+			}
+
 			if (pthread_mutex_lock(&var_lock) != 0) {
 				perror("pthread_mutex_lock");
 				exit(EXIT_FAILURE);
@@ -2165,8 +2426,8 @@ void *run_thread(void *vargs) {
 				}
 			}
 
-			*arg->along += geompos - prevgeom;
-			prevgeom = geompos;
+			*arg->along += geom.pos - prevgeom;
+			prevgeom = geom.pos;
 
 			if (pthread_mutex_unlock(&var_lock) != 0) {
 				perror("pthread_mutex_unlock");
@@ -2174,33 +2435,62 @@ void *run_thread(void *vargs) {
 			}
 		}
 
-		if (arg->pass == 1) {
-			// Since the fclose() has closed the underlying file descriptor
-			arg->geomfd[j] = -1;
-		} else {
-			int newfd = dup(arg->geomfd[j]);
-			if (newfd < 0) {
-				perror("dup geometry");
-				exit(EXIT_FAILURE);
-			}
-			if (lseek(newfd, 0, SEEK_SET) < 0) {
-				perror("lseek geometry");
-				exit(EXIT_FAILURE);
-			}
-			arg->geomfd[j] = newfd;
-		}
+		tile_queue &q = arg->scheduler->queues[arg->thread];
+		q.tiles++;
+		q.busy += timer_now() - start_time;
+	}
+
+	return NULL;
+}
+
+// Whether a tile that was made with the thresholds that the zoom level
+// started with would come out differently with the zoom-wide thresholds
+// that it ended with.
+static bool needs_retiling(held_tile const &h, double gamma0, double gamma, unsigned long long mingap, long long minextent, double fraction0, double fraction) {
+	if (h.thresholds_changed) {
+		return true;
+	}
+	if (!h.had_features) {
+		return false;
+	}
+	if (gamma != gamma0 || fraction != fraction0) {
+		return true;
+	}
+	if (mingap > h.min_gap) {
+		return true;
+	}
+	if (minextent >= h.min_extent) {
+		return true;
+	}
+	return false;
+}
 
-		if (fclose(geom) != 0) {
-			perror("close geom");
+// Once the last tile has been made: waits for the tiles to be written
+// and for the filters to exit, closes the files of held tiles, and
+// reports what tiling took.
+static void finish_tiling(std::vector<filter_process> &prefilter_processes, std::vector<filter_process> &postfilter_processes, std::vector<FILE *> &hold_files) {
+	writer_finish();
+
+	for (size_t j = 0; j < prefilter_processes.size(); j++) {
+		finish_filter_process(&prefilter_processes[j]);
+		finish_filter_process(&postfilter_processes[j]);
+	}
+
+	for (size_t j = 0; j < hold_files.size(); j++) {
+		if (fclose(hold_files[j]) != 0) {
+			perror("close held tiles");
 			exit(EXIT_FAILURE);
 		}
 	}
 
-	arg->running--;
-	return NULL;
+	if (performance_stats) {
+		report_tile_size_estimates();
+		report_writer_stats();
+		report_filter_stats();
+	}
 }
 
-int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpool, unsigned *midx, unsigned *midy, int &maxzoom, int minzoom, sqlite3 *outdb, const char *outdir, int buffer, const char *fname, const char *tmpdir, double gamma, int full_detail, int low_detail, int min_detail, long long *meta_off, long long *pool_off, unsigned *initial_x, unsigned *initial_y, double simplification, std::vector<std::map<std::string, layermap_entry>> &layermaps, const char *prefilter, const char *postfilter) {
+int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpool, unsigned *midx, unsigned *midy, int &maxzoom, int minzoom, sqlite3 *outdb, const char *outdir, archive_writer *outarchive, int buffer, const char *fname, const char *tmpdir, double gamma, int full_detail, int low_detail, int min_detail, long long *meta_off, long long *pool_off, unsigned *initial_x, unsigned *initial_y, double simplification, std::vector<std::map<std::string, layermap_entry>> &layermaps, const char *prefilter, const char *postfilter) {
 	// The existing layermaps are one table per input thread.
 	// We need to add another one per *tiling* thread so that it can be
 	// safely changed during tiling.
@@ -2222,6 +2512,49 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 		}
 	}
 
+	// Where each tile begins within each of the geometry files.
+	// The initial geometry file is a single tile.
+	std::vector<std::vector<long long>> tile_starts;
+	tile_starts.resize(TEMP_FILES);
+	tile_starts[0].push_back(0);
+
+	// The initial geometry file is never compressed
+	bool geom_compressed = false;
+
+	// With --single-pass-as-needed, each tiling thread sets its finished tiles
+	// aside in a file of its own until the zoom-wide thresholds are known
+	bool single_pass_as_needed = additional[A_SINGLE_PASS_AS_NEEDED] && !additional[A_EXTEND_ZOOMS] &&
+				     (additional[A_INCREASE_GAMMA_AS_NEEDED] || additional[A_DROP_DENSEST_AS_NEEDED] || additional[A_DROP_FRACTION_AS_NEEDED] || additional[A_DROP_SMALLEST_AS_NEEDED] || additional[A_COALESCE_SMALLEST_AS_NEEDED]);
+	std::vector<FILE *> hold_files;
+
+	// With --persistent-filters, each tiling thread starts its own filters
+	// the first time it needs them and keeps them until the end.
+	std::vector<filter_process> prefilter_processes, postfilter_processes;
+	if (additional[A_PERSISTENT_FILTERS]) {
+		prefilter_processes.resize(CPUS);
+		postfilter_processes.resize(CPUS);
+	}
+	if (single_pass_as_needed) {
+		for (size_t j = 0; j < CPUS; j++) {
+			char holdname[strlen(tmpdir) + strlen("/hold.XXXXXXXX") + 1];
+			sprintf(holdname, "%s/hold.XXXXXXXX", tmpdir);
+			int holdfd = mkstemp_cloexec(holdname);
+			if (holdfd < 0) {
+				perror(holdname);
+				exit(EXIT_FAILURE);
+			}
+			FILE *fp = fdopen(holdfd, "w+b");
+			if (fp == NULL) {
+				perror(holdname);
+				exit(EXIT_FAILURE);
+			}
+			unlink(holdname);
+			hold_files.push_back(fp);
+		}
+	}
+
+	writer_start(outdb, outdir, outarchive);
+
 	int i;
 	for (i = 0; i <= maxzoom; i++) {
 		long long most = 0;
@@ -2245,6 +2578,27 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 			unlink(geomname);
 		}
 
+		long long subpos[TEMP_FILES];
+		std::vector<std::vector<long long>> sub_tile_starts;
+		sub_tile_starts.resize(TEMP_FILES);
+		for (size_t j = 0; j < TEMP_FILES; j++) {
+			subpos[j] = 0;
+		}
+
+		char *geom_map[TEMP_FILES];
+		for (size_t j = 0; j < TEMP_FILES; j++) {
+			geom_map[j] = NULL;
+
+			if (geom_size[j] > 0) {
+				geom_map[j] = (char *) mmap(NULL, geom_size[j], PROT_READ, MAP_PRIVATE, geomfd[j], 0);
+				if (geom_map[j] == MAP_FAILED) {
+					perror("mmap geom");
+					exit(EXIT_FAILURE);
+				}
+				madvise(geom_map[j], geom_size[j], MADV_RANDOM);  // sequential, but from several pointers at once
+			}
+		}
+
 		size_t useful_threads = 0;
 		long long todo = 0;
 		for (size_t j = 0; j < TEMP_FILES; j++) {
@@ -2276,13 +2630,12 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 			threads = 1U << 30;
 		}
 
-		// Assign temporary files to threads
-
-		std::vector<struct task> tasks;
-		tasks.resize(TEMP_FILES);
+		// Assign temporary files to threads. Each thread starts out
+		// with all the tiles from the files it is assigned, but they
+		// may be taken over by other threads once those run out of work.
 
 		struct dispatch {
-			struct task *tasks = NULL;
+			size_t thread = 0;
 			long long todo = 0;
 			struct dispatch *next = NULL;
 		};
@@ -2291,7 +2644,7 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 
 		struct dispatch *dispatch_head = &dispatches[0];
 		for (size_t j = 0; j < threads; j++) {
-			dispatches[j].tasks = NULL;
+			dispatches[j].thread = j;
 			dispatches[j].todo = 0;
 			if (j + 1 < threads) {
 				dispatches[j].next = &dispatches[j + 1];
@@ -2300,14 +2653,26 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 			}
 		}
 
+		std::vector<std::vector<task>> assigned;
+		assigned.resize(threads);
+
 		for (size_t j = 0; j < TEMP_FILES; j++) {
 			if (geom_size[j] == 0) {
 				continue;
 			}
 
-			tasks[j].fileno = j;
-			tasks[j].next = dispatch_head->tasks;
-			dispatch_head->tasks = &tasks[j];
+			for (size_t k = 0; k < tile_starts[j].size(); k++) {
+				task t;
+				t.fileno = j;
+				t.start = tile_starts[j][k];
+				if (k + 1 < tile_starts[j].size()) {
+					t.end = tile_starts[j][k + 1];
+				} else {
+					t.end = geom_size[j];
+				}
+
+				assigned[dispatch_head->thread].push_back(t);
+			}
 			dispatch_head->todo += geom_size[j];
 
 			struct dispatch *here = dispatch_head;
@@ -2330,25 +2695,105 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 		if (additional[A_INCREASE_GAMMA_AS_NEEDED] || additional[A_DROP_DENSEST_AS_NEEDED] || additional[A_DROP_FRACTION_AS_NEEDED] || additional[A_DROP_SMALLEST_AS_NEEDED] || additional[A_COALESCE_SMALLEST_AS_NEEDED]) {
 			start = 0;
 		}
+		if (single_pass_as_needed) {
+			start = 1;
+		}
+
+		std::vector<std::vector<held_tile>> held;
+		held.resize(threads);
+		long long hold_pos[threads];
+		for (size_t thread = 0; thread < threads; thread++) {
+			hold_pos[thread] = 0;
+		}
+		size_t held_tiles = 0, retiled_tiles = 0;
 
 		double zoom_gamma = gamma;
 		unsigned long long zoom_mingap = 0;
 		long long zoom_minextent = 0;
 		double zoom_fraction = 1;
 
-		for (size_t pass = start; pass < 2; pass++) {
+		size_t zoom_tiles = 0;
+		size_t zoom_stolen = 0;
+		double zoom_busy = 0;
+		double zoom_elapsed = 0;
+
+		// Pass 0 only finds the zoom-wide thresholds, and pass 1 makes the tiles.
+		// With --single-pass-as-needed, the tiles are made only once and then
+		// the ones that the thresholds would change are made again.
+		for (size_t run = start; run < 3; run++) {
+			size_t pass = run;
+			bool retiling = false;
+
+			if (run == 2) {
+				if (!single_pass_as_needed || err != INT_MAX) {
+					break;
+				}
+
+				pass = 1;
+				retiling = true;
+
+				for (size_t thread = 0; thread < threads; thread++) {
+					assigned[thread].clear();
+
+					if (fflush(hold_files[thread]) != 0) {
+						perror("flush held tiles");
+						exit(EXIT_FAILURE);
+					}
+
+					for (size_t k = 0; k < held[thread].size(); k++) {
+						held_tile &h = held[thread][k];
+						held_tiles++;
+
+						if (needs_retiling(h, gamma, zoom_gamma, zoom_mingap, zoom_minextent, 1, zoom_fraction)) {
+							assigned[thread].push_back(h.t);
+							retiled_tiles++;
+						} else {
+							std::string data;
+							data.resize(h.len);
+							if (pread(fileno(hold_files[thread]), &data[0], h.len, h.off) != h.len) {
+								perror("read held tile");
+								exit(EXIT_FAILURE);
+							}
+							writer_enqueue(h.z, h.x, h.y, data);
+						}
+					}
+
+					held[thread].clear();
+					if (ftruncate(fileno(hold_files[thread]), 0) != 0) {
+						perror("truncate held tiles");
+						exit(EXIT_FAILURE);
+					}
+					rewind(hold_files[thread]);
+				}
+
+				if (retiled_tiles == 0) {
+					break;
+				}
+			}
+
 			pthread_t pthreads[threads];
+			freeze_tile_size_model();
 			std::vector<write_tile_args> args;
 			args.resize(threads);
 			int running = threads;
 			long long along = 0;
 
+			tile_scheduler scheduler;
+			scheduler.running = &running;
+			scheduler.queues.resize(threads);
+			for (size_t thread = 0; thread < threads; thread++) {
+				for (size_t k = 0; k < assigned[thread].size(); k++) {
+					scheduler.queues[thread].tasks.push_back(assigned[thread][k]);
+					scheduler.queues[thread].todo += assigned[thread][k].end - assigned[thread][k].start;
+				}
+			}
+
+			double pass_start = timer_now();
+
 			for (size_t thread = 0; thread < threads; thread++) {
 				args[thread].metabase = metabase;
 				args[thread].stringpool = stringpool;
 				args[thread].min_detail = min_detail;
-				args[thread].outdb = outdb;  // locked with db_lock
-				args[thread].outdir = outdir;
 				args[thread].buffer = buffer;
 				args[thread].fname = fname;
 				args[thread].geomfile = sub + thread * (TEMP_FILES / threads);
@@ -2365,8 +2810,13 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 				args[thread].child_shards = TEMP_FILES / threads;
 				args[thread].simplification = simplification;
 
-				args[thread].geomfd = geomfd;
-				args[thread].geom_size = geom_size;
+				args[thread].geom_map = geom_map;
+				args[thread].geom_compressed = geom_compressed;
+				if (additional[A_COMPRESS_TEMPORARY_FILES]) {
+					args[thread].blocks.resize(TEMP_FILES / threads);
+				}
+				args[thread].geompos = subpos + thread * (TEMP_FILES / threads);
+				args[thread].tile_starts = &sub_tile_starts[thread * (TEMP_FILES / threads)];
 				args[thread].midx = midx;  // locked with var_lock
 				args[thread].midy = midy;  // locked with var_lock
 				args[thread].maxzoom = maxzoom;
@@ -2383,11 +2833,22 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 				args[thread].tiling_seg = thread + layermaps_off;
 				args[thread].prefilter = prefilter;
 				args[thread].postfilter = postfilter;
+				if (additional[A_PERSISTENT_FILTERS]) {
+					args[thread].prefilter_process = &prefilter_processes[thread];
+					args[thread].postfilter_process = &postfilter_processes[thread];
+				}
 
-				args[thread].tasks = dispatches[thread].tasks;
+				args[thread].scheduler = &scheduler;
+				args[thread].thread = thread;
 				args[thread].running = &running;
 				args[thread].pass = pass;
 				args[thread].passes = 2 - start;
+				args[thread].retiling = retiling;
+				if (single_pass_as_needed && !retiling) {
+					args[thread].held = &held[thread];
+					args[thread].hold_file = hold_files[thread];
+					args[thread].hold_pos = &hold_pos[thread];
+				}
 				args[thread].wrote_zoom = -1;
 				args[thread].still_dropping = false;
 
@@ -2429,10 +2890,36 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 				if (additional[A_EXTEND_ZOOMS] && i == maxzoom && args[thread].still_dropping && maxzoom < MAX_ZOOM) {
 					maxzoom++;
 				}
+
+				zoom_tiles += scheduler.queues[thread].tiles;
+				zoom_stolen += scheduler.queues[thread].stolen;
+				zoom_busy += scheduler.queues[thread].busy;
+			}
+
+			zoom_elapsed += (timer_now() - pass_start) * threads;
+		}
+
+		if (performance_stats) {
+			long long written = 0;
+			for (size_t j = 0; j < TEMP_FILES; j++) {
+				written += subpos[j];
+			}
+
+			fprintf(stderr, "Zoom %d: %zu tiles on %zu threads, %zu stolen, %.1f%% thread utilization, %lld bytes of geometry written for the next zoom\n", i, zoom_tiles, threads, zoom_stolen, zoom_elapsed > 0 ? 100 * zoom_busy / zoom_elapsed : 100.0, written);
+			if (single_pass_as_needed && held_tiles > 0) {
+				fprintf(stderr, "Zoom %d: %zu of %zu tiles had to be made again with the zoom-wide thresholds\n", i, retiled_tiles, held_tiles);
 			}
 		}
 
 		for (size_t j = 0; j < TEMP_FILES; j++) {
+			if (geom_map[j] != NULL) {
+				madvise(geom_map[j], geom_size[j], MADV_DONTNEED);
+				if (munmap(geom_map[j], geom_size[j]) != 0) {
+					perror("munmap geom");
+					exit(EXIT_FAILURE);
+				}
+			}
+
 			// Can be < 0 if there is only one source file, at z0
 			if (geomfd[j] >= 0) {
 				if (close(geomfd[j]) != 0) {
@@ -2453,9 +2940,12 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 
 			geomfd[j] = subfd[j];
 			geom_size[j] = geomst.st_size;
+			tile_starts[j] = sub_tile_starts[j];
 		}
+		geom_compressed = additional[A_COMPRESS_TEMPORARY_FILES];
 
 		if (err != INT_MAX) {
+			finish_tiling(prefilter_processes, postfilter_processes, hold_files);
 			return err;
 		}
 	}
@@ -2473,5 +2963,7 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 	if (!quiet) {
 		fprintf(stderr, "\n");
 	}
+
+	finish_tiling(prefilter_processes, postfilter_processes, hold_files);
 	return maxzoom;
 }
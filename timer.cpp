@@ -0,0 +1,13 @@
+#include <stddef.h>
+#include <sys/time.h>
+#include "timer.hpp"
+
+/**
+ * Returns the current wall-clock time in seconds,
+ * for reporting elapsed times in performance statistics.
+ */
+double timer_now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
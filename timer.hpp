@@ -0,0 +1,6 @@
+#ifndef TIMER_HPP
+#define TIMER_HPP
+
+double timer_now();
+
+#endif
@@ -1,6 +1,27 @@
 #define CATCH_CONFIG_MAIN
 #include "catch/catch.hpp"
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <dirent.h>
+#include <limits.h>
+#include <math.h>
+#include <string>
+#include <vector>
 #include "text.hpp"
+#include "memfile.hpp"
+#include "pool.hpp"
+#include "main.hpp"
+#include "sort.hpp"
+#include "timer.hpp"
+#include "evaluator.hpp"
+#include "archive.hpp"
+#include "scan.hpp"
+#include "serial.hpp"
+#include "geometry.hpp"
+#include "options.hpp"
+#include "jsonpull/jsonpull.h"
 
 TEST_CASE("UTF-8 enforcement", "[utf8]") {
 	REQUIRE(check_utf8("") == std::string(""));
@@ -18,3 +39,1025 @@ TEST_CASE("UTF-8 truncation", "[trunc]") {
 	REQUIRE(truncate16("0123456789😀😬😁😂😃😄😅😆", 17) == std::string("0123456789😀😬😁"));
 	REQUIRE(truncate16("0123456789あいうえおかきくけこさ", 16) == std::string("0123456789あいうえおか"));
 }
+
+TEST_CASE("String pool deduplication", "[pool]") {
+	char poolname[] = "/tmp/pool.XXXXXXXX";
+	char treename[] = "/tmp/tree.XXXXXXXX";
+	int poolfd = mkstemp(poolname);
+	int treefd = mkstemp(treename);
+	REQUIRE(poolfd >= 0);
+	REQUIRE(treefd >= 0);
+	unlink(poolname);
+	unlink(treename);
+
+	struct memfile *poolfile = memfile_open(poolfd);
+	struct memfile *treefile = memfile_open(treefd);
+	REQUIRE(poolfile != NULL);
+	REQUIRE(treefile != NULL);
+
+	// Enough strings to make the table grow many times
+	std::vector<long long> offs;
+	for (size_t i = 0; i < 100000; i++) {
+		offs.push_back(addpool(poolfile, treefile, std::to_string(i).c_str(), 2));
+	}
+
+	bool same = true, different = true;
+	for (size_t i = 0; i < 100000; i++) {
+		if (addpool(poolfile, treefile, std::to_string(i).c_str(), 2) != offs[i]) {
+			same = false;
+		}
+		if (addpool(poolfile, treefile, std::to_string(i).c_str(), 1) == offs[i]) {
+			different = false;
+		}
+	}
+	REQUIRE(same);
+	REQUIRE(different);
+	REQUIRE(std::string(poolfile->map + offs[12345] + 1) == "12345");
+	REQUIRE(addpool(poolfile, treefile, "", 2) == addpool(poolfile, treefile, "", 2));
+
+	long long size = poolfile->off;
+	addpool(poolfile, treefile, "99999", 2);
+	REQUIRE(poolfile->off == size);
+
+	memfile_close(poolfile);
+	memfile_close(treefile);
+}
+
+// The string pool's search tree from before it became a hash table,
+// kept as the baseline for the benchmark below
+struct tree_stringpool {
+	unsigned long left = 0;
+	unsigned long right = 0;
+	unsigned long off = 0;
+};
+
+static int swizzlecmp(const char *a, const char *b) {
+	ssize_t alen = strlen(a);
+	ssize_t blen = strlen(b);
+
+	if (strcmp(a, b) == 0) {
+		return 0;
+	}
+
+	long long hash1 = 0, hash2 = 0;
+	for (ssize_t i = alen - 1; i >= 0; i--) {
+		hash1 = (hash1 * 37 + a[i]) & INT_MAX;
+	}
+	for (ssize_t i = blen - 1; i >= 0; i--) {
+		hash2 = (hash2 * 37 + b[i]) & INT_MAX;
+	}
+
+	int h1 = hash1, h2 = hash2;
+	if (h1 == h2) {
+		return strcmp(a, b);
+	}
+
+	return h1 - h2;
+}
+
+static long long tree_addpool(struct memfile *poolfile, struct memfile *treefile, unsigned long &root, const char *s, char type) {
+	unsigned long *sp = &root;
+	size_t depth = 0;
+
+	// In typical data, traversal depth generally stays under 2.5x
+	size_t max = 3 * log(treefile->off / sizeof(struct tree_stringpool)) / log(2);
+	if (max < 30) {
+		max = 30;
+	}
+
+	while (*sp != 0) {
+		struct tree_stringpool *node = (struct tree_stringpool *) (treefile->map + *sp);
+		int cmp = swizzlecmp(s, poolfile->map + node->off + 1);
+
+		if (cmp == 0) {
+			cmp = type - (poolfile->map + node->off)[0];
+		}
+
+		if (cmp < 0) {
+			sp = &node->left;
+		} else if (cmp > 0) {
+			sp = &node->right;
+		} else {
+			return node->off;
+		}
+
+		depth++;
+		if (depth > max) {
+			// Search is very deep, so string is probably unique.
+			// Add it to the pool without adding it to the search tree.
+			long long off = poolfile->off;
+			memfile_write(poolfile, &type, 1);
+			memfile_write(poolfile, (void *) s, strlen(s) + 1);
+			return off;
+		}
+	}
+
+	// *sp is probably in the memory-mapped file, and will move if the file grows.
+	long long ssp;
+	if (sp == &root) {
+		ssp = -1;
+	} else {
+		ssp = ((char *) sp) - treefile->map;
+	}
+
+	long long off = poolfile->off;
+	memfile_write(poolfile, &type, 1);
+	memfile_write(poolfile, (void *) s, strlen(s) + 1);
+
+	struct tree_stringpool tsp;
+	tsp.off = off;
+
+	long long p = treefile->off;
+	memfile_write(treefile, &tsp, sizeof(struct tree_stringpool));
+
+	if (ssp == -1) {
+		root = p;
+	} else {
+		*((unsigned long *) (treefile->map + ssp)) = p;
+	}
+	return off;
+}
+
+// Adds the strings to a new pool and then looks each of them up again,
+// reporting the rates and how much of the pool went to duplicate copies
+static void time_pool(std::vector<std::string> const &strings, bool tree) {
+	char poolname[] = "/tmp/pool.XXXXXXXX";
+	char treename[] = "/tmp/tree.XXXXXXXX";
+	int poolfd = mkstemp(poolname);
+	int treefd = mkstemp(treename);
+	REQUIRE(poolfd >= 0);
+	REQUIRE(treefd >= 0);
+	unlink(poolname);
+	unlink(treename);
+
+	struct memfile *poolfile = memfile_open(poolfd);
+	struct memfile *treefile = memfile_open(treefd);
+	REQUIRE(poolfile != NULL);
+	REQUIRE(treefile != NULL);
+
+	// As in the old reader setup, so that no tree node is at offset 0
+	unsigned long root = 0;
+	if (tree) {
+		struct tree_stringpool p;
+		memfile_write(treefile, &p, sizeof(struct tree_stringpool));
+	}
+
+	size_t n = strings.size();
+	std::vector<long long> offs(n);
+	double start = timer_now();
+	for (size_t i = 0; i < n; i++) {
+		if (tree) {
+			offs[i] = tree_addpool(poolfile, treefile, root, strings[i].c_str(), 2);
+		} else {
+			offs[i] = addpool(poolfile, treefile, strings[i].c_str(), 2);
+		}
+	}
+	double insert_time = timer_now() - start;
+	long long inserted_size = poolfile->off;
+
+	size_t found = 0;
+	start = timer_now();
+	for (size_t i = 0; i < n; i++) {
+		long long off;
+		if (tree) {
+			off = tree_addpool(poolfile, treefile, root, strings[i].c_str(), 2);
+		} else {
+			off = addpool(poolfile, treefile, strings[i].c_str(), 2);
+		}
+		if (off == offs[i]) {
+			found++;
+		}
+	}
+	double lookup_time = timer_now() - start;
+
+	if (!tree) {
+		REQUIRE(found == n);
+		REQUIRE(offs[0] == offs[1]);
+	}
+
+	printf("%zu strings, %s: %.2fM inserts/second, %.2fM lookups/second, %lld pool bytes, %zu lookups found the inserted copy\n",
+	       n, tree ? "tree" : "hash table", n / insert_time / 1e6, n / lookup_time / 1e6, inserted_size, found);
+
+	memfile_close(poolfile);
+	memfile_close(treefile);
+}
+
+// Run explicitly with ./unit "[pool-benchmark]"
+TEST_CASE("String pool speed", "[.][pool-benchmark]") {
+	for (size_t n = 100000; n <= 2000000; n *= 20) {
+		// 48-byte strings, each of them appearing twice
+		std::vector<std::string> strings;
+		for (size_t i = 0; i < n; i++) {
+			char buf[49];
+			snprintf(buf, sizeof(buf), "%048llu", (i / 2) * 2654435761ULL % (n * 16));
+			strings.push_back(buf);
+		}
+
+		time_pool(strings, true);
+		time_pool(strings, false);
+	}
+}
+
+static std::vector<struct index> random_indices(size_t n, unsigned long long prefix, int shift) {
+	std::vector<struct index> ixs(n);
+	unsigned long long state = 88172645463325252ULL;
+
+	for (size_t i = 0; i < n; i++) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+
+		// Clustered keys sharing a prefix, with some duplicates to tie-break by sequence
+		ixs[i].ix = prefix | ((state >> shift) & 0xFFFFFFFFFFULL);
+		ixs[i].seq = (state >> 20) & 0xFFFFFF;
+		ixs[i].start = i;
+	}
+
+	return ixs;
+}
+
+static bool same_order(std::vector<struct index> const &a, std::vector<struct index> const &b) {
+	for (size_t i = 0; i < a.size(); i++) {
+		if (a[i].ix != b[i].ix || a[i].seq != b[i].seq || a[i].start != b[i].start) {
+			return false;
+		}
+	}
+	return true;
+}
+
+TEST_CASE("Index sorting", "[sort]") {
+	for (size_t n = 1; n <= 1000000; n *= 10) {
+		for (int shift = 0; shift <= 32; shift += 16) {
+			std::vector<struct index> expected = random_indices(n, 0x1234000000000000ULL, shift);
+			std::vector<struct index> actual = expected;
+			std::vector<struct index> scratch(n);
+
+			qsort(expected.data(), n, sizeof(struct index), indexcmp);
+			sort_index(actual.data(), n, scratch.data());
+			REQUIRE(same_order(expected, actual));
+		}
+	}
+}
+
+// Run explicitly with ./unit "[sort-benchmark]"
+TEST_CASE("Index sorting speed", "[.][sort-benchmark]") {
+	for (size_t n = 1000; n <= 10000000; n *= 10) {
+		std::vector<struct index> ixs = random_indices(n, 0x1234000000000000ULL, 0);
+		std::vector<struct index> copy = ixs;
+		std::vector<struct index> scratch(n);
+
+		double start = timer_now();
+		qsort(copy.data(), n, sizeof(struct index), indexcmp);
+		double qsort_time = timer_now() - start;
+
+		start = timer_now();
+		sort_index(ixs.data(), n, scratch.data());
+		double radix_time = timer_now() - start;
+
+		REQUIRE(same_order(copy, ixs));
+		printf("%zu records: qsort %.3f seconds, radix %.3f seconds\n", n, qsort_time, radix_time);
+	}
+}
+
+static mvt_value string_value(std::string const &s) {
+	mvt_value v;
+	v.type = mvt_string;
+	v.string_value = s;
+	return v;
+}
+
+static mvt_value number_value(double d) {
+	mvt_value v;
+	v.type = mvt_double;
+	v.numeric_value.double_value = d;
+	return v;
+}
+
+static bool filter_feature(filter_program const *filter, std::string const &layer, std::map<std::string, mvt_value> const &feature) {
+	std::vector<const mvt_value *> slots(filter->keys.size(), NULL);
+
+	for (auto const &kv : feature) {
+		ssize_t slot = filter_slot(filter, kv.first);
+		if (slot >= 0) {
+			slots[slot] = &kv.second;
+		}
+	}
+
+	return evaluate(filter, layer, slots);
+}
+
+TEST_CASE("Feature filters", "[filter]") {
+	json_object *j = parse_filter("{ \"roads\": [ \"all\", [ \"==\", \"kind\", \"highway\" ], [ \">=\", \"lanes\", 2 ], [ \"!has\", \"closed\" ] ], \"*\": [ \"!in\", \"$type\", \"Polygon\" ], \"places\": [ \"any\", [ \"in\", \"rank\", 1, 2, 3 ], [ \"none\", [ \"has\", \"rank\" ] ] ] }");
+	filter_program *filter = compile_filter(j);
+
+	REQUIRE(filter->keys.size() == 5);
+	REQUIRE(filter_slot(filter, "kind") >= 0);
+	REQUIRE(filter_slot(filter, "name") < 0);
+	REQUIRE(filter_uses_layer(filter, "water"));
+
+	std::map<std::string, mvt_value> road;
+	road["kind"] = string_value("highway");
+	road["lanes"] = number_value(4);
+	road["$type"] = string_value("LineString");
+	REQUIRE(filter_feature(filter, "roads", road));
+
+	road["lanes"] = number_value(1);
+	REQUIRE(!filter_feature(filter, "roads", road));
+
+	road["lanes"] = number_value(2);
+	road["closed"] = string_value("yes");
+	REQUIRE(!filter_feature(filter, "roads", road));
+
+	// Filters for other layers don't apply, but "*" does
+	REQUIRE(filter_feature(filter, "water", road));
+	road["$type"] = string_value("Polygon");
+	REQUIRE(!filter_feature(filter, "water", road));
+
+	std::map<std::string, mvt_value> place;
+	REQUIRE(filter_feature(filter, "places", place));
+	place["rank"] = number_value(2);
+	REQUIRE(filter_feature(filter, "places", place));
+	place["rank"] = number_value(7);
+	REQUIRE(!filter_feature(filter, "places", place));
+	place["rank"] = string_value("2");
+	REQUIRE(!filter_feature(filter, "places", place));
+
+	delete filter;
+	json_free(j);
+}
+
+// Run explicitly with ./unit "[filter-benchmark]"
+TEST_CASE("Feature filter speed", "[.][filter-benchmark]") {
+	std::string clauses;
+	for (size_t i = 0; i < 30; i++) {
+		clauses += ", [ \"!=\", \"key" + std::to_string(i) + "\", \"value" + std::to_string(i) + "\" ]";
+	}
+
+	json_object *j = parse_filter(("{ \"*\": [ \"all\"" + clauses + " ] }").c_str());
+	filter_program *filter = compile_filter(j);
+
+	std::vector<std::map<std::string, mvt_value>> features(1000);
+	for (size_t i = 0; i < features.size(); i++) {
+		for (size_t k = 0; k < 30; k++) {
+			features[i]["key" + std::to_string(k)] = string_value("value" + std::to_string((i * k) % 100));
+		}
+	}
+
+	size_t n = 0, matched = 0;
+	double start = timer_now();
+	for (size_t rep = 0; rep < 1000; rep++) {
+		for (size_t i = 0; i < features.size(); i++) {
+			matched += filter_feature(filter, "layer", features[i]);
+			n++;
+		}
+	}
+	double elapsed = timer_now() - start;
+
+	printf("%zu features (%zu matched) in %.3f seconds\n", n, matched, elapsed);
+
+	delete filter;
+	json_free(j);
+}
+
+// serial.o refers to these, which main.cpp defines for tippecanoe
+int quiet = 1;
+int quiet_progress = 1;
+int geometry_scale = 0;
+int prevent[256];
+int additional[256];
+
+void checkdisk(std::vector<struct reader> *) {
+}
+
+// Run explicitly with ./unit "[serial-benchmark]"
+TEST_CASE("Feature serialization speed", "[.][serial-benchmark]") {
+	std::vector<serial_feature> features(20000);
+	for (size_t i = 0; i < features.size(); i++) {
+		serial_feature &sf = features[i];
+		sf.t = VT_LINE;
+		sf.seq = i + 1;
+		sf.index = i * 12345;
+
+		long long x = (i * 7919) % 1000000, y = (i * 104729) % 1000000;
+		for (size_t j = 0; j < 200; j++) {
+			x += (long long) ((i + j) * 37 % 201) - 100;
+			y += (long long) ((i * j) * 53 % 201) - 100;
+			sf.geometry.push_back(draw(j == 0 ? VT_MOVETO : VT_LINETO, x, y));
+		}
+	}
+
+	char geomname[] = "/tmp/geom.XXXXXXXX";
+	int fd = mkstemp(geomname);
+	REQUIRE(fd >= 0);
+	unlink(geomname);
+	FILE *fp = fdopen(fd, "w+b");
+	REQUIRE(fp != NULL);
+
+	const size_t passes = 5;
+	double write_time = 0, read_time = 0;
+	long long geompos = 0;
+	size_t read = 0;
+	unsigned initial_x = 0, initial_y = 0;
+	long long meta_off = 0;
+
+	for (size_t pass = 0; pass < passes; pass++) {
+		REQUIRE(fseek(fp, 0, SEEK_SET) == 0);
+		geompos = 0;
+
+		double start = timer_now();
+		for (size_t i = 0; i < features.size(); i++) {
+			serialize_feature(fp, &features[i], &geompos, geomname, 0, 0, true);
+		}
+		REQUIRE(fflush(fp) == 0);
+		write_time += timer_now() - start;
+
+		std::string data(geompos, '\0');
+		REQUIRE(pread(fd, &data[0], geompos, 0) == geompos);
+
+		geom_reader r;
+		r.base = &data[0];
+		r.len = geompos;
+
+		start = timer_now();
+		read = 0;
+		size_t vertices = 0;
+		while (r.pos < r.len) {
+			serial_feature sf = deserialize_feature(r, NULL, &meta_off, 0, 0, 0, &initial_x, &initial_y);
+			vertices += sf.geometry.size();
+			read++;
+		}
+		read_time += timer_now() - start;
+		REQUIRE(read == features.size());
+		REQUIRE(vertices == features.size() * 200);
+	}
+
+	fclose(fp);
+
+	double mb = geompos * (double) passes / 1024 / 1024;
+	printf("%zu features, %.1f MB of geometry: write %.1f MB/s, read %.1f MB/s\n", read, geompos / 1024.0 / 1024.0, mb / write_time, mb / read_time);
+}
+
+TEST_CASE("Tile views", "[mvt]") {
+	mvt_tile tile;
+	const char *names[] = {"roads", "water"};
+
+	for (size_t l = 0; l < 2; l++) {
+		mvt_layer layer;
+		layer.name = names[l];
+		layer.version = 2;
+		layer.extent = 4096 << l;
+
+		for (size_t i = 0; i < 10; i++) {
+			mvt_feature feature;
+			feature.type = (i % 3) + 1;
+			feature.geometry.push_back(mvt_geometry(mvt_moveto, i, 2 * i));
+			feature.geometry.push_back(mvt_geometry(mvt_lineto, 3 * i, 4 * i));
+			layer.tag(feature, "name", string_value("feature " + std::to_string(i % 4)));
+			layer.features.push_back(feature);
+		}
+
+		tile.layers.push_back(layer);
+	}
+
+	std::string encoded = tile.encode();
+	std::string compressed;
+	compress(encoded, compressed);
+
+	mvt_tile_view view;
+	bool was_compressed;
+	REQUIRE(view.decode(compressed, was_compressed));
+	REQUIRE(was_compressed);
+	REQUIRE(view.layers.size() == 2);
+	REQUIRE(view.layers[1].name == "water");
+	REQUIRE(view.layers[1].extent == 8192);
+
+	int points = 0, lines = 0, polygons = 0;
+	view.layers[0].count_types(points, lines, polygons);
+	REQUIRE(points == 4);
+	REQUIRE(lines == 3);
+	REQUIRE(polygons == 3);
+
+	mvt_layer layer;
+	REQUIRE(view.layers[1].decode(layer));
+	REQUIRE(layer.features.size() == 10);
+	REQUIRE(layer.keys.size() == 1);
+	REQUIRE(layer.values.size() == 4);
+	REQUIRE(layer.features[7].geometry[1].x == 21);
+	REQUIRE(layer.values[layer.features[7].tags[1]].string_value == "feature 3");
+
+	// Tagging a decoded layer reuses its existing keys and values
+	mvt_feature feature;
+	layer.tag(feature, "name", string_value("feature 2"));
+	REQUIRE(layer.keys.size() == 1);
+	REQUIRE(layer.values.size() == 4);
+
+	mvt_tile decoded;
+	REQUIRE(decoded.decode(encoded, was_compressed));
+	REQUIRE(!was_compressed);
+	REQUIRE(decoded.encode() == encoded);
+}
+
+TEST_CASE("Tile archives", "[archive]") {
+	for (int z = 0; z <= 5; z++) {
+		std::vector<bool> used(1 << (2 * z), false);
+
+		for (unsigned x = 0; x < (1U << z); x++) {
+			for (unsigned y = 0; y < (1U << z); y++) {
+				unsigned long long id = archive_tile_id(z, x, y);
+				int z2;
+				unsigned x2, y2;
+				archive_tile_zxy(id, &z2, &x2, &y2);
+				REQUIRE(z2 == z);
+				REQUIRE(x2 == x);
+				REQUIRE(y2 == y);
+
+				// Each zoom level's ids follow the previous level's, without gaps
+				unsigned long long base = ((1ULL << (2 * z)) - 1) / 3;
+				REQUIRE(id >= base);
+				REQUIRE(id - base < used.size());
+				REQUIRE(!used[id - base]);
+				used[id - base] = true;
+			}
+		}
+	}
+
+	// Consecutive ids along the curve are adjacent tiles
+	for (unsigned long long id = 21; id + 1 < 85; id++) {
+		int z1, z2;
+		unsigned x1, y1, x2, y2;
+		archive_tile_zxy(id, &z1, &x1, &y1);
+		archive_tile_zxy(id + 1, &z2, &x2, &y2);
+		REQUIRE(z1 == 3);
+		REQUIRE(z2 == 3);
+		REQUIRE((x1 > x2 ? x1 - x2 : x2 - x1) + (y1 > y2 ? y1 - y2 : y2 - y1) == 1);
+	}
+
+	char fname[] = "/tmp/archive.XXXXXX";
+	int fd = mkstemp(fname);
+	REQUIRE(fd >= 0);
+	close(fd);
+	unlink(fname);
+
+	archive_writer *aw = archive_open(fname);
+	std::string ocean = "ocean";
+	std::string land = "land";
+	for (unsigned x = 0; x < 4; x++) {
+		for (unsigned y = 0; y < 4; y++) {
+			std::string &data = (x == 2 && y == 1) ? land : ocean;
+			archive_write_tile(aw, 2, x, y, data.data(), data.size());
+		}
+	}
+	std::string top = "top";
+	archive_write_tile(aw, 0, 0, 0, top.data(), top.size());
+	archive_write_metadata(aw, "{ \"name\": \"test\" }");
+	archive_close(aw);
+
+	archive_reader *ar = archive_open_read(fname);
+	REQUIRE(ar != NULL);
+	REQUIRE(ar->tiles == 17);
+	REQUIRE(ar->contents == 3);
+	REQUIRE(ar->entries == 4);  // the top tile, and ocean on either side of land
+	REQUIRE(ar->minzoom == 0);
+	REQUIRE(ar->maxzoom == 2);
+	REQUIRE(archive_read_metadata(ar) == "{ \"name\": \"test\" }");
+
+	std::string tile;
+	REQUIRE(archive_read_tile(ar, 0, 0, 0, tile));
+	REQUIRE(tile == "top");
+	REQUIRE(archive_read_tile(ar, 2, 2, 1, tile));
+	REQUIRE(tile == "land");
+	REQUIRE(archive_read_tile(ar, 2, 3, 3, tile));
+	REQUIRE(tile == "ocean");
+	REQUIRE(!archive_read_tile(ar, 1, 0, 0, tile));
+	REQUIRE(!archive_read_tile(ar, 3, 0, 0, tile));
+
+	std::vector<archive_tile> tiles = archive_tiles(ar);
+	REQUIRE(tiles.size() == 17);
+	REQUIRE(tiles[0].z == 0);
+	REQUIRE(tiles[1].z == 2);
+	REQUIRE(tiles[1].x == 0);
+	REQUIRE(tiles[1].y == 3);  // in TMS row order
+
+	archive_close_read(ar);
+	unlink(fname);
+}
+
+TEST_CASE("JSON parse arena", "[json]") {
+	std::string s = "{ \"type\": \"FeatureCollection\", \"features\": [";
+	for (size_t i = 0; i < 1000; i++) {
+		if (i != 0) {
+			s += ",";
+		}
+		s += "{ \"type\": \"Feature\", \"properties\": { \"name\": \"feature " + std::to_string(i) + "\" }, ";
+		s += "\"geometry\": { \"type\": \"LineString\", \"coordinates\": [";
+		for (size_t j = 0; j < 100; j++) {
+			if (j != 0) {
+				s += ",";
+			}
+			s += "[" + std::to_string(i) + "," + std::to_string(j) + ".5]";
+		}
+		s += "] } }";
+	}
+	s += "], \"name\": \"collection\" }";
+
+	json_pull *jp = json_begin_string(s.c_str());
+	json_use_arena(jp);
+
+	size_t features = 0;
+	unsigned long long allocations = 0;
+	std::string collection;
+	json_object *j;
+	while ((j = json_read(jp)) != NULL) {
+		json_object *type = json_hash_get(j, "type");
+		if (type == NULL || type->type != JSON_STRING) {
+			continue;
+		}
+
+		// The enclosing collection survives the resets, without the features
+		if (strcmp(type->string, "FeatureCollection") == 0) {
+			char *out = json_stringify(j);
+			collection = out;
+			free(out);
+			continue;
+		}
+		if (strcmp(type->string, "Feature") != 0) {
+			continue;
+		}
+
+		json_object *name = json_hash_get(json_hash_get(j, "properties"), "name");
+		REQUIRE(name != NULL);
+		REQUIRE(std::string(name->string) == "feature " + std::to_string(features));
+
+		json_object *coordinates = json_hash_get(json_hash_get(j, "geometry"), "coordinates");
+		REQUIRE(coordinates != NULL);
+		REQUIRE(coordinates->length == 100);
+		REQUIRE(coordinates->array[99]->array[0]->number == features);
+		REQUIRE(coordinates->array[99]->array[1]->number == 99.5);
+
+		json_free(j);
+		json_arena_reset(jp);
+		features++;
+
+		// Once the arena has warmed up, features are parsed without allocating
+		if (features == 10) {
+			allocations = jp->allocations;
+		}
+	}
+
+	REQUIRE(jp->error == NULL);
+	REQUIRE(features == 1000);
+	REQUIRE(jp->resets == 1000);
+	REQUIRE(jp->allocations == allocations);
+	REQUIRE(collection == "{\"type\":\"FeatureCollection\",\"features\":[],\"name\":\"collection\"}");
+
+	json_end(jp);
+}
+
+static bool same_double(double a, double b) {
+	return memcmp(&a, &b, sizeof(double)) == 0;
+}
+
+static ssize_t read_one_byte(json_pull *jp, char *buffer, size_t n) {
+	const char *cp = (const char *) jp->source;
+	if (n == 0 || *cp == '\0') {
+		return 0;
+	}
+
+	buffer[0] = *cp;
+	jp->source = (void *) (cp + 1);
+	return 1;
+}
+
+TEST_CASE("JSON numbers", "[json]") {
+	std::vector<std::string> numbers = {
+		"0", "-0", "1", "-1", "123456789", "-122.4194155", "37.7749295", "0.000001", "0.1", "1E+2",
+		"1e22", "1e23", "1e-400", "1e400", "9007199254740992", "9007199254740993", "12345678901234567890123",
+		"3.14159265358979323846", "1.7976931348623157e308", "4.9e-324", "2.2250738585072014e-308",
+		"0.30000000000000004", "100000000000000000000000.5", "-0.0000000000000000000000001e25"};
+
+	unsigned long long state = 88172645463325252ULL;
+	for (size_t i = 0; i < 10000; i++) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+
+		// Longitudes and latitudes with 5 to 8 decimal places
+		char buf[50];
+		double coordinate = (state % 360000000000ULL) / 1e9 - 180;
+		snprintf(buf, sizeof(buf), "%.*f", (int) (5 + (state >> 60) % 4), coordinate);
+		numbers.push_back(buf);
+	}
+
+	for (size_t i = 0; i < numbers.size(); i++) {
+		INFO(numbers[i]);
+		REQUIRE(same_double(json_number(numbers[i].c_str()), strtod(numbers[i].c_str(), NULL)));
+	}
+
+	// Numbers found within the read buffer and numbers read a character
+	// at a time must come out the same
+	std::string array = "[";
+	for (size_t i = 0; i < numbers.size(); i++) {
+		if (i != 0) {
+			array += ",";
+		}
+		array += numbers[i];
+	}
+	array += "]";
+
+	json_pull *buffered = json_begin_string(array.c_str());
+	json_pull *unbuffered = json_begin(read_one_byte, (void *) array.c_str());
+	json_object *a = json_read_tree(buffered);
+	json_object *b = json_read_tree(unbuffered);
+	REQUIRE(a != NULL);
+	REQUIRE(b != NULL);
+	REQUIRE(a->length == numbers.size());
+	REQUIRE(b->length == numbers.size());
+
+	for (size_t i = 0; i < numbers.size(); i++) {
+		INFO(numbers[i]);
+		REQUIRE(a->array[i]->type == JSON_NUMBER);
+		REQUIRE(b->array[i]->type == JSON_NUMBER);
+		REQUIRE(std::string(a->array[i]->string) == numbers[i]);
+		REQUIRE(std::string(b->array[i]->string) == numbers[i]);
+		REQUIRE(a->array[i]->length == numbers[i].size());
+		REQUIRE(same_double(a->array[i]->number, b->array[i]->number));
+		REQUIRE(same_double(a->array[i]->number, strtod(numbers[i].c_str(), NULL)));
+	}
+
+	json_end(buffered);
+	json_end(unbuffered);
+
+	const char *bad[] = {"[1.]", "[1.e5]", "[1e]", "[1e+]", "[-.5]"};
+	for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+		INFO(bad[i]);
+		json_pull *jp = json_begin_string(bad[i]);
+		REQUIRE(json_read_tree(jp) == NULL);
+		REQUIRE(jp->error != NULL);
+		json_end(jp);
+	}
+}
+
+TEST_CASE("JSON packed arrays", "[json]") {
+	const char *feature = "{ \"type\": \"Feature\", \"properties\": { \"coordinates\": [ 1.50 ], \"a\": { \"coordinates\": [ 2 ] } }, "
+			      "\"geometry\": { \"coordinates\": [ [ 1, 2 ], [3.5,-4e2], [ 5, null, \"x\", { \"coordinates\": [ 6 ] }, [ ] ] ], \"type\": \"LineString\" } }";
+
+	json_pull *jp = json_begin_string(feature);
+	json_pack_arrays(jp, "coordinates");
+	json_object *j = json_read_tree(jp);
+	REQUIRE(j != NULL);
+
+	json_object *coordinates = json_hash_get(json_hash_get(j, "geometry"), "coordinates");
+	REQUIRE(coordinates != NULL);
+	REQUIRE(coordinates->type == JSON_PACKED);
+	REQUIRE(std::string(coordinates->string) == "[[nn][nn][nxxx[]]]");
+	REQUIRE(coordinates->length == 18);
+	REQUIRE(coordinates->numbers[0] == 1);
+	REQUIRE(coordinates->numbers[1] == 2);
+	REQUIRE(coordinates->numbers[2] == 3.5);
+	REQUIRE(coordinates->numbers[3] == -400);
+	REQUIRE(coordinates->numbers[4] == 5);
+
+	char *s = json_stringify(coordinates);
+	REQUIRE(std::string(s) == "[[1,2],[3.5,-400],[5,...,...,...,[]]]");
+	free(s);
+
+	// Attributes are left alone, however deep
+	json_object *properties = json_hash_get(j, "properties");
+	json_object *attribute = json_hash_get(properties, "coordinates");
+	REQUIRE(attribute->type == JSON_ARRAY);
+	REQUIRE(std::string(attribute->array[0]->string) == "1.50");
+	REQUIRE(json_hash_get(json_hash_get(properties, "a"), "coordinates")->type == JSON_ARRAY);
+
+	json_end(jp);
+
+	const char *bad[] = {"{ \"coordinates\": [ [ 1, 2 ] ", "{ \"coordinates\": [ 1 2 ] }", "{ \"coordinates\": [ 1, ] }",
+			     "{ \"coordinates\": [ , 1 ] }", "{ \"coordinates\": [ 1, [ } ] }"};
+	for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+		INFO(bad[i]);
+		jp = json_begin_string(bad[i]);
+		json_pack_arrays(jp, "coordinates");
+		REQUIRE(json_read_tree(jp) == NULL);
+		REQUIRE(jp->error != NULL);
+		json_end(jp);
+	}
+}
+
+// Byte at a time, to check the block scanner against
+static bool split_bytewise(std::string const &s, size_t segments, feature_collection_split &out) {
+	bool in_string = false, escaped = false, in_features = false, found = false;
+	long long depth = 0, line = 1, end_line = 1;
+	size_t string_start = 0, segment = 1, target = s.size() / segments;
+	std::string last_string;
+
+	out.cuts.clear();
+	out.lines.clear();
+
+	for (size_t i = 0; i < s.size(); i++) {
+		char c = s[i];
+
+		if (c == '\n') {
+			line++;
+		}
+
+		if (in_string) {
+			if (escaped) {
+				escaped = false;
+			} else if (c == '\\') {
+				escaped = true;
+			} else if (c == '"') {
+				in_string = false;
+				last_string = s.substr(string_start, i - string_start);
+			}
+		} else if (c == '"') {
+			in_string = true;
+			string_start = i + 1;
+		} else if (c == '{' || c == '[') {
+			if (depth == 1 && c == '[' && last_string == "features") {
+				found = in_features = true;
+				out.features_start = i + 1;
+				out.start_line = line;
+			}
+			depth++;
+		} else if (c == '}' || c == ']') {
+			depth--;
+			if (in_features && depth == 2 && segment < segments && i + 1 >= target) {
+				out.cuts.push_back(i + 1);
+				out.lines.push_back(line);
+				while (segment < segments && target <= i + 1) {
+					segment++;
+					target = s.size() * segment / segments;
+				}
+			} else if (in_features && depth == 1) {
+				in_features = false;
+				out.features_end = i;
+				end_line = line;
+			}
+		} else if (c == ',') {
+			last_string.clear();
+		}
+	}
+
+	while (out.cuts.size() + 1 < segments) {
+		out.cuts.push_back(out.features_end);
+		out.lines.push_back(end_line);
+	}
+
+	return found;
+}
+
+TEST_CASE("FeatureCollection splitting", "[scan]") {
+	srand(42);
+
+	// Strings full of quotes, backslashes, and brackets, so that the
+	// runs of backslashes and the strings cross block boundaries
+	const char *pieces[] = {"\\\"", "\\\\", "\\\\\\\"", "{", "}", "[", "]", "a", " ", "\\n", "\\u005c"};
+
+	for (size_t n = 0; n < 300; n++) {
+		std::string s = std::string(rand() % 70, ' ') + "{ \"type\": \"FeatureCollection\"," + std::string(rand() % 3, '\n') + " \"features\"" + std::string(rand() % 3, ' ') + ":\n[";
+		size_t features = rand() % 40;
+
+		for (size_t i = 0; i < features; i++) {
+			if (i != 0) {
+				s += ",\n";
+			}
+
+			std::string v;
+			size_t len = rand() % 80;
+			for (size_t j = 0; j < len; j++) {
+				v += pieces[rand() % (sizeof(pieces) / sizeof(pieces[0]))];
+			}
+
+			s += "{ \"type\": \"Feature\", \"properties\": { \"seq\": " + std::to_string(i) + ", \"s\": \"" + v + "\", \"features\": [ ] }, ";
+			s += "\"geometry\": { \"type\": \"Point\", \"coordinates\": [ 1, 2 ] } }";
+		}
+
+		s += "],\n\"bbox\": [ 1, 2, 3, 4 ] }" + std::string(rand() % 3, '\n');
+
+		for (size_t segments = 1; segments <= 5; segments += 2) {
+			feature_collection_split expect;
+			REQUIRE(split_bytewise(s, segments, expect));
+
+			for (scan_kind kind : {SCAN_SCALAR, SCAN_SSE2, SCAN_AVX2}) {
+				if (!scan_available(kind)) {
+					continue;
+				}
+
+				INFO(kind);
+				feature_collection_split got;
+				REQUIRE(split_feature_collection(s.c_str(), s.size(), segments, got, kind));
+				REQUIRE(got.features_start == expect.features_start);
+				REQUIRE(got.start_line == expect.start_line);
+				REQUIRE(got.features_end == expect.features_end);
+				REQUIRE(got.cuts == expect.cuts);
+				REQUIRE(got.lines == expect.lines);
+			}
+
+			// Each piece parses by itself, and together they have
+			// all the features in order
+			feature_collection_split split;
+			REQUIRE(split_feature_collection(s.c_str(), s.size(), segments, split, scan_best()));
+			long long seq = 0;
+			for (size_t i = 0; i < segments; i++) {
+				size_t start = i == 0 ? split.features_start : split.cuts[i - 1];
+				size_t end = i + 1 == segments ? split.features_end : split.cuts[i];
+
+				std::string piece = s.substr(start, end - start);
+				json_pull *jp = json_begin_string(piece.c_str());
+				json_object *j;
+				while ((j = json_read_tree(jp)) != NULL) {
+					REQUIRE(json_hash_get(json_hash_get(j, "properties"), "seq")->number == seq);
+					seq++;
+					json_free(j);
+				}
+				REQUIRE(jp->error == NULL);
+				json_end(jp);
+			}
+			REQUIRE(seq == (long long) features);
+		}
+	}
+
+	const char *bad[] = {
+		"",
+		"[ ]",
+		"{ \"type\": \"FeatureCollection\" }",
+		"{ \"features\": [ ] } { }",
+		"{ \"features\": [ ] } ]",
+		"{ \"features\": [ ] ",
+		"{ \"features\": [ ] } x",
+		"{ \"features\": [ ], \"features\": [ ] }",
+		"{ \"features\": [ \"] }",
+		"{ \"a\": \"\\\", \"features\": [ ] }",
+		"{ \"a\": { \"features\": [ ] } }",
+	};
+	for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+		INFO(bad[i]);
+		feature_collection_split split;
+		REQUIRE(!split_feature_collection(bad[i], strlen(bad[i]), 4, split, scan_best()));
+	}
+}
+
+// Run explicitly with ./unit "[json-benchmark]"
+TEST_CASE("JSON parsing speed", "[.][json-benchmark]") {
+	std::vector<std::string> inputs;
+	DIR *d = opendir("tests");
+	REQUIRE(d != NULL);
+	struct dirent *de;
+	while ((de = readdir(d)) != NULL) {
+		std::string fname = std::string("tests/") + de->d_name + "/in.json";
+		FILE *f = fopen(fname.c_str(), "r");
+		if (f != NULL) {
+			std::string contents;
+			char buf[BUFSIZ];
+			size_t n;
+			while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+				contents.append(buf, n);
+			}
+			fclose(f);
+			inputs.push_back(contents);
+		}
+	}
+	closedir(d);
+
+	// Parse once with a tree node for every token, and again with
+	// coordinates packed as parse_json() does. Tokens are counted
+	// the first time, since packed numbers aren't returned separately.
+	size_t tokens = 0, numbers = 0;
+	for (int packed = 0; packed < 2; packed++) {
+		size_t bytes = 0;
+		double start = timer_now();
+
+		for (size_t rep = 0; rep < 10; rep++) {
+			for (size_t i = 0; i < inputs.size(); i++) {
+				json_pull *jp = json_begin_string(inputs[i].c_str());
+				json_use_arena(jp);
+				if (packed) {
+					json_pack_arrays(jp, "coordinates");
+				}
+
+				json_object *j;
+				while ((j = json_read(jp)) != NULL) {
+					if (!packed) {
+						tokens++;
+						numbers += (j->type == JSON_NUMBER);
+					}
+
+					// Free each feature after reading it, as parse_json() does
+					if (j->type == JSON_HASH && j->parent != NULL) {
+						json_object *type = json_hash_get(j, "type");
+						if (type != NULL && type->type == JSON_STRING && strcmp(type->string, "Feature") == 0) {
+							json_free(j);
+							json_arena_reset(jp);
+						}
+					}
+				}
+
+				json_end(jp);
+				bytes += inputs[i].size();
+			}
+		}
+		double elapsed = timer_now() - start;
+
+		printf("%s: %zu files, %.1f MB: %zu tokens (%zu numbers) in %.3f seconds, %.2f million tokens/s, %.1f MB/s\n",
+		       packed ? "Packed coordinates" : "Tree of tokens", inputs.size(), bytes / 1e6, tokens, numbers, elapsed, tokens / elapsed / 1e6, bytes / elapsed / 1e6);
+	}
+}
@@ -0,0 +1,307 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <string>
+#include <deque>
+#include <vector>
+#include <sqlite3.h>
+#include "writer.hpp"
+#include "mbtiles.hpp"
+#include "dirtiles.hpp"
+#include "archive.hpp"
+#include "timer.hpp"
+#include "main.hpp"
+
+// How many tiles go into each transaction
+#define WRITE_BATCH 10000
+
+// How much tile data may be waiting to be written before
+// the tiling threads have to wait for the writer to catch up
+#define WRITE_QUEUE_BYTES (64 * 1024 * 1024)
+
+// How many threads write tiles into an output directory, where
+// each new file costs a system call or two of its own
+#define DIR_WRITER_THREADS 4
+
+struct pending_tile {
+	int z = 0;
+	unsigned tx = 0;
+	unsigned ty = 0;
+	std::string data = "";
+};
+
+// Each writer thread has its own queue. Directory output is sharded
+// by z/x column so that every column directory belongs to one thread;
+// mbtiles output always uses a single shard.
+struct writer_shard {
+	std::deque<pending_tile> queue{};
+	pthread_cond_t nonempty;
+	pthread_t thread;
+	dir_writer dw{};
+	mbtiles_writer mw{};
+
+	long long tiles_written = 0;
+	double write_time = 0;
+	double max_write_time = 0;
+};
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_nonfull = PTHREAD_COND_INITIALIZER;
+
+static std::vector<writer_shard> shards;
+static size_t queue_tiles = 0;
+static size_t queue_bytes = 0;
+static bool finishing = false;
+
+static sqlite3 *writer_db = NULL;
+static const char *writer_dir = NULL;
+static archive_writer *writer_archive = NULL;
+
+static long long tiles_written = 0;
+static long long transactions = 0;
+static long long producer_waits = 0;
+static size_t max_depth = 0;
+static size_t max_bytes = 0;
+static double write_time = 0;
+static double max_write_time = 0;
+static double writer_elapsed = 0;
+static long long dir_files = 0;
+static long long dir_bytes = 0;
+static long long dirs_made = 0;
+static long long columns_opened = 0;
+
+static void lock() {
+	if (pthread_mutex_lock(&queue_lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void unlock() {
+	if (pthread_mutex_unlock(&queue_lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void *run_writer(void *v) {
+	writer_shard *shard = (writer_shard *) v;
+	size_t in_transaction = 0;
+
+	while (true) {
+		lock();
+
+		while (shard->queue.size() == 0 && !finishing) {
+			if (pthread_cond_wait(&shard->nonempty, &queue_lock) != 0) {
+				perror("pthread_cond_wait");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		if (shard->queue.size() == 0) {
+			unlock();
+			break;
+		}
+
+		pending_tile t;
+		t.z = shard->queue.front().z;
+		t.tx = shard->queue.front().tx;
+		t.ty = shard->queue.front().ty;
+		t.data.swap(shard->queue.front().data);
+		shard->queue.pop_front();
+		queue_tiles--;
+		queue_bytes -= t.data.size();
+
+		if (pthread_cond_broadcast(&queue_nonfull) != 0) {
+			perror("pthread_cond_broadcast");
+			exit(EXIT_FAILURE);
+		}
+
+		unlock();
+
+		double before = timer_now();
+
+		if (writer_db != NULL) {
+			if (in_transaction == 0) {
+				mbtiles_begin(writer_db);
+			}
+
+			mbtiles_write_tile(&shard->mw, t.z, t.tx, t.ty, t.data.data(), t.data.size());
+			in_transaction++;
+
+			if (in_transaction >= WRITE_BATCH) {
+				mbtiles_commit(writer_db);
+				transactions++;
+				in_transaction = 0;
+			}
+		} else if (writer_dir != NULL) {
+			dir_writer_write(&shard->dw, t.z, t.tx, t.ty, t.data);
+		} else if (writer_archive != NULL) {
+			archive_write_tile(writer_archive, t.z, t.tx, t.ty, t.data.data(), t.data.size());
+		}
+
+		double elapsed = timer_now() - before;
+		shard->write_time += elapsed;
+		if (elapsed > shard->max_write_time) {
+			shard->max_write_time = elapsed;
+		}
+		shard->tiles_written++;
+	}
+
+	if (in_transaction > 0) {
+		mbtiles_commit(writer_db);
+		transactions++;
+	}
+
+	return NULL;
+}
+
+static double writer_started = 0;
+
+/**
+ * Starts the threads that write finished tiles to the mbtiles
+ * database, the output directory, or the tile archive. Tiles that go
+ * to the same mbtiles database, z/x directory, or archive are written
+ * in the order they are enqueued.
+ */
+void writer_start(sqlite3 *outdb, const char *outdir, archive_writer *outarchive) {
+	writer_db = outdb;
+	writer_dir = outdir;
+	writer_archive = outarchive;
+	finishing = false;
+	writer_started = timer_now();
+
+	size_t nshards = 1;
+	if (outdir != NULL) {
+		nshards = CPUS < DIR_WRITER_THREADS ? CPUS : DIR_WRITER_THREADS;
+		if (nshards < 1) {
+			nshards = 1;
+		}
+	}
+
+	shards.clear();
+	shards.resize(nshards);
+
+	for (size_t i = 0; i < shards.size(); i++) {
+		if (pthread_cond_init(&shards[i].nonempty, NULL) != 0) {
+			perror("pthread_cond_init");
+			exit(EXIT_FAILURE);
+		}
+
+		if (outdb != NULL) {
+			mbtiles_writer_open(&shards[i].mw, outdb);
+		} else if (outdir != NULL) {
+			dir_writer_open(&shards[i].dw, outdir);
+		}
+	}
+
+	for (size_t i = 0; i < shards.size(); i++) {
+		if (pthread_create(&shards[i].thread, NULL, run_writer, &shards[i]) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/**
+ * Hands a finished tile to a writer thread, waiting if too much
+ * tile data is already waiting to be written. Takes over the contents
+ * of data, leaving it empty.
+ */
+void writer_enqueue(int z, unsigned tx, unsigned ty, std::string &data) {
+	writer_shard &shard = shards[((unsigned long long) z * 1000003 + tx) % shards.size()];
+
+	lock();
+
+	if (queue_tiles > 0 && queue_bytes + data.size() > WRITE_QUEUE_BYTES) {
+		producer_waits++;
+
+		while (queue_tiles > 0 && queue_bytes + data.size() > WRITE_QUEUE_BYTES) {
+			if (pthread_cond_wait(&queue_nonfull, &queue_lock) != 0) {
+				perror("pthread_cond_wait");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	shard.queue.push_back(pending_tile());
+	pending_tile &t = shard.queue.back();
+	t.z = z;
+	t.tx = tx;
+	t.ty = ty;
+	t.data.swap(data);
+	queue_tiles++;
+	queue_bytes += t.data.size();
+
+	if (queue_tiles > max_depth) {
+		max_depth = queue_tiles;
+	}
+	if (queue_bytes > max_bytes) {
+		max_bytes = queue_bytes;
+	}
+
+	if (pthread_cond_signal(&shard.nonempty) != 0) {
+		perror("pthread_cond_signal");
+		exit(EXIT_FAILURE);
+	}
+
+	unlock();
+}
+
+/**
+ * Waits for the writer threads to write everything that has been
+ * enqueued and commit it.
+ */
+void writer_finish() {
+	lock();
+	finishing = true;
+	for (size_t i = 0; i < shards.size(); i++) {
+		if (pthread_cond_signal(&shards[i].nonempty) != 0) {
+			perror("pthread_cond_signal");
+			exit(EXIT_FAILURE);
+		}
+	}
+	unlock();
+
+	for (size_t i = 0; i < shards.size(); i++) {
+		void *retval;
+		if (pthread_join(shards[i].thread, &retval) != 0) {
+			perror("pthread_join");
+			exit(EXIT_FAILURE);
+		}
+
+		if (writer_db != NULL) {
+			mbtiles_writer_close(&shards[i].mw);
+		} else if (writer_dir != NULL) {
+			dir_writer_close(&shards[i].dw);
+			dir_files += shards[i].dw.files;
+			dir_bytes += shards[i].dw.bytes;
+			dirs_made += shards[i].dw.dirs_made;
+			columns_opened += shards[i].dw.columns_opened;
+		}
+
+		tiles_written += shards[i].tiles_written;
+		write_time += shards[i].write_time;
+		if (shards[i].max_write_time > max_write_time) {
+			max_write_time = shards[i].max_write_time;
+		}
+
+		if (pthread_cond_destroy(&shards[i].nonempty) != 0) {
+			perror("pthread_cond_destroy");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	writer_elapsed += timer_now() - writer_started;
+	shards.clear();
+}
+
+void report_writer_stats() {
+	fprintf(stderr, "Tile writer: %lld tiles in %lld transactions, %.3f ms average and %.3f ms longest write, queue up to %zu tiles and %zu bytes, %lld waits for a full queue\n",
+		tiles_written, transactions, tiles_written > 0 ? 1000 * write_time / tiles_written : 0.0, 1000 * max_write_time, max_depth, max_bytes, producer_waits);
+
+	if (dir_files > 0) {
+		fprintf(stderr, "Directory writer: %lld files and %lld bytes, %.0f files/s, %lld directories made, %lld directories opened\n",
+			dir_files, dir_bytes, writer_elapsed > 0 ? dir_files / writer_elapsed : 0.0, dirs_made, columns_opened);
+	}
+}
@@ -0,0 +1,12 @@
+#ifndef WRITER_HPP
+#define WRITER_HPP
+
+#include <string>
+#include <sqlite3.h>
+
+void writer_start(sqlite3 *outdb, const char *outdir, struct archive_writer *outarchive);
+void writer_enqueue(int z, unsigned tx, unsigned ty, std::string &data);
+void writer_finish();
+void report_writer_stats();
+
+#endif